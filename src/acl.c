@@ -24,6 +24,7 @@
 #include "main.h"
 
 #include "acl.h"
+#include "dns.h"
 #include "heap.h"
 #include "log.h"
 #include "network.h"
@@ -242,7 +243,8 @@ acl_string_processing (struct acl_s *acl,
                 memset (&hints, 0, sizeof (struct addrinfo));
                 hints.ai_family = AF_UNSPEC;
                 hints.ai_socktype = SOCK_STREAM;
-                if (getaddrinfo (acl->address.string, NULL, &hints, &res) != 0)
+                if (dns_getaddrinfo (acl->address.string, NULL, &hints,
+                                     &res) != 0)
                         goto STRING_TEST;
 
                 ressave = res;
@@ -256,7 +258,7 @@ acl_string_processing (struct acl_s *acl,
                         }
                 } while ((res = res->ai_next) != NULL);
 
-                freeaddrinfo (ressave);
+                dns_freeaddrinfo (ressave);
 
                 if (match) {
                         if (acl->access == ACL_DENY)
@@ -0,0 +1,569 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Pools of peers (the members of an upstream group, or the backends of
+ * a reverse proxy path) with load balancing and health tracking.  The configuration side of a pool is an
+ * ordinary linked list which every process builds when it reads the
+ * config file.  The run-time state of each peer lives in a table in
+ * shared memory, keyed by "host:port", so that a peer ejected by one
+ * child is skipped by all of them, and so that the master process can
+ * publish the results of its active health checks to the children.
+ */
+
+#include "main.h"
+
+#include "balancer.h"
+#include "heap.h"
+#include "log.h"
+#include "shared-lock.h"
+#include "sock.h"
+#include "text.h"
+#include "conf.h"
+
+/*
+ * Number of peers whose state can be tracked.  Slots are never reused,
+ * so this has to cover the peers of every configuration loaded since
+ * startup.
+ */
+#define BALANCER_SLOTS 512
+#define PEER_NAME_LENGTH 272
+
+/*
+ * Each peer has a circuit breaker.  It opens after MaxFails consecutive
+ * connection failures, and the peer is then skipped without trying to
+ * connect to it.  After FailTimeout seconds the breaker is half-open:
+ * a single connection is let through as a trial, which either closes
+ * the breaker again or re-opens it.
+ */
+typedef enum {
+        BREAKER_CLOSED,
+        BREAKER_OPEN,
+        BREAKER_HALF_OPEN
+} breaker_t;
+
+static const char *breaker_names[] = { "closed", "open", "half-open" };
+
+struct peer_state {
+        char name[PEER_NAME_LENGTH];    /* "host:port", empty if unused */
+        unsigned int active;            /* connections in progress */
+        unsigned int fails;             /* consecutive failures */
+        breaker_t breaker;
+        time_t open_until;              /* breaker open until then */
+        time_t trial_since;             /* half-open trial in progress */
+        unsigned int unhealthy;         /* boolean, from health checks */
+        long current_weight;            /* smooth round-robin state */
+};
+
+static struct peer_state *peer_states = NULL;
+
+/*
+ * Allocate the shared peer table.  Must be called before the children
+ * are created.
+ */
+int balancer_init (void)
+{
+        peer_states = (struct peer_state *)
+            calloc_shared_memory (BALANCER_SLOTS, sizeof (struct peer_state));
+        if (peer_states == MAP_FAILED) {
+                peer_states = NULL;
+                log_message (LOG_ERR,
+                             "Could not allocate memory for the peer table.");
+                return -1;
+        }
+
+        return 0;
+}
+
+static unsigned int hash_name (const char *name)
+{
+        unsigned int hash = 5381;
+
+        while (*name)
+                hash = ((hash << 5) + hash) +
+                    (unsigned int) tolower ((unsigned char) *name++);
+
+        return hash;
+}
+
+/*
+ * Scramble the bits of a hash value (the MurmurHash3 finalizer), so that
+ * similar inputs give unrelated scores.
+ */
+static unsigned int mix_hash (unsigned int h)
+{
+        h ^= h >> 16;
+        h *= 0x85ebca6bU;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35U;
+        h ^= h >> 16;
+
+        return h;
+}
+
+/*
+ * Rendezvous (highest random weight) hashing: every (key, peer) pair
+ * gets a pseudo-random score and the peer with the highest one wins.
+ * When a peer is down only the keys it owned move elsewhere, and they
+ * come back when it returns.  A peer draws one score per unit of weight
+ * and keeps the best, which gives it a share of the keys proportional to
+ * its weight.
+ */
+static unsigned int
+rendezvous_score (unsigned int key_hash, const struct balancer_peer *peer)
+{
+        unsigned int r, score, best = 0;
+
+        for (r = 0; r != peer->weight; r++) {
+                score = mix_hash (key_hash ^ mix_hash (peer->hash + r));
+                if (score > best)
+                        best = score;
+        }
+
+        return best;
+}
+
+/*
+ * Find the shared state of a peer, claiming a free slot if the peer has
+ * not been seen before.  LOCK_BALANCER must be held by the caller.
+ */
+static struct peer_state *peer_state_locked (struct balancer_peer *peer)
+{
+        char name[PEER_NAME_LENGTH];
+        unsigned int i, pos;
+
+        if (!peer_states || peer->slot == -2)
+                return NULL;
+
+        if (peer->slot >= 0)
+                return &peer_states[peer->slot];
+
+        snprintf (name, sizeof (name), "%s:%d", peer->host, peer->port);
+
+        pos = hash_name (name) % BALANCER_SLOTS;
+        for (i = 0; i != BALANCER_SLOTS; i++) {
+                if (peer_states[pos].name[0] == '\0') {
+                        strlcpy (peer_states[pos].name, name,
+                                 PEER_NAME_LENGTH);
+                        peer->slot = pos;
+                        break;
+                }
+
+                if (strcasecmp (peer_states[pos].name, name) == 0) {
+                        peer->slot = pos;
+                        break;
+                }
+
+                pos = (pos + 1) % BALANCER_SLOTS;
+        }
+
+        if (peer->slot < 0) {
+                /* Table is full; balance this peer without any state. */
+                peer->slot = -2;
+                return NULL;
+        }
+
+        return &peer_states[peer->slot];
+}
+
+/*
+ * Check whether the breaker of a peer lets a connection through, moving
+ * it from open to half-open once FailTimeout has passed.  A half-open
+ * breaker only allows one trial at a time; a trial which never reported
+ * back (because its child died, say) is given up after FailTimeout.
+ */
+static int breaker_allows (struct peer_state *state, time_t now)
+{
+        if (!state)
+                return TRUE;
+
+        if (state->breaker == BREAKER_OPEN) {
+                if (state->open_until > now)
+                        return FALSE;
+
+                state->breaker = BREAKER_HALF_OPEN;
+                state->trial_since = 0;
+        }
+
+        if (state->breaker == BREAKER_HALF_OPEN && state->trial_since
+            && difftime (now, state->trial_since) < config.fail_timeout)
+                return FALSE;
+
+        return TRUE;
+}
+
+static void breaker_open (struct peer_state *state, time_t now)
+{
+        state->breaker = BREAKER_OPEN;
+        state->open_until = now + config.fail_timeout;
+        state->trial_since = 0;
+}
+
+/*
+ * Returns true if peer "a" has fewer active connections per unit of
+ * weight than peer "b".
+ */
+static int
+fewer_connections (const struct balancer_peer *a, const struct peer_state *sa,
+                   const struct balancer_peer *b, const struct peer_state *sb)
+{
+        unsigned long active_a = sa ? sa->active : 0;
+        unsigned long active_b = sb ? sb->active : 0;
+
+        return active_a * b->weight < active_b * a->weight;
+}
+
+/*
+ * Add a peer to the end of the pool.
+ */
+int balancer_add_peer (struct balancer_pool *pool, const char *host,
+                       int port, unsigned int weight)
+{
+        struct balancer_peer *peer, **tail;
+        char name[PEER_NAME_LENGTH];
+
+        assert (pool != NULL);
+        assert (host != NULL);
+
+        peer = (struct balancer_peer *)
+            safecalloc (1, sizeof (struct balancer_peer));
+        if (!peer)
+                return -1;
+
+        peer->host = safestrdup (host);
+        if (!peer->host) {
+                safefree (peer);
+                return -1;
+        }
+
+        peer->port = port;
+        peer->weight = weight > 0 ? weight : 1;
+        peer->index = pool->npeers++;
+        peer->slot = -1;
+
+        snprintf (name, sizeof (name), "%s:%d", host, port);
+        peer->hash = hash_name (name);
+
+        for (tail = &pool->peers; *tail; tail = &(*tail)->next) ;
+        *tail = peer;
+
+        return 0;
+}
+
+int balancer_set_policy (struct balancer_pool *pool, const char *policy)
+{
+        if (strcasecmp (policy, "roundrobin") == 0)
+                pool->policy = BALANCE_ROUNDROBIN;
+        else if (strcasecmp (policy, "leastconn") == 0)
+                pool->policy = BALANCE_LEASTCONN;
+        else if (strcasecmp (policy, "hosthash") == 0)
+                pool->policy = BALANCE_HASH_HOST;
+        else if (strcasecmp (policy, "urlhash") == 0)
+                pool->policy = BALANCE_HASH_URL;
+        else if (strcasecmp (policy, "cookiehash") == 0)
+                pool->policy = BALANCE_HASH_COOKIE;
+        else
+                return -1;
+
+        return 0;
+}
+
+void balancer_free_pool (struct balancer_pool *pool)
+{
+        while (pool->peers) {
+                struct balancer_peer *tmp = pool->peers;
+
+                pool->peers = tmp->next;
+                safefree (tmp->host);
+                safefree (tmp);
+        }
+
+        pool->npeers = 0;
+}
+
+/*
+ * Pick the peer to use for the next connection, skipping the peers
+ * flagged in "tried" (indexed by peer->index; may be NULL).  The hashing
+ * policies map "key" to a peer; the other policies ignore it.  Without a
+ * cookie to hash, the cookie policy picks the least busy peer instead,
+ * rather than sending every new client to the same one.  The chosen peer
+ * is counted as active until balancer_release() is called.
+ *
+ * Returns NULL if every peer has already been tried.
+ */
+struct balancer_peer *balancer_select (struct balancer_pool *pool,
+                                       const unsigned char *tried,
+                                       const char *key)
+{
+        struct balancer_peer *peer, *best = NULL;
+        struct peer_state *state, *best_state = NULL;
+        time_t now = time (NULL);
+        unsigned int key_hash, score, best_score = 0;
+        long total = 0;
+        int pass, hashing, leastconn;
+
+        key_hash = mix_hash (hash_name (key ? key : ""));
+        hashing = pool->policy == BALANCE_HASH_HOST
+            || pool->policy == BALANCE_HASH_URL
+            || (pool->policy == BALANCE_HASH_COOKIE && key);
+        leastconn = pool->policy == BALANCE_LEASTCONN
+            || (pool->policy == BALANCE_HASH_COOKIE && !key);
+
+        shared_lock_wait (LOCK_BALANCER);
+
+        /*
+         * The first pass only considers the peers which passed their
+         * health checks.  If all of them failed, try the others anyway,
+         * since the checks may be wrong.  Peers whose breaker is open are
+         * never used, so the request can fail straight away.
+         */
+        for (pass = 0; pass != 2 && !best; pass++) {
+                total = 0;
+
+                for (peer = pool->peers; peer; peer = peer->next) {
+                        if (tried && tried[peer->index])
+                                continue;
+
+                        state = peer_state_locked (peer);
+                        if (!breaker_allows (state, now))
+                                continue;
+                        if (pass == 0 && state && state->unhealthy)
+                                continue;
+
+                        if (hashing) {
+                                score = rendezvous_score (key_hash, peer);
+                                if (!best || score > best_score) {
+                                        best = peer;
+                                        best_state = state;
+                                        best_score = score;
+                                }
+                                continue;
+                        }
+
+                        if (leastconn) {
+                                if (!best
+                                    || fewer_connections (peer, state,
+                                                          best, best_state)) {
+                                        best = peer;
+                                        best_state = state;
+                                }
+                                continue;
+                        }
+
+                        /* Smooth weighted round-robin */
+                        if (state) {
+                                state->current_weight += peer->weight;
+                                total += peer->weight;
+                        }
+
+                        if (!best || (state && best_state
+                                      && state->current_weight >
+                                      best_state->current_weight)) {
+                                best = peer;
+                                best_state = state;
+                        }
+                }
+        }
+
+        if (best_state) {
+                if (pool->policy == BALANCE_ROUNDROBIN)
+                        best_state->current_weight -= total;
+                if (best_state->breaker == BREAKER_HALF_OPEN)
+                        best_state->trial_since = now;
+                best_state->active++;
+        }
+
+        shared_lock_release (LOCK_BALANCER);
+
+        return best;
+}
+
+/*
+ * A connection to the peer was established.
+ */
+void balancer_succeeded (struct balancer_peer *peer)
+{
+        struct peer_state *state;
+        unsigned int closed = FALSE;
+
+        shared_lock_wait (LOCK_BALANCER);
+        state = peer_state_locked (peer);
+        if (state) {
+                closed = (state->breaker != BREAKER_CLOSED);
+                state->breaker = BREAKER_CLOSED;
+                state->trial_since = 0;
+                state->fails = 0;
+        }
+        shared_lock_release (LOCK_BALANCER);
+
+        if (closed)
+                log_message (LOG_NOTICE, "Circuit breaker for %s:%d closed",
+                             peer->host, peer->port);
+}
+
+/*
+ * A connection attempt to the peer failed.  The breaker opens after
+ * MaxFails consecutive failures, or straight away if this was the trial
+ * connection of a half-open breaker.
+ */
+void balancer_failed (struct balancer_peer *peer)
+{
+        struct peer_state *state;
+        unsigned int opened = FALSE, fails = 0;
+
+        shared_lock_wait (LOCK_BALANCER);
+        state = peer_state_locked (peer);
+        if (state) {
+                fails = ++state->fails;
+                if (state->breaker == BREAKER_HALF_OPEN
+                    || (config.max_fails > 0
+                        && state->fails >= config.max_fails)) {
+                        opened = (state->breaker != BREAKER_OPEN);
+                        breaker_open (state, time (NULL));
+                }
+        }
+        shared_lock_release (LOCK_BALANCER);
+
+        if (opened)
+                log_message (LOG_WARNING,
+                             "Circuit breaker for %s:%d opened for %u "
+                             "seconds after %u failed connection attempts",
+                             peer->host, peer->port, config.fail_timeout,
+                             fails);
+}
+
+/*
+ * The connection handed out by balancer_select() is finished.
+ */
+void balancer_release (struct balancer_peer *peer)
+{
+        struct peer_state *state;
+
+        shared_lock_wait (LOCK_BALANCER);
+        state = peer_state_locked (peer);
+        if (state && state->active > 0)
+                state->active--;
+        shared_lock_release (LOCK_BALANCER);
+}
+
+/*
+ * Try to open a TCP connection to the peer, giving up after
+ * HealthCheckTimeout seconds.  Returns 0 if the peer accepted the
+ * connection.
+ */
+static int probe_peer (const struct balancer_peer *peer)
+{
+        int sockfd;
+
+        sockfd = opensock_timeout (peer->host, peer->port, NULL,
+                                   config.health_check_timeout);
+        if (sockfd < 0)
+                return -1;
+
+        close (sockfd);
+        return 0;
+}
+
+/*
+ * Actively probe every peer of the pool, at most once every
+ * HealthCheckInterval seconds.  This is run by the master process; the
+ * results are shared with the children through the peer table.
+ */
+void balancer_check_health (struct balancer_pool *pool)
+{
+        struct balancer_peer *peer;
+        struct peer_state *state;
+        time_t now = time (NULL);
+        int up, changed;
+
+        if (config.health_check_interval == 0)
+                return;
+
+        if (difftime (now, pool->last_check) < config.health_check_interval)
+                return;
+        pool->last_check = now;
+
+        for (peer = pool->peers; peer; peer = peer->next) {
+                up = (probe_peer (peer) == 0);
+                changed = FALSE;
+
+                shared_lock_wait (LOCK_BALANCER);
+                state = peer_state_locked (peer);
+                if (state) {
+                        changed = (state->unhealthy == (unsigned int) up);
+                        state->unhealthy = !up;
+                        if (up && changed) {
+                                state->fails = 0;
+                                state->breaker = BREAKER_CLOSED;
+                                state->trial_since = 0;
+                        }
+                }
+                shared_lock_release (LOCK_BALANCER);
+
+                if (changed)
+                        log_message (up ? LOG_NOTICE : LOG_WARNING,
+                                     "Health check: %s:%d is %s",
+                                     peer->host, peer->port,
+                                     up ? "up again" : "down");
+        }
+}
+
+/*
+ * Describe the state of every known peer as rows of an HTML table, for
+ * the statistics page.  Returns the number of peers listed.
+ */
+unsigned int balancer_status_html (char *buf, size_t len)
+{
+        struct peer_state *state;
+        unsigned int i, count = 0;
+        time_t now = time (NULL);
+        size_t used = 0;
+        int n;
+
+        if (len > 0)
+                buf[0] = '\0';
+
+        if (!peer_states)
+                return 0;
+
+        shared_lock_wait (LOCK_BALANCER);
+        for (i = 0; i != BALANCER_SLOTS && used < len; i++) {
+                state = &peer_states[i];
+                if (state->name[0] == '\0')
+                        continue;
+
+                n = snprintf (buf + used, len - used,
+                              "<tr><td>%s</td><td>%s</td><td>%s</td>"
+                              "<td>%u</td><td>%u</td><td>%ld</td></tr>\n",
+                              state->name, breaker_names[state->breaker],
+                              state->unhealthy ? "down" : "up",
+                              state->active, state->fails,
+                              state->breaker == BREAKER_OPEN
+                              && state->open_until > now ?
+                              (long) (state->open_until - now) : 0L);
+                if (n < 0 || (size_t) n >= len - used) {
+                        buf[used] = '\0';
+                        break;
+                }
+
+                used += n;
+                count++;
+        }
+        shared_lock_release (LOCK_BALANCER);
+
+        return count;
+}
@@ -0,0 +1,75 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'balancer.c' for detailed information. */
+
+#ifndef TINYPROXY_BALANCER_H
+#define TINYPROXY_BALANCER_H
+
+#include "common.h"
+
+typedef enum {
+        BALANCE_ROUNDROBIN,     /* smooth weighted round-robin */
+        BALANCE_LEASTCONN,      /* fewest active connections per weight */
+        BALANCE_HASH_HOST,      /* consistent hashing of the host name */
+        BALANCE_HASH_URL,       /* consistent hashing of the full URL */
+        BALANCE_HASH_COOKIE     /* consistent hashing of a cookie */
+} balance_policy_t;
+
+/*
+ * A member of a pool as read from the configuration file.  The run-time
+ * state (connection counts, failures, health) is kept in shared memory
+ * so that all the children see the same picture; "slot" caches the
+ * location of that state once it has been looked up.
+ */
+struct balancer_peer {
+        struct balancer_peer *next;
+        char *host;
+        int port;
+        unsigned int weight;
+        unsigned int index;     /* position within the pool */
+        unsigned int hash;      /* of "host:port", for consistent hashing */
+        int slot;               /* -1 until looked up */
+};
+
+struct balancer_pool {
+        balance_policy_t policy;
+        struct balancer_peer *peers;
+        unsigned int npeers;
+        time_t last_check;      /* last active health check (master only) */
+};
+
+extern int balancer_init (void);
+
+extern int balancer_add_peer (struct balancer_pool *pool, const char *host,
+                              int port, unsigned int weight);
+extern int balancer_set_policy (struct balancer_pool *pool,
+                                const char *policy);
+extern void balancer_free_pool (struct balancer_pool *pool);
+
+extern struct balancer_peer *balancer_select (struct balancer_pool *pool,
+                                              const unsigned char *tried,
+                                              const char *key);
+extern void balancer_succeeded (struct balancer_peer *peer);
+extern void balancer_failed (struct balancer_peer *peer);
+extern void balancer_release (struct balancer_peer *peer);
+
+extern void balancer_check_health (struct balancer_pool *pool);
+extern unsigned int balancer_status_html (char *buf, size_t len);
+
+#endif
@@ -56,7 +56,8 @@ struct buffer_s {
  * to the buffer. The data IS copied, so make sure if you allocated your
  * data buffer on the heap, delete it because you now have TWO copies.
  */
-static struct bufline_s *makenewline (unsigned char *data, size_t length)
+static struct bufline_s *makenewline (const unsigned char *data,
+                                      size_t length)
 {
         struct bufline_s *newline;
 
@@ -151,7 +152,8 @@ size_t buffer_size (struct buffer_s *buffptr)
 /*
  * Push a new line on to the end of the buffer.
  */
-int add_to_buffer (struct buffer_s *buffptr, unsigned char *data, size_t length)
+int add_to_buffer (struct buffer_s *buffptr, const unsigned char *data,
+                   size_t length)
 {
         struct bufline_s *newline;
 
@@ -204,18 +206,44 @@ static struct bufline_s *remove_from_buffer (struct buffer_s *buffptr)
         return line;
 }
 
+/*
+ * Get the data added last to the buffer, such as by read_buffer().
+ */
+size_t buffer_last_line (struct buffer_s *buffptr, const unsigned char **data)
+{
+        assert (buffptr != NULL);
+
+        if (!BUFFER_TAIL (buffptr))
+                return 0;
+
+        *data = BUFFER_TAIL (buffptr)->string;
+        return BUFFER_TAIL (buffptr)->length;
+}
+
 /*
  * Reads the bytes from the socket, and adds them to the buffer.
  * Takes a connection and returns the number of bytes read.
  */
 #define READ_BUFFER_SIZE (1024 * 2)
 ssize_t read_buffer (int fd, struct buffer_s * buffptr)
+{
+        return read_buffer_limit (fd, buffptr, READ_BUFFER_SIZE);
+}
+
+/*
+ * Same as read_buffer(), but read at most "limit" bytes.
+ */
+ssize_t read_buffer_limit (int fd, struct buffer_s * buffptr, size_t limit)
 {
         ssize_t bytesin;
         unsigned char *buffer;
 
         assert (fd >= 0);
         assert (buffptr != NULL);
+        assert (limit > 0);
+
+        if (limit > READ_BUFFER_SIZE)
+                limit = READ_BUFFER_SIZE;
 
         /*
          * Don't allow the buffer to grow larger than MAXBUFFSIZE
@@ -228,7 +256,7 @@ ssize_t read_buffer (int fd, struct buffer_s * buffptr)
                 return -ENOMEM;
         }
 
-        bytesin = read (fd, buffer, READ_BUFFER_SIZE);
+        bytesin = read (fd, buffer, limit);
 
         if (bytesin > 0) {
                 if (add_to_buffer (buffptr, buffer, bytesin) < 0) {
@@ -321,3 +349,38 @@ ssize_t write_buffer (int fd, struct buffer_s * buffptr)
                 }
         }
 }
+
+/*
+ * Write all of the buffer to a file, which unlike a socket does not make
+ * us wait.  Returns the number of bytes written, or -1 on an error, after
+ * which the buffer holds what was not written.
+ */
+ssize_t flush_buffer (int fd, struct buffer_s * buffptr)
+{
+        ssize_t len, total = 0;
+        struct bufline_s *line;
+
+        assert (fd >= 0);
+        assert (buffptr != NULL);
+
+        while (buffptr->size > 0) {
+                line = BUFFER_HEAD (buffptr);
+                len = write (fd, line->string + line->pos,
+                             line->length - line->pos);
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        log_message (LOG_ERR,
+                                     "flushbuff: write() error \"%s\" on file descriptor %d",
+                                     strerror (errno), fd);
+                        return -1;
+                }
+
+                line->pos += len;
+                if (line->pos == line->length)
+                        free_line (remove_from_buffer (buffptr));
+                total += len;
+        }
+
+        return total;
+}
@@ -31,10 +31,15 @@ extern size_t buffer_size (struct buffer_s *buffptr);
 /*
  * Add a new line to the given buffer. The data IS copied into the structure.
  */
-extern int add_to_buffer (struct buffer_s *buffptr, unsigned char *data,
+extern int add_to_buffer (struct buffer_s *buffptr, const unsigned char *data,
                           size_t length);
 
 extern ssize_t read_buffer (int fd, struct buffer_s *buffptr);
+extern size_t buffer_last_line (struct buffer_s *buffptr,
+                                 const unsigned char **data);
+extern ssize_t read_buffer_limit (int fd, struct buffer_s *buffptr,
+                                  size_t limit);
 extern ssize_t write_buffer (int fd, struct buffer_s *buffptr);
+extern ssize_t flush_buffer (int fd, struct buffer_s *buffptr);
 
 #endif /* __BUFFER_H_ */
@@ -0,0 +1,2036 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A cache of HTTP responses, kept in memory shared by all the children.
+ *
+ * The memory (CacheSize) is split into blocks of CACHE_BLOCK_SIZE bytes,
+ * and each response is stored in a chain of them, behind its key: the
+ * URL, the names of the request headers listed by Vary, and the values
+ * the request had for them.  A hit is sent to the client with a single
+ * writev() straight from the blocks, along with the Age and Connection
+ * headers for that client.
+ *
+ * Only responses which say how long they stay fresh (with max-age,
+ * s-maxage or Expires) are kept.  Once stale, a response with an ETag or
+ * Last-Modified header is revalidated with a conditional request, and
+ * sent again if the server answers 304 (Not Modified).  Within its
+ * stale-while-revalidate time it is sent at once instead, and a single
+ * child then refreshes it from the server; within its stale-if-error
+ * time it stands in for the errors of the server.  When the memory is
+ * full, responses are evicted with the CLOCK algorithm: a response
+ * which was used since the hand last passed it gets a second chance.
+ * Responses are "pinned" while they are being sent to a client, so that
+ * their blocks are not reused under it.  A pin holds until the child
+ * sending the response lets go of it; those of the children which exit
+ * first are taken back when the cache runs out of pins or room.
+ *
+ * With CacheDir, a second and larger tier of blocks lives in a file
+ * there ("objects"), which is mapped into memory.  Every response kept
+ * is written to both tiers; the memory tier holds the ones in use, and
+ * those found only in the file are sent from the mapping and then
+ * copied back into memory.  The index of the file stays in shared
+ * memory, and its changes are appended to a journal next to it, which
+ * is replayed and compacted when Tinyproxy starts, so that the cache
+ * survives restarts.
+ */
+
+#include "main.h"
+
+#include "cache.h"
+#include "heap.h"
+#include "log.h"
+#include "shared-lock.h"
+#include "conf.h"
+
+#define CACHE_BLOCK_SIZE 4096
+#define CACHE_PINS 1024         /* responses being sent at once */
+#define CACHE_REFRESH_TIMEOUT 30        /* and a refresh to finish */
+
+#define CACHE_FETCHES 64        /* fetches others may wait for at once */
+#define CACHE_COLLAPSE_POLL 10000       /* microseconds between looks */
+#define CACHE_PASS_TIME 60      /* to remember a URL is not cached */
+
+#ifdef IOV_MAX
+#  define CACHE_IOV_MAX IOV_MAX
+#else
+#  define CACHE_IOV_MAX 16
+#endif
+
+#define CACHE_MEMORY 0
+#define CACHE_DISK 1
+#define CACHE_TIERS 2
+
+#define JOURNAL_ADD 0x4a414444  /* record types */
+#define JOURNAL_DEL 0x4a44454c
+
+struct cache_entry {
+        int next;               /* in the hash chain (or free list) */
+        unsigned int hash;
+        unsigned int in_use;
+        unsigned int referenced;        /* used since the hand passed */
+
+        int first_block;
+        unsigned int nblocks;
+        size_t keylen;
+        size_t headlen;
+        size_t bodylen;
+
+        time_t stored;          /* when the response was generated */
+        time_t expires;
+        long stale_while;       /* stale-while-revalidate */
+        long stale_error;       /* stale-if-error */
+        unsigned int validator; /* has an ETag or Last-Modified */
+
+        unsigned int pins;
+        time_t refreshing;      /* since when a child refreshes it */
+};
+
+struct cache_s {
+        unsigned int nentries;
+        unsigned int nblocks;
+        unsigned int used;
+        int free_entry;
+        int free_block;
+        unsigned int free_blocks;
+        unsigned int hand;
+        unsigned int journal_records;
+
+        /* Only kept in the memory tier */
+        unsigned long hits;
+        unsigned long disk_hits;
+        unsigned long misses;
+        unsigned long saved;
+};
+
+/*
+ * A tier of the cache: its state in shared memory, the blocks, and for
+ * the disk tier the journal of the index.
+ */
+struct cache_tier {
+        struct cache_s *cache;
+        int *buckets;
+        struct cache_entry *entries;
+        int *block_next;
+        unsigned char *blocks;
+        char *journal;
+};
+
+/*
+ * An entry of the journal, followed by the list of its blocks when one
+ * is added.
+ */
+struct journal_record {
+        unsigned int type;
+        int idx;
+        unsigned int hash;
+        unsigned int nblocks;
+        size_t keylen;
+        size_t headlen;
+        size_t bodylen;
+        time_t stored;
+        time_t expires;
+        long stale_while;
+        long stale_error;
+        unsigned int validator;
+};
+
+/*
+ * A response being relayed from the server, kept in the process until
+ * all of it has arrived.
+ */
+struct cache_object {
+        char *vary;             /* names of the headers it varies on */
+        char *spec;             /* and the values the request had */
+        char *etag;
+        char *lastmod;
+        char *head;
+        size_t headlen;
+        unsigned char *body;
+        size_t bodylen;
+        size_t bodysize;
+        time_t stored;
+        time_t expires;
+        long stale_while;
+        long stale_error;
+};
+
+/*
+ * A URL being fetched from the server by a child, which the others
+ * asking for it wait for (collapsed forwarding).
+ */
+struct cache_fetch {
+        unsigned int hash;
+        pid_t leader;           /* 0 once it is over */
+        time_t started;
+        time_t pass_until;      /* its response was not kept */
+        char url[1024];
+};
+
+/*
+ * A response being sent by a child.
+ */
+struct cache_pin {
+        pid_t owner;            /* 0 when the slot is free */
+        int tier;
+        int entry;
+};
+
+/*
+ * Position in a chain of blocks.
+ */
+struct cache_cursor {
+        int block;
+        size_t offset;
+};
+
+static struct cache_tier tiers[CACHE_TIERS];
+static struct cache_fetch *fetches = NULL;
+static struct cache_pin *pin_table = NULL;
+
+#define CACHE_STATS (tiers[CACHE_MEMORY].cache)
+
+static unsigned int blocks_for (unsigned long kilobytes)
+{
+        unsigned long n;
+
+        n = (kilobytes + CACHE_BLOCK_SIZE / 1024 - 1)
+            / (CACHE_BLOCK_SIZE / 1024);
+
+        return n < 4 ? 4 : (unsigned int) n;
+}
+
+/*
+ * Allocate the shared state of a tier of "n" blocks, and the blocks
+ * themselves unless they are given.
+ */
+static int
+tier_alloc (struct cache_tier *tier, unsigned int n, unsigned char *blocks)
+{
+        unsigned int i;
+        size_t size, offset;
+        unsigned char *mem;
+
+        size = sizeof (struct cache_s) + n * sizeof (int)
+            + n * sizeof (struct cache_entry) + n * sizeof (int);
+        offset = (size + 15) & ~((size_t) 15);
+        if (!blocks)
+                size = offset + (size_t) n * CACHE_BLOCK_SIZE;
+
+        mem = (unsigned char *) malloc_shared_memory (size);
+        if (mem == MAP_FAILED)
+                return -1;
+
+        tier->cache = (struct cache_s *) mem;
+        tier->buckets = (int *) (mem + sizeof (struct cache_s));
+        tier->entries = (struct cache_entry *) (tier->buckets + n);
+        tier->block_next = (int *) (tier->entries + n);
+        tier->blocks = blocks ? blocks : mem + offset;
+
+        memset (tier->cache, 0, sizeof (struct cache_s));
+        tier->cache->nentries = tier->cache->nblocks = n;
+        tier->cache->free_blocks = n;
+
+        for (i = 0; i != n; i++) {
+                tier->buckets[i] = -1;
+                memset (&tier->entries[i], 0, sizeof (struct cache_entry));
+                tier->entries[i].next = (i + 1 < n) ? (int) i + 1 : -1;
+                tier->block_next[i] = (i + 1 < n) ? (int) i + 1 : -1;
+        }
+
+        return 0;
+}
+
+static unsigned int hash_key (const char *key)
+{
+        unsigned int hash = 5381;
+
+        while (*key)
+                hash = ((hash << 5) + hash) + (unsigned char) *key++;
+
+        return hash;
+}
+
+/*
+ * Copy data into a chain of blocks, or out of it.
+ */
+static void
+cursor_copy (struct cache_tier *tier, struct cache_cursor *cursor,
+             unsigned char *data, size_t len, int out)
+{
+        size_t n;
+        unsigned char *block;
+
+        while (len > 0) {
+                if (cursor->offset == CACHE_BLOCK_SIZE) {
+                        cursor->block = tier->block_next[cursor->block];
+                        cursor->offset = 0;
+                }
+
+                n = CACHE_BLOCK_SIZE - cursor->offset;
+                if (n > len)
+                        n = len;
+
+                block = tier->blocks
+                    + (size_t) cursor->block * CACHE_BLOCK_SIZE
+                    + cursor->offset;
+                if (out)
+                        memcpy (data, block, n);
+                else
+                        memcpy (block, data, n);
+
+                cursor->offset += n;
+                data += n;
+                len -= n;
+        }
+}
+
+/*
+ * Get a copy of the key of an entry, as written by store_locked().
+ */
+static char *entry_key (struct cache_tier *tier, struct cache_entry *entry)
+{
+        struct cache_cursor cursor;
+        char *key;
+
+        key = (char *) safemalloc (entry->keylen);
+        if (!key)
+                return NULL;
+
+        cursor.block = entry->first_block;
+        cursor.offset = 0;
+        cursor_copy (tier, &cursor, (unsigned char *) key, entry->keylen,
+                     TRUE);
+
+        return key;
+}
+
+/*
+ * Add a range of the data of an entry to an array of iovecs.
+ */
+static unsigned int
+entry_iov (struct cache_tier *tier, struct cache_entry *entry,
+           size_t offset, size_t len, struct iovec *iov)
+{
+        int block = entry->first_block;
+        unsigned int n = 0;
+        size_t chunk;
+
+        while (offset >= CACHE_BLOCK_SIZE) {
+                block = tier->block_next[block];
+                offset -= CACHE_BLOCK_SIZE;
+        }
+
+        while (len > 0) {
+                chunk = CACHE_BLOCK_SIZE - offset;
+                if (chunk > len)
+                        chunk = len;
+
+                iov[n].iov_base = tier->blocks
+                    + (size_t) block * CACHE_BLOCK_SIZE + offset;
+                iov[n].iov_len = chunk;
+                n++;
+
+                block = tier->block_next[block];
+                offset = 0;
+                len -= chunk;
+        }
+
+        return n;
+}
+
+static int entry_pinned (struct cache_entry *entry)
+{
+        return entry->pins > 0;
+}
+
+static void release_pin_locked (struct cache_pin *pin)
+{
+        struct cache_entry *entry = &tiers[pin->tier].entries[pin->entry];
+
+        if (entry->pins > 0)
+                entry->pins--;
+        pin->owner = 0;
+}
+
+/*
+ * Take back the pins of the children which exited without letting go
+ * of them.  Returns the number of pins taken back.
+ */
+static unsigned int reclaim_pins_locked (void)
+{
+        struct cache_pin *pin;
+        unsigned int i, n = 0;
+
+        for (i = 0; i != CACHE_PINS; i++) {
+                pin = &pin_table[i];
+                if (pin->owner == 0 || kill (pin->owner, 0) == 0
+                    || errno != ESRCH)
+                        continue;
+
+                release_pin_locked (pin);
+                n++;
+        }
+
+        return n;
+}
+
+/*
+ * Pin an entry for the request until unpin_locked().  Returns -1 if
+ * all the pins are held.
+ */
+static int pin_entry_locked (struct conn_s *connptr, int tier, int idx)
+{
+        struct cache_pin *pin;
+        int i;
+
+        for (i = 0; i != CACHE_PINS; i++) {
+                pin = &pin_table[i];
+                if (pin->owner != 0)
+                        continue;
+
+                pin->owner = getpid ();
+                pin->tier = tier;
+                pin->entry = idx;
+                tiers[tier].entries[idx].pins++;
+                connptr->cache_pin = i;
+                return 0;
+        }
+
+        if (reclaim_pins_locked () > 0)
+                return pin_entry_locked (connptr, tier, idx);
+
+        return -1;
+}
+
+static void unpin_locked (struct conn_s *connptr)
+{
+        struct cache_pin *pin;
+
+        if (connptr->cache_pin < 0)
+                return;
+
+        pin = &pin_table[connptr->cache_pin];
+        if (pin->owner == getpid ())
+                release_pin_locked (pin);
+        connptr->cache_pin = -1;
+}
+
+/*
+ * Is an entry of no more use, not even when stale?
+ */
+static int entry_dead (struct cache_entry *entry, time_t now)
+{
+        long grace = entry->stale_while > entry->stale_error
+            ? entry->stale_while : entry->stale_error;
+
+        return !entry->validator && now >= entry->expires + grace;
+}
+
+/*
+ * Write a journal record about an entry of the disk tier.
+ */
+static int
+journal_write (struct cache_tier *tier, int fd, unsigned int type, int idx)
+{
+        struct cache_entry *entry = &tier->entries[idx];
+        struct journal_record *rec;
+        int *list;
+        size_t len = sizeof (struct journal_record);
+        unsigned int i;
+        int block, ret;
+
+        if (type == JOURNAL_ADD)
+                len += entry->nblocks * sizeof (int);
+
+        rec = (struct journal_record *) safecalloc (1, len);
+        if (!rec)
+                return -1;
+
+        rec->type = type;
+        rec->idx = idx;
+        if (type == JOURNAL_ADD) {
+                rec->hash = entry->hash;
+                rec->nblocks = entry->nblocks;
+                rec->keylen = entry->keylen;
+                rec->headlen = entry->headlen;
+                rec->bodylen = entry->bodylen;
+                rec->stored = entry->stored;
+                rec->expires = entry->expires;
+                rec->stale_while = entry->stale_while;
+                rec->stale_error = entry->stale_error;
+                rec->validator = entry->validator;
+
+                list = (int *) (rec + 1);
+                for (i = 0, block = entry->first_block; i != entry->nblocks;
+                     i++, block = tier->block_next[block])
+                        list[i] = block;
+        }
+
+        ret = write (fd, rec, len) == (ssize_t) len ? 0 : -1;
+        safefree (rec);
+
+        return ret;
+}
+
+/*
+ * Rewrite the journal with just the entries in the index.
+ */
+static void journal_compact_locked (struct cache_tier *tier)
+{
+        char *path;
+        unsigned int i;
+        int fd;
+
+        path = (char *) safemalloc (strlen (tier->journal) + 5);
+        if (!path)
+                return;
+        sprintf (path, "%s.new", tier->journal);
+
+        fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+                log_message (LOG_WARNING, "Could not write \"%s\": %s",
+                             path, strerror (errno));
+                safefree (path);
+                return;
+        }
+
+        for (i = 0; i != tier->cache->nentries; i++)
+                if (tier->entries[i].in_use
+                    && journal_write (tier, fd, JOURNAL_ADD, i) < 0)
+                        break;
+
+        if (close (fd) < 0 || i != tier->cache->nentries
+            || rename (path, tier->journal) < 0) {
+                log_message (LOG_WARNING, "Could not write \"%s\": %s",
+                             path, strerror (errno));
+                unlink (path);
+        } else {
+                tier->cache->journal_records = tier->cache->used;
+        }
+
+        safefree (path);
+}
+
+/*
+ * Note a change of the index of the disk tier in its journal.
+ */
+static void
+journal_append_locked (struct cache_tier *tier, unsigned int type, int idx)
+{
+        int fd;
+
+        if (!tier->journal)
+                return;
+
+        fd = open (tier->journal, O_WRONLY | O_APPEND | O_CREAT, 0600);
+        if (fd < 0 || journal_write (tier, fd, type, idx) < 0)
+                log_message (LOG_WARNING, "Could not write \"%s\": %s",
+                             tier->journal, strerror (errno));
+        if (fd >= 0)
+                close (fd);
+
+        /* Keep it from growing much beyond what it describes */
+        if (++tier->cache->journal_records > 4 * tier->cache->used + 1024)
+                journal_compact_locked (tier);
+}
+
+/*
+ * Read the journal back into the index of the disk tier.  Entries are
+ * only checked afterwards, by rebuild_index().
+ */
+static void journal_replay (struct cache_tier *tier)
+{
+        struct journal_record rec;
+        struct cache_entry *entry;
+        unsigned int n = tier->cache->nentries, i;
+        int *list;
+        int fd, valid;
+        size_t len;
+
+        fd = open (tier->journal, O_RDONLY);
+        if (fd < 0)
+                return;
+
+        list = (int *) safemalloc (n * sizeof (int));
+        if (!list) {
+                close (fd);
+                return;
+        }
+
+        while (read (fd, &rec, sizeof (rec)) == (ssize_t) sizeof (rec)) {
+                if ((rec.type != JOURNAL_ADD && rec.type != JOURNAL_DEL)
+                    || rec.idx < 0 || (unsigned int) rec.idx >= n)
+                        break;
+
+                entry = &tier->entries[rec.idx];
+                entry->in_use = FALSE;
+                if (rec.type == JOURNAL_DEL)
+                        continue;
+
+                if (rec.nblocks == 0 || rec.nblocks > n)
+                        break;
+                len = rec.nblocks * sizeof (int);
+                if (read (fd, list, len) != (ssize_t) len)
+                        break;
+
+                valid = TRUE;
+                for (i = 0; i != rec.nblocks; i++)
+                        if (list[i] < 0 || (unsigned int) list[i] >= n)
+                                valid = FALSE;
+                if (!valid)
+                        continue;
+
+                for (i = 0; i != rec.nblocks; i++)
+                        tier->block_next[list[i]] =
+                            (i + 1 < rec.nblocks) ? list[i + 1] : -1;
+
+                entry->in_use = TRUE;
+                entry->hash = rec.hash;
+                entry->first_block = list[0];
+                entry->nblocks = rec.nblocks;
+                entry->keylen = rec.keylen;
+                entry->headlen = rec.headlen;
+                entry->bodylen = rec.bodylen;
+                entry->stored = rec.stored;
+                entry->expires = rec.expires;
+                entry->stale_while = rec.stale_while;
+                entry->stale_error = rec.stale_error;
+                entry->validator = rec.validator;
+        }
+
+        safefree (list);
+        close (fd);
+}
+
+/*
+ * Check the chain of blocks and the key of an entry read back from the
+ * journal.
+ */
+static int
+entry_valid (struct cache_tier *tier, struct cache_entry *entry,
+             unsigned char *used, time_t now)
+{
+        unsigned int i, n = tier->cache->nblocks;
+        int block = entry->first_block;
+        char *key;
+        int valid;
+
+        if (entry_dead (entry, now) || entry->keylen == 0
+            || entry->keylen + entry->headlen + entry->bodylen >
+            (size_t) entry->nblocks * CACHE_BLOCK_SIZE)
+                return FALSE;
+
+        for (i = 0; i != entry->nblocks; i++) {
+                if (block < 0 || (unsigned int) block >= n || used[block])
+                        return FALSE;
+                block = tier->block_next[block];
+        }
+        if (block != -1)
+                return FALSE;
+
+        key = entry_key (tier, entry);
+        if (!key)
+                return FALSE;
+        valid = key[entry->keylen - 1] == '\0'
+            && hash_key (key) == entry->hash;
+        safefree (key);
+
+        return valid;
+}
+
+/*
+ * Rebuild the hash chains and free lists of a tier from the entries in
+ * use, dropping those which are not sound.
+ */
+static void rebuild_index (struct cache_tier *tier, time_t now)
+{
+        struct cache_s *cache = tier->cache;
+        struct cache_entry *entry;
+        unsigned char *used;
+        unsigned int i, j;
+        int block;
+
+        used = (unsigned char *) safecalloc (cache->nblocks, 1);
+        if (!used)
+                return;
+
+        cache->used = 0;
+        cache->free_entry = cache->free_block = -1;
+        cache->free_blocks = 0;
+
+        for (i = 0; i != cache->nentries; i++)
+                tier->buckets[i] = -1;
+
+        for (i = cache->nentries; i-- > 0;) {
+                entry = &tier->entries[i];
+                if (entry->in_use && entry_valid (tier, entry, used, now)) {
+                        for (j = 0, block = entry->first_block;
+                             j != entry->nblocks;
+                             j++, block = tier->block_next[block])
+                                used[block] = TRUE;
+
+                        entry->referenced = FALSE;
+                        entry->pins = 0;
+                        entry->refreshing = 0;
+                        entry->next = tier->buckets[entry->hash
+                                                    % cache->nentries];
+                        tier->buckets[entry->hash % cache->nentries] = i;
+                        cache->used++;
+                } else {
+                        entry->in_use = FALSE;
+                        entry->next = cache->free_entry;
+                        cache->free_entry = i;
+                }
+        }
+
+        for (i = cache->nblocks; i-- > 0;) {
+                if (used[i])
+                        continue;
+                tier->block_next[i] = cache->free_block;
+                cache->free_block = i;
+                cache->free_blocks++;
+        }
+
+        safefree (used);
+}
+
+/*
+ * Open the file of the disk tier, and load its index.
+ */
+static int disk_init (void)
+{
+        struct cache_tier *tier = &tiers[CACHE_DISK];
+        unsigned int n = blocks_for (config.cache_disk_size);
+        size_t size = (size_t) n * CACHE_BLOCK_SIZE;
+        char *path;
+        void *blocks;
+        int fd;
+
+        path = (char *) safemalloc (strlen (config.cache_dir) + 10);
+        tier->journal = (char *) safemalloc (strlen (config.cache_dir) + 10);
+        if (!path || !tier->journal)
+                goto fail;
+        sprintf (path, "%s/objects", config.cache_dir);
+        sprintf (tier->journal, "%s/journal", config.cache_dir);
+
+        fd = open (path, O_RDWR | O_CREAT, 0600);
+        if (fd < 0 || ftruncate (fd, size) < 0) {
+                log_message (LOG_ERR, "Could not open the cache file "
+                             "\"%s\": %s", path, strerror (errno));
+                if (fd >= 0)
+                        close (fd);
+                goto fail;
+        }
+
+        blocks = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close (fd);
+        if (blocks == MAP_FAILED) {
+                log_message (LOG_ERR, "Could not map the cache file "
+                             "\"%s\": %s", path, strerror (errno));
+                goto fail;
+        }
+
+        if (tier_alloc (tier, n, (unsigned char *) blocks) < 0) {
+                log_message (LOG_ERR,
+                             "Could not allocate memory for the cache.");
+                munmap (blocks, size);
+                goto fail;
+        }
+
+        journal_replay (tier);
+        rebuild_index (tier, time (NULL));
+        journal_compact_locked (tier);
+
+        log_message (LOG_INFO, "Loaded %u responses from the cache in \"%s\"",
+                     tier->cache->used, config.cache_dir);
+
+        safefree (path);
+        return 0;
+
+fail:
+        tier->cache = NULL;
+        safefree (tier->journal);
+        safefree (path);
+        return -1;
+}
+
+/*
+ * Allocate the shared memory and open the file of the disk tier.  Must
+ * be called before the children are created; changes of the settings
+ * only take effect on restart.
+ */
+int cache_init (void)
+{
+        if (config.cache_size == 0 || CACHE_STATS)
+                return 0;
+
+        if (tier_alloc (&tiers[CACHE_MEMORY], blocks_for (config.cache_size),
+                        NULL) < 0) {
+                tiers[CACHE_MEMORY].cache = NULL;
+                log_message (LOG_ERR,
+                             "Could not allocate memory for the cache.");
+                return -1;
+        }
+
+        fetches = (struct cache_fetch *)
+            calloc_shared_memory (CACHE_FETCHES, sizeof (struct cache_fetch));
+        if (fetches == MAP_FAILED)
+                fetches = NULL;
+
+        pin_table = (struct cache_pin *)
+            calloc_shared_memory (CACHE_PINS, sizeof (struct cache_pin));
+        if (pin_table == MAP_FAILED) {
+                pin_table = NULL;
+                tiers[CACHE_MEMORY].cache = NULL;
+                log_message (LOG_ERR,
+                             "Could not allocate memory for the cache.");
+                return -1;
+        }
+
+        if (config.cache_dir)
+                return disk_init ();
+
+        return 0;
+}
+
+/*
+ * Remove an entry from a tier, and give its blocks back.
+ */
+static void unlink_entry_locked (struct cache_tier *tier, int idx)
+{
+        struct cache_s *cache = tier->cache;
+        struct cache_entry *entry = &tier->entries[idx];
+        int *link = &tier->buckets[entry->hash % cache->nentries];
+        int last;
+
+        while (*link != idx)
+                link = &tier->entries[*link].next;
+        *link = entry->next;
+
+        for (last = entry->first_block; tier->block_next[last] != -1;
+             last = tier->block_next[last]) ;
+        tier->block_next[last] = cache->free_block;
+        cache->free_block = entry->first_block;
+        cache->free_blocks += entry->nblocks;
+
+        entry->in_use = FALSE;
+        entry->pins = 0;
+        entry->next = cache->free_entry;
+        cache->free_entry = idx;
+        cache->used--;
+
+        journal_append_locked (tier, JOURNAL_DEL, idx);
+}
+
+/*
+ * Get rid of a response which is no longer wanted.  One being sent
+ * just goes stale, and is removed when it is found next.
+ */
+static void drop_entry_locked (struct cache_tier *tier, int idx)
+{
+        struct cache_entry *entry = &tier->entries[idx];
+
+        if (entry_pinned (entry)) {
+                entry->expires = 0;
+                entry->stale_while = entry->stale_error = 0;
+                entry->validator = FALSE;
+        } else {
+                unlink_entry_locked (tier, idx);
+        }
+}
+
+/*
+ * Evict one response with the CLOCK algorithm, preferring those which
+ * are no longer fresh.  Returns -1 if all of them are being sent.
+ */
+static int evict_locked (struct cache_tier *tier, time_t now)
+{
+        struct cache_s *cache = tier->cache;
+        struct cache_entry *entry;
+        unsigned int i;
+
+        for (i = 0; i != 2 * cache->nentries; i++) {
+                entry = &tier->entries[cache->hand];
+                cache->hand = (cache->hand + 1) % cache->nentries;
+
+                if (!entry->in_use || entry_pinned (entry))
+                        continue;
+
+                if (entry->referenced && entry->expires > now) {
+                        entry->referenced = FALSE;
+                        continue;
+                }
+
+                unlink_entry_locked (tier, entry - tier->entries);
+                return 0;
+        }
+
+        /* Some of the children sending them may be gone */
+        if (reclaim_pins_locked () > 0)
+                return evict_locked (tier, now);
+
+        return -1;
+}
+
+/*
+ * Find the value of a directive in a Cache-Control header.  Returns
+ * TRUE if it is there, and stores its value (or -1) in "value".
+ */
+static int
+cache_directive (const char *header, const char *name, long *value)
+{
+        size_t len = strlen (name);
+        const char *p = header;
+
+        while (p && *p) {
+                while (*p == ' ' || *p == '\t' || *p == ',')
+                        p++;
+
+                if (strncasecmp (p, name, len) == 0
+                    && (p[len] == '\0' || p[len] == ',' || p[len] == '='
+                        || p[len] == ' ' || p[len] == '\t')) {
+                        if (value) {
+                                *value = -1;
+                                if (p[len] == '=')
+                                        *value = strtol (p + len + 1 +
+                                                         (p[len + 1] == '"'),
+                                                         NULL, 10);
+                        }
+                        return TRUE;
+                }
+
+                p = strchr (p, ',');
+        }
+
+        return FALSE;
+}
+
+/*
+ * Parse a date in the preferred format of HTTP (RFC 7231, 7.1.1.1).
+ * Returns -1 for anything else, which counts as being in the past.
+ */
+static time_t parse_http_date (const char *date)
+{
+        static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        char month[4];
+        const char *p;
+        int day, year, hour, min, sec;
+        long y, era, yoe, doy, doe, mp, mon;
+
+        if (sscanf (date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT",
+                    &day, month, &year, &hour, &min, &sec) != 6)
+                return -1;
+
+        p = strstr (months, month);
+        if (!p || (p - months) % 3 != 0 || year < 1970)
+                return -1;
+        mon = (p - months) / 3;
+
+        /* Days since the epoch for a date of the Gregorian calendar */
+        y = year - (mon < 2);
+        era = y / 400;
+        yoe = y - era * 400;
+        mp = (mon + 9) % 12;
+        doy = (153 * mp + 2) / 5 + day - 1;
+        doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+        return (time_t) ((era * 146097 + doe - 719468) * 86400L
+                         + hour * 3600L + min * 60L + sec);
+}
+
+/*
+ * How long a response stays fresh, or -1 if it must not be kept.  The
+ * "fallback" is for responses which do not say.
+ */
+static long response_ttl (hashmap_t hashofheaders, long fallback, time_t now)
+{
+        char *header;
+        long ttl;
+        time_t expires, date;
+
+        if (hashmap_entry_by_key (hashofheaders, "cache-control",
+                                  (void **) &header) > 0) {
+                if (cache_directive (header, "no-store", NULL)
+                    || cache_directive (header, "no-cache", NULL)
+                    || cache_directive (header, "private", NULL))
+                        return -1;
+
+                if (cache_directive (header, "s-maxage", &ttl)
+                    || cache_directive (header, "max-age", &ttl))
+                        return ttl;
+        }
+
+        if (hashmap_entry_by_key (hashofheaders, "expires",
+                                  (void **) &header) <= 0)
+                return fallback;
+        expires = parse_http_date (header);
+
+        date = now;
+        if (hashmap_entry_by_key (hashofheaders, "date",
+                                  (void **) &header) > 0
+            && parse_http_date (header) > 0)
+                date = parse_http_date (header);
+
+        return expires < 0 ? -1 : (long) (expires - date);
+}
+
+/*
+ * Describe the values a request has for the headers a response varies
+ * on, as "name: value" lines.
+ */
+static char *vary_spec (const char *vary, hashmap_t hashofheaders)
+{
+        char *spec, *name, *value, *p;
+        size_t len, size = 1;
+        const char *start;
+
+        spec = safestrdup ("");
+        if (!spec)
+                return NULL;
+
+        for (start = vary; *start;) {
+                while (*start == ' ' || *start == '\t' || *start == ',')
+                        start++;
+                len = strcspn (start, " \t,");
+                if (len == 0)
+                        break;
+
+                name = (char *) safemalloc (len + 1);
+                if (!name)
+                        goto fail;
+                memcpy (name, start, len);
+                name[len] = '\0';
+                start += len;
+
+                if (!hashofheaders
+                    || hashmap_entry_by_key (hashofheaders, name,
+                                             (void **) &value) <= 0)
+                        value = NULL;
+
+                size += len + 3 + (value ? strlen (value) : 0);
+                p = (char *) saferealloc (spec, size);
+                if (!p) {
+                        safefree (name);
+                        goto fail;
+                }
+                spec = p;
+
+                for (p = name; *p; p++)
+                        *p = tolower ((unsigned char) *p);
+                strcat (spec, name);
+                if (value) {
+                        strcat (spec, ":");
+                        strcat (spec, value);
+                }
+                strcat (spec, "\n");
+                safefree (name);
+        }
+
+        return spec;
+
+fail:
+        safefree (spec);
+        return NULL;
+}
+
+
+/*
+ * Is this entry the response for the URL and request headers?  Returns
+ * 0 if it is for another URL, 1 for another variant of the URL, and 2
+ * if it matches.
+ */
+static int
+entry_matches (struct cache_tier *tier, struct cache_entry *entry,
+               const char *url, hashmap_t hashofheaders)
+{
+        char *key, *vary, *spec, *want;
+        int ret = 0;
+
+        key = entry_key (tier, entry);
+        if (!key)
+                return 0;
+
+        if (strcmp (key, url) == 0) {
+                ret = 1;
+                vary = key + strlen (key) + 1;
+                spec = vary + strlen (vary) + 1;
+
+                want = vary_spec (vary, hashofheaders);
+                if (want && strcmp (want, spec) == 0)
+                        ret = 2;
+                safefree (want);
+        }
+
+        safefree (key);
+        return ret;
+}
+
+/*
+ * Find the response of a tier for the request, fresh or not, dropping
+ * those of no more use met on the way.
+ */
+static int
+find_entry_locked (struct cache_tier *tier, const char *url,
+                   unsigned int hash, hashmap_t hashofheaders, time_t now)
+{
+        struct cache_entry *entries = tier->entries;
+        int idx, next;
+
+        for (idx = tier->buckets[hash % tier->cache->nentries]; idx != -1;
+             idx = next) {
+                next = entries[idx].next;
+                if (entries[idx].hash != hash
+                    || entry_matches (tier, &entries[idx], url,
+                                      hashofheaders) < 2)
+                        continue;
+
+                if (entry_dead (&entries[idx], now)) {
+                        drop_entry_locked (tier, idx);
+                        continue;
+                }
+
+                return idx;
+        }
+
+        return -1;
+}
+
+/*
+ * Store a response in a tier.  The parts hold the key, then the head
+ * and the body.
+ */
+static int
+store_locked (struct cache_tier *tier, unsigned int hash, const char *key,
+              struct iovec *parts, unsigned int nparts,
+              struct cache_entry *from, time_t now)
+{
+        struct cache_s *cache = tier->cache;
+        struct cache_entry *entry;
+        struct cache_cursor cursor;
+        const char *vary = key + strlen (key) + 1;
+        const char *spec = vary + strlen (vary) + 1;
+        size_t total = from->keylen + from->headlen + from->bodylen;
+        unsigned int need, i;
+        int idx, next, last;
+        char *other, *other_vary;
+
+        need = (total + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+        if (need > cache->nblocks / 2)
+                return -1;
+
+        /* Replace the same variant, and any kept under another Vary */
+        for (idx = tier->buckets[hash % cache->nentries]; idx != -1;
+             idx = next) {
+                next = tier->entries[idx].next;
+                if (tier->entries[idx].hash != hash)
+                        continue;
+
+                other = entry_key (tier, &tier->entries[idx]);
+                if (!other)
+                        continue;
+                other_vary = other + strlen (other) + 1;
+                if (strcmp (other, key) == 0
+                    && (strcmp (other_vary, vary) != 0
+                        || strcmp (other_vary + strlen (other_vary) + 1,
+                                   spec) == 0))
+                        drop_entry_locked (tier, idx);
+                safefree (other);
+        }
+
+        while (cache->free_blocks < need || cache->free_entry == -1) {
+                if (evict_locked (tier, now) < 0)
+                        return -1;
+        }
+
+        idx = cache->free_entry;
+        entry = &tier->entries[idx];
+        cache->free_entry = entry->next;
+
+        entry->first_block = last = cache->free_block;
+        for (i = 1; i != need; i++)
+                last = tier->block_next[last];
+        cache->free_block = tier->block_next[last];
+        tier->block_next[last] = -1;
+        cache->free_blocks -= need;
+
+        cursor.block = entry->first_block;
+        cursor.offset = 0;
+        for (i = 0; i != nparts; i++)
+                cursor_copy (tier, &cursor,
+                             (unsigned char *) parts[i].iov_base,
+                             parts[i].iov_len, FALSE);
+
+        entry->hash = hash;
+        entry->in_use = TRUE;
+        entry->referenced = FALSE;
+        entry->nblocks = need;
+        entry->keylen = from->keylen;
+        entry->headlen = from->headlen;
+        entry->bodylen = from->bodylen;
+        entry->stored = from->stored;
+        entry->expires = from->expires;
+        entry->stale_while = from->stale_while;
+        entry->stale_error = from->stale_error;
+        entry->validator = from->validator;
+        entry->pins = 0;
+        entry->refreshing = 0;
+
+        entry->next = tier->buckets[hash % cache->nentries];
+        tier->buckets[hash % cache->nentries] = idx;
+        cache->used++;
+
+        journal_append_locked (tier, JOURNAL_ADD, idx);
+
+        return 0;
+}
+
+/*
+ * Copy a response found in the disk tier into memory, where it will be
+ * found next time.
+ */
+static void promote_locked (struct cache_entry *entry, time_t now)
+{
+        struct cache_tier *disk = &tiers[CACHE_DISK];
+        struct iovec *iov;
+        unsigned int n;
+        char *key;
+
+        key = entry_key (disk, entry);
+        iov = (struct iovec *) safemalloc (entry->nblocks
+                                           * sizeof (struct iovec));
+        if (key && iov) {
+                n = entry_iov (disk, entry, 0, entry->keylen + entry->headlen
+                               + entry->bodylen, iov);
+                store_locked (&tiers[CACHE_MEMORY], entry->hash, key, iov, n,
+                              entry, now);
+        }
+
+        safefree (iov);
+        safefree (key);
+}
+
+/*
+ * Remove all the responses for a URL.
+ */
+static void invalidate_url (const char *url)
+{
+        struct cache_tier *tier;
+        unsigned int hash = hash_key (url);
+        int i, idx, next;
+
+        shared_lock_wait (LOCK_CACHE);
+        for (i = 0; i != CACHE_TIERS; i++) {
+                tier = &tiers[i];
+                if (!tier->cache)
+                        continue;
+
+                for (idx = tier->buckets[hash % tier->cache->nentries];
+                     idx != -1; idx = next) {
+                        next = tier->entries[idx].next;
+                        if (tier->entries[idx].hash == hash
+                            && entry_matches (tier, &tier->entries[idx], url,
+                                              NULL) > 0)
+                                drop_entry_locked (tier, idx);
+                }
+        }
+        shared_lock_release (LOCK_CACHE);
+}
+
+/*
+ * Add the validators of a stale response to the request, so that the
+ * server can answer 304 (Not Modified) if it is still good.
+ */
+static void
+add_validators (struct cache_tier *tier, struct cache_entry *entry,
+                hashmap_t hashofheaders)
+{
+        char *key, *etag, *lastmod;
+
+        key = entry_key (tier, entry);
+        if (!key)
+                return;
+
+        /* After the URL, the Vary names and values */
+        etag = key + strlen (key) + 1;
+        etag += strlen (etag) + 1;
+        etag += strlen (etag) + 1;
+        if (etag >= key + entry->keylen)
+                goto done;
+        lastmod = etag + strlen (etag) + 1;
+
+        if (*etag)
+                hashmap_insert (hashofheaders, "If-None-Match", etag,
+                                strlen (etag) + 1);
+        if (lastmod < key + entry->keylen && *lastmod)
+                hashmap_insert (hashofheaders, "If-Modified-Since", lastmod,
+                                strlen (lastmod) + 1);
+
+done:
+        safefree (key);
+}
+
+/*
+ * Find the response for the request in the tiers, fresh or stale.
+ */
+static int
+find_response_locked (const char *url, unsigned int hash,
+                      hashmap_t hashofheaders, int stale_ok, time_t now,
+                      int *tier)
+{
+        int i, idx;
+
+        for (i = 0; i != CACHE_TIERS; i++) {
+                if (!tiers[i].cache)
+                        continue;
+
+                idx = find_entry_locked (&tiers[i], url, hash, hashofheaders,
+                                         now);
+                if (idx >= 0
+                    && (stale_ok || tiers[i].entries[idx].expires > now)) {
+                        *tier = i;
+                        return idx;
+                }
+        }
+
+        return -1;
+}
+
+/*
+ * Is another child fetching this URL from the server?  If none is, this
+ * one becomes the one others wait for ("lead"), unless the last response
+ * for the URL could not be kept.
+ */
+static int
+fetch_in_flight_locked (struct conn_s *connptr, const char *url,
+                        unsigned int hash, int lead, time_t now)
+{
+        struct cache_fetch *fetch;
+        int i, free_slot = -1;
+
+        if (!fetches || config.cache_collapse_timeout == 0
+            || strlen (url) >= sizeof (fetches->url))
+                return FALSE;
+
+        for (i = 0; i != CACHE_FETCHES; i++) {
+                fetch = &fetches[i];
+                if (fetch->leader != 0
+                    && now - fetch->started >= config.cache_collapse_timeout)
+                        fetch->leader = 0;
+
+                if (fetch->leader == 0 && fetch->pass_until <= now) {
+                        if (free_slot < 0)
+                                free_slot = i;
+                        continue;
+                }
+
+                /* A child does not wait for its own pipelined request */
+                if (fetch->hash == hash && strcmp (fetch->url, url) == 0)
+                        return fetch->leader != 0
+                            && fetch->leader != getpid ();
+        }
+
+        if (lead && free_slot >= 0) {
+                fetch = &fetches[free_slot];
+                fetch->hash = hash;
+                fetch->leader = getpid ();
+                fetch->started = now;
+                fetch->pass_until = 0;
+                strcpy (fetch->url, url);
+                connptr->cache_fetch = free_slot;
+        }
+
+        return FALSE;
+}
+
+/*
+ * Wait until the fetch of a URL by another child is over, or for
+ * CacheCollapseTimeout seconds at most.
+ */
+static void collapse_wait (const char *url, unsigned int hash)
+{
+        struct cache_fetch *fetch;
+        struct timeval tv;
+        time_t start = time (NULL);
+        int i, busy = TRUE;
+
+        while (busy && time (NULL) - start < config.cache_collapse_timeout) {
+                tv.tv_sec = 0;
+                tv.tv_usec = CACHE_COLLAPSE_POLL;
+                select (0, NULL, NULL, NULL, &tv);
+
+                busy = FALSE;
+                shared_lock_wait (LOCK_CACHE);
+                for (i = 0; i != CACHE_FETCHES && !busy; i++) {
+                        fetch = &fetches[i];
+                        busy = fetch->leader != 0 && fetch->hash == hash
+                            && strcmp (fetch->url, url) == 0;
+                }
+                shared_lock_release (LOCK_CACHE);
+        }
+}
+
+/*
+ * Let the children waiting for the response of this one go on.  If it
+ * is not kept ("pass"), the next requests for the URL do not wait.
+ */
+static void end_fetch_locked (struct conn_s *connptr, int pass)
+{
+        struct cache_fetch *fetch;
+
+        if (connptr->cache_fetch < 0)
+                return;
+
+        fetch = &fetches[connptr->cache_fetch];
+        if (fetch->leader == getpid ()
+            && strcmp (fetch->url, connptr->cache_key) == 0) {
+                fetch->leader = 0;
+                if (pass)
+                        fetch->pass_until = time (NULL) + CACHE_PASS_TIME;
+        }
+        connptr->cache_fetch = -1;
+}
+
+static void end_fetch (struct conn_s *connptr, int pass)
+{
+        if (connptr->cache_fetch < 0)
+                return;
+
+        shared_lock_wait (LOCK_CACHE);
+        end_fetch_locked (connptr, pass);
+        shared_lock_release (LOCK_CACHE);
+}
+
+int
+cache_lookup (struct conn_s *connptr, struct request_s *request,
+              hashmap_t hashofheaders)
+{
+        struct cache_entry *entry;
+        char *header;
+        char url[1024];
+        unsigned int hash;
+        int i = 0, idx, bypass = FALSE, stale_ok, revalidate = FALSE;
+        int waited = FALSE;
+        time_t now;
+        long value;
+
+        if (!CACHE_STATS || connptr->connect_method || !request->path)
+                return FALSE;
+
+        snprintf (url, sizeof (url), "http://%s:%d%s", request->host,
+                  request->port, request->path);
+
+        /* Requests which change the resource make its copies obsolete */
+        if (strcasecmp (request->method, "GET") != 0
+            && strcasecmp (request->method, "HEAD") != 0) {
+                if (strcasecmp (request->method, "OPTIONS") != 0
+                    && strcasecmp (request->method, "TRACE") != 0)
+                        invalidate_url (url);
+                return FALSE;
+        }
+
+        if (hashmap_search (hashofheaders, "authorization") > 0
+            || hashmap_search (hashofheaders, "transfer-encoding") > 0
+            || (hashmap_entry_by_key (hashofheaders, "content-length",
+                                      (void **) &header) > 0
+                && strtol (header, NULL, 10) > 0))
+                return FALSE;
+
+        if (hashmap_entry_by_key (hashofheaders, "cache-control",
+                                  (void **) &header) > 0) {
+                if (cache_directive (header, "no-store", NULL))
+                        return FALSE;
+                if (cache_directive (header, "no-cache", NULL)
+                    || (cache_directive (header, "max-age", &value)
+                        && value == 0))
+                        bypass = TRUE;
+        }
+        if (hashmap_entry_by_key (hashofheaders, "pragma",
+                                  (void **) &header) > 0
+            && cache_directive (header, "no-cache", NULL))
+                bypass = TRUE;
+
+        /* The response may be kept even when the client wants a new one */
+        connptr->cache_key = safestrdup (url);
+        if (!connptr->cache_key)
+                return FALSE;
+
+        /* Stale copies are only revalidated with conditions of our own */
+        stale_ok = connptr->protocol.major >= 1
+            && hashmap_search (hashofheaders, "if-none-match") <= 0
+            && hashmap_search (hashofheaders, "if-modified-since") <= 0
+            && hashmap_search (hashofheaders, "if-range") <= 0
+            && hashmap_search (hashofheaders, "range") <= 0;
+
+        hash = hash_key (url);
+        now = time (NULL);
+
+        shared_lock_wait (LOCK_CACHE);
+        for (;;) {
+                idx = bypass ? -1 : find_response_locked (url, hash,
+                                                          hashofheaders,
+                                                          stale_ok, now, &i);
+                if (idx >= 0) {
+                        entry = &tiers[i].entries[idx];
+                        if (entry->expires > now
+                            || now < entry->expires + entry->stale_while)
+                                break;
+                }
+
+                /*
+                 * Wait for another child fetching the same URL, and then
+                 * look again: its answer may well be in the cache.
+                 */
+                if (bypass || waited
+                    || !fetch_in_flight_locked (connptr, url, hash,
+                                                stale_ok
+                                                && !connptr->head_method,
+                                                now))
+                        break;
+
+                shared_lock_release (LOCK_CACHE);
+                collapse_wait (url, hash);
+                waited = TRUE;
+                now = time (NULL);
+                shared_lock_wait (LOCK_CACHE);
+        }
+
+        if (idx < 0) {
+                CACHE_STATS->misses++;
+                shared_lock_release (LOCK_CACHE);
+                return FALSE;
+        }
+
+        /* Without a pin the blocks could be reused under the reply */
+        if (pin_entry_locked (connptr, i, idx) < 0) {
+                log_message (LOG_WARNING,
+                             "No pin left to send \"%s\" from the cache", url);
+                CACHE_STATS->misses++;
+                shared_lock_release (LOCK_CACHE);
+                return FALSE;
+        }
+
+        entry = &tiers[i].entries[idx];
+        if (entry->expires <= now) {
+                /*
+                 * Within stale-while-revalidate, the copy is sent at once
+                 * and this child refreshes it, unless another one is at
+                 * it.  Otherwise the server is asked first.
+                 */
+                if (now < entry->expires + entry->stale_while) {
+                        if (now - entry->refreshing >= CACHE_REFRESH_TIMEOUT) {
+                                entry->refreshing = now;
+                                connptr->cache_refresh = TRUE;
+                        }
+                } else {
+                        revalidate = TRUE;
+                }
+
+                if (revalidate || connptr->cache_refresh)
+                        add_validators (&tiers[i], entry, hashofheaders);
+        }
+
+        entry->referenced = TRUE;
+        if (revalidate) {
+                CACHE_STATS->misses++;
+        } else {
+                CACHE_STATS->hits++;
+                if (i == CACHE_DISK)
+                        CACHE_STATS->disk_hits++;
+        }
+        shared_lock_release (LOCK_CACHE);
+
+        connptr->cache_tier = i;
+        connptr->cache_entry = idx;
+        return !revalidate && !connptr->cache_refresh;
+}
+
+/*
+ * Write all the iovecs, picking up after partial writes.
+ */
+static int write_iov (int fd, struct iovec *iov, unsigned int n)
+{
+        ssize_t len;
+
+        while (n > 0) {
+                len = writev (fd, iov, n > CACHE_IOV_MAX ? CACHE_IOV_MAX : n);
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+
+                while (n > 0 && (size_t) len >= iov->iov_len) {
+                        len -= iov->iov_len;
+                        iov++;
+                        n--;
+                }
+                if (n > 0) {
+                        iov->iov_base = (char *) iov->iov_base + len;
+                        iov->iov_len -= len;
+                }
+        }
+
+        return 0;
+}
+
+
+/*
+ * Send the response found by cache_lookup() to the client.
+ */
+int cache_send (struct conn_s *connptr)
+{
+        struct cache_tier *tier = &tiers[connptr->cache_tier];
+        struct cache_entry *entry = &tier->entries[connptr->cache_entry];
+        struct iovec *iov;
+        char extra[128];
+        unsigned int n = 0;
+        time_t now;
+        long age;
+        int ret;
+
+        iov = (struct iovec *) safemalloc ((entry->nblocks + 3)
+                                           * sizeof (struct iovec));
+        if (!iov)
+                return -1;
+
+        age = (long) difftime (time (NULL), entry->stored);
+        if (connptr->keepalive)
+                snprintf (extra, sizeof (extra),
+                          "Age: %ld\r\nConnection: keep-alive\r\n"
+                          "Keep-Alive: timeout=%u\r\n\r\n",
+                          age > 0 ? age : 0, config.keepalive_timeout);
+        else
+                snprintf (extra, sizeof (extra), "Age: %ld\r\n%s\r\n",
+                          age > 0 ? age : 0,
+                          config.keepalive ? "Connection: close\r\n" : "");
+
+        /* A simple HTTP/0.9 request only gets the body */
+        if (connptr->protocol.major >= 1) {
+                n = entry_iov (tier, entry, entry->keylen, entry->headlen,
+                               iov);
+                iov[n].iov_base = extra;
+                iov[n].iov_len = strlen (extra);
+                n++;
+        }
+        if (!connptr->head_method)
+                n += entry_iov (tier, entry, entry->keylen + entry->headlen,
+                                entry->bodylen, iov + n);
+
+        ret = write_iov (connptr->client_fd, iov, n);
+        safefree (iov);
+
+        log_message (LOG_INFO, "Answered \"%s\" from the cache%s",
+                     connptr->cache_key,
+                     connptr->cache_tier == CACHE_DISK ? " on disk" : "");
+
+        now = time (NULL);
+        shared_lock_wait (LOCK_CACHE);
+        unpin_locked (connptr);
+        if (ret == 0)
+                CACHE_STATS->saved += entry->headlen + entry->bodylen;
+        if (connptr->cache_tier == CACHE_DISK && entry->in_use
+            && entry->expires > now)
+                promote_locked (entry, now);
+        shared_lock_release (LOCK_CACHE);
+        connptr->cache_entry = -1;
+
+        return ret;
+}
+
+static void free_object (struct cache_object *obj)
+{
+        safefree (obj->vary);
+        safefree (obj->spec);
+        safefree (obj->etag);
+        safefree (obj->lastmod);
+        safefree (obj->head);
+        safefree (obj->body);
+        safefree (obj);
+}
+
+/*
+ * Start keeping a copy of a response, if it can be cached.  The headers
+ * are those left for the client, without the hop-by-hop ones.
+ */
+static void
+begin_object (struct conn_s *connptr, const char *response_line,
+              int status, hashmap_t hashofheaders)
+{
+        struct cache_object *obj;
+        hashmap_iter iter;
+        char *data, *header, *vary;
+        const char *extra;
+        size_t size;
+        long ttl, age = 0;
+        int validator;
+        time_t now = time (NULL);
+
+        if (!CACHE_STATS || !connptr->cache_key || connptr->head_method
+            || connptr->response_chunked
+            || connptr->content_length.server < 0
+            || (unsigned long) connptr->content_length.server >
+            config.cache_max_object * 1024UL)
+                return;
+
+        if (status != 200 && status != 203 && status != 404 && status != 410)
+                return;
+
+        if (hashmap_search (hashofheaders, "set-cookie") > 0)
+                return;
+
+        /* Reverse proxied ones may be kept anyway (ReverseCache) */
+        ttl = response_ttl (hashofheaders, connptr->cache_time > 0
+                            ? (long) connptr->cache_time : -1, now);
+        if (hashmap_entry_by_key (hashofheaders, "age",
+                                  (void **) &header) > 0)
+                age = strtol (header, NULL, 10);
+
+        /* One which is already stale is only worth keeping to revalidate */
+        validator = hashmap_search (hashofheaders, "etag") > 0
+            || hashmap_search (hashofheaders, "last-modified") > 0;
+        if (ttl < 0 || (ttl - age <= 0 && !validator))
+                return;
+
+        obj = (struct cache_object *) safecalloc (1,
+                                                  sizeof (struct cache_object));
+        if (!obj)
+                return;
+
+        if (hashmap_entry_by_key (hashofheaders, "etag",
+                                  (void **) &header) > 0)
+                obj->etag = safestrdup (header);
+        else
+                obj->etag = safestrdup ("");
+        if (hashmap_entry_by_key (hashofheaders, "last-modified",
+                                  (void **) &header) > 0)
+                obj->lastmod = safestrdup (header);
+        else
+                obj->lastmod = safestrdup ("");
+        if (!obj->etag || !obj->lastmod)
+                goto fail;
+
+        if (hashmap_entry_by_key (hashofheaders, "cache-control",
+                                  (void **) &header) > 0) {
+                if (cache_directive (header, "stale-while-revalidate",
+                                     &obj->stale_while)
+                    && obj->stale_while < 0)
+                        obj->stale_while = 0;
+                if (cache_directive (header, "stale-if-error",
+                                     &obj->stale_error)
+                    && obj->stale_error < 0)
+                        obj->stale_error = 0;
+        }
+
+        /* The headers given to ReverseCache count as if listed by Vary */
+        if (hashmap_entry_by_key (hashofheaders, "vary",
+                                  (void **) &vary) <= 0)
+                vary = NULL;
+        extra = connptr->cache_vary ? connptr->cache_vary : "";
+        size = (vary ? strlen (vary) : 0) + strlen (extra) + 3;
+        obj->vary = (char *) safemalloc (size);
+        if (!obj->vary)
+                goto fail;
+        snprintf (obj->vary, size, "%s%s%s", vary ? vary : "",
+                  vary && *extra ? ", " : "", extra);
+        if (strchr (obj->vary, '*'))
+                goto fail;
+        obj->spec = vary_spec (obj->vary, connptr->cache_headers);
+        if (!obj->spec)
+                goto fail;
+
+        /* The Age is worked out again for each hit */
+        hashmap_remove (hashofheaders, "age");
+
+        size = strlen (response_line) + 3;
+        iter = hashmap_first (hashofheaders);
+        for (; iter >= 0 && !hashmap_is_end (hashofheaders, iter); ++iter) {
+                hashmap_return_entry (hashofheaders, iter, &data,
+                                      (void **) &header);
+                size += strlen (data) + strlen (header) + 4;
+        }
+
+        obj->head = (char *) safemalloc (size);
+        if (!obj->head)
+                goto fail;
+        snprintf (obj->head, size, "%s\r\n", response_line);
+        iter = hashmap_first (hashofheaders);
+        for (; iter >= 0 && !hashmap_is_end (hashofheaders, iter); ++iter) {
+                hashmap_return_entry (hashofheaders, iter, &data,
+                                      (void **) &header);
+                obj->headlen = strlen (obj->head);
+                snprintf (obj->head + obj->headlen, size - obj->headlen,
+                          "%s: %s\r\n", data, header);
+        }
+        obj->headlen = strlen (obj->head);
+
+        obj->bodysize = connptr->content_length.server;
+        if (obj->bodysize > 0) {
+                obj->body = (unsigned char *) safemalloc (obj->bodysize);
+                if (!obj->body)
+                        goto fail;
+        }
+
+        obj->stored = now - age;
+        obj->expires = obj->stored + ttl;
+        connptr->cache_object = obj;
+        return;
+
+fail:
+        free_object (obj);
+}
+
+void
+cache_begin (struct conn_s *connptr, const char *response_line,
+             int status, hashmap_t hashofheaders)
+{
+        begin_object (connptr, response_line, status, hashofheaders);
+
+        /* Nobody need wait for a response which is not kept */
+        if (!connptr->cache_object)
+                end_fetch (connptr, TRUE);
+}
+
+/*
+ * Keep the part of the body just relayed.
+ */
+void
+cache_append (struct conn_s *connptr, const unsigned char *data, size_t len)
+{
+        struct cache_object *obj = connptr->cache_object;
+
+        if (!obj)
+                return;
+
+        if (obj->bodylen + len > obj->bodysize) {
+                free_object (obj);
+                connptr->cache_object = NULL;
+                return;
+        }
+
+        memcpy (obj->body + obj->bodylen, data, len);
+        obj->bodylen += len;
+}
+
+
+/*
+ * Store the response once all of it has been relayed.
+ */
+void cache_commit (struct conn_s *connptr)
+{
+        struct cache_object *obj = connptr->cache_object;
+        struct cache_entry from;
+        struct iovec parts[3];
+        char *url = connptr->cache_key;
+        char *key, *p;
+        const char *fields[5];
+        size_t len;
+        unsigned int hash;
+        time_t now = time (NULL);
+        int i, stored = FALSE;
+
+        if (!obj || obj->bodylen != obj->bodysize)
+                return;
+
+        /* The key, followed by the validators */
+        fields[0] = url;
+        fields[1] = obj->vary;
+        fields[2] = obj->spec;
+        fields[3] = obj->etag;
+        fields[4] = obj->lastmod;
+
+        from.keylen = 0;
+        for (i = 0; i != 5; i++)
+                from.keylen += strlen (fields[i]) + 1;
+        from.headlen = obj->headlen;
+        from.bodylen = obj->bodylen;
+        from.stored = obj->stored;
+        from.expires = obj->expires;
+        from.stale_while = obj->stale_while;
+        from.stale_error = obj->stale_error;
+        from.validator = obj->etag[0] != '\0' || obj->lastmod[0] != '\0';
+
+        key = (char *) safemalloc (from.keylen);
+        if (!key)
+                goto done;
+        for (i = 0, p = key; i != 5; i++, p += len) {
+                len = strlen (fields[i]) + 1;
+                memcpy (p, fields[i], len);
+        }
+
+        parts[0].iov_base = key;
+        parts[0].iov_len = from.keylen;
+        parts[1].iov_base = obj->head;
+        parts[1].iov_len = obj->headlen;
+        parts[2].iov_base = obj->body;
+        parts[2].iov_len = obj->bodylen;
+
+        hash = hash_key (url);
+
+        shared_lock_wait (LOCK_CACHE);
+        for (i = 0; i != CACHE_TIERS; i++)
+                if (tiers[i].cache
+                    && store_locked (&tiers[i], hash, key, parts, 3, &from,
+                                     now) == 0)
+                        stored = TRUE;
+        end_fetch_locked (connptr, FALSE);
+        shared_lock_release (LOCK_CACHE);
+
+        if (stored)
+                log_message (LOG_INFO,
+                             "Cached \"%s\" (%lu bytes) for %ld seconds",
+                             url, (unsigned long) obj->bodylen,
+                             (long) (obj->expires - now));
+
+        safefree (key);
+done:
+        free_object (obj);
+        connptr->cache_object = NULL;
+}
+
+/*
+ * Can the stale response found by cache_lookup() be sent instead of an
+ * error from the server?
+ */
+int cache_use_stale (struct conn_s *connptr)
+{
+        struct cache_entry *entry;
+        int ret;
+
+        if (connptr->cache_entry < 0)
+                return FALSE;
+        if (connptr->cache_refresh)
+                return TRUE;
+
+        entry = &tiers[connptr->cache_tier].entries[connptr->cache_entry];
+        shared_lock_wait (LOCK_CACHE);
+        ret = entry->in_use
+            && time (NULL) < entry->expires + entry->stale_error;
+        shared_lock_release (LOCK_CACHE);
+
+        return ret;
+}
+
+/*
+ * Freshen the stored copies of a response after the server answered a
+ * revalidation with 304 (Not Modified).  Without new freshness
+ * information, they are good for as long as they were at first.
+ */
+void cache_refresh (struct conn_s *connptr, hashmap_t hashofheaders)
+{
+        struct cache_tier *tier;
+        struct cache_entry *entry;
+        char *url = connptr->cache_key;
+        char *header;
+        unsigned int hash;
+        long ttl, age = 0;
+        time_t now = time (NULL);
+        int i, idx;
+
+        if (!CACHE_STATS || !url)
+                return;
+
+        ttl = response_ttl (hashofheaders, -1, now);
+        if (hashmap_entry_by_key (hashofheaders, "age",
+                                  (void **) &header) > 0)
+                age = strtol (header, NULL, 10);
+
+        hash = hash_key (url);
+
+        shared_lock_wait (LOCK_CACHE);
+        for (i = 0; i != CACHE_TIERS; i++) {
+                tier = &tiers[i];
+                if (!tier->cache)
+                        continue;
+
+                for (idx = tier->buckets[hash % tier->cache->nentries];
+                     idx != -1; idx = tier->entries[idx].next) {
+                        entry = &tier->entries[idx];
+                        if (entry->hash != hash || entry_dead (entry, now)
+                            || entry_matches (tier, entry, url,
+                                              connptr->cache_headers) < 2)
+                                continue;
+
+                        if (ttl < 0)
+                                ttl = (long) (entry->expires - entry->stored);
+                        entry->stored = now - age;
+                        entry->expires = entry->stored + ttl;
+                        entry->refreshing = 0;
+                        journal_append_locked (tier, JOURNAL_ADD, idx);
+                }
+        }
+        end_fetch_locked (connptr, FALSE);
+        shared_lock_release (LOCK_CACHE);
+
+        log_message (LOG_INFO, "Revalidated \"%s\" for %ld seconds", url,
+                     ttl);
+}
+
+/*
+ * Let go of the response found by cache_lookup(), when the server sent
+ * a new one.
+ */
+void cache_unpin (struct conn_s *connptr)
+{
+        if (connptr->cache_pin >= 0 && CACHE_STATS) {
+                shared_lock_wait (LOCK_CACHE);
+                unpin_locked (connptr);
+                shared_lock_release (LOCK_CACHE);
+        }
+        connptr->cache_entry = -1;
+}
+
+/*
+ * Forget the cache state of a request, see reset_conn().
+ */
+void cache_release (struct conn_s *connptr)
+{
+        end_fetch (connptr, FALSE);
+        cache_unpin (connptr);
+        connptr->cache_refresh = FALSE;
+
+        if (connptr->cache_object) {
+                free_object (connptr->cache_object);
+                connptr->cache_object = NULL;
+        }
+
+        if (connptr->cache_headers) {
+                hashmap_delete (connptr->cache_headers);
+                connptr->cache_headers = NULL;
+        }
+
+        if (connptr->cache_key) {
+                safefree (connptr->cache_key);
+                connptr->cache_key = NULL;
+        }
+
+        connptr->cache_time = 0;
+        if (connptr->cache_vary) {
+                safefree (connptr->cache_vary);
+                connptr->cache_vary = NULL;
+        }
+}
+
+void
+cache_stats (unsigned long *hits, unsigned long *misses,
+             unsigned long *disk_hits, unsigned long *saved)
+{
+        *hits = CACHE_STATS ? CACHE_STATS->hits : 0;
+        *misses = CACHE_STATS ? CACHE_STATS->misses : 0;
+        *disk_hits = CACHE_STATS ? CACHE_STATS->disk_hits : 0;
+        *saved = CACHE_STATS ? CACHE_STATS->saved : 0;
+}
@@ -0,0 +1,63 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'cache.c' for detailed information. */
+
+#ifndef TINYPROXY_CACHE_H
+#define TINYPROXY_CACHE_H
+
+#include "conns.h"
+#include "hashmap.h"
+#include "reqs.h"
+
+extern int cache_init (void);
+
+/*
+ * Called for each request once it has been parsed.  Returns TRUE if the
+ * answer is in the cache, and is then sent by cache_send() instead of
+ * asking the server.
+ */
+extern int cache_lookup (struct conn_s *connptr, struct request_s *request,
+                         hashmap_t hashofheaders);
+extern int cache_send (struct conn_s *connptr);
+
+/*
+ * A stale response found by cache_lookup() stays pinned while the server
+ * is asked about it.  With "cache_refresh" set, it is sent at once and
+ * the answer of the server only refreshes it.
+ */
+extern int cache_use_stale (struct conn_s *connptr);
+extern void cache_refresh (struct conn_s *connptr, hashmap_t hashofheaders);
+extern void cache_unpin (struct conn_s *connptr);
+
+/*
+ * Keeping a copy of the response from the server, which is stored once
+ * all of it has been relayed.
+ */
+extern void cache_begin (struct conn_s *connptr, const char *response_line,
+                         int status, hashmap_t hashofheaders);
+extern void cache_append (struct conn_s *connptr, const unsigned char *data,
+                          size_t len);
+extern void cache_commit (struct conn_s *connptr);
+
+extern void cache_release (struct conn_s *connptr);
+
+extern void cache_stats (unsigned long *hits, unsigned long *misses,
+                         unsigned long *disk_hits, unsigned long *saved);
+
+#endif
@@ -28,7 +28,9 @@
 #include "heap.h"
 #include "log.h"
 #include "reqs.h"
+#include "reverse-proxy.h"
 #include "sock.h"
+#include "upstream.h"
 #include "utils.h"
 #include "conf.h"
 
@@ -51,6 +53,9 @@ struct child_s {
  */
 static struct child_s *child_ptr;
 
+/* The process running the health checks, see maintenance_main() */
+static pid_t maintenance_pid = -1;
+
 static struct child_config_s {
         unsigned int maxclients, maxrequestsperchild;
         unsigned int maxspareservers, minspareservers, startservers;
@@ -297,6 +302,61 @@ static pid_t child_make (struct child_s *ptr)
         return -1;
 }
 
+/*
+ * The health checks and DNS refreshes of the upstream proxies and the
+ * reverse proxy backends wait on the network for as long as a server
+ * takes to answer, so they run in a process of their own rather than in
+ * the master loop.  Their results reach the children through shared
+ * memory.  The process ends with the signals sent to the children, and
+ * the master starts it again on its next pass.
+ */
+static void maintenance_main (pid_t master)
+{
+        close (listenfd);
+
+        while (getppid () == master) {
+#ifdef UPSTREAM_SUPPORT
+                /* Probe the members of the upstream groups when due */
+                upstream_check_health (config.upstream_groups);
+                upstream_prefetch (config.upstream_list,
+                                   config.upstream_groups);
+#endif
+#ifdef REVERSE_SUPPORT
+                reversepath_check_health (config.reversepath_list);
+                reversepath_prefetch (config.reversepath_list);
+#endif
+                sleep (5);
+        }
+
+        exit (0);
+}
+
+/*
+ * Fork the health check process unless it is already running.
+ */
+static void maintenance_start (void)
+{
+        pid_t master = getpid ();
+
+        if (maintenance_pid > 0 && kill (maintenance_pid, 0) == 0)
+                return;
+
+        if ((maintenance_pid = fork ()) < 0) {
+                log_message (LOG_WARNING,
+                             "Could not create the health check process: %s",
+                             strerror (errno));
+                return;
+        }
+        if (maintenance_pid > 0)
+                return;         /* parent */
+
+        set_signal_handler (SIGCHLD, SIG_DFL);
+        set_signal_handler (SIGTERM, SIG_DFL);
+        set_signal_handler (SIGHUP, SIG_DFL);
+
+        maintenance_main (master);      /* never returns */
+}
+
 /*
  * Create a pool of children to handle incoming connections
  */
@@ -431,6 +491,9 @@ void child_main_loop (void)
 
                 sleep (5);
 
+                /* Bring the health checks back if they stopped */
+                maintenance_start ();
+
                 /* Handle log rotation if it was requested */
                 if (received_sighup) {
                         /*
@@ -446,6 +509,9 @@ void child_main_loop (void)
                         /* propagate filter reload to all children */
                         child_kill_children (SIGHUP);
 
+                        /* the health checks end, and restart on the new config */
+                        maintenance_pid = -1;
+
                         received_sighup = FALSE;
                 }
         }
@@ -462,6 +528,8 @@ void child_kill_children (int sig)
                 if (child_ptr[i].status != T_EMPTY)
                         kill (child_ptr[i].tid, sig);
         }
+        if (maintenance_pid > 0)
+                kill (maintenance_pid, sig);
 }
 
 int child_listening_sock (uint16_t port)
@@ -0,0 +1,257 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/* Framing of bodies sent with the chunked transfer coding.  The data is
+ * scanned as it is relayed, so that the end of the body is known without
+ * waiting for the connection to close.  The chunks are normally passed
+ * on as they are; they are only decoded for clients which do not
+ * understand the coding.
+ */
+
+#include "main.h"
+
+#include "chunked.h"
+#include "heap.h"
+#include "log.h"
+
+#define CHUNKED_READ_SIZE (1024 * 2)
+
+/*
+ * Longest chunk size accepted, in hex digits.
+ */
+#define CHUNK_MAX_DIGITS (sizeof (unsigned long) * 2 - 1)
+
+void chunked_init (struct chunked_s *chunked)
+{
+        chunked->state = CHUNK_SIZE;
+        chunked->remaining = 0;
+        chunked->digits = 0;
+}
+
+int chunked_done (const struct chunked_s *chunked)
+{
+        return chunked->state == CHUNK_DONE;
+}
+
+static int hex_value (char c)
+{
+        if (c >= '0' && c <= '9')
+                return c - '0';
+        if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+        return -1;
+}
+
+/*
+ * The chunk size line has been read.
+ */
+static void end_size_line (struct chunked_s *chunked)
+{
+        chunked->state = chunked->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+        chunked->digits = 0;
+}
+
+/*
+ * Scan "len" bytes of a chunked body.  Returns the number of bytes
+ * which belong to the body (fewer than "len" only if its end was found),
+ * or -1 if the framing is broken.  If "payload" is not NULL, the data is
+ * decoded in place: the chunk data is moved to the start of "data" and
+ * its length is stored in "payload".
+ */
+ssize_t
+chunked_parse (struct chunked_s *chunked, char *data, size_t len,
+               size_t *payload)
+{
+        size_t pos = 0, out = 0, n;
+        int value;
+        char c;
+
+        while (pos < len && chunked->state != CHUNK_DONE) {
+                if (chunked->state == CHUNK_DATA) {
+                        n = len - pos;
+                        if (n > chunked->remaining)
+                                n = chunked->remaining;
+
+                        if (payload && out != pos)
+                                memmove (data + out, data + pos, n);
+                        out += n;
+                        pos += n;
+
+                        chunked->remaining -= n;
+                        if (chunked->remaining == 0)
+                                chunked->state = CHUNK_DATA_CR;
+                        continue;
+                }
+
+                c = data[pos++];
+
+                switch (chunked->state) {
+                case CHUNK_SIZE:
+                        value = hex_value (c);
+                        if (value >= 0
+                            && chunked->digits < CHUNK_MAX_DIGITS) {
+                                chunked->remaining =
+                                    chunked->remaining * 16 + value;
+                                chunked->digits++;
+                        } else if (chunked->digits == 0) {
+                                chunked->state = CHUNK_ERROR;
+                        } else if (c == ';' || c == ' ' || c == '\t') {
+                                chunked->state = CHUNK_EXT;
+                        } else if (c == '\r') {
+                                chunked->state = CHUNK_SIZE_LF;
+                        } else if (c == '\n') {
+                                end_size_line (chunked);
+                        } else {
+                                chunked->state = CHUNK_ERROR;
+                        }
+                        break;
+
+                case CHUNK_EXT:
+                        if (c == '\r')
+                                chunked->state = CHUNK_SIZE_LF;
+                        else if (c == '\n')
+                                end_size_line (chunked);
+                        break;
+
+                case CHUNK_SIZE_LF:
+                        if (c == '\n')
+                                end_size_line (chunked);
+                        else
+                                chunked->state = CHUNK_ERROR;
+                        break;
+
+                case CHUNK_DATA_CR:
+                        if (c == '\r')
+                                chunked->state = CHUNK_DATA_LF;
+                        else if (c == '\n')
+                                chunked->state = CHUNK_SIZE;
+                        else
+                                chunked->state = CHUNK_ERROR;
+                        break;
+
+                case CHUNK_DATA_LF:
+                        if (c == '\n')
+                                chunked->state = CHUNK_SIZE;
+                        else
+                                chunked->state = CHUNK_ERROR;
+                        break;
+
+                case CHUNK_TRAILER:
+                        if (c == '\r')
+                                chunked->state = CHUNK_TRAILER_LF;
+                        else if (c == '\n')
+                                chunked->state = CHUNK_DONE;
+                        else
+                                chunked->state = CHUNK_TRAILER_LINE;
+                        break;
+
+                case CHUNK_TRAILER_LINE:
+                        if (c == '\n')
+                                chunked->state = CHUNK_TRAILER;
+                        break;
+
+                case CHUNK_TRAILER_LF:
+                        if (c == '\n')
+                                chunked->state = CHUNK_DONE;
+                        else
+                                chunked->state = CHUNK_ERROR;
+                        break;
+
+                default:
+                        break;
+                }
+
+                if (chunked->state == CHUNK_ERROR)
+                        return -1;
+        }
+
+        if (payload)
+                *payload = out;
+
+        return pos;
+}
+
+/*
+ * Read the next part of a chunked body from a socket into a buffer,
+ * without reading anything past its end (such as the next request on
+ * the connection).  The data is decoded if "decode" is set.  Returns
+ * the number of bytes read, 0 if there was nothing to read yet, or -1
+ * on errors and if the connection was closed.
+ */
+ssize_t
+read_chunked_buffer (int fd, struct buffer_s *buffptr,
+                     struct chunked_s *chunked, unsigned int decode)
+{
+        char *buffer, *discard;
+        ssize_t bytesin, used;
+        size_t payload;
+
+        assert (fd >= 0);
+        assert (buffptr != NULL);
+
+        if (buffer_size (buffptr) >= MAXBUFFSIZE)
+                return 0;
+
+        buffer = (char *) safemalloc (CHUNKED_READ_SIZE);
+        discard = (char *) safemalloc (CHUNKED_READ_SIZE);
+        if (!buffer || !discard) {
+                safefree (buffer);
+                safefree (discard);
+                return -ENOMEM;
+        }
+
+        bytesin = recv (fd, buffer, CHUNKED_READ_SIZE, MSG_PEEK);
+        if (bytesin <= 0) {
+                if (bytesin < 0 && (errno == EAGAIN || errno == EINTR))
+                        used = 0;
+                else
+                        used = -1;
+                goto done;
+        }
+
+        /* Take only what belongs to the body off the socket */
+        used = chunked_parse (chunked, buffer, bytesin,
+                              decode ? &payload : NULL);
+        if (used < 0) {
+                log_message (LOG_ERR,
+                             "Invalid chunked encoding on file descriptor %d",
+                             fd);
+                goto done;
+        }
+
+        if (recv (fd, discard, used, 0) != used) {
+                used = -1;
+                goto done;
+        }
+
+        if (!decode)
+                payload = used;
+
+        if (payload > 0
+            && add_to_buffer (buffptr, (unsigned char *) buffer,
+                              payload) < 0)
+                used = -1;
+
+done:
+        safefree (buffer);
+        safefree (discard);
+        return used;
+}
@@ -0,0 +1,59 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/* See 'chunked.c' for detailed information. */
+
+#ifndef TINYPROXY_CHUNKED_H
+#define TINYPROXY_CHUNKED_H
+
+#include "buffer.h"
+
+typedef enum {
+        CHUNK_SIZE,             /* reading the chunk size */
+        CHUNK_EXT,              /* skipping chunk extensions */
+        CHUNK_SIZE_LF,          /* end of the chunk size line */
+        CHUNK_DATA,             /* inside the chunk data */
+        CHUNK_DATA_CR,          /* end of the chunk data */
+        CHUNK_DATA_LF,
+        CHUNK_TRAILER,          /* at the start of a trailer line */
+        CHUNK_TRAILER_LINE,     /* inside a trailer line */
+        CHUNK_TRAILER_LF,       /* end of the last (empty) line */
+        CHUNK_DONE,
+        CHUNK_ERROR
+} chunk_state_t;
+
+/*
+ * Progress through a message body sent with the chunked transfer
+ * coding.
+ */
+struct chunked_s {
+        chunk_state_t state;
+        unsigned long remaining;        /* of the current chunk's data */
+        unsigned int digits;            /* of the chunk size read so far */
+};
+
+extern void chunked_init (struct chunked_s *chunked);
+extern int chunked_done (const struct chunked_s *chunked);
+extern ssize_t chunked_parse (struct chunked_s *chunked, char *data,
+                              size_t len, size_t *payload);
+extern ssize_t read_chunked_buffer (int fd, struct buffer_s *buffptr,
+                                    struct chunked_s *chunked,
+                                    unsigned int decode);
+
+#endif
@@ -54,6 +54,9 @@
 #ifdef HAVE_SYS_SELECT_H
 #  include	<sys/select.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#  include	<sys/sendfile.h>
+#endif
 #ifdef HAVE_SYS_SOCKET_H
 #  include	<sys/socket.h>
 #endif
@@ -88,6 +91,9 @@
 #ifdef HAVE_NETINET_IN_H
 #  include	<netinet/in.h>
 #endif
+#ifdef HAVE_NETINET_TCP_H
+#  include	<netinet/tcp.h>
+#endif
 #ifdef HAVE_ARPA_INET_H
 #  include	<arpa/inet.h>
 #endif
@@ -36,6 +36,7 @@
 #include "reverse-proxy.h"
 #include "upstream.h"
 #include "connect-ports.h"
+#include "dns.h"
 
 /*
  * The configuration directives are defined in the structure below.  Each
@@ -122,6 +123,9 @@ static HANDLE_FUNC (handle_bindsame);
 static HANDLE_FUNC (handle_connectport);
 static HANDLE_FUNC (handle_defaulterrorfile);
 static HANDLE_FUNC (handle_deny);
+static HANDLE_FUNC (handle_dnscache);
+static HANDLE_FUNC (handle_dnsserver);
+static HANDLE_FUNC (handle_staticresolve);
 static HANDLE_FUNC (handle_errorfile);
 static HANDLE_FUNC (handle_addheader);
 #ifdef FILTER_ENABLE
@@ -146,12 +150,36 @@ static HANDLE_FUNC (handle_reversebaseurl);
 static HANDLE_FUNC (handle_reversemagic);
 static HANDLE_FUNC (handle_reverseonly);
 static HANDLE_FUNC (handle_reversepath);
+static HANDLE_FUNC (handle_reversecache);
+static HANDLE_FUNC (handle_reversebackend);
+static HANDLE_FUNC (handle_reversepolicy);
+static HANDLE_FUNC (handle_reversehttp2);
 #endif
 static HANDLE_FUNC (handle_startservers);
 static HANDLE_FUNC (handle_statfile);
 static HANDLE_FUNC (handle_stathost);
 static HANDLE_FUNC (handle_syslog);
 static HANDLE_FUNC (handle_timeout);
+static HANDLE_FUNC (handle_connecttimeout);
+static HANDLE_FUNC (handle_keepalive);
+static HANDLE_FUNC (handle_keepalivetimeout);
+static HANDLE_FUNC (handle_maxkeepaliverequests);
+static HANDLE_FUNC (handle_pipelinedepth);
+static HANDLE_FUNC (handle_upgradeidletimeout);
+static HANDLE_FUNC (handle_http2maxstreams);
+static HANDLE_FUNC (handle_poolmaxidleperhost);
+static HANDLE_FUNC (handle_poolidletimeout);
+static HANDLE_FUNC (handle_cachesize);
+static HANDLE_FUNC (handle_cachemaxobjectsize);
+static HANDLE_FUNC (handle_cachedir);
+static HANDLE_FUNC (handle_cachedisksize);
+static HANDLE_FUNC (handle_cachecollapsetimeout);
+static HANDLE_FUNC (handle_spooldir);
+static HANDLE_FUNC (handle_spoolsize);
+static HANDLE_FUNC (handle_healthcheckinterval);
+static HANDLE_FUNC (handle_healthchecktimeout);
+static HANDLE_FUNC (handle_maxfails);
+static HANDLE_FUNC (handle_failtimeout);
 
 static HANDLE_FUNC (handle_user);
 static HANDLE_FUNC (handle_viaproxyname);
@@ -161,6 +189,10 @@ static HANDLE_FUNC (handle_xtinyproxy);
 #ifdef UPSTREAM_SUPPORT
 static HANDLE_FUNC (handle_upstream);
 static HANDLE_FUNC (handle_upstream_no);
+static HANDLE_FUNC (handle_upstream_unix);
+static HANDLE_FUNC (handle_upstream_group);
+static HANDLE_FUNC (handle_upstreamgroup);
+static HANDLE_FUNC (handle_upstreampolicy);
 #endif
 
 static void config_free_regex (void);
@@ -205,11 +237,14 @@ struct {
         STDCONF ("defaulterrorfile", STR, handle_defaulterrorfile),
         STDCONF ("statfile", STR, handle_statfile),
         STDCONF ("stathost", STR, handle_stathost),
+        STDCONF ("dnsserver", STR, handle_dnsserver),
         STDCONF ("xtinyproxy",  BOOL, handle_xtinyproxy),
         /* boolean arguments */
         STDCONF ("syslog", BOOL, handle_syslog),
         STDCONF ("bindsame", BOOL, handle_bindsame),
         STDCONF ("disableviaheader", BOOL, handle_disableviaheader),
+        STDCONF ("dnscache", BOOL, handle_dnscache),
+        STDCONF ("keepalive", BOOL, handle_keepalive),
         /* integer arguments */
         STDCONF ("port", INT, handle_port),
         STDCONF ("maxclients", INT, handle_maxclients),
@@ -218,7 +253,26 @@ struct {
         STDCONF ("startservers", INT, handle_startservers),
         STDCONF ("maxrequestsperchild", INT, handle_maxrequestsperchild),
         STDCONF ("timeout", INT, handle_timeout),
+        STDCONF ("connecttimeout", INT, handle_connecttimeout),
+        STDCONF ("keepalivetimeout", INT, handle_keepalivetimeout),
+        STDCONF ("maxkeepaliverequests", INT, handle_maxkeepaliverequests),
+        STDCONF ("pipelinedepth", INT, handle_pipelinedepth),
+        STDCONF ("upgradeidletimeout", INT, handle_upgradeidletimeout),
+        STDCONF ("http2maxstreams", INT, handle_http2maxstreams),
+        STDCONF ("poolmaxidleperhost", INT, handle_poolmaxidleperhost),
+        STDCONF ("poolidletimeout", INT, handle_poolidletimeout),
+        STDCONF ("cachesize", INT, handle_cachesize),
+        STDCONF ("cachemaxobjectsize", INT, handle_cachemaxobjectsize),
+        STDCONF ("cachedir", STR, handle_cachedir),
+        STDCONF ("cachedisksize", INT, handle_cachedisksize),
+        STDCONF ("cachecollapsetimeout", INT, handle_cachecollapsetimeout),
+        STDCONF ("spooldir", STR, handle_spooldir),
+        STDCONF ("spoolsize", INT, handle_spoolsize),
         STDCONF ("connectport", INT, handle_connectport),
+        STDCONF ("healthcheckinterval", INT, handle_healthcheckinterval),
+        STDCONF ("healthchecktimeout", INT, handle_healthchecktimeout),
+        STDCONF ("maxfails", INT, handle_maxfails),
+        STDCONF ("failtimeout", INT, handle_failtimeout),
         /* alphanumeric arguments */
         STDCONF ("user", ALNUM, handle_user),
         STDCONF ("group", ALNUM, handle_group),
@@ -232,6 +286,7 @@ struct {
         /* other */
         STDCONF ("errorfile", INT WS STR, handle_errorfile),
         STDCONF ("addheader",  STR WS STR, handle_addheader),
+        STDCONF ("staticresolve", STR WS STR, handle_staticresolve),
 
 #ifdef FILTER_ENABLE
         /* filtering */
@@ -247,6 +302,14 @@ struct {
         STDCONF ("reverseonly", BOOL, handle_reverseonly),
         STDCONF ("reversemagic", BOOL, handle_reversemagic),
         STDCONF ("reversepath", STR "(" WS STR ")?", handle_reversepath),
+        STDCONF ("reversecache", STR WS INT "(" WS STR ")?",
+                 handle_reversecache),
+        STDCONF ("reversebackend", STR WS STR "(" WS INT ")?",
+                 handle_reversebackend),
+        STDCONF ("reversepolicy",
+                 STR WS "(roundrobin|leastconn|cookiehash)" "(" WS STR ")?",
+                 handle_reversepolicy),
+        STDCONF ("reversehttp2", STR, handle_reversehttp2),
 #endif
 #ifdef UPSTREAM_SUPPORT
         /* upstream is rather complicated */
@@ -257,6 +320,19 @@ struct {
                 BEGIN "(upstream)" WS "(" IP "|" ALNUM ")" ":" INT "(" WS STR
                       ")?" END, handle_upstream, NULL
         },
+        {
+                BEGIN "(upstream)" WS "unix:(/[^[:space:]]+)" "(" WS STR
+                      ")?" END, handle_upstream_unix, NULL
+        },
+        {
+                BEGIN "(upstream)" WS "group" WS STR "(" WS STR ")?" END,
+                handle_upstream_group, NULL
+        },
+        STDCONF ("upstreamgroup", STR WS "(" IP "|" ALNUM ")" ":" INT
+                 "(" WS INT ")?", handle_upstreamgroup),
+        STDCONF ("upstreampolicy",
+                 STR WS "(roundrobin|leastconn|hosthash|urlhash)",
+                 handle_upstreampolicy),
 #endif
         /* loglevel */
         STDCONF ("loglevel", "(critical|error|warning|notice|connect|info)",
@@ -288,16 +364,22 @@ static void free_config (struct config_s *conf)
         safefree (conf->stathost);
         safefree (conf->user);
         safefree (conf->group);
+        safefree (conf->cache_dir);
+        safefree (conf->spool_dir);
         safefree (conf->ipAddr);
 #ifdef FILTER_ENABLE
         safefree (conf->filter);
 #endif                          /* FILTER_ENABLE */
 #ifdef REVERSE_SUPPORT
         free_reversepath_list(conf->reversepath_list);
+        trie_delete (conf->reversepath_trie);
+        trie_delete (conf->reverseurl_trie);
+        free_reversepath_hosts (conf->reversehosts);
         safefree (conf->reversebaseurl);
 #endif
 #ifdef UPSTREAM_SUPPORT
         free_upstream_list (conf->upstream_list);
+        free_upstream_groups (conf->upstream_groups);
 #endif                          /* UPSTREAM_SUPPORT */
         safefree (conf->pidpath);
         safefree (conf->bind_address);
@@ -308,6 +390,8 @@ static void free_config (struct config_s *conf)
         safefree (conf->statpage);
         flush_access_list (conf->access_list);
         free_connect_ports_list (conf->connect_ports);
+        vector_delete (conf->dns_servers);
+        free_static_hosts (conf->static_hosts);
         hashmap_delete (conf->anonymous_map);
 
         memset (conf, 0, sizeof(*conf));
@@ -495,13 +579,34 @@ static void initialize_with_defaults (struct config_s *conf,
 
 #ifdef UPSTREAM_SUPPORT
         /* struct upstream *upstream_list; */
+        /* struct upstream_group *upstream_groups; */
 #endif                          /* UPSTREAM_SUPPORT */
 
+        conf->health_check_interval = defaults->health_check_interval;
+        conf->health_check_timeout = defaults->health_check_timeout;
+        conf->max_fails = defaults->max_fails;
+        conf->fail_timeout = defaults->fail_timeout;
+
         if (defaults->pidpath) {
                 conf->pidpath = safestrdup (defaults->pidpath);
         }
 
         conf->idletimeout = defaults->idletimeout;
+        conf->connect_timeout = defaults->connect_timeout;
+        conf->keepalive = defaults->keepalive;
+        conf->keepalive_timeout = defaults->keepalive_timeout;
+        conf->max_keepalive_requests = defaults->max_keepalive_requests;
+        conf->pipeline_depth = defaults->pipeline_depth;
+        conf->upgrade_idle_timeout = defaults->upgrade_idle_timeout;
+        conf->http2_max_streams = defaults->http2_max_streams;
+        conf->pool_max_idle = defaults->pool_max_idle;
+        conf->pool_idle_timeout = defaults->pool_idle_timeout;
+        conf->cache_size = defaults->cache_size;
+        conf->cache_max_object = defaults->cache_max_object;
+        conf->cache_disk_size = defaults->cache_disk_size;
+        conf->cache_collapse_timeout = defaults->cache_collapse_timeout;
+        conf->spool_size = defaults->spool_size;
+        conf->dns_cache = defaults->dns_cache;
 
         if (defaults->bind_address) {
                 conf->bind_address = safestrdup (defaults->bind_address);
@@ -828,6 +933,151 @@ static HANDLE_FUNC (handle_timeout)
         return set_int_arg (&conf->idletimeout, line, &match[2]);
 }
 
+static HANDLE_FUNC (handle_dnscache)
+{
+        return set_bool_arg (&conf->dns_cache, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_dnsserver)
+{
+        char *server;
+        int ret;
+
+        server = get_string_arg (line, &match[2]);
+        if (!server)
+                return -1;
+
+        if (!conf->dns_servers) {
+                conf->dns_servers = vector_create ();
+                if (!conf->dns_servers) {
+                        safefree (server);
+                        return -1;
+                }
+        }
+
+        ret = vector_append (conf->dns_servers, server, strlen (server) + 1);
+        safefree (server);
+
+        return ret;
+}
+
+static HANDLE_FUNC (handle_staticresolve)
+{
+        char *name, *ip;
+        int ret = -1;
+
+        name = get_string_arg (line, &match[2]);
+        ip = get_string_arg (line, &match[3]);
+
+        if (name && ip)
+                ret = dns_add_static (name, ip, &conf->static_hosts);
+
+        safefree (name);
+        safefree (ip);
+
+        return ret;
+}
+
+static HANDLE_FUNC (handle_connecttimeout)
+{
+        return set_int_arg (&conf->connect_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_keepalive)
+{
+        return set_bool_arg (&conf->keepalive, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_keepalivetimeout)
+{
+        return set_int_arg (&conf->keepalive_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_maxkeepaliverequests)
+{
+        return set_int_arg (&conf->max_keepalive_requests, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_pipelinedepth)
+{
+        return set_int_arg (&conf->pipeline_depth, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_upgradeidletimeout)
+{
+        return set_int_arg (&conf->upgrade_idle_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_http2maxstreams)
+{
+        return set_int_arg (&conf->http2_max_streams, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_poolmaxidleperhost)
+{
+        return set_int_arg (&conf->pool_max_idle, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_poolidletimeout)
+{
+        return set_int_arg (&conf->pool_idle_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_cachesize)
+{
+        return set_int_arg (&conf->cache_size, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_cachemaxobjectsize)
+{
+        return set_int_arg (&conf->cache_max_object, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_cachedir)
+{
+        return set_string_arg (&conf->cache_dir, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_cachedisksize)
+{
+        return set_int_arg (&conf->cache_disk_size, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_cachecollapsetimeout)
+{
+        return set_int_arg (&conf->cache_collapse_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_spooldir)
+{
+        return set_string_arg (&conf->spool_dir, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_spoolsize)
+{
+        return set_int_arg (&conf->spool_size, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_healthcheckinterval)
+{
+        return set_int_arg (&conf->health_check_interval, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_healthchecktimeout)
+{
+        return set_int_arg (&conf->health_check_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_maxfails)
+{
+        return set_int_arg (&conf->max_fails, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_failtimeout)
+{
+        return set_int_arg (&conf->fail_timeout, line, &match[2]);
+}
+
 static HANDLE_FUNC (handle_connectport)
 {
         add_connect_port_allowed (get_long_arg (line, &match[2]),
@@ -1031,15 +1281,113 @@ static HANDLE_FUNC (handle_reversepath)
                         safefree (arg1);
                         return -1;
                 }
-                reversepath_add (arg1, arg2, &conf->reversepath_list);
+                reversepath_add (arg1, arg2, conf);
                 safefree (arg1);
                 safefree (arg2);
         } else {
-                reversepath_add (NULL, arg1, &conf->reversepath_list);
+                reversepath_add (NULL, arg1, conf);
                 safefree (arg1);
         }
         return 0;
 }
+
+static HANDLE_FUNC (handle_reversecache)
+{
+        /*
+         * The list of headers is optional.  As in handle_errorfile(),
+         * match[4] is the "0x" of the number.
+         */
+        char *path, *vary = NULL;
+        unsigned long seconds;
+
+        path = get_string_arg (line, &match[2]);
+        if (!path)
+                return -1;
+        seconds = get_long_arg (line, &match[3]);
+
+        if (match[6].rm_so != -1) {
+                vary = get_string_arg (line, &match[6]);
+                if (!vary) {
+                        safefree (path);
+                        return -1;
+                }
+        }
+
+        reversepath_cache (path, seconds, vary, conf->reversepath_list);
+        safefree (path);
+        safefree (vary);
+        return 0;
+}
+
+static HANDLE_FUNC (handle_reversebackend)
+{
+        char *path, *url;
+        long weight = 1;
+        int ret = -1;
+
+        path = get_string_arg (line, &match[2]);
+        url = get_string_arg (line, &match[3]);
+        if (!path || !url)
+                goto done;
+
+        if (match[5].rm_so != -1)
+                weight = get_long_arg (line, &match[5]);
+        if (weight < 1) {
+                log_message (LOG_WARNING,
+                             "Nonsense reverse proxy backend: invalid weight");
+                goto done;
+        }
+
+        ret = reversepath_backend (path, url, (unsigned int) weight, conf);
+
+done:
+        safefree (path);
+        safefree (url);
+
+        return ret;
+}
+
+static HANDLE_FUNC (handle_reversepolicy)
+{
+        char *path, *policy, *cookie = NULL;
+        int ret = -1;
+
+        path = get_string_arg (line, &match[2]);
+        policy = get_string_arg (line, &match[3]);
+        if (!path || !policy)
+                goto done;
+
+        if (match[5].rm_so != -1) {
+                cookie = get_string_arg (line, &match[5]);
+                if (!cookie)
+                        goto done;
+        }
+
+        ret = reversepath_policy (path, policy, cookie,
+                                  conf->reversepath_list);
+
+done:
+        safefree (path);
+        safefree (policy);
+        safefree (cookie);
+
+        return ret;
+}
+
+static HANDLE_FUNC (handle_reversehttp2)
+{
+        char *path;
+        int ret;
+
+        path = get_string_arg (line, &match[2]);
+        if (!path)
+                return -1;
+
+        ret = reversepath_http2 (path, conf->reversepath_list);
+        safefree (path);
+
+        return ret;
+}
 #endif
 
 #ifdef UPSTREAM_SUPPORT
@@ -1069,6 +1417,33 @@ static HANDLE_FUNC (handle_upstream)
         return 0;
 }
 
+/*
+ * An upstream proxy listening on a unix domain socket, which is known by
+ * the path of the socket in place of a host name.
+ */
+static HANDLE_FUNC (handle_upstream_unix)
+{
+        char *path, *domain = NULL;
+
+        path = get_string_arg (line, &match[2]);
+        if (!path)
+                return -1;
+
+        if (match[4].rm_so != -1) {
+                domain = get_string_arg (line, &match[4]);
+                if (!domain) {
+                        safefree (path);
+                        return -1;
+                }
+        }
+
+        upstream_add (path, 0, domain, &conf->upstream_list);
+        safefree (path);
+        safefree (domain);
+
+        return 0;
+}
+
 static HANDLE_FUNC (handle_upstream_no)
 {
         char *domain;
@@ -1082,4 +1457,93 @@ static HANDLE_FUNC (handle_upstream_no)
 
         return 0;
 }
+
+static HANDLE_FUNC (handle_upstream_group)
+{
+        char *name;
+        char *domain = NULL;
+
+        name = get_string_arg (line, &match[2]);
+        if (!name)
+                return -1;
+
+        if (match[4].rm_so != -1) {
+                domain = get_string_arg (line, &match[4]);
+                if (!domain) {
+                        safefree (name);
+                        return -1;
+                }
+        }
+
+        upstream_add_group (name, domain, &conf->upstream_list,
+                            &conf->upstream_groups);
+
+        safefree (name);
+        safefree (domain);
+
+        return 0;
+}
+
+static HANDLE_FUNC (handle_upstreamgroup)
+{
+        struct upstream_group *group;
+        char *name, *host;
+        int port;
+        long weight = 1;
+        int ret = -1;
+
+        name = get_string_arg (line, &match[2]);
+        host = get_string_arg (line, &match[3]);
+        if (!name || !host)
+                goto done;
+
+        port = (int) get_long_arg (line, &match[8]);
+        if (match[11].rm_so != -1)
+                weight = get_long_arg (line, &match[11]);
+
+        if (port < 1 || weight < 1) {
+                log_message (LOG_WARNING,
+                             "Nonsense upstream group member: invalid port "
+                             "or weight");
+                goto done;
+        }
+
+        group = upstream_group_get (name, &conf->upstream_groups);
+        if (!group
+            || balancer_add_peer (&group->pool, host, port,
+                                  (unsigned int) weight) < 0)
+                goto done;
+
+        log_message (LOG_INFO, "Added %s:%d (weight %ld) to upstream group %s",
+                     host, port, weight, name);
+        ret = 0;
+
+done:
+        safefree (name);
+        safefree (host);
+
+        return ret;
+}
+
+static HANDLE_FUNC (handle_upstreampolicy)
+{
+        struct upstream_group *group;
+        char *name, *policy;
+        int ret = -1;
+
+        name = get_string_arg (line, &match[2]);
+        policy = get_string_arg (line, &match[3]);
+        if (!name || !policy)
+                goto done;
+
+        group = upstream_group_get (name, &conf->upstream_groups);
+        if (group)
+                ret = balancer_set_policy (&group->pool, policy);
+
+done:
+        safefree (name);
+        safefree (policy);
+
+        return ret;
+}
 #endif
@@ -23,6 +23,7 @@
 #define TINYPROXY_CONF_H
 
 #include "hashmap.h"
+#include "trie.h"
 #include "vector.h"
 
 /*
@@ -58,15 +59,66 @@ struct config_s {
 #endif
 #ifdef REVERSE_SUPPORT
         struct reversepath *reversepath_list;
+        trie_t reversepath_trie;        /* of the list, by path */
+        trie_t reverseurl_trie;         /* and by URL */
+        hashmap_t reversehosts;         /* host name -> trie of its paths */
         unsigned int reverseonly;       /* boolean */
         unsigned int reversemagic;      /* boolean */
         char *reversebaseurl;
 #endif
 #ifdef UPSTREAM_SUPPORT
         struct upstream *upstream_list;
+        struct upstream_group *upstream_groups;
 #endif                          /* UPSTREAM_SUPPORT */
+
+        /*
+         * Health checking of balanced peers (such as upstream groups).
+         */
+        unsigned int health_check_interval;     /* 0 disables the checks */
+        unsigned int health_check_timeout;
+        unsigned int max_fails;
+        unsigned int fail_timeout;
         char *pidpath;
         unsigned int idletimeout;
+        unsigned int connect_timeout;   /* 0 means no timeout */
+
+        /*
+         * Persistent client connections.
+         */
+        unsigned int keepalive; /* boolean */
+        unsigned int keepalive_timeout;
+        unsigned int max_keepalive_requests;    /* 0 means no limit */
+        unsigned int pipeline_depth;
+        unsigned int upgrade_idle_timeout;      /* 0 means no timeout */
+        unsigned int http2_max_streams; /* 0 turns HTTP/2 clients away */
+
+        /*
+         * Reuse of server connections.
+         */
+        unsigned int pool_max_idle;     /* 0 disables the pool */
+        unsigned int pool_idle_timeout;
+
+        /*
+         * Response cache, sizes in kilobytes.
+         */
+        unsigned int cache_size;        /* 0 disables the cache */
+        unsigned int cache_max_object;
+        char *cache_dir;        /* of the disk tier, if any */
+        unsigned int cache_disk_size;
+        unsigned int cache_collapse_timeout;    /* seconds */
+
+        /*
+         * Responses kept on disk for clients slower than their server.
+         */
+        char *spool_dir;        /* NULL disables spooling */
+        unsigned int spool_size;        /* kilobytes per response */
+
+        /*
+         * Internal caching DNS resolver.
+         */
+        unsigned int dns_cache; /* boolean */
+        vector_t dns_servers;
+        struct static_host *static_hosts;
         char *bind_address;
         unsigned int bindsame;
 
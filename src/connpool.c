@@ -0,0 +1,184 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Idle connections to web servers and upstream proxies, kept by each
+ * child for reuse by its later requests.  Connections are keyed by the
+ * host, port and local address they were opened with.  The list is
+ * ordered from the most recently used connection to the oldest one.
+ */
+
+#include "main.h"
+
+#include "connpool.h"
+#include "heap.h"
+#include "log.h"
+#include "conf.h"
+
+struct pooled_conn {
+        struct pooled_conn *next;
+        char *key;
+        int fd;
+        time_t idle_since;
+};
+
+static struct pooled_conn *pool = NULL;
+
+/*
+ * Close a pooled connection and unlink it from the list.
+ */
+static void drop_conn (struct pooled_conn **ptr)
+{
+        struct pooled_conn *conn = *ptr;
+
+        *ptr = conn->next;
+        close (conn->fd);
+        safefree (conn->key);
+        safefree (conn);
+}
+
+/*
+ * Close the connections which stayed idle for too long.
+ */
+static void expire_conns (time_t now)
+{
+        struct pooled_conn **ptr = &pool;
+
+        while (*ptr) {
+                if (difftime (now, (*ptr)->idle_since)
+                    >= config.pool_idle_timeout)
+                        drop_conn (ptr);
+                else
+                        ptr = &(*ptr)->next;
+        }
+}
+
+/*
+ * An idle connection must have nothing to read: either the server has
+ * closed it, or it sent something it should not have.
+ */
+static int conn_is_alive (int fd)
+{
+        char c;
+        ssize_t ret;
+
+        ret = recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+        return ret < 0 && errno == EAGAIN;
+}
+
+/*
+ * Build the key of connections to a host.  The caller must free it.
+ */
+char *connpool_key (const char *host, int port, const char *bind_to)
+{
+        char *key;
+        size_t len;
+
+        if (!bind_to)
+                bind_to = config.bind_address ? config.bind_address : "";
+
+        len = strlen (host) + strlen (bind_to) + 10;
+        key = (char *) safemalloc (len);
+        if (key)
+                snprintf (key, len, "%s:%d@%s", host, port, bind_to);
+
+        return key;
+}
+
+/*
+ * Take an idle connection for a key out of the pool.  Returns its file
+ * descriptor, or -1 if there is none.
+ */
+int connpool_get (const char *key)
+{
+        struct pooled_conn **ptr = &pool, *conn;
+        int fd;
+
+        expire_conns (time (NULL));
+
+        while (*ptr) {
+                if (strcmp ((*ptr)->key, key) != 0) {
+                        ptr = &(*ptr)->next;
+                        continue;
+                }
+
+                if (!conn_is_alive ((*ptr)->fd)) {
+                        drop_conn (ptr);
+                        continue;
+                }
+
+                conn = *ptr;
+                *ptr = conn->next;
+
+                fd = conn->fd;
+                safefree (conn->key);
+                safefree (conn);
+
+                return fd;
+        }
+
+        return -1;
+}
+
+/*
+ * Give a connection back to the pool once a response has been read in
+ * full.  The oldest idle connection for the key is closed when there
+ * are already PoolMaxIdlePerHost of them.
+ */
+void connpool_put (const char *key, int fd)
+{
+        struct pooled_conn **ptr, **oldest = NULL, *conn;
+        unsigned int count = 0;
+        time_t now = time (NULL);
+
+        expire_conns (now);
+
+        for (ptr = &pool; *ptr; ptr = &(*ptr)->next) {
+                if (strcmp ((*ptr)->key, key) == 0) {
+                        count++;
+                        oldest = ptr;
+                }
+        }
+
+        if (oldest && count >= config.pool_max_idle)
+                drop_conn (oldest);
+
+        conn = (struct pooled_conn *) safemalloc (sizeof (struct pooled_conn));
+        if (conn)
+                conn->key = safestrdup (key);
+        if (!conn || !conn->key) {
+                safefree (conn);
+                close (fd);
+                return;
+        }
+
+        conn->fd = fd;
+        conn->idle_since = now;
+        conn->next = pool;
+        pool = conn;
+}
+
+/*
+ * A process forked off a child must not share its idle connections
+ * with it: only its copies of them are closed.
+ */
+void connpool_forget (void)
+{
+        while (pool)
+                drop_conn (&pool);
+}
@@ -0,0 +1,29 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'connpool.c' for detailed information. */
+
+#ifndef TINYPROXY_CONNPOOL_H
+#define TINYPROXY_CONNPOOL_H
+
+extern char *connpool_key (const char *host, int port, const char *bind_to);
+extern int connpool_get (const char *key);
+extern void connpool_put (const char *key, int fd);
+extern void connpool_forget (void);
+
+#endif
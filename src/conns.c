@@ -24,15 +24,19 @@
 
 #include "main.h"
 
+#include "balancer.h"
 #include "buffer.h"
+#include "cache.h"
 #include "conns.h"
 #include "heap.h"
+#include "http2.h"
 #include "log.h"
+#include "reqs.h"
 #include "stats.h"
 
-struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
-                                const char *string_addr,
-                                const char *sock_ipaddr)
+static struct conn_s *allocate_conn (int client_fd, const char *ipaddr,
+                                     const char *string_addr,
+                                     const char *sock_ipaddr)
 {
         struct conn_s *connptr;
         struct buffer_s *cbuffer, *sbuffer;
@@ -69,24 +73,51 @@ struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
         connptr->error_number = -1;
 
         connptr->connect_method = FALSE;
+        connptr->head_method = FALSE;
         connptr->show_stats = FALSE;
+        connptr->upgrade = NULL;
+        connptr->upgraded = FALSE;
+        connptr->keepalive = FALSE;
+        connptr->server_keepalive = FALSE;
+        connptr->pool_key = NULL;
+        connptr->retry_request = NULL;
+        connptr->retry_headers = NULL;
+        connptr->retry_host = NULL;
+        connptr->http2 = NULL;
 
         connptr->protocol.major = connptr->protocol.minor = 0;
 
         /* There is _no_ content length initially */
         connptr->content_length.server = connptr->content_length.client = -1;
+        connptr->response_chunked = connptr->dechunk = FALSE;
+        connptr->request_chunked = FALSE;
+
+        connptr->cache_key = NULL;
+        connptr->cache_headers = NULL;
+        connptr->cache_entry = -1;
+        connptr->cache_tier = 0;
+        connptr->cache_pin = -1;
+        connptr->cache_refresh = FALSE;
+        connptr->cache_fetch = -1;
+        connptr->cache_time = 0;
+        connptr->cache_vary = NULL;
+        connptr->cache_object = NULL;
 
         connptr->server_ip_addr = (sock_ipaddr ?
                                    safestrdup (sock_ipaddr) : NULL);
         connptr->client_ip_addr = safestrdup (ipaddr);
         connptr->client_string_addr = safestrdup (string_addr);
 
+        connptr->shares_client = FALSE;
         connptr->upstream_proxy = NULL;
-
-        update_stats (STAT_OPEN);
+        connptr->upstream_peer = NULL;
 
 #ifdef REVERSE_SUPPORT
         connptr->reversepath = NULL;
+        connptr->reverse_pool = NULL;
+        connptr->reverse_peer = NULL;
+        connptr->reverse_socket = NULL;
+        connptr->reverse_http2 = FALSE;
 #endif
 
         return connptr;
@@ -103,15 +134,61 @@ error_exit:
         return NULL;
 }
 
+struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
+                                const char *string_addr,
+                                const char *sock_ipaddr)
+{
+        struct conn_s *connptr;
+
+        connptr = allocate_conn (client_fd, ipaddr, string_addr, sock_ipaddr);
+        if (connptr)
+                update_stats (STAT_OPEN);
+
+        return connptr;
+}
+
+/*
+ * Create the structure for another request in progress on a client
+ * connection (when requests are pipelined).
+ */
+struct conn_s *pipeline_conn (struct conn_s *connptr)
+{
+        struct conn_s *pipelined;
+
+        pipelined = allocate_conn (connptr->client_fd, connptr->client_ip_addr,
+                                   connptr->client_string_addr,
+                                   connptr->server_ip_addr);
+        if (pipelined)
+                pipelined->shares_client = TRUE;
+
+        return pipelined;
+}
+
+/*
+ * Drop the copy of a request kept to be sent again.
+ */
+void forget_retry (struct conn_s *connptr)
+{
+        free_request_struct (connptr->retry_request);
+        connptr->retry_request = NULL;
+        if (connptr->retry_headers) {
+                hashmap_delete (connptr->retry_headers);
+                connptr->retry_headers = NULL;
+        }
+        safefree (connptr->retry_host);
+}
+
 void destroy_conn (struct conn_s *connptr)
 {
         assert (connptr != NULL);
 
-        if (connptr->client_fd != -1)
+        if (connptr->client_fd != -1 && !connptr->shares_client)
                 if (close (connptr->client_fd) < 0)
                         log_message (LOG_INFO, "Client (%d) close message: %s",
                                      connptr->client_fd, strerror (errno));
-        if (connptr->server_fd != -1)
+        if (connptr->http2)
+                http2_close (connptr->http2);
+        else if (connptr->server_fd != -1)
                 if (close (connptr->server_fd) < 0)
                         log_message (LOG_INFO, "Server (%d) close message: %s",
                                      connptr->server_fd, strerror (errno));
@@ -136,13 +213,112 @@ void destroy_conn (struct conn_s *connptr)
                 safefree (connptr->client_ip_addr);
         if (connptr->client_string_addr)
                 safefree (connptr->client_string_addr);
+        if (connptr->pool_key)
+                safefree (connptr->pool_key);
+        forget_retry (connptr);
+        safefree (connptr->upgrade);
+
+        cache_release (connptr);
 
 #ifdef REVERSE_SUPPORT
         if (connptr->reversepath)
                 safefree (connptr->reversepath);
+        if (connptr->reverse_peer)
+                balancer_release (connptr->reverse_peer);
+        safefree (connptr->reverse_socket);
 #endif
 
+        if (connptr->upstream_peer)
+                balancer_release (connptr->upstream_peer);
+
+        if (!connptr->shares_client)
+                update_stats (STAT_CLOSE);
+
         safefree (connptr);
+}
 
-        update_stats (STAT_CLOSE);
+/*
+ * Get a connection ready for the next request from the same client,
+ * closing the server side and forgetting everything about the last
+ * request.
+ */
+void reset_conn (struct conn_s *connptr)
+{
+        assert (connptr != NULL);
+
+        if (connptr->http2) {
+                http2_close (connptr->http2);
+                connptr->http2 = NULL;
+                connptr->server_fd = -1;
+        } else if (connptr->server_fd != -1) {
+                if (close (connptr->server_fd) < 0)
+                        log_message (LOG_INFO, "Server (%d) close message: %s",
+                                     connptr->server_fd, strerror (errno));
+                connptr->server_fd = -1;
+        }
+
+        if (connptr->request_line) {
+                safefree (connptr->request_line);
+                connptr->request_line = NULL;
+        }
+
+        if (connptr->error_variables) {
+                hashmap_delete (connptr->error_variables);
+                connptr->error_variables = NULL;
+        }
+
+        if (connptr->error_string) {
+                safefree (connptr->error_string);
+                connptr->error_string = NULL;
+        }
+        connptr->error_number = -1;
+
+        connptr->connect_method = FALSE;
+        connptr->head_method = FALSE;
+        connptr->show_stats = FALSE;
+        connptr->keepalive = FALSE;
+        connptr->server_keepalive = FALSE;
+
+        if (connptr->upgrade) {
+                safefree (connptr->upgrade);
+                connptr->upgrade = NULL;
+        }
+        connptr->upgraded = FALSE;
+
+        if (connptr->pool_key) {
+                safefree (connptr->pool_key);
+                connptr->pool_key = NULL;
+        }
+        forget_retry (connptr);
+
+        connptr->protocol.major = connptr->protocol.minor = 0;
+        connptr->content_length.server = connptr->content_length.client = -1;
+        connptr->response_chunked = connptr->dechunk = FALSE;
+        connptr->request_chunked = FALSE;
+
+        cache_release (connptr);
+
+#ifdef REVERSE_SUPPORT
+        if (connptr->reversepath) {
+                safefree (connptr->reversepath);
+                connptr->reversepath = NULL;
+        }
+
+        connptr->reverse_pool = NULL;
+        if (connptr->reverse_socket) {
+                safefree (connptr->reverse_socket);
+                connptr->reverse_socket = NULL;
+        }
+        connptr->reverse_http2 = FALSE;
+        if (connptr->reverse_peer) {
+                balancer_release (connptr->reverse_peer);
+                connptr->reverse_peer = NULL;
+        }
+#endif
+
+        connptr->upstream_proxy = NULL;
+        if (connptr->upstream_peer) {
+                balancer_release (connptr->upstream_peer);
+                connptr->upstream_peer = NULL;
+        }
 }
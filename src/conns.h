@@ -22,8 +22,12 @@
 #define TINYPROXY_CONNS_H
 
 #include "main.h"
+#include "chunked.h"
 #include "hashmap.h"
 
+/* Forward declaration */
+struct request_s;
+
 /*
  * Connection Definition
  */
@@ -39,8 +43,46 @@ struct conn_s {
 
         /* Booleans */
         unsigned int connect_method;
+        unsigned int head_method;
         unsigned int show_stats;
 
+        /*
+         * The protocol the client asked to switch to (the Upgrade
+         * header), and whether the server did.
+         */
+        char *upgrade;
+        unsigned int upgraded;
+
+        /*
+         * Whether the client connection stays open for another request
+         * once this one has been answered.
+         */
+        unsigned int keepalive;
+
+        /*
+         * Whether the server connection can go back to the pool after
+         * the response, and the pool key it belongs under.
+         */
+        unsigned int server_keepalive;
+        char *pool_key;
+
+        /*
+         * A request without a body sent on a connection from the pool,
+         * which the server may have closed just as it went out.  It is
+         * kept, with the server it was for, until the response starts,
+         * so that it can be sent again on a new connection.
+         */
+        struct request_s *retry_request;
+        hashmap_t retry_headers;
+        char *retry_host;
+        int retry_port;
+
+        /*
+         * The stream of the request, for a server spoken to over HTTP/2.
+         * server_fd is then the connection of all its streams.
+         */
+        struct http2_stream *http2;
+
         /*
          * This structure stores key -> value mappings for substitution
          * in the error HTML files.
@@ -56,6 +98,39 @@ struct conn_s {
                 long int client;
         } content_length;
 
+        /*
+         * Framing of a response sent with the chunked transfer coding,
+         * which is decoded for clients which do not support it.
+         */
+        unsigned int response_chunked;
+        unsigned int dechunk;
+        struct chunked_s chunked;
+
+        /*
+         * Framing of a chunked request body, which is streamed to the
+         * server (see content_length.client otherwise).
+         */
+        unsigned int request_chunked;
+        struct chunked_s request_chunks;
+
+        /*
+         * Response cache (see cache.c): the key of a request which may
+         * be cached, its headers, the entry answering it (and the tier it
+         * is in, its pin, and whether the answer of the server only
+         * refreshes it), the fetch others wait for, the copy of the response being kept
+         * and the ReverseCache settings for it.
+         */
+        char *cache_key;
+        hashmap_t cache_headers;
+        int cache_entry;
+        int cache_tier;
+        int cache_pin;
+        unsigned int cache_refresh;
+        int cache_fetch;
+        struct cache_object *cache_object;
+        unsigned int cache_time;
+        char *cache_vary;
+
         /*
          * Store the server's IP (for BindSame)
          */
@@ -80,12 +155,40 @@ struct conn_s {
          * Place to store the current per-connection reverse proxy path
          */
         char *reversepath;
+
+        /*
+         * The reverse path whose backends the request is balanced over,
+         * and the backend in use.
+         */
+        struct reversepath *reverse_pool;
+        struct balancer_peer *reverse_peer;
+
+        /*
+         * The path of the socket of a unix: backend.
+         */
+        char *reverse_socket;
+
+        /*
+         * Whether the backends are spoken to over HTTP/2 (ReverseHTTP2).
+         */
+        unsigned int reverse_http2;
 #endif
 
+        /*
+         * Set for the extra structures of pipelined requests, which
+         * share the client socket of the connection.
+         */
+        unsigned int shares_client;
+
         /*
          * Pointer to upstream proxy.
          */
         struct upstream *upstream_proxy;
+
+        /*
+         * Member of an upstream group in use, if any.
+         */
+        struct balancer_peer *upstream_peer;
 };
 
 /*
@@ -94,6 +197,9 @@ struct conn_s {
 extern struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
                                        const char *string_addr,
                                        const char *sock_ipaddr);
+extern struct conn_s *pipeline_conn (struct conn_s *connptr);
 extern void destroy_conn (struct conn_s *connptr);
+extern void reset_conn (struct conn_s *connptr);
+extern void forget_retry (struct conn_s *connptr);
 
 #endif
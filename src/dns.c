@@ -0,0 +1,972 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Host name resolution.  Names listed with StaticResolve are answered
+ * from the configuration without any lookup.
+ *
+ * Other names go through a small caching DNS resolver.  getaddrinfo()
+ * blocks, and its answers are not shared between the children, so every
+ * request for a popular host used to pay for its own lookup.  When
+ * DNSCache is enabled, names are resolved by sending the A and AAAA
+ * queries in parallel over UDP to the servers given with DNSServer (or
+ * else those in /etc/resolv.conf), and the answers are kept in shared
+ * memory for as long as their TTL allows.  Names which do not exist are
+ * cached as well.  While one child is resolving a name, the others
+ * asking for it wait for its answer instead of sending queries of their
+ * own.
+ *
+ * Numeric addresses, names without a dot (which may need the search
+ * list or /etc/hosts) and answers too large for a UDP datagram are left
+ * to the system resolver, as are names the servers could not be asked
+ * about, which /etc/hosts or another source of nsswitch may know.
+ */
+
+#include "main.h"
+
+#include "dns.h"
+#include "heap.h"
+#include "log.h"
+#include "shared-lock.h"
+#include "text.h"
+#include "vector.h"
+#include "conf.h"
+
+#define DNS_CACHE_SLOTS 1024
+#define DNS_CACHE_WAYS 4        /* slots a name may live in */
+#define DNS_MAX_ADDRS 8         /* per address family */
+#define DNS_MAX_SERVERS 3
+#define DNS_NAME_LENGTH 256
+#define DNS_PACKET_SIZE 512
+#define DNS_PORT "53"
+
+#define DNS_TIMEOUT 2           /* seconds, per server */
+#define DNS_PENDING_TIMEOUT (DNS_TIMEOUT * DNS_MAX_SERVERS + 1)
+#define DNS_NEGATIVE_TTL 30     /* when the server gives no SOA record */
+#define DNS_MAX_NEGATIVE_TTL 300
+#define DNS_MAX_TTL 86400
+#define DNS_PREFETCH_AHEAD 15   /* refresh entries this close to expiry */
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_REPLY_MALFORMED -1
+#define DNS_REPLY_TRUNCATED -2
+
+typedef enum {
+        DNS_EMPTY,
+        DNS_PENDING,            /* being resolved by some process */
+        DNS_VALID,
+        DNS_NEGATIVE            /* the name does not exist */
+} dns_state_t;
+
+/* Outcome of a lookup */
+typedef enum {
+        LOOKUP_OK,
+        LOOKUP_NXDOMAIN,
+        LOOKUP_FAIL,
+        LOOKUP_FALLBACK         /* use the system resolver instead */
+} lookup_t;
+
+struct dns_entry {
+        char name[DNS_NAME_LENGTH];
+        dns_state_t state;
+        time_t expires;         /* or start of the lookup, when pending */
+        unsigned int naddr4, naddr6;
+        struct in_addr addr4[DNS_MAX_ADDRS];
+        struct in6_addr addr6[DNS_MAX_ADDRS];
+};
+
+struct dns_server {
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+};
+
+/*
+ * The nodes of the lists returned by dns_getaddrinfo() carry their own
+ * address, so that each one is a single allocation.
+ */
+struct dns_addrinfo {
+        struct addrinfo ai;
+        struct sockaddr_storage addr;
+};
+
+static struct dns_entry *dns_cache = NULL;
+
+/* The nameservers, read with the configuration */
+static struct dns_server dns_servers[DNS_MAX_SERVERS];
+static unsigned int dns_nservers = 0;
+
+static int urandom_fd = -1;
+
+/*
+ * Allocate the shared cache.  Must be called before the children are
+ * created.
+ */
+int dns_init (void)
+{
+        urandom_fd = open ("/dev/urandom", O_RDONLY);
+        dns_configure ();
+
+        dns_cache = (struct dns_entry *)
+            calloc_shared_memory (DNS_CACHE_SLOTS, sizeof (struct dns_entry));
+        if (dns_cache == MAP_FAILED) {
+                dns_cache = NULL;
+                log_message (LOG_ERR,
+                             "Could not allocate memory for the DNS cache.");
+                return -1;
+        }
+
+        return 0;
+}
+
+static unsigned int hash_name (const char *name)
+{
+        unsigned int hash = 5381;
+
+        while (*name)
+                hash = ((hash << 5) + hash) +
+                    (unsigned int) tolower ((unsigned char) *name++);
+
+        return hash;
+}
+
+static unsigned int get16 (const unsigned char *p)
+{
+        return ((unsigned int) p[0] << 8) | p[1];
+}
+
+static unsigned long get32 (const unsigned char *p)
+{
+        return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16)
+            | ((unsigned long) p[2] << 8) | p[3];
+}
+
+static long elapsed_ms (const struct timeval *since)
+{
+        struct timeval now;
+
+        gettimeofday (&now, NULL);
+        return (now.tv_sec - since->tv_sec) * 1000L
+            + (now.tv_usec - since->tv_usec) / 1000L;
+}
+
+/*
+ * Query IDs should be hard to guess, to make spoofed answers unlikely.
+ */
+static unsigned int random_id (void)
+{
+        static unsigned int seed = 0;
+        unsigned int id;
+
+        if (urandom_fd >= 0
+            && read (urandom_fd, &id, sizeof (id)) == sizeof (id))
+                return id & 0xffff;
+
+        seed = seed * 1103515245U + 12345U
+            + (unsigned int) getpid () + (unsigned int) time (NULL);
+        return (seed >> 16) & 0xffff;
+}
+
+/*
+ * Parse a nameserver given as "ip", "ip:port" or "[ipv6]:port".
+ */
+static int parse_server (const char *spec, struct dns_server *server)
+{
+        struct addrinfo hints, *res;
+        char host[INET6_ADDRSTRLEN + 2];
+        const char *port = DNS_PORT;
+        char *p;
+
+        if (strlcpy (host, spec, sizeof (host)) >= sizeof (host))
+                return -1;
+
+        if (host[0] == '[') {
+                p = strchr (host, ']');
+                if (!p)
+                        return -1;
+                *p++ = '\0';
+                if (*p == ':')
+                        port = spec + (p - host) + 1;
+                memmove (host, host + 1, strlen (host + 1) + 1);
+        } else if ((p = strchr (host, ':')) && !strchr (p + 1, ':')) {
+                *p = '\0';
+                port = spec + (p - host) + 1;
+        }
+
+        memset (&hints, 0, sizeof (struct addrinfo));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+        if (getaddrinfo (host, port, &hints, &res) != 0)
+                return -1;
+
+        memcpy (&server->addr, res->ai_addr, res->ai_addrlen);
+        server->addrlen = res->ai_addrlen;
+        freeaddrinfo (res);
+
+        return 0;
+}
+
+/*
+ * Collect the nameservers to use: those configured with DNSServer, or
+ * else the ones listed in /etc/resolv.conf.
+ */
+static unsigned int get_servers (struct dns_server *servers)
+{
+        unsigned int n = 0;
+        char line[256], addr[INET6_ADDRSTRLEN + 2];
+        FILE *f;
+        ssize_t i;
+
+        if (config.dns_servers) {
+                for (i = 0; i < vector_length (config.dns_servers)
+                     && n < DNS_MAX_SERVERS; i++) {
+                        const char *spec = (const char *)
+                            vector_getentry (config.dns_servers, i, NULL);
+
+                        if (parse_server (spec, &servers[n]) == 0)
+                                n++;
+                        else
+                                log_message (LOG_WARNING,
+                                             "Invalid DNS server \"%s\"", spec);
+                }
+
+                return n;
+        }
+
+        f = fopen ("/etc/resolv.conf", "r");
+        if (!f)
+                return 0;
+
+        while (n < DNS_MAX_SERVERS && fgets (line, sizeof (line), f)) {
+                if (sscanf (line, "nameserver %47s", addr) == 1
+                    && parse_server (addr, &servers[n]) == 0)
+                        n++;
+        }
+
+        fclose (f);
+        return n;
+}
+
+/*
+ * Read the nameservers again, whenever the configuration is loaded.
+ */
+void dns_configure (void)
+{
+        dns_nservers = get_servers (dns_servers);
+}
+
+/*
+ * Build a query for one record type.  Returns the length of the packet,
+ * or -1 if the name cannot be encoded.
+ */
+static int
+build_query (unsigned char *pkt, unsigned int id, const char *name,
+             unsigned int type)
+{
+        const char *label, *dot;
+        size_t n;
+        int off = 12;
+
+        memset (pkt, 0, 12);
+        pkt[0] = (unsigned char) (id >> 8);
+        pkt[1] = (unsigned char) id;
+        pkt[2] = 0x01;          /* recursion desired */
+        pkt[5] = 1;             /* one question */
+
+        for (label = name; *label; label = dot + 1) {
+                dot = strchr (label, '.');
+                n = dot ? (size_t) (dot - label) : strlen (label);
+                if (n == 0 || n > 63 || off + n + 6 > DNS_PACKET_SIZE)
+                        return -1;
+
+                pkt[off++] = (unsigned char) n;
+                memcpy (pkt + off, label, n);
+                off += n;
+
+                if (!dot)
+                        break;
+        }
+
+        pkt[off++] = 0;
+        pkt[off++] = (unsigned char) (type >> 8);
+        pkt[off++] = (unsigned char) type;
+        pkt[off++] = 0;
+        pkt[off++] = DNS_CLASS_IN;
+
+        return off;
+}
+
+/*
+ * Skip over a (possibly compressed) name.  Returns the offset just past
+ * it, or -1 if the packet is malformed.
+ */
+static int skip_name (const unsigned char *pkt, int len, int off)
+{
+        while (off < len) {
+                if (pkt[off] == 0)
+                        return off + 1;
+                if ((pkt[off] & 0xc0) == 0xc0)
+                        return off + 2 <= len ? off + 2 : -1;
+                if (pkt[off] & 0xc0)
+                        return -1;
+                off += pkt[off] + 1;
+        }
+
+        return -1;
+}
+
+/*
+ * Add the addresses of an answer to "result".  "ttl" is lowered to the
+ * smallest TTL of the addresses, and "neg_ttl" is set from the SOA
+ * record if there is one.  Returns the response code of the answer, or
+ * one of the DNS_REPLY_* errors.
+ */
+static int
+parse_reply (const unsigned char *pkt, int len, struct dns_entry *result,
+             unsigned long *ttl, unsigned long *neg_ttl)
+{
+        unsigned int qdcount, ancount, nscount, i, type, rclass, rdlen;
+        unsigned long rttl, minimum;
+        int off = 12;
+
+        if (len < 12 || !(pkt[2] & 0x80))
+                return DNS_REPLY_MALFORMED;
+        if (pkt[2] & 0x02)
+                return DNS_REPLY_TRUNCATED;
+
+        qdcount = get16 (pkt + 4);
+        ancount = get16 (pkt + 6);
+        nscount = get16 (pkt + 8);
+
+        for (i = 0; i != qdcount; i++) {
+                off = skip_name (pkt, len, off);
+                if (off < 0 || off + 4 > len)
+                        return DNS_REPLY_MALFORMED;
+                off += 4;
+        }
+
+        for (i = 0; i != ancount + nscount; i++) {
+                off = skip_name (pkt, len, off);
+                if (off < 0 || off + 10 > len)
+                        return DNS_REPLY_MALFORMED;
+
+                type = get16 (pkt + off);
+                rclass = get16 (pkt + off + 2);
+                rttl = get32 (pkt + off + 4) & 0x7fffffffUL;
+                rdlen = get16 (pkt + off + 8);
+                off += 10;
+
+                if (off + (int) rdlen > len)
+                        return DNS_REPLY_MALFORMED;
+
+                if (rclass != DNS_CLASS_IN) {
+                        off += rdlen;
+                        continue;
+                }
+
+                if (i < ancount && type == DNS_TYPE_A && rdlen == 4) {
+                        if (result->naddr4 < DNS_MAX_ADDRS)
+                                memcpy (&result->addr4[result->naddr4++],
+                                        pkt + off, 4);
+                        if (rttl < *ttl)
+                                *ttl = rttl;
+                } else if (i < ancount && type == DNS_TYPE_AAAA
+                           && rdlen == 16) {
+                        if (result->naddr6 < DNS_MAX_ADDRS)
+                                memcpy (&result->addr6[result->naddr6++],
+                                        pkt + off, 16);
+                        if (rttl < *ttl)
+                                *ttl = rttl;
+                } else if (i >= ancount && type == DNS_TYPE_SOA
+                           && rdlen >= 22) {
+                        /* RFC 2308: the lesser of the TTL and MINIMUM */
+                        minimum = get32 (pkt + off + rdlen - 4);
+                        *neg_ttl = rttl < minimum ? rttl : minimum;
+                }
+
+                off += rdlen;
+        }
+
+        return pkt[3] & 0x0f;
+}
+
+/*
+ * Ask one server for the A and AAAA records of a name, in parallel.
+ */
+static lookup_t
+query_server (const struct dns_server *server, const char *name,
+              struct dns_entry *result)
+{
+        static const unsigned int types[2] = { DNS_TYPE_A, DNS_TYPE_AAAA };
+        unsigned char pkt[DNS_PACKET_SIZE];
+        unsigned int ids[2], answered[2] = { FALSE, FALSE };
+        int rcode[2] = { -1, -1 };
+        unsigned long ttl = DNS_MAX_TTL, neg_ttl = DNS_NEGATIVE_TTL;
+        struct timeval start, tv;
+        fd_set rset;
+        int sockfd, len, r, i;
+        long left;
+
+        sockfd = socket (server->addr.ss_family, SOCK_DGRAM, 0);
+        if (sockfd < 0)
+                return LOOKUP_FAIL;
+
+        /* A connected socket only accepts datagrams from the server */
+        if (connect (sockfd, (const struct sockaddr *) &server->addr,
+                     server->addrlen) < 0) {
+                close (sockfd);
+                return LOOKUP_FAIL;
+        }
+
+        for (i = 0; i != 2; i++) {
+                ids[i] = random_id ();
+                len = build_query (pkt, ids[i], name, types[i]);
+                if (len < 0) {
+                        close (sockfd);
+                        return LOOKUP_FALLBACK;
+                }
+
+                if (send (sockfd, pkt, len, 0) != len) {
+                        close (sockfd);
+                        return LOOKUP_FAIL;
+                }
+        }
+
+        gettimeofday (&start, NULL);
+
+        while (!answered[0] || !answered[1]) {
+                left = DNS_TIMEOUT * 1000L - elapsed_ms (&start);
+                if (left <= 0)
+                        break;
+
+                FD_ZERO (&rset);
+                FD_SET (sockfd, &rset);
+                tv.tv_sec = left / 1000;
+                tv.tv_usec = (left % 1000) * 1000;
+
+                r = select (sockfd + 1, &rset, NULL, NULL, &tv);
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r <= 0)
+                        break;
+
+                len = recv (sockfd, pkt, sizeof (pkt), 0);
+                if (len < 12)
+                        continue;
+
+                for (i = 0; i != 2; i++) {
+                        if (!answered[i] && get16 (pkt) == ids[i])
+                                break;
+                }
+                if (i == 2)
+                        continue;       /* not ours, or a duplicate */
+
+                r = parse_reply (pkt, len, result, &ttl, &neg_ttl);
+                if (r == DNS_REPLY_TRUNCATED) {
+                        close (sockfd);
+                        return LOOKUP_FALLBACK;
+                }
+                if (r == DNS_REPLY_MALFORMED)
+                        continue;
+
+                answered[i] = TRUE;
+                rcode[i] = r;
+        }
+
+        close (sockfd);
+
+        if (result->naddr4 + result->naddr6 > 0) {
+                result->state = DNS_VALID;
+                result->expires = time (NULL) + (time_t) ttl;
+                return LOOKUP_OK;
+        }
+
+        /*
+         * The name does not exist, or exists without any address.  Both
+         * are worth remembering for a little while.
+         */
+        if (rcode[0] == DNS_RCODE_NXDOMAIN || rcode[1] == DNS_RCODE_NXDOMAIN
+            || (rcode[0] == DNS_RCODE_NOERROR
+                && rcode[1] == DNS_RCODE_NOERROR)) {
+                if (neg_ttl > DNS_MAX_NEGATIVE_TTL)
+                        neg_ttl = DNS_MAX_NEGATIVE_TTL;
+                result->state = DNS_NEGATIVE;
+                result->expires = time (NULL) + (time_t) neg_ttl;
+                return LOOKUP_NXDOMAIN;
+        }
+
+        return LOOKUP_FAIL;
+}
+
+static lookup_t dns_query (const char *name, struct dns_entry *result)
+{
+        unsigned int i;
+        lookup_t ret = LOOKUP_FAIL;
+
+        if (dns_nservers == 0)
+                return LOOKUP_FALLBACK;
+
+        for (i = 0; i != dns_nservers; i++) {
+                memset (result, 0, sizeof (struct dns_entry));
+
+                ret = query_server (&dns_servers[i], name, result);
+                if (ret != LOOKUP_FAIL)
+                        break;
+        }
+
+        if (ret == LOOKUP_FAIL)
+                log_message (LOG_WARNING, "DNS lookup of %s failed", name);
+
+        return ret;
+}
+
+/*
+ * Find the cache slot of a name: the one holding it, or else the one to
+ * use for it (empty or expired, or else the one expiring first).  Slots
+ * being resolved by other processes are left alone unless their lookup
+ * has clearly been abandoned.  LOCK_DNS must be held by the caller.
+ */
+static struct dns_entry *
+dns_slot_locked (const char *name, time_t now, unsigned int *found)
+{
+        struct dns_entry *entry, *victim = NULL;
+        unsigned int i, pos;
+
+        pos = hash_name (name) % DNS_CACHE_SLOTS;
+        *found = FALSE;
+
+        for (i = 0; i != DNS_CACHE_WAYS; i++) {
+                entry = &dns_cache[(pos + i) % DNS_CACHE_SLOTS];
+
+                if (entry->state != DNS_EMPTY
+                    && strcasecmp (entry->name, name) == 0) {
+                        *found = TRUE;
+                        return entry;
+                }
+
+                if (entry->state == DNS_PENDING
+                    && difftime (now, entry->expires) < DNS_PENDING_TIMEOUT)
+                        continue;
+
+                if (!victim || entry->state == DNS_EMPTY
+                    || (victim->state != DNS_EMPTY
+                        && entry->expires < victim->expires))
+                        victim = entry;
+        }
+
+        return victim;
+}
+
+/*
+ * Save the answer of a lookup in a cache slot.  LOCK_DNS must be held.
+ */
+static void
+dns_store_locked (struct dns_entry *entry, const char *name,
+                  const struct dns_entry *result)
+{
+        *entry = *result;
+        strlcpy (entry->name, name, DNS_NAME_LENGTH);
+}
+
+/*
+ * Resolve a name through the cache, filling in "result".
+ */
+static lookup_t dns_lookup (const char *name, struct dns_entry *result)
+{
+        struct dns_entry *entry;
+        struct timeval tv;
+        time_t now, started = time (NULL);
+        unsigned int found;
+        lookup_t ret;
+
+        for (;;) {
+                now = time (NULL);
+
+                shared_lock_wait (LOCK_DNS);
+                entry = dns_slot_locked (name, now, &found);
+
+                if (found && entry->expires > now
+                    && entry->state == DNS_VALID) {
+                        *result = *entry;
+                        shared_lock_release (LOCK_DNS);
+                        return LOOKUP_OK;
+                }
+
+                if (found && entry->expires > now
+                    && entry->state == DNS_NEGATIVE) {
+                        shared_lock_release (LOCK_DNS);
+                        return LOOKUP_NXDOMAIN;
+                }
+
+                /* Somebody else is asking already: wait for the answer */
+                if (found && entry->state == DNS_PENDING
+                    && difftime (now, entry->expires) < DNS_PENDING_TIMEOUT
+                    && difftime (now, started) < DNS_PENDING_TIMEOUT) {
+                        shared_lock_release (LOCK_DNS);
+
+                        tv.tv_sec = 0;
+                        tv.tv_usec = 20000;
+                        select (0, NULL, NULL, NULL, &tv);
+                        continue;
+                }
+
+                if (entry) {
+                        strlcpy (entry->name, name, DNS_NAME_LENGTH);
+                        entry->state = DNS_PENDING;
+                        entry->expires = now;
+                }
+
+                shared_lock_release (LOCK_DNS);
+                break;
+        }
+
+        ret = dns_query (name, result);
+
+        if (!entry)
+                return ret;
+
+        shared_lock_wait (LOCK_DNS);
+        if (entry->state == DNS_PENDING
+            && strcasecmp (entry->name, name) == 0) {
+                if (ret == LOOKUP_OK || ret == LOOKUP_NXDOMAIN)
+                        dns_store_locked (entry, name, result);
+                else
+                        entry->state = DNS_EMPTY;
+        }
+        shared_lock_release (LOCK_DNS);
+
+        return ret;
+}
+
+/*
+ * Append a copy of an address to a list being built.
+ */
+static int
+append_addrinfo (struct addrinfo ***tail, const struct sockaddr *addr,
+                 socklen_t addrlen, const struct addrinfo *hints)
+{
+        struct dns_addrinfo *node;
+
+        node = (struct dns_addrinfo *)
+            safecalloc (1, sizeof (struct dns_addrinfo));
+        if (!node)
+                return -1;
+
+        memcpy (&node->addr, addr, addrlen);
+        node->ai.ai_family = addr->sa_family;
+        node->ai.ai_socktype = hints && hints->ai_socktype ?
+            hints->ai_socktype : SOCK_STREAM;
+        node->ai.ai_protocol = hints ? hints->ai_protocol : 0;
+        node->ai.ai_addr = (struct sockaddr *) &node->addr;
+        node->ai.ai_addrlen = addrlen;
+
+        **tail = &node->ai;
+        *tail = &node->ai.ai_next;
+
+        return 0;
+}
+
+/*
+ * Use getaddrinfo(), copying its result so that it can be freed with
+ * dns_freeaddrinfo() like the others.
+ */
+static int
+system_getaddrinfo (const char *host, const char *service,
+                    const struct addrinfo *hints, struct addrinfo **res)
+{
+        struct addrinfo *sysres, *p, **tail = res;
+        int ret;
+
+        *res = NULL;
+
+        ret = getaddrinfo (host, service, hints, &sysres);
+        if (ret != 0)
+                return ret;
+
+        for (p = sysres; p; p = p->ai_next) {
+                if (append_addrinfo (&tail, p->ai_addr, p->ai_addrlen,
+                                     p) < 0) {
+                        ret = EAI_MEMORY;
+                        break;
+                }
+        }
+
+        freeaddrinfo (sysres);
+
+        if (ret != 0) {
+                dns_freeaddrinfo (*res);
+                *res = NULL;
+        }
+
+        return ret;
+}
+
+static int is_numeric_address (const char *host)
+{
+        struct in6_addr addr;
+
+        return inet_pton (AF_INET, host, &addr) > 0
+            || inet_pton (AF_INET6, host, &addr) > 0;
+}
+
+/*
+ * Names which the cache is used for (not the paths of unix sockets).
+ */
+static int dns_cacheable (const char *host)
+{
+        return config.dns_cache && dns_cache && *host != '/'
+            && strchr (host, '.')
+            && strlen (host) < DNS_NAME_LENGTH && !is_numeric_address (host);
+}
+
+/*
+ * Add a StaticResolve entry.  A name may be given several addresses.
+ */
+int dns_add_static (const char *name, const char *ip,
+                    struct static_host **static_hosts)
+{
+        struct addrinfo hints, *res;
+        struct static_host *host, **tail;
+
+        memset (&hints, 0, sizeof (struct addrinfo));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICHOST;
+
+        if (getaddrinfo (ip, NULL, &hints, &res) != 0) {
+                log_message (LOG_WARNING,
+                             "Invalid address \"%s\" for %s in StaticResolve",
+                             ip, name);
+                return -1;
+        }
+
+        host = (struct static_host *)
+            safecalloc (1, sizeof (struct static_host));
+        if (!host) {
+                freeaddrinfo (res);
+                return -1;
+        }
+
+        host->name = safestrdup (name);
+        memcpy (&host->addr, res->ai_addr, res->ai_addrlen);
+        host->addrlen = res->ai_addrlen;
+        freeaddrinfo (res);
+
+        if (!host->name) {
+                safefree (host);
+                return -1;
+        }
+
+        /* Keep the order of the config file */
+        for (tail = static_hosts; *tail; tail = &(*tail)->next) ;
+        *tail = host;
+
+        return 0;
+}
+
+void free_static_hosts (struct static_host *static_hosts)
+{
+        while (static_hosts) {
+                struct static_host *tmp = static_hosts;
+
+                static_hosts = static_hosts->next;
+                safefree (tmp->name);
+                safefree (tmp);
+        }
+}
+
+static int is_static_host (const char *host)
+{
+        struct static_host *entry;
+
+        for (entry = config.static_hosts; entry; entry = entry->next)
+                if (strcasecmp (entry->name, host) == 0)
+                        return TRUE;
+
+        return FALSE;
+}
+
+/*
+ * Answer from the StaticResolve entries.  Returns 0 if the name has
+ * any, EAI_NONAME if it has none, or EAI_MEMORY.
+ */
+static int
+static_getaddrinfo (const char *host, unsigned short port,
+                    const struct addrinfo *hints, struct addrinfo **res)
+{
+        struct static_host *entry;
+        struct addrinfo **tail = res;
+        struct sockaddr_storage addr;
+        int family = hints ? hints->ai_family : AF_UNSPEC;
+
+        *res = NULL;
+
+        for (entry = config.static_hosts; entry; entry = entry->next) {
+                if (strcasecmp (entry->name, host) != 0)
+                        continue;
+                if (family != AF_UNSPEC && family != entry->addr.ss_family)
+                        continue;
+
+                memcpy (&addr, &entry->addr, entry->addrlen);
+                if (addr.ss_family == AF_INET)
+                        ((struct sockaddr_in *) &addr)->sin_port =
+                            htons (port);
+                else
+                        ((struct sockaddr_in6 *) &addr)->sin6_port =
+                            htons (port);
+
+                if (append_addrinfo (&tail, (struct sockaddr *) &addr,
+                                     entry->addrlen, hints) < 0) {
+                        dns_freeaddrinfo (*res);
+                        *res = NULL;
+                        return EAI_MEMORY;
+                }
+        }
+
+        return *res ? 0 : EAI_NONAME;
+}
+
+/*
+ * Make sure the cache holds a fresh answer for a name, looking it up
+ * again when it is missing or about to expire.  The master process does
+ * this for the hosts named in the config file, so that requests to them
+ * do not wait for DNS.  The old answer stays in use during the lookup.
+ */
+void dns_prefetch (const char *name)
+{
+        struct dns_entry *entry, result;
+        time_t now = time (NULL);
+        unsigned int found, fresh;
+        lookup_t ret;
+
+        if (!dns_cacheable (name) || is_static_host (name))
+                return;
+
+        shared_lock_wait (LOCK_DNS);
+        entry = dns_slot_locked (name, now, &found);
+        fresh = found && (entry->state == DNS_PENDING
+                          || difftime (entry->expires, now)
+                          > DNS_PREFETCH_AHEAD);
+        shared_lock_release (LOCK_DNS);
+
+        if (fresh)
+                return;
+
+        ret = dns_query (name, &result);
+        if (ret != LOOKUP_OK && ret != LOOKUP_NXDOMAIN)
+                return;
+
+        shared_lock_wait (LOCK_DNS);
+        entry = dns_slot_locked (name, time (NULL), &found);
+        if (entry)
+                dns_store_locked (entry, name, &result);
+        shared_lock_release (LOCK_DNS);
+}
+
+int
+dns_getaddrinfo (const char *host, const char *service,
+                 const struct addrinfo *hints, struct addrinfo **res)
+{
+        struct dns_entry result;
+        struct addrinfo **tail = res;
+        struct sockaddr_in sin;
+        struct sockaddr_in6 sin6;
+        int family = hints ? hints->ai_family : AF_UNSPEC;
+        unsigned short port = 0;
+        unsigned int i;
+        char *end;
+
+        assert (host != NULL);
+        assert (res != NULL);
+
+        if (service) {
+                port = (unsigned short) strtoul (service, &end, 10);
+                if (*end != '\0')
+                        return system_getaddrinfo (host, service, hints, res);
+        }
+
+        if (config.static_hosts
+            && static_getaddrinfo (host, port, hints, res) != EAI_NONAME)
+                return *res ? 0 : EAI_MEMORY;
+
+        if (!dns_cacheable (host))
+                return system_getaddrinfo (host, service, hints, res);
+
+        switch (dns_lookup (host, &result)) {
+        case LOOKUP_OK:
+                break;
+        case LOOKUP_NXDOMAIN:
+                return EAI_NONAME;
+        case LOOKUP_FAIL:
+                /* /etc/hosts, mDNS and the like may still know the name */
+        case LOOKUP_FALLBACK:
+                return system_getaddrinfo (host, service, hints, res);
+        }
+
+        *res = NULL;
+
+        if (family == AF_UNSPEC || family == AF_INET6) {
+                for (i = 0; i != result.naddr6; i++) {
+                        memset (&sin6, 0, sizeof (sin6));
+                        sin6.sin6_family = AF_INET6;
+                        sin6.sin6_port = htons (port);
+                        sin6.sin6_addr = result.addr6[i];
+
+                        if (append_addrinfo (&tail, (struct sockaddr *) &sin6,
+                                             sizeof (sin6), hints) < 0)
+                                goto nomem;
+                }
+        }
+
+        if (family == AF_UNSPEC || family == AF_INET) {
+                for (i = 0; i != result.naddr4; i++) {
+                        memset (&sin, 0, sizeof (sin));
+                        sin.sin_family = AF_INET;
+                        sin.sin_port = htons (port);
+                        sin.sin_addr = result.addr4[i];
+
+                        if (append_addrinfo (&tail, (struct sockaddr *) &sin,
+                                             sizeof (sin), hints) < 0)
+                                goto nomem;
+                }
+        }
+
+        return *res ? 0 : EAI_NONAME;
+
+nomem:
+        dns_freeaddrinfo (*res);
+        *res = NULL;
+        return EAI_MEMORY;
+}
+
+void dns_freeaddrinfo (struct addrinfo *res)
+{
+        while (res) {
+                struct addrinfo *next = res->ai_next;
+
+                /* The addrinfo is the first member of its node */
+                safefree (res);
+                res = next;
+        }
+}
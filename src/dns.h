@@ -0,0 +1,56 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'dns.c' for detailed information. */
+
+#ifndef TINYPROXY_DNS_H
+#define TINYPROXY_DNS_H
+
+#include "common.h"
+
+/*
+ * Addresses given with StaticResolve, which take precedence over DNS.
+ */
+struct static_host {
+        struct static_host *next;
+        char *name;
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+};
+
+extern int dns_init (void);
+extern void dns_configure (void);
+
+extern int dns_add_static (const char *name, const char *ip,
+                           struct static_host **static_hosts);
+extern void free_static_hosts (struct static_host *static_hosts);
+
+/*
+ * Drop-in replacements for getaddrinfo() and freeaddrinfo().  When the
+ * DNSCache directive is enabled, names are looked up with the internal
+ * resolver and cache; otherwise the system resolver is used.  Lists
+ * returned by dns_getaddrinfo() MUST be freed with dns_freeaddrinfo().
+ */
+extern int dns_getaddrinfo (const char *host, const char *service,
+                            const struct addrinfo *hints,
+                            struct addrinfo **res);
+extern void dns_freeaddrinfo (struct addrinfo *res);
+
+extern void dns_prefetch (const char *name);
+
+#endif
@@ -0,0 +1,599 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* HPACK, the compression of the header fields of HTTP/2 (RFC 7541).
+ *
+ * The decoder handles everything a peer may send: references to the
+ * static and dynamic tables, Huffman coded strings and changes of the
+ * table size.  The encoder keeps it simple, and only refers to the names
+ * (or whole fields) of the static table, with the values sent as they
+ * are.
+ */
+
+#include "main.h"
+
+#include "heap.h"
+#include "hpack.h"
+
+struct hpack_entry {
+        char *name;
+        char *value;
+};
+
+/* The fields every table starts with, at indices 1 to 61 */
+static const struct {
+        const char *name;
+        const char *value;
+} static_table[] = {
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""}
+};
+
+#define STATIC_ENTRIES (sizeof (static_table) / sizeof (static_table[0]))
+
+/* The Huffman code of each byte, and of the end of string (256) */
+static const unsigned int huffman_codes[257] = {
+        0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+        0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+        0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+        0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+        0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+        0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+        0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+        0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+        0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+        0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+        0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+        0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+        0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+        0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+        0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+        0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+        0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+        0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+        0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+        0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+        0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+        0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+        0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+        0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+        0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+        0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+        0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+        0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+        0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+        0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+        0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+        0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+        0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+        0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+        0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+        0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+        0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+        0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+        0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+        0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+        0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+        0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+        0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff
+};
+
+static const unsigned char huffman_lengths[257] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28,
+        28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28,
+        28, 28, 28, 28, 28, 28, 28, 28, 6, 10, 10, 12,
+        13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8,
+        15, 6, 12, 10, 13, 6, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7,
+        6, 6, 6, 5, 6, 7, 6, 5, 5, 6, 7, 7,
+        7, 7, 7, 15, 11, 14, 13, 28, 20, 22, 20, 20,
+        22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23,
+        22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21,
+        23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21,
+        23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27,
+        27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24,
+        21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20, 21,
+        22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27,
+        27, 27, 27, 26, 30
+};
+
+/*
+ * The Huffman codes as a binary tree, built on first use: the children
+ * of node n are tree[n][0] and tree[n][1], with negative numbers for the
+ * leaves (-1 - symbol) and 0 for a code which does not exist.
+ */
+static short huffman_tree[256][2];
+static unsigned int huffman_nodes = 0;
+
+static void build_huffman_tree (void)
+{
+        unsigned int sym, node;
+        int bit, len;
+
+        huffman_nodes = 1;
+        for (sym = 0; sym != 257; sym++) {
+                node = 0;
+                for (len = huffman_lengths[sym] - 1; len >= 0; len--) {
+                        bit = (huffman_codes[sym] >> len) & 1;
+                        if (len == 0) {
+                                huffman_tree[node][bit] = -1 - (short) sym;
+                        } else {
+                                if (huffman_tree[node][bit] == 0)
+                                        huffman_tree[node][bit] =
+                                            (short) huffman_nodes++;
+                                node = huffman_tree[node][bit];
+                        }
+                }
+        }
+}
+
+/*
+ * Decode a Huffman coded string into "out", which has room for "size"
+ * bytes.  The padding at the end must be the start of the code of the
+ * end of string, which may not appear otherwise.  Returns the length, or
+ * -1 if the string is malformed or too long.
+ */
+static ssize_t huffman_decode (const unsigned char *in, size_t len,
+                               char *out, size_t size)
+{
+        size_t i, n = 0;
+        unsigned int node = 0, padding = 0;
+        int bit, next;
+
+        if (huffman_nodes == 0)
+                build_huffman_tree ();
+
+        for (i = 0; i != len; i++) {
+                for (bit = 7; bit >= 0; bit--) {
+                        next = huffman_tree[node][(in[i] >> bit) & 1];
+                        padding = ((in[i] >> bit) & 1) ? padding + 1 : 8;
+
+                        if (next > 0) {
+                                node = next;
+                                continue;
+                        }
+                        if (next == 0 || next == -257 || n == size)
+                                return -1;
+
+                        out[n++] = (char) (-1 - next);
+                        node = 0;
+                        padding = 0;
+                }
+        }
+
+        /* Up to seven bits of ones only */
+        if (node != 0 && padding > 7)
+                return -1;
+
+        return n;
+}
+
+void hpack_init (struct hpack_table *table, size_t limit)
+{
+        memset (table, 0, sizeof (*table));
+        table->max_size = table->limit = limit;
+}
+
+static void free_entry (struct hpack_entry *entry)
+{
+        safefree (entry->name);
+        safefree (entry->value);
+        safefree (entry);
+}
+
+/*
+ * Drop the oldest entries until the table fits in "size".
+ */
+static void evict (struct hpack_table *table, size_t size)
+{
+        unsigned int n = 0;
+
+        while (n != table->count && table->size > size) {
+                table->size -= strlen (table->entries[n]->name)
+                    + strlen (table->entries[n]->value) + 32;
+                free_entry (table->entries[n++]);
+        }
+
+        table->count -= n;
+        memmove (table->entries, table->entries + n,
+                 table->count * sizeof (struct hpack_entry *));
+}
+
+void hpack_free (struct hpack_table *table)
+{
+        evict (table, 0);
+        safefree (table->entries);
+        table->count = 0;
+        table->size = 0;
+}
+
+/*
+ * Add a field to the dynamic table.  One larger than the whole table
+ * just empties it.
+ */
+static int add_entry (struct hpack_table *table, const char *name,
+                      const char *value)
+{
+        struct hpack_entry *entry, **entries;
+        size_t size = strlen (name) + strlen (value) + 32;
+
+        if (size > table->max_size) {
+                evict (table, 0);
+                return 0;
+        }
+        evict (table, table->max_size - size);
+
+        entries = (struct hpack_entry **)
+            saferealloc (table->entries,
+                         (table->count + 1) * sizeof (struct hpack_entry *));
+        if (!entries)
+                return -1;
+        table->entries = entries;
+
+        entry = (struct hpack_entry *) safemalloc (sizeof (struct hpack_entry));
+        if (!entry)
+                return -1;
+        entry->name = safestrdup (name);
+        entry->value = safestrdup (value);
+        if (!entry->name || !entry->value) {
+                free_entry (entry);
+                return -1;
+        }
+
+        table->entries[table->count++] = entry;
+        table->size += size;
+        return 0;
+}
+
+/*
+ * Look a field up by index, in the static table first and then in the
+ * dynamic one, from its newest entry on.
+ */
+static int get_entry (struct hpack_table *table, unsigned long index,
+                      const char **name, const char **value)
+{
+        if (index == 0)
+                return -1;
+
+        if (index <= STATIC_ENTRIES) {
+                *name = static_table[index - 1].name;
+                *value = static_table[index - 1].value;
+                return 0;
+        }
+
+        index -= STATIC_ENTRIES;
+        if (index > table->count)
+                return -1;
+
+        *name = table->entries[table->count - index]->name;
+        *value = table->entries[table->count - index]->value;
+        return 0;
+}
+
+/*
+ * Decode an integer with a prefix of "bits" bits in the first byte.
+ */
+static int decode_integer (const unsigned char **pos, const unsigned char *end,
+                           unsigned int bits, unsigned long *value)
+{
+        unsigned long mask = (1UL << bits) - 1;
+        unsigned int shift = 0;
+
+        if (*pos == end)
+                return -1;
+
+        *value = *(*pos)++ & mask;
+        if (*value < mask)
+                return 0;
+
+        do {
+                if (*pos == end || shift > 21)
+                        return -1;
+                *value += (unsigned long) (**pos & 0x7f) << shift;
+                shift += 7;
+        } while (*(*pos)++ & 0x80);
+
+        return 0;
+}
+
+/*
+ * Decode a string literal into a new string, to be freed.  A NUL byte in
+ * it, which would cut the string short, sets "nul".
+ */
+static char *decode_string (const unsigned char **pos,
+                            const unsigned char *end, unsigned int *nul)
+{
+        unsigned long len;
+        int huffman;
+        char *str;
+        ssize_t n;
+
+        if (*pos == end)
+                return NULL;
+        huffman = **pos & 0x80;
+
+        if (decode_integer (pos, end, 7, &len) < 0
+            || len > (unsigned long) (end - *pos))
+                return NULL;
+
+        if (!huffman) {
+                str = (char *) safemalloc (len + 1);
+                if (!str)
+                        return NULL;
+                memcpy (str, *pos, len);
+                str[len] = '\0';
+                n = (ssize_t) len;
+        } else {
+                /* The shortest code has five bits */
+                str = (char *) safemalloc (len * 8 / 5 + 1);
+                if (!str)
+                        return NULL;
+                n = huffman_decode (*pos, len, str, len * 8 / 5);
+                if (n < 0) {
+                        safefree (str);
+                        return NULL;
+                }
+                str[n] = '\0';
+        }
+
+        if (memchr (str, '\0', (size_t) n))
+                *nul = TRUE;
+
+        *pos += len;
+        return str;
+}
+
+int hpack_decode (struct hpack_table *table, const unsigned char *data,
+                  size_t len, hashmap_t headers)
+{
+        const unsigned char *pos = data, *end = data + len;
+        const char *name, *value;
+        char *newname, *newvalue;
+        unsigned long index;
+        unsigned int bits, nul = FALSE;
+        int ret;
+
+        while (pos != end) {
+                newname = newvalue = NULL;
+
+                if (*pos & 0x80) {
+                        /* An indexed field */
+                        if (decode_integer (&pos, end, 7, &index) < 0
+                            || get_entry (table, index, &name, &value) < 0)
+                                return -1;
+                        if (hashmap_insert (headers, name, value,
+                                            strlen (value) + 1) < 0)
+                                return -1;
+                        continue;
+                }
+
+                if ((*pos & 0xe0) == 0x20) {
+                        /* A change of the size of the table */
+                        if (decode_integer (&pos, end, 5, &index) < 0
+                            || index > table->limit)
+                                return -1;
+                        table->max_size = index;
+                        evict (table, index);
+                        continue;
+                }
+
+                /*
+                 * A literal field, which goes into the table if it
+                 * starts with 01, and not otherwise (0000 or 0001).
+                 */
+                bits = (*pos & 0x40) ? 6 : 4;
+                if (decode_integer (&pos, end, bits, &index) < 0)
+                        return -1;
+
+                if (index == 0) {
+                        name = newname = decode_string (&pos, end, &nul);
+                        if (!newname)
+                                return -1;
+                } else if (get_entry (table, index, &name, &value) < 0) {
+                        return -1;
+                } else if (bits == 6) {
+                        /* Adding the field may evict the entry named */
+                        name = newname = safestrdup (name);
+                        if (!newname)
+                                return -1;
+                }
+
+                value = newvalue = decode_string (&pos, end, &nul);
+                if (!newvalue) {
+                        safefree (newname);
+                        return -1;
+                }
+
+                ret = 0;
+                if (bits == 6)
+                        ret = add_entry (table, name, value);
+
+                /* The names must already be in lower case */
+                if (ret == 0)
+                        ret = hashmap_insert (headers, name, value,
+                                              strlen (value) + 1);
+
+                safefree (newname);
+                safefree (newvalue);
+                if (ret < 0)
+                        return -1;
+        }
+
+        return nul ? 1 : 0;
+}
+
+/*
+ * Make room for "len" more bytes in a block.
+ */
+static int grow_block (struct hpack_block *block, size_t len)
+{
+        unsigned char *data;
+        size_t size;
+
+        if (block->len + len <= block->size)
+                return 0;
+
+        size = block->size ? block->size : 256;
+        while (size < block->len + len)
+                size *= 2;
+
+        data = (unsigned char *) saferealloc (block->data, size);
+        if (!data)
+                return -1;
+
+        block->data = data;
+        block->size = size;
+        return 0;
+}
+
+/*
+ * Encode an integer with a prefix of "bits" bits, the other bits of the
+ * first byte being "flags".
+ */
+static int encode_integer (struct hpack_block *block, unsigned char flags,
+                           unsigned int bits, size_t value)
+{
+        size_t mask = ((size_t) 1 << bits) - 1;
+
+        if (grow_block (block, 1 + sizeof (size_t) * 8 / 7 + 1) < 0)
+                return -1;
+
+        if (value < mask) {
+                block->data[block->len++] = flags | (unsigned char) value;
+                return 0;
+        }
+
+        block->data[block->len++] = flags | (unsigned char) mask;
+        value -= mask;
+        while (value >= 0x80) {
+                block->data[block->len++] = (unsigned char) (value | 0x80);
+                value >>= 7;
+        }
+        block->data[block->len++] = (unsigned char) value;
+        return 0;
+}
+
+static int encode_string (struct hpack_block *block, const char *str,
+                          int lower)
+{
+        size_t i, len = strlen (str);
+
+        if (encode_integer (block, 0, 7, len) < 0
+            || grow_block (block, len) < 0)
+                return -1;
+
+        for (i = 0; i != len; i++)
+                block->data[block->len++] = lower ?
+                    (unsigned char) tolower ((unsigned char) str[i])
+                    : (unsigned char) str[i];
+        return 0;
+}
+
+int hpack_encode (struct hpack_block *block, const char *name,
+                  const char *value)
+{
+        size_t i, index = 0;
+
+        for (i = 0; i != STATIC_ENTRIES; i++) {
+                if (strcasecmp (static_table[i].name, name) != 0)
+                        continue;
+
+                if (strcmp (static_table[i].value, value) == 0)
+                        return encode_integer (block, 0x80, 7, i + 1);
+                if (index == 0)
+                        index = i + 1;
+        }
+
+        /* A literal field, which does not go into the table */
+        if (encode_integer (block, 0x00, 4, index) < 0
+            || (index == 0 && encode_string (block, name, TRUE) < 0))
+                return -1;
+
+        return encode_string (block, value, FALSE);
+}
+
+void hpack_block_free (struct hpack_block *block)
+{
+        safefree (block->data);
+        block->len = block->size = 0;
+}
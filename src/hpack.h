@@ -0,0 +1,75 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'hpack.c' for detailed information. */
+
+#ifndef TINYPROXY_HPACK_H
+#define TINYPROXY_HPACK_H
+
+#include "common.h"
+#include "hashmap.h"
+
+/* The size of the dynamic table both sides start with */
+#define HPACK_TABLE_SIZE 4096
+
+/*
+ * The dynamic table of a decoder, which the header blocks of the peer
+ * add to.
+ */
+struct hpack_entry;
+struct hpack_table {
+        struct hpack_entry **entries;   /* the oldest first */
+        unsigned int count;
+        size_t size;
+        size_t max_size;        /* set by the peer, up to "limit" */
+        size_t limit;           /* set by us */
+};
+
+/*
+ * An encoded header block, grown as header fields are added.
+ */
+struct hpack_block {
+        unsigned char *data;
+        size_t len;
+        size_t size;
+};
+
+extern void hpack_init (struct hpack_table *table, size_t limit);
+extern void hpack_free (struct hpack_table *table);
+
+/*
+ * Decode a complete header block into "headers", with the names in
+ * lower case and the pseudo-header fields (":status" and so on) kept
+ * under their names.  Returns 0, 1 if a field held a NUL byte (which is
+ * not an error of the compression, but leaves the field cut short), or
+ * -1 if the block is malformed, after which the table can not be used
+ * any more.
+ */
+extern int hpack_decode (struct hpack_table *table, const unsigned char *data,
+                         size_t len, hashmap_t headers);
+
+/*
+ * Add a header field to a block.  The encoder never adds to the dynamic
+ * table of the peer, so it needs none of its own.  Returns -1 if memory
+ * ran out.
+ */
+extern int hpack_encode (struct hpack_block *block, const char *name,
+                         const char *value);
+extern void hpack_block_free (struct hpack_block *block);
+
+#endif
@@ -0,0 +1,83 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The framing layer of HTTP/2 (RFC 9113), shared by the client in
+ * 'http2.c' and the server in 'http2-server.c'.
+ */
+
+#ifndef TINYPROXY_HTTP2_FRAME_H
+#define TINYPROXY_HTTP2_FRAME_H
+
+#define FRAME_DATA              0x0
+#define FRAME_HEADERS           0x1
+#define FRAME_RST_STREAM        0x3
+#define FRAME_SETTINGS          0x4
+#define FRAME_PUSH_PROMISE      0x5
+#define FRAME_PING              0x6
+#define FRAME_GOAWAY            0x7
+#define FRAME_WINDOW_UPDATE     0x8
+#define FRAME_CONTINUATION      0x9
+
+#define FLAG_END_STREAM         0x1
+#define FLAG_ACK                0x1
+#define FLAG_END_HEADERS        0x4
+#define FLAG_PADDED             0x8
+#define FLAG_PRIORITY           0x20
+
+#define SETTINGS_ENABLE_PUSH            0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define SETTINGS_MAX_FRAME_SIZE         0x5
+
+#define ERROR_NONE              0x0
+#define ERROR_PROTOCOL          0x1
+#define ERROR_INTERNAL          0x2
+#define ERROR_FLOW_CONTROL      0x3
+#define ERROR_STREAM_CLOSED     0x5
+#define ERROR_FRAME_SIZE        0x6
+#define ERROR_REFUSED_STREAM    0x7
+#define ERROR_CANCEL            0x8
+#define ERROR_COMPRESSION       0x9
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+#define FRAME_HEADER    9
+#define MAX_FRAME       16384   /* the default, which we do not raise */
+#define MAX_WINDOW      0x7fffffffL
+#define DEFAULT_WINDOW  65535L
+#define STREAM_WINDOW   (256L * 1024)
+#define SESSION_WINDOW  (1024L * 1024)
+#define INPUT_SIZE      (2 * (FRAME_HEADER + MAX_FRAME))
+
+/*
+ * Numbers are sent big-endian, in "bytes" bytes.
+ */
+extern void http2_put_uint (unsigned char *p, unsigned long value,
+                            unsigned int bytes);
+extern unsigned long http2_get_uint (const unsigned char *p,
+                                     unsigned int bytes);
+
+/*
+ * Strip the padding (and for HEADERS, the priority) from the payload of
+ * a DATA or HEADERS frame of that type.  Returns -1 if the frame is too
+ * short for them.
+ */
+extern int http2_unpad (unsigned int type, unsigned int flags,
+                        const unsigned char **payload, size_t *len);
+
+#endif
@@ -0,0 +1,1385 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* An HTTP/2 server for clients which speak it without TLS ("h2c", with
+ * prior knowledge), so that a client can have many requests in progress
+ * on one connection.
+ *
+ * A child serves one request at a time, writing the answer straight to
+ * the client socket, so each stream is given a process of its own: the
+ * child forks, and the new process serves the stream over a socket pair
+ * just as it would an HTTP/1.1 connection.  The child itself only
+ * translates between the two: the header blocks of the client become
+ * HTTP/1.1 requests, and the responses go back as HEADERS and DATA
+ * frames, within the flow control windows of the client.
+ */
+
+#include "main.h"
+
+#include "http2-server.h"
+#include "http2-frame.h"
+#include "http2.h"
+#include "hpack.h"
+#include "buffer.h"
+#include "chunked.h"
+#include "conf.h"
+#include "connpool.h"
+#include "heap.h"
+#include "log.h"
+#include "reqs.h"
+#include "sock.h"
+
+#define HEADER_BUCKETS  32
+
+/* Frames queued for the client, past which the responses wait */
+#define OUTPUT_LIMIT    (256L * 1024)
+
+/*
+ * A request of the client, and the process serving it.
+ */
+struct client_stream {
+        struct client_stream *next;
+        unsigned long id;
+        pid_t pid;
+        int fd;                         /* -1 once the process is done */
+
+        struct buffer_s *request;       /* not written to the process yet */
+        unsigned int chunked;           /* the request body is sent so */
+        unsigned int request_end;       /* the client's side is closed */
+        long recv_window;
+        size_t unacked;                 /* body passed on, not acknowledged */
+
+        char *head;                     /* the response header, being read */
+        size_t headlen;
+        unsigned int responded;         /* its final header was sent */
+        unsigned int no_body;           /* as for HEAD requests */
+        unsigned int response_chunked;
+        struct chunked_s chunks;
+
+        char data[MAX_FRAME];           /* of the response, not sent yet */
+        size_t datalen;
+        size_t dataoff;
+        long send_window;
+
+        unsigned int eof;               /* the response is all there */
+        unsigned int finished;          /* the stream is closed */
+};
+
+struct client_session {
+        int fd;
+        const char *peer_ipaddr;
+        const char *peer_string;
+        const char *sock_ipaddr;
+
+        struct buffer_s *out;           /* frames not written yet */
+        struct client_stream *streams;
+        unsigned int nstreams;
+        unsigned long last_id;
+
+        long send_window;
+        long initial_window;            /* set by the client */
+        size_t unacked;
+
+        unsigned int goaway;            /* no new streams */
+        unsigned int dead;              /* nothing more at all */
+
+        struct hpack_table decoder;
+
+        /* A header block being received, and its stream */
+        unsigned char *block;
+        size_t blocklen;
+        unsigned long block_id;
+        unsigned int block_end;
+
+        unsigned char *in;
+        size_t inlen;
+        unsigned int preface;           /* it has been read */
+};
+
+static int queue_frame (struct client_session *session, unsigned int type,
+                        unsigned int flags, unsigned long id,
+                        const void *payload, size_t len)
+{
+        unsigned char frame[FRAME_HEADER + MAX_FRAME];
+
+        assert (len <= MAX_FRAME);
+
+        http2_put_uint (frame, len, 3);
+        frame[3] = (unsigned char) type;
+        frame[4] = (unsigned char) flags;
+        http2_put_uint (frame + 5, id & MAX_WINDOW, 4);
+        if (len > 0)
+                memcpy (frame + FRAME_HEADER, payload, len);
+
+        if (add_to_buffer (session->out, frame, FRAME_HEADER + len) < 0) {
+                session->dead = TRUE;
+                return -1;
+        }
+
+        return 0;
+}
+
+static int queue_window_update (struct client_session *session,
+                                unsigned long id, size_t increment)
+{
+        unsigned char payload[4];
+
+        http2_put_uint (payload, increment, 4);
+        return queue_frame (session, FRAME_WINDOW_UPDATE, 0, id, payload, 4);
+}
+
+static int queue_rst_stream (struct client_session *session,
+                             unsigned long id, unsigned long error)
+{
+        unsigned char payload[4];
+
+        http2_put_uint (payload, error, 4);
+        return queue_frame (session, FRAME_RST_STREAM, 0, id, payload, 4);
+}
+
+/*
+ * Tell the client which streams were seen, and that no more will be.
+ * After an error that is the last thing it hears.
+ */
+static void queue_goaway (struct client_session *session, unsigned long error)
+{
+        unsigned char payload[8];
+
+        if (error != ERROR_NONE)
+                log_message (LOG_WARNING, "HTTP/2 error %lu on the "
+                             "connection from %s", error,
+                             session->peer_ipaddr);
+
+        http2_put_uint (payload, session->last_id, 4);
+        http2_put_uint (payload + 4, error, 4);
+        queue_frame (session, FRAME_GOAWAY, 0, 0, payload, 8);
+
+        session->goaway = TRUE;
+        if (error != ERROR_NONE)
+                session->dead = TRUE;
+}
+
+/*
+ * Send a header block, in CONTINUATION frames if it is large.
+ */
+static int queue_headers (struct client_session *session, unsigned long id,
+                          struct hpack_block *block, int end_stream)
+{
+        unsigned int type = FRAME_HEADERS, flags;
+        size_t offset = 0, len;
+
+        do {
+                len = block->len - offset;
+                if (len > MAX_FRAME)
+                        len = MAX_FRAME;
+
+                flags = 0;
+                if (type == FRAME_HEADERS && end_stream)
+                        flags |= FLAG_END_STREAM;
+                if (offset + len == block->len)
+                        flags |= FLAG_END_HEADERS;
+
+                if (queue_frame (session, type, flags, id,
+                                 block->data + offset, len) < 0)
+                        return -1;
+
+                offset += len;
+                type = FRAME_CONTINUATION;
+        } while (offset != block->len);
+
+        return 0;
+}
+
+static int add_text (struct buffer_s *buffptr, const char *text)
+{
+        return add_to_buffer (buffptr, (const unsigned char *) text,
+                              strlen (text));
+}
+
+/*
+ * The client has sent all of its request.
+ */
+static void end_request (struct client_stream *stream)
+{
+        stream->request_end = TRUE;
+        if (stream->chunked)
+                add_text (stream->request, "0\r\n\r\n");
+}
+
+static struct client_stream *find_stream (struct client_session *session,
+                                          unsigned long id)
+{
+        struct client_stream *stream;
+
+        for (stream = session->streams; stream; stream = stream->next)
+                if (stream->id == id)
+                        return stream;
+
+        return NULL;
+}
+
+/*
+ * Done with a stream, one way or the other.  Its process is left to
+ * notice on its own.
+ */
+static void finish_stream (struct client_session *session,
+                           struct client_stream *stream)
+{
+        if (stream->fd >= 0) {
+                close (stream->fd);
+                stream->fd = -1;
+        }
+
+        /* The client need not send the rest of its request */
+        if (!stream->request_end)
+                queue_rst_stream (session, stream->id, ERROR_NONE);
+
+        stream->request_end = TRUE;
+        stream->finished = TRUE;
+}
+
+static void reset_stream (struct client_session *session,
+                          struct client_stream *stream, unsigned long error)
+{
+        stream->request_end = TRUE;
+        queue_rst_stream (session, stream->id, error);
+        finish_stream (session, stream);
+}
+
+static void free_stream (struct client_stream *stream)
+{
+        if (stream->fd >= 0)
+                close (stream->fd);
+        if (stream->request)
+                delete_buffer (stream->request);
+        safefree (stream->head);
+        safefree (stream);
+}
+
+/*
+ * Send what the windows allow of the response body, and the end of the
+ * stream once it has all gone.
+ */
+static void flush_stream (struct client_session *session,
+                          struct client_stream *stream)
+{
+        long window;
+        size_t len;
+        unsigned int flags;
+
+        while (stream->datalen > 0 && !stream->finished) {
+                window = stream->send_window < session->send_window ?
+                    stream->send_window : session->send_window;
+                if (window <= 0)
+                        return;
+
+                len = stream->datalen;
+                if (len > (size_t) window)
+                        len = window;
+
+                flags = stream->eof && len == stream->datalen ?
+                    FLAG_END_STREAM : 0;
+                if (queue_frame (session, FRAME_DATA, flags, stream->id,
+                                 stream->data + stream->dataoff, len) < 0)
+                        return;
+
+                stream->send_window -= len;
+                session->send_window -= len;
+                stream->dataoff += len;
+                stream->datalen -= len;
+
+                if (flags)
+                        finish_stream (session, stream);
+        }
+
+        if (stream->eof && !stream->finished) {
+                queue_frame (session, FRAME_DATA, FLAG_END_STREAM,
+                             stream->id, NULL, 0);
+                finish_stream (session, stream);
+        }
+}
+
+static void flush_streams (struct client_session *session)
+{
+        struct client_stream *stream;
+
+        for (stream = session->streams; stream; stream = stream->next)
+                flush_stream (session, stream);
+}
+
+/*
+ * Turn the header of an HTTP/1.x response into a header block, without
+ * the fields which only concern the connection it came on.  Returns the
+ * status code, or -1 if the header is malformed.
+ */
+static int send_response_header (struct client_session *session,
+                                 struct client_stream *stream)
+{
+        static const char *skipheaders[] = {
+                "connection",
+                "keep-alive",
+                "proxy-connection",
+                "transfer-encoding",
+                "upgrade"
+        };
+        struct hpack_block block;
+        char *line, *next, *value, *end;
+        char status[4];
+        unsigned int major, minor, code, i;
+        int ret = -1;
+
+        memset (&block, 0, sizeof (block));
+
+        if (sscanf (stream->head, "HTTP/%u.%u %3u", &major, &minor,
+                    &code) != 3 || code < 100 || code > 999)
+                return -1;
+
+        snprintf (status, sizeof (status), "%u", code);
+        if (hpack_encode (&block, ":status", status) < 0)
+                goto done;
+
+        for (line = strchr (stream->head, '\n'); line; line = next) {
+                line++;
+                next = strchr (line, '\n');
+                if (next) {
+                        *next = '\0';
+                        if (next > line && next[-1] == '\r')
+                                next[-1] = '\0';
+                }
+
+                value = strchr (line, ':');
+                if (!value || value == line)
+                        continue;
+
+                end = value;
+                while (end > line && isspace ((unsigned char) end[-1]))
+                        end--;
+                *end = '\0';
+                for (value++; *value == ' ' || *value == '\t'; value++) ;
+
+                if (strcasecmp (line, "transfer-encoding") == 0
+                    && strstr (value, "chunked"))
+                        stream->response_chunked = TRUE;
+
+                for (i = 0; i != sizeof (skipheaders) / sizeof (char *); i++)
+                        if (strcasecmp (line, skipheaders[i]) == 0)
+                                break;
+
+                if (i == sizeof (skipheaders) / sizeof (char *)
+                    && hpack_encode (&block, line, value) < 0)
+                        goto done;
+        }
+
+        if (queue_headers (session, stream->id, &block, FALSE) < 0)
+                goto done;
+
+        if (code == 204 || code == 304)
+                stream->no_body = TRUE;
+        ret = code;
+
+done:
+        hpack_block_free (&block);
+        return ret;
+}
+
+/*
+ * Read the response of the process serving a stream.  More is only read
+ * once what came before has gone out.
+ */
+static void read_response (struct client_session *session,
+                           struct client_stream *stream)
+{
+        char buffer[MAX_FRAME];
+        char *data = buffer, *end, *head;
+        ssize_t len;
+        size_t n, payload;
+        int code;
+
+        len = recv (stream->fd, buffer, sizeof (buffer), 0);
+        if (len < 0 && (errno == EAGAIN || errno == EINTR))
+                return;
+
+        if (len <= 0) {
+                close (stream->fd);
+                stream->fd = -1;
+
+                /* The response was cut short */
+                if (!stream->responded
+                    || (stream->response_chunked && !stream->no_body
+                        && !chunked_done (&stream->chunks))) {
+                        reset_stream (session, stream, ERROR_INTERNAL);
+                        return;
+                }
+
+                stream->eof = TRUE;
+                flush_stream (session, stream);
+                return;
+        }
+
+        while (!stream->responded && len > 0) {
+                if (stream->headlen + len > MAXBUFFSIZE) {
+                        reset_stream (session, stream, ERROR_INTERNAL);
+                        return;
+                }
+
+                head = (char *) saferealloc (stream->head,
+                                             stream->headlen + len + 1);
+                if (!head) {
+                        reset_stream (session, stream, ERROR_INTERNAL);
+                        return;
+                }
+                memcpy (head + stream->headlen, data, len);
+                head[stream->headlen + len] = '\0';
+
+                end = strstr (head + (stream->headlen > 3 ?
+                                      stream->headlen - 3 : 0), "\r\n\r\n");
+                stream->head = head;
+                if (!end) {
+                        stream->headlen += len;
+                        return;
+                }
+
+                /* What follows the header belongs to the body */
+                n = end + 4 - head - stream->headlen;
+                data += n;
+                len -= n;
+                end[2] = '\0';
+
+                code = send_response_header (session, stream);
+                safefree (stream->head);
+                stream->headlen = 0;
+                if (code < 0) {
+                        reset_stream (session, stream, ERROR_INTERNAL);
+                        return;
+                }
+
+                /* Interim responses are passed on, and followed by more */
+                if (code >= 200)
+                        stream->responded = TRUE;
+        }
+
+        if (len == 0 || stream->no_body || stream->eof)
+                return;
+
+        payload = len;
+        if (stream->response_chunked) {
+                if (chunked_parse (&stream->chunks, data, len,
+                                   &payload) < 0) {
+                        reset_stream (session, stream, ERROR_INTERNAL);
+                        return;
+                }
+                if (chunked_done (&stream->chunks)) {
+                        close (stream->fd);
+                        stream->fd = -1;
+                        stream->eof = TRUE;
+                }
+        }
+
+        memcpy (stream->data, data, payload);
+        stream->datalen = payload;
+        stream->dataoff = 0;
+        flush_stream (session, stream);
+}
+
+/*
+ * Pass the request on to the process serving the stream, and give the
+ * client more room once the body it sent has gone.  What the process
+ * does not take any more (it answered without it) is dropped.
+ */
+static void write_request (struct client_session *session,
+                           struct client_stream *stream)
+{
+        ssize_t ret = -1;
+
+        while (stream->fd >= 0 && buffer_size (stream->request) > 0) {
+                ret = write_buffer (stream->fd, stream->request);
+                if (ret <= 0)
+                        break;
+        }
+
+        if (ret < 0 && buffer_size (stream->request) > 0) {
+                delete_buffer (stream->request);
+                stream->request = new_buffer ();
+                if (!stream->request) {
+                        reset_stream (session, stream, ERROR_INTERNAL);
+                        return;
+                }
+        }
+
+        if (!stream->request_end && stream->unacked >= STREAM_WINDOW / 2) {
+                queue_window_update (session, stream->id, stream->unacked);
+                stream->recv_window += stream->unacked;
+                stream->unacked = 0;
+        }
+}
+
+/*
+ * Check the fields of a request before any of them goes into HTTP/1.1
+ * text, where a line break or a space in the wrong place would start a
+ * header line or a request of the client's own (RFC 9113, 8.2.1).  The
+ * names must be lower case tokens, and the values must not break lines.
+ */
+static int valid_headers (hashmap_t headers)
+{
+        static const char *pseudo[] = {
+                ":method", ":scheme", ":authority", ":path"
+        };
+        char *name, *value, *p;
+        hashmap_iter iter;
+        unsigned int i;
+
+        iter = hashmap_first (headers);
+        for (; iter >= 0 && !hashmap_is_end (headers, iter); ++iter) {
+                hashmap_return_entry (headers, iter, &name, (void **) &value);
+
+                if (*name == ':') {
+                        for (i = 0; i != sizeof (pseudo) / sizeof (char *);
+                             i++)
+                                if (strcmp (name, pseudo[i]) == 0)
+                                        break;
+                        if (i == sizeof (pseudo) / sizeof (char *))
+                                return FALSE;
+
+                        /* These go into the request line */
+                        if (strchr (value, ' '))
+                                return FALSE;
+                } else if (*name == '\0') {
+                        return FALSE;
+                }
+
+                for (p = name + (*name == ':'); *p; p++)
+                        if (isupper ((unsigned char) *p)
+                            || (!isalnum ((unsigned char) *p)
+                                && !strchr ("!#$%&'*+-.^_`|~", *p)))
+                                return FALSE;
+
+                if (strpbrk (value, "\r\n"))
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+/*
+ * Write out an HTTP/1.1 request for the header block of a stream.  The
+ * URL is passed in origin form, as the client sent it, where tinyproxy
+ * can handle that (as a reverse or transparent proxy), and in absolute
+ * form otherwise.
+ */
+static int build_request (struct client_stream *stream, hashmap_t headers,
+                          int end_stream)
+{
+        static const char *skipheaders[] = {
+                "connection",
+                "keep-alive",
+                "proxy-connection",
+                "te",
+                "transfer-encoding",
+                "upgrade"
+        };
+        char *method = NULL, *scheme = NULL, *authority = NULL, *path = NULL;
+        char *name, *value, *text, *host;
+        hashmap_iter iter;
+        size_t size, pos;
+        unsigned int i, origin_form = FALSE;
+        int ret;
+
+        hashmap_entry_by_key (headers, ":method", (void **) &method);
+        hashmap_entry_by_key (headers, ":scheme", (void **) &scheme);
+        hashmap_entry_by_key (headers, ":authority", (void **) &authority);
+        hashmap_entry_by_key (headers, ":path", (void **) &path);
+
+        if (!method)
+                return -1;
+        if (strcmp (method, "CONNECT") == 0) {
+                if (!authority)
+                        return -1;
+        } else if (!scheme || !path || *path == '\0') {
+                return -1;
+        }
+
+        if (strcmp (method, "HEAD") == 0)
+                stream->no_body = TRUE;
+
+#ifdef REVERSE_SUPPORT
+        if (config.reversepath_list)
+                origin_form = TRUE;
+#endif
+#ifdef TRANSPARENT_PROXY
+        origin_form = TRUE;
+#endif
+        if (!authority)
+                origin_form = TRUE;
+
+        /* The size of it all, give or take a few bytes */
+        size = 128 + (authority ? strlen (authority) : 0);
+        iter = hashmap_first (headers);
+        for (; iter >= 0 && !hashmap_is_end (headers, iter); ++iter) {
+                hashmap_return_entry (headers, iter, &name, (void **) &value);
+                size += strlen (name) + strlen (value) + 4;
+        }
+
+        text = (char *) safemalloc (size);
+        if (!text)
+                return -1;
+
+        if (strcmp (method, "CONNECT") == 0)
+                pos = snprintf (text, size, "CONNECT %s HTTP/1.1\r\n",
+                                authority);
+        else if (origin_form)
+                pos = snprintf (text, size, "%s %s HTTP/1.1\r\n", method,
+                                path);
+        else
+                pos = snprintf (text, size, "%s %s://%s%s HTTP/1.1\r\n",
+                                method, scheme, authority, path);
+
+        if (authority
+            && hashmap_entry_by_key (headers, "host", (void **) &host) <= 0)
+                pos += snprintf (text + pos, size - pos, "Host: %s\r\n",
+                                 authority);
+
+        /* Cookies come in pieces, which go back on one line */
+        iter = hashmap_first (headers);
+        for (; iter >= 0 && !hashmap_is_end (headers, iter); ++iter) {
+                hashmap_return_entry (headers, iter, &name, (void **) &value);
+                if (strcmp (name, "cookie") != 0)
+                        continue;
+
+                pos += snprintf (text + pos, size - pos,
+                                 text[pos - 1] == '\n' ? "cookie: %s"
+                                 : "; %s", value);
+        }
+        if (text[pos - 1] != '\n')
+                pos += snprintf (text + pos, size - pos, "\r\n");
+
+        iter = hashmap_first (headers);
+        for (; iter >= 0 && !hashmap_is_end (headers, iter); ++iter) {
+                hashmap_return_entry (headers, iter, &name, (void **) &value);
+                if (*name == ':' || strcmp (name, "cookie") == 0)
+                        continue;
+
+                for (i = 0; i != sizeof (skipheaders) / sizeof (char *); i++)
+                        if (strcmp (name, skipheaders[i]) == 0)
+                                break;
+                if (i == sizeof (skipheaders) / sizeof (char *))
+                        pos += snprintf (text + pos, size - pos,
+                                         "%s: %s\r\n", name, value);
+        }
+
+        /* A body of unknown length is sent chunked, except for tunnels */
+        if (!end_stream && strcmp (method, "CONNECT") != 0
+            && hashmap_entry_by_key (headers, "content-length",
+                                     (void **) &value) <= 0) {
+                stream->chunked = TRUE;
+                pos += snprintf (text + pos, size - pos,
+                                 "Transfer-Encoding: chunked\r\n");
+        }
+
+        pos += snprintf (text + pos, size - pos, "Connection: close\r\n\r\n");
+
+        ret = add_text (stream->request, text);
+        safefree (text);
+        return ret;
+}
+
+/*
+ * Fork the process serving a stream.  It drops whatever the child holds
+ * for the connection and for the other streams.
+ */
+static int start_process (struct client_session *session,
+                          struct client_stream *stream)
+{
+        struct client_stream *other;
+        int fds[2];
+
+        if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+                log_message (LOG_ERR, "Could not create a socket pair for "
+                             "an HTTP/2 stream: %s", strerror (errno));
+                return -1;
+        }
+
+        if (fds[0] >= FD_SETSIZE) {
+                close (fds[0]);
+                close (fds[1]);
+                return -1;
+        }
+
+        stream->pid = fork ();
+        if (stream->pid < 0) {
+                log_message (LOG_ERR, "Could not fork for an HTTP/2 "
+                             "stream: %s", strerror (errno));
+                close (fds[0]);
+                close (fds[1]);
+                return -1;
+        }
+
+        if (stream->pid == 0) {
+                close (fds[0]);
+                close (session->fd);
+                for (other = session->streams; other; other = other->next)
+                        if (other->fd >= 0)
+                                close (other->fd);
+
+                connpool_forget ();
+                http2_forget ();
+
+                serve_client (fds[1], session->peer_ipaddr,
+                              session->peer_string, session->sock_ipaddr);
+                exit (0);
+        }
+
+        close (fds[1]);
+        socket_nonblocking (fds[0]);
+        stream->fd = fds[0];
+        return 0;
+}
+
+static void start_stream (struct client_session *session, unsigned long id,
+                          hashmap_t headers, int end_stream)
+{
+        struct client_stream *stream;
+
+        if (session->goaway
+            || session->nstreams >= config.http2_max_streams) {
+                queue_rst_stream (session, id, ERROR_REFUSED_STREAM);
+                return;
+        }
+
+        stream = (struct client_stream *) safecalloc (1, sizeof (*stream));
+        if (!stream) {
+                queue_rst_stream (session, id, ERROR_REFUSED_STREAM);
+                return;
+        }
+
+        stream->id = id;
+        stream->fd = -1;
+        stream->recv_window = STREAM_WINDOW;
+        stream->send_window = session->initial_window;
+        stream->request_end = end_stream;
+        chunked_init (&stream->chunks);
+
+        stream->request = new_buffer ();
+        if (!stream->request) {
+                free_stream (stream);
+                queue_rst_stream (session, id, ERROR_REFUSED_STREAM);
+                return;
+        }
+
+        if (build_request (stream, headers, end_stream) < 0) {
+                free_stream (stream);
+                queue_rst_stream (session, id, ERROR_PROTOCOL);
+                return;
+        }
+
+        if (start_process (session, stream) < 0) {
+                free_stream (stream);
+                queue_rst_stream (session, id, ERROR_REFUSED_STREAM);
+                return;
+        }
+
+        stream->next = session->streams;
+        session->streams = stream;
+        session->nstreams++;
+}
+
+/*
+ * A complete header block has come: a new request, or the trailers of
+ * one, which are dropped.
+ */
+static int end_headers (struct client_session *session)
+{
+        struct client_stream *stream;
+        hashmap_t headers;
+        unsigned long id = session->block_id;
+        int malformed;
+
+        headers = hashmap_create (HEADER_BUCKETS);
+        if (!headers) {
+                queue_goaway (session, ERROR_INTERNAL);
+                return -1;
+        }
+
+        malformed = hpack_decode (&session->decoder, session->block,
+                                  session->blocklen, headers);
+        if (malformed < 0) {
+                hashmap_delete (headers);
+                queue_goaway (session, ERROR_COMPRESSION);
+                return -1;
+        }
+
+        session->block_id = 0;
+        session->blocklen = 0;
+
+        stream = find_stream (session, id);
+        if (stream) {
+                if (!session->block_end || stream->request_end
+                    || malformed) {
+                        reset_stream (session, stream, ERROR_PROTOCOL);
+                } else {
+                        end_request (stream);
+                }
+        } else if (id > session->last_id) {
+                session->last_id = id;
+                if (malformed || !valid_headers (headers))
+                        queue_rst_stream (session, id, ERROR_PROTOCOL);
+                else
+                        start_stream (session, id, headers,
+                                      session->block_end);
+        } else {
+                queue_rst_stream (session, id, ERROR_STREAM_CLOSED);
+        }
+
+        hashmap_delete (headers);
+        return 0;
+}
+
+static int add_block (struct client_session *session,
+                      const unsigned char *payload, size_t len)
+{
+        unsigned char *block;
+
+        /* As for HTTP/1.x headers, there is a limit */
+        if (session->blocklen + len > MAXBUFFSIZE) {
+                queue_goaway (session, ERROR_PROTOCOL);
+                return -1;
+        }
+
+        block = (unsigned char *) saferealloc (session->block,
+                                               session->blocklen + len + 1);
+        if (!block) {
+                queue_goaway (session, ERROR_INTERNAL);
+                return -1;
+        }
+
+        memcpy (block + session->blocklen, payload, len);
+        session->block = block;
+        session->blocklen += len;
+        return 0;
+}
+
+static int handle_data (struct client_session *session, unsigned int flags,
+                        unsigned long id, const unsigned char *payload,
+                        size_t len)
+{
+        struct client_stream *stream;
+        size_t datalen = len;
+        char size[32];
+
+        if (id == 0
+            || http2_unpad (FRAME_DATA, flags, &payload, &datalen) < 0) {
+                queue_goaway (session, ERROR_PROTOCOL);
+                return -1;
+        }
+
+        session->unacked += len;
+        if (session->unacked >= SESSION_WINDOW / 2) {
+                if (queue_window_update (session, 0, session->unacked) < 0)
+                        return -1;
+                session->unacked = 0;
+        }
+
+        stream = find_stream (session, id);
+        if (!stream) {
+                if (id > session->last_id) {
+                        queue_goaway (session, ERROR_PROTOCOL);
+                        return -1;
+                }
+                return 0;
+        }
+        if (stream->request_end) {
+                if (!stream->finished)
+                        reset_stream (session, stream, ERROR_STREAM_CLOSED);
+                return 0;
+        }
+
+        stream->recv_window -= len;
+        if (stream->recv_window < 0) {
+                reset_stream (session, stream, ERROR_FLOW_CONTROL);
+                return 0;
+        }
+        stream->unacked += len;
+
+        if (stream->chunked && datalen > 0) {
+                snprintf (size, sizeof (size), "%lx\r\n",
+                          (unsigned long) datalen);
+                add_text (stream->request, size);
+        }
+        if (datalen > 0)
+                add_to_buffer (stream->request, payload, datalen);
+        if (stream->chunked && datalen > 0)
+                add_text (stream->request, "\r\n");
+
+        if (flags & FLAG_END_STREAM)
+                end_request (stream);
+
+        /* Nobody reads it any more, but the client's window must stay open */
+        if (stream->fd < 0)
+                write_request (session, stream);
+
+        return 0;
+}
+
+static int handle_settings (struct client_session *session,
+                            unsigned int flags, unsigned long id,
+                            const unsigned char *payload, size_t len)
+{
+        struct client_stream *stream;
+        unsigned long setting, value;
+        size_t i;
+
+        if (id != 0 || (flags & FLAG_ACK ? len != 0 : len % 6 != 0)) {
+                queue_goaway (session, ERROR_PROTOCOL);
+                return -1;
+        }
+        if (flags & FLAG_ACK)
+                return 0;
+
+        for (i = 0; i != len; i += 6) {
+                setting = http2_get_uint (payload + i, 2);
+                value = http2_get_uint (payload + i + 2, 4);
+
+                switch (setting) {
+                case SETTINGS_INITIAL_WINDOW_SIZE:
+                        if (value > MAX_WINDOW) {
+                                queue_goaway (session, ERROR_FLOW_CONTROL);
+                                return -1;
+                        }
+                        for (stream = session->streams; stream;
+                             stream = stream->next)
+                                stream->send_window +=
+                                    (long) value - session->initial_window;
+                        session->initial_window = (long) value;
+                        break;
+
+                case SETTINGS_MAX_FRAME_SIZE:
+                        if (value < MAX_FRAME || value > 0xffffff) {
+                                queue_goaway (session, ERROR_PROTOCOL);
+                                return -1;
+                        }
+                        break;
+                }
+        }
+
+        return queue_frame (session, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static int handle_window_update (struct client_session *session,
+                                 unsigned long id,
+                                 const unsigned char *payload, size_t len)
+{
+        struct client_stream *stream;
+        unsigned long increment;
+
+        if (len != 4) {
+                queue_goaway (session, ERROR_FRAME_SIZE);
+                return -1;
+        }
+
+        increment = http2_get_uint (payload, 4) & MAX_WINDOW;
+        if (id == 0) {
+                if (increment == 0
+                    || session->send_window > MAX_WINDOW - (long) increment) {
+                        queue_goaway (session, ERROR_FLOW_CONTROL);
+                        return -1;
+                }
+                session->send_window += increment;
+                return 0;
+        }
+
+        stream = find_stream (session, id);
+        if (!stream || stream->finished)
+                return 0;
+
+        if (increment == 0
+            || stream->send_window > MAX_WINDOW - (long) increment) {
+                reset_stream (session, stream, ERROR_FLOW_CONTROL);
+                return 0;
+        }
+
+        stream->send_window += increment;
+        return 0;
+}
+
+/*
+ * Act on one frame of the client.
+ */
+static int handle_frame (struct client_session *session, unsigned int type,
+                         unsigned int flags, unsigned long id,
+                         const unsigned char *payload, size_t len)
+{
+        struct client_stream *stream;
+
+        /* Nothing may come between the frames of a header block */
+        if (session->block_id != 0 && type != FRAME_CONTINUATION) {
+                queue_goaway (session, ERROR_PROTOCOL);
+                return -1;
+        }
+
+        switch (type) {
+        case FRAME_DATA:
+                return handle_data (session, flags, id, payload, len);
+
+        case FRAME_HEADERS:
+                if (id == 0 || id % 2 == 0
+                    || http2_unpad (FRAME_HEADERS, flags, &payload,
+                                    &len) < 0) {
+                        queue_goaway (session, ERROR_PROTOCOL);
+                        return -1;
+                }
+
+                session->block_id = id;
+                session->block_end = flags & FLAG_END_STREAM;
+                if (add_block (session, payload, len) < 0)
+                        return -1;
+                return flags & FLAG_END_HEADERS ? end_headers (session) : 0;
+
+        case FRAME_CONTINUATION:
+                if (id == 0 || id != session->block_id) {
+                        queue_goaway (session, ERROR_PROTOCOL);
+                        return -1;
+                }
+
+                if (add_block (session, payload, len) < 0)
+                        return -1;
+                return flags & FLAG_END_HEADERS ? end_headers (session) : 0;
+
+        case FRAME_RST_STREAM:
+                if (len != 4) {
+                        queue_goaway (session, ERROR_FRAME_SIZE);
+                        return -1;
+                }
+
+                stream = find_stream (session, id);
+                if (stream && !stream->finished) {
+                        stream->request_end = TRUE;
+                        finish_stream (session, stream);
+                }
+                return 0;
+
+        case FRAME_SETTINGS:
+                return handle_settings (session, flags, id, payload, len);
+
+        case FRAME_PUSH_PROMISE:
+                /* Only servers push */
+                queue_goaway (session, ERROR_PROTOCOL);
+                return -1;
+
+        case FRAME_PING:
+                if (len != 8 || id != 0) {
+                        queue_goaway (session, ERROR_PROTOCOL);
+                        return -1;
+                }
+                if (flags & FLAG_ACK)
+                        return 0;
+                return queue_frame (session, FRAME_PING, FLAG_ACK, 0,
+                                    payload, 8);
+
+        case FRAME_GOAWAY:
+                /* The streams already open are still answered */
+                session->goaway = TRUE;
+                return 0;
+
+        case FRAME_WINDOW_UPDATE:
+                return handle_window_update (session, id, payload, len);
+
+        default:
+                /* PRIORITY, and the types unknown to us */
+                return 0;
+        }
+}
+
+/*
+ * Read what the client sent, and handle the complete frames in it.
+ */
+static void read_frames (struct client_session *session)
+{
+        const unsigned char *frame;
+        size_t pos = 0, len, preface = strlen (PREFACE);
+        ssize_t ret;
+
+        ret = recv (session->fd, session->in + session->inlen,
+                    INPUT_SIZE - session->inlen, 0);
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+                return;
+        if (ret <= 0) {
+                session->dead = TRUE;
+                return;
+        }
+        session->inlen += ret;
+
+        if (!session->preface) {
+                if (session->inlen < preface)
+                        return;
+                if (memcmp (session->in, PREFACE, preface) != 0) {
+                        queue_goaway (session, ERROR_PROTOCOL);
+                        return;
+                }
+                session->preface = TRUE;
+                pos = preface;
+        }
+
+        while (!session->dead && session->inlen - pos >= FRAME_HEADER) {
+                frame = session->in + pos;
+                len = http2_get_uint (frame, 3);
+                if (len > MAX_FRAME) {
+                        queue_goaway (session, ERROR_FRAME_SIZE);
+                        return;
+                }
+                if (session->inlen - pos < FRAME_HEADER + len)
+                        break;
+
+                pos += FRAME_HEADER + len;
+                handle_frame (session, frame[3], frame[4],
+                              http2_get_uint (frame + 5, 4) & MAX_WINDOW,
+                              frame + FRAME_HEADER, len);
+        }
+
+        memmove (session->in, session->in + pos, session->inlen - pos);
+        session->inlen -= pos;
+}
+
+/*
+ * Write out the frames queued for the client.  Returns -1 if it is gone.
+ */
+static int write_frames (struct client_session *session)
+{
+        ssize_t ret;
+
+        while (buffer_size (session->out) > 0) {
+                ret = write_buffer (session->fd, session->out);
+                if (ret < 0)
+                        return -1;
+                if (ret == 0)
+                        break;
+        }
+
+        return 0;
+}
+
+/*
+ * Forget the streams which are done with, and the processes which served
+ * them.
+ */
+static void reap_streams (struct client_session *session)
+{
+        struct client_stream **ptr = &session->streams, *stream;
+
+        while (*ptr) {
+                stream = *ptr;
+                if (stream->finished) {
+                        *ptr = stream->next;
+                        free_stream (stream);
+                        session->nstreams--;
+                } else {
+                        ptr = &stream->next;
+                }
+        }
+
+        while (waitpid (-1, NULL, WNOHANG) > 0) ;
+}
+
+int http2_preface (int fd)
+{
+        char buffer[sizeof (PREFACE) - 1];
+        fd_set rset;
+        struct timeval tv;
+        ssize_t len;
+        int ret;
+
+        do {
+                FD_ZERO (&rset);
+                FD_SET (fd, &rset);
+                tv.tv_sec = config.idletimeout;
+                tv.tv_usec = 0;
+
+                ret = select (fd + 1, &rset, NULL, NULL, &tv);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret <= 0)
+                return FALSE;
+
+        len = recv (fd, buffer, sizeof (buffer), MSG_PEEK);
+        if (len <= 0 || memcmp (buffer, PREFACE, len) != 0)
+                return FALSE;
+
+        /* Only the start of it came, wait for the rest */
+        if ((size_t) len < sizeof (buffer)) {
+                tv.tv_sec = config.idletimeout;
+                tv.tv_usec = 0;
+                setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+                len = recv (fd, buffer, sizeof (buffer),
+                            MSG_PEEK | MSG_WAITALL);
+
+                tv.tv_sec = 0;
+                setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+        }
+
+        return len == sizeof (buffer)
+            && memcmp (buffer, PREFACE, sizeof (buffer)) == 0;
+}
+
+void http2_serve (int fd, const char *peer_ipaddr, const char *peer_string,
+                  const char *sock_ipaddr)
+{
+        struct client_session session;
+        struct client_stream *stream;
+        unsigned char settings[12];
+        fd_set rset, wset;
+        struct timeval tv;
+        int maxfd, ret;
+
+        memset (&session, 0, sizeof (session));
+        session.fd = fd;
+        session.peer_ipaddr = peer_ipaddr;
+        session.peer_string = peer_string;
+        session.sock_ipaddr = sock_ipaddr;
+        session.send_window = DEFAULT_WINDOW;
+        session.initial_window = DEFAULT_WINDOW;
+        hpack_init (&session.decoder, HPACK_TABLE_SIZE);
+
+        session.out = new_buffer ();
+        session.in = (unsigned char *) safemalloc (INPUT_SIZE);
+        if (!session.out || !session.in)
+                goto done;
+
+        log_message (LOG_CONN, "HTTP/2 connection from %s [%s] "
+                     "(file descriptor %d)", peer_string, peer_ipaddr, fd);
+
+        /*
+         * Our settings: as many streams as may be served at once, and
+         * larger windows than the default for them and the connection.
+         */
+        http2_put_uint (settings, SETTINGS_MAX_CONCURRENT_STREAMS, 2);
+        http2_put_uint (settings + 2, config.http2_max_streams, 4);
+        http2_put_uint (settings + 6, SETTINGS_INITIAL_WINDOW_SIZE, 2);
+        http2_put_uint (settings + 8, STREAM_WINDOW, 4);
+
+        if (queue_frame (&session, FRAME_SETTINGS, 0, 0, settings,
+                         sizeof (settings)) < 0
+            || queue_window_update (&session, 0,
+                                    SESSION_WINDOW - DEFAULT_WINDOW) < 0)
+                goto done;
+
+        socket_nonblocking (fd);
+#ifdef TCP_NODELAY
+        /*
+         * Frames are written as they are ready, many of them small, and
+         * must not wait for the acknowledgement of the ones before.
+         */
+        {
+                int on = 1;
+
+                setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+        }
+#endif
+
+        for (;;) {
+                reap_streams (&session);
+                if (session.dead
+                    || (session.goaway && session.nstreams == 0))
+                        break;
+
+                FD_ZERO (&rset);
+                FD_ZERO (&wset);
+                maxfd = fd;
+
+                FD_SET (fd, &rset);
+                if (buffer_size (session.out) > 0)
+                        FD_SET (fd, &wset);
+
+                for (stream = session.streams; stream; stream = stream->next) {
+                        if (stream->fd < 0)
+                                continue;
+
+                        if (stream->datalen == 0
+                            && buffer_size (session.out) < OUTPUT_LIMIT)
+                                FD_SET (stream->fd, &rset);
+                        if (buffer_size (stream->request) > 0)
+                                FD_SET (stream->fd, &wset);
+                        if (stream->fd > maxfd)
+                                maxfd = stream->fd;
+                }
+
+                tv.tv_sec = config.idletimeout;
+                tv.tv_usec = 0;
+
+                ret = select (maxfd + 1, &rset, &wset, NULL, &tv);
+                if (ret < 0 && errno == EINTR)
+                        continue;
+                if (ret < 0) {
+                        log_message (LOG_ERR, "http2_serve: select() error "
+                                     "\"%s\"", strerror (errno));
+                        break;
+                }
+
+                if (ret == 0) {
+                        /* Idle, or a client which does not read */
+                        if (session.nstreams == 0) {
+                                queue_goaway (&session, ERROR_NONE);
+                                break;
+                        }
+                        if (buffer_size (session.out) > 0)
+                                break;
+                        continue;
+                }
+
+                if (FD_ISSET (fd, &wset) && write_frames (&session) < 0)
+                        break;
+                if (FD_ISSET (fd, &rset))
+                        read_frames (&session);
+
+                for (stream = session.streams; stream; stream = stream->next) {
+                        if (stream->fd >= 0 && FD_ISSET (stream->fd, &wset))
+                                write_request (&session, stream);
+                        if (stream->fd >= 0 && FD_ISSET (stream->fd, &rset))
+                                read_response (&session, stream);
+                }
+
+                /* The windows may have opened */
+                flush_streams (&session);
+        }
+
+        /* The last frames, a GOAWAY among them, go out if they can */
+        while (buffer_size (session.out) > 0) {
+                FD_ZERO (&wset);
+                FD_SET (fd, &wset);
+                tv.tv_sec = config.idletimeout;
+                tv.tv_usec = 0;
+
+                if (select (fd + 1, NULL, &wset, NULL, &tv) <= 0
+                    || write_frames (&session) < 0)
+                        break;
+        }
+
+done:
+        while ((stream = session.streams) != NULL) {
+                session.streams = stream->next;
+                free_stream (stream);
+        }
+        while (waitpid (-1, NULL, 0) > 0 || errno == EINTR) ;
+
+        if (session.out)
+                delete_buffer (session.out);
+        hpack_free (&session.decoder);
+        safefree (session.block);
+        safefree (session.in);
+
+        log_message (LOG_CONN, "Closed HTTP/2 connection from %s [%s]",
+                     peer_string, peer_ipaddr);
+}
@@ -0,0 +1,37 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'http2-server.c' for detailed information. */
+
+#ifndef TINYPROXY_HTTP2_SERVER_H
+#define TINYPROXY_HTTP2_SERVER_H
+
+/*
+ * Wait for the first bytes of a client, and check whether they are the
+ * HTTP/2 connection preface.  Nothing is read from the socket.
+ */
+extern int http2_preface (int fd);
+
+/*
+ * Serve a client which speaks HTTP/2, until it goes away.  The socket is
+ * left for the caller to close.
+ */
+extern void http2_serve (int fd, const char *peer_ipaddr,
+                         const char *peer_string, const char *sock_ipaddr);
+
+#endif
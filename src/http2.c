@@ -0,0 +1,1024 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* An HTTP/2 client for servers spoken to without TLS ("h2c", with prior
+ * knowledge, RFC 9113), so that the requests of a child to a server share
+ * one connection, each on a stream of its own, instead of each needing a
+ * connection.
+ *
+ * A child does one thing at a time, so a connection is driven by
+ * whichever request is waiting on it: the frames read meanwhile are
+ * handled for all the streams, and the data of the others is kept until
+ * they are read, within the flow control windows we gave them.  The
+ * window of the connection itself is opened again as soon as the data
+ * arrives, so that a stream nobody reads yet can not hold up the others.
+ */
+
+#include "main.h"
+
+#include "http2.h"
+#include "http2-frame.h"
+#include "hpack.h"
+#include "conf.h"
+#include "connpool.h"
+#include "heap.h"
+#include "log.h"
+#include "network.h"
+#include "sock.h"
+#include "stats.h"
+
+#define HEADER_BUCKETS  32
+
+/*
+ * Response data received for a stream, and not read yet.
+ */
+struct http2_data {
+        struct http2_data *next;
+        char *data;
+        size_t len;
+        size_t offset;
+};
+
+struct http2_stream {
+        struct http2_stream *next;
+        struct http2_session *session;
+        unsigned long id;               /* 0 until the headers are sent */
+        struct hpack_block block;       /* the request headers */
+
+        long send_window;
+        long recv_window;
+        size_t unacked;                 /* read, but not acknowledged */
+
+        hashmap_t headers;              /* the response, until read */
+        struct http2_data *data, *last;
+
+        unsigned int responded;         /* the response headers came */
+        unsigned int sent_end;          /* our side is closed */
+        unsigned int ended;             /* the server's side is closed */
+        unsigned int reset;             /* or the stream failed */
+};
+
+struct http2_session {
+        struct http2_session *next;
+        char *key;
+        int fd;
+        time_t idle_since;
+
+        unsigned long next_id;
+        unsigned int nstreams;
+        struct http2_stream *streams;
+
+        /* Set by the server */
+        unsigned long max_streams;
+        long initial_window;
+        size_t max_frame;
+
+        long send_window;
+        size_t unacked;
+
+        unsigned int goaway;            /* no new streams */
+        unsigned int dead;              /* no streams at all */
+
+        struct hpack_table decoder;
+
+        /* A header block being received, and its stream */
+        unsigned char *block;
+        size_t blocklen;
+        unsigned long block_id;
+        unsigned int block_end;
+
+        unsigned char *in;
+        size_t inlen;
+        size_t inpos;
+};
+
+static struct http2_session *sessions = NULL;
+
+static void fail_session (struct http2_session *session, unsigned long error);
+
+void http2_put_uint (unsigned char *p, unsigned long value,
+                     unsigned int bytes)
+{
+        while (bytes-- > 0) {
+                p[bytes] = (unsigned char) (value & 0xff);
+                value >>= 8;
+        }
+}
+
+unsigned long http2_get_uint (const unsigned char *p, unsigned int bytes)
+{
+        unsigned long value = 0;
+
+        while (bytes-- > 0)
+                value = (value << 8) | *p++;
+
+        return value;
+}
+
+static int write_frame (struct http2_session *session, unsigned int type,
+                        unsigned int flags, unsigned long id,
+                        const void *payload, size_t len)
+{
+        unsigned char frame[FRAME_HEADER + MAX_FRAME];
+
+        assert (len <= MAX_FRAME);
+
+        if (session->dead)
+                return -1;
+
+        http2_put_uint (frame, len, 3);
+        frame[3] = (unsigned char) type;
+        frame[4] = (unsigned char) flags;
+        http2_put_uint (frame + 5, id & MAX_WINDOW, 4);
+        if (len > 0)
+                memcpy (frame + FRAME_HEADER, payload, len);
+
+        if (safe_write (session->fd, (char *) frame, FRAME_HEADER + len) < 0) {
+                log_message (LOG_WARNING, "Lost the HTTP/2 connection to %s",
+                             session->key);
+                fail_session (session, ERROR_NONE);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int send_window_update (struct http2_session *session,
+                               unsigned long id, size_t increment)
+{
+        unsigned char payload[4];
+
+        http2_put_uint (payload, increment, 4);
+        return write_frame (session, FRAME_WINDOW_UPDATE, 0, id, payload, 4);
+}
+
+static int send_rst_stream (struct http2_stream *stream, unsigned long error)
+{
+        unsigned char payload[4];
+
+        stream->reset = TRUE;
+        http2_put_uint (payload, error, 4);
+        return write_frame (stream->session, FRAME_RST_STREAM, 0, stream->id,
+                            payload, 4);
+}
+
+/*
+ * Give up on a connection after a protocol error, or when it is lost.
+ * All its streams fail.
+ */
+static void fail_session (struct http2_session *session, unsigned long error)
+{
+        unsigned char payload[8];
+        struct http2_stream *stream;
+
+        if (!session->dead && error != ERROR_NONE) {
+                log_message (LOG_WARNING, "HTTP/2 error %lu on the "
+                             "connection to %s", error, session->key);
+
+                http2_put_uint (payload, 0, 4);
+                http2_put_uint (payload + 4, error, 4);
+                write_frame (session, FRAME_GOAWAY, 0, 0, payload, 8);
+        }
+
+        session->dead = TRUE;
+        for (stream = session->streams; stream; stream = stream->next)
+                stream->reset = TRUE;
+}
+
+static void free_session (struct http2_session *session)
+{
+        struct http2_session **ptr;
+        unsigned char payload[8];
+
+        for (ptr = &sessions; *ptr; ptr = &(*ptr)->next) {
+                if (*ptr == session) {
+                        *ptr = session->next;
+                        break;
+                }
+        }
+
+        if (!session->dead) {
+                http2_put_uint (payload, 0, 4);
+                http2_put_uint (payload + 4, ERROR_NONE, 4);
+                write_frame (session, FRAME_GOAWAY, 0, 0, payload, 8);
+        }
+
+        close (session->fd);
+        hpack_free (&session->decoder);
+        safefree (session->block);
+        safefree (session->in);
+        safefree (session->key);
+        safefree (session);
+}
+
+static struct http2_stream *find_stream (struct http2_session *session,
+                                         unsigned long id)
+{
+        struct http2_stream *stream;
+
+        for (stream = session->streams; stream; stream = stream->next)
+                if (stream->id == id)
+                        return stream;
+
+        return NULL;
+}
+
+/*
+ * Have at least "need" bytes of input, waiting up to the idle timeout
+ * for them.
+ */
+static int fill_input (struct http2_session *session, size_t need)
+{
+        fd_set rset;
+        struct timeval tv;
+        ssize_t len;
+        int ret;
+
+        while (session->inlen - session->inpos < need) {
+                if (session->inpos > 0) {
+                        memmove (session->in, session->in + session->inpos,
+                                 session->inlen - session->inpos);
+                        session->inlen -= session->inpos;
+                        session->inpos = 0;
+                }
+
+                len = recv (session->fd, session->in + session->inlen,
+                            INPUT_SIZE - session->inlen, MSG_DONTWAIT);
+                if (len > 0) {
+                        session->inlen += len;
+                        continue;
+                }
+                if (len == 0 || (errno != EAGAIN && errno != EINTR))
+                        return -1;
+
+                FD_ZERO (&rset);
+                FD_SET (session->fd, &rset);
+                tv.tv_sec = config.idletimeout;
+                tv.tv_usec = 0;
+
+                ret = select (session->fd + 1, &rset, NULL, NULL, &tv);
+                if (ret == 0 || (ret < 0 && errno != EINTR))
+                        return -1;
+        }
+
+        return 0;
+}
+
+static int add_data (struct http2_stream *stream, const unsigned char *data,
+                     size_t len)
+{
+        struct http2_data *chunk;
+
+        chunk = (struct http2_data *) safecalloc (1, sizeof (*chunk));
+        if (!chunk)
+                return -1;
+
+        chunk->data = (char *) safemalloc (len);
+        if (!chunk->data) {
+                safefree (chunk);
+                return -1;
+        }
+        memcpy (chunk->data, data, len);
+        chunk->len = len;
+
+        if (stream->last)
+                stream->last->next = chunk;
+        else
+                stream->data = chunk;
+        stream->last = chunk;
+
+        return 0;
+}
+
+int http2_unpad (unsigned int type, unsigned int flags,
+                 const unsigned char **payload, size_t *len)
+{
+        size_t pad = 0;
+
+        if (flags & FLAG_PADDED) {
+                if (*len < 1)
+                        return -1;
+                pad = **payload;
+                (*payload)++;
+                (*len)--;
+        }
+
+        /* Only HEADERS frames carry a priority: others ignore the flag */
+        if (type == FRAME_HEADERS && (flags & FLAG_PRIORITY)) {
+                if (*len < 5)
+                        return -1;
+                *payload += 5;
+                *len -= 5;
+        }
+
+        if (pad > *len)
+                return -1;
+        *len -= pad;
+        return 0;
+}
+
+static int handle_data (struct http2_session *session, unsigned int flags,
+                        unsigned long id, const unsigned char *payload,
+                        size_t len)
+{
+        struct http2_stream *stream;
+        size_t datalen = len;
+
+        if (id == 0
+            || http2_unpad (FRAME_DATA, flags, &payload, &datalen) < 0) {
+                fail_session (session, ERROR_PROTOCOL);
+                return -1;
+        }
+
+        session->unacked += len;
+        if (session->unacked >= SESSION_WINDOW / 2) {
+                if (send_window_update (session, 0, session->unacked) < 0)
+                        return -1;
+                session->unacked = 0;
+        }
+
+        stream = find_stream (session, id);
+        if (!stream || stream->reset)
+                return 0;
+
+        stream->recv_window -= len;
+        if (stream->recv_window < 0 || !stream->responded) {
+                return send_rst_stream (stream, stream->responded ?
+                                        ERROR_FLOW_CONTROL : ERROR_PROTOCOL);
+        }
+
+        /* The padding counts as read at once */
+        stream->unacked += len - datalen;
+
+        if (datalen > 0 && add_data (stream, payload, datalen) < 0)
+                return send_rst_stream (stream, ERROR_INTERNAL);
+
+        if (flags & FLAG_END_STREAM)
+                stream->ended = TRUE;
+
+        return 0;
+}
+
+/*
+ * A complete header block has come: a response, an interim response
+ * (which we drop), or trailers (which we drop as well).  All of them go
+ * through the decoder, to keep its table in step with the server.
+ */
+static int end_headers (struct http2_session *session)
+{
+        struct http2_stream *stream;
+        hashmap_t headers;
+        char *status;
+        int ret;
+
+        headers = hashmap_create (HEADER_BUCKETS);
+        if (!headers) {
+                fail_session (session, ERROR_INTERNAL);
+                return -1;
+        }
+
+        ret = hpack_decode (&session->decoder, session->block,
+                            session->blocklen, headers);
+        if (ret < 0) {
+                hashmap_delete (headers);
+                fail_session (session, ERROR_COMPRESSION);
+                return -1;
+        }
+
+        stream = find_stream (session, session->block_id);
+        session->block_id = 0;
+        session->blocklen = 0;
+
+        if (!stream || stream->reset) {
+                hashmap_delete (headers);
+                return 0;
+        }
+
+        if (stream->responded
+            || (hashmap_entry_by_key (headers, ":status",
+                                      (void **) &status) > 0
+                && *status == '1' && !session->block_end)) {
+                hashmap_delete (headers);
+        } else {
+                stream->headers = headers;
+                stream->responded = TRUE;
+        }
+
+        if (session->block_end)
+                stream->ended = TRUE;
+
+        return 0;
+}
+
+static int add_block (struct http2_session *session,
+                      const unsigned char *payload, size_t len)
+{
+        unsigned char *block;
+
+        /* As for HTTP/1.x headers, there is a limit */
+        if (session->blocklen + len > MAXBUFFSIZE) {
+                fail_session (session, ERROR_PROTOCOL);
+                return -1;
+        }
+
+        block = (unsigned char *) saferealloc (session->block,
+                                               session->blocklen + len + 1);
+        if (!block) {
+                fail_session (session, ERROR_INTERNAL);
+                return -1;
+        }
+
+        memcpy (block + session->blocklen, payload, len);
+        session->block = block;
+        session->blocklen += len;
+        return 0;
+}
+
+static int handle_settings (struct http2_session *session,
+                            unsigned int flags, unsigned long id,
+                            const unsigned char *payload, size_t len)
+{
+        struct http2_stream *stream;
+        unsigned long setting, value;
+        size_t i;
+
+        if (id != 0 || (flags & FLAG_ACK ? len != 0 : len % 6 != 0)) {
+                fail_session (session, ERROR_PROTOCOL);
+                return -1;
+        }
+        if (flags & FLAG_ACK)
+                return 0;
+
+        for (i = 0; i != len; i += 6) {
+                setting = http2_get_uint (payload + i, 2);
+                value = http2_get_uint (payload + i + 2, 4);
+
+                switch (setting) {
+                case SETTINGS_MAX_CONCURRENT_STREAMS:
+                        session->max_streams = value;
+                        break;
+
+                case SETTINGS_INITIAL_WINDOW_SIZE:
+                        if (value > MAX_WINDOW) {
+                                fail_session (session, ERROR_FLOW_CONTROL);
+                                return -1;
+                        }
+                        for (stream = session->streams; stream;
+                             stream = stream->next)
+                                stream->send_window +=
+                                    (long) value - session->initial_window;
+                        session->initial_window = (long) value;
+                        break;
+
+                case SETTINGS_MAX_FRAME_SIZE:
+                        if (value < MAX_FRAME || value > 0xffffff) {
+                                fail_session (session, ERROR_PROTOCOL);
+                                return -1;
+                        }
+                        break;
+                }
+        }
+
+        return write_frame (session, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static int handle_goaway (struct http2_session *session,
+                          const unsigned char *payload, size_t len)
+{
+        struct http2_stream *stream;
+        unsigned long last_id;
+
+        if (len < 8) {
+                fail_session (session, ERROR_FRAME_SIZE);
+                return -1;
+        }
+
+        last_id = http2_get_uint (payload, 4) & MAX_WINDOW;
+        log_message (LOG_INFO, "HTTP/2 connection to %s going away "
+                     "(error %lu)", session->key,
+                     http2_get_uint (payload + 4, 4));
+
+        /* The streams after the last one were not processed at all */
+        session->goaway = TRUE;
+        for (stream = session->streams; stream; stream = stream->next)
+                if (stream->id > last_id)
+                        stream->reset = TRUE;
+
+        return 0;
+}
+
+static int handle_window_update (struct http2_session *session,
+                                 unsigned long id,
+                                 const unsigned char *payload, size_t len)
+{
+        struct http2_stream *stream;
+        unsigned long increment;
+
+        if (len != 4) {
+                fail_session (session, ERROR_FRAME_SIZE);
+                return -1;
+        }
+
+        increment = http2_get_uint (payload, 4) & MAX_WINDOW;
+        if (id == 0) {
+                if (increment == 0
+                    || session->send_window > MAX_WINDOW - (long) increment) {
+                        fail_session (session, ERROR_FLOW_CONTROL);
+                        return -1;
+                }
+                session->send_window += increment;
+                return 0;
+        }
+
+        stream = find_stream (session, id);
+        if (!stream || stream->reset)
+                return 0;
+
+        if (increment == 0
+            || stream->send_window > MAX_WINDOW - (long) increment)
+                return send_rst_stream (stream, ERROR_FLOW_CONTROL);
+
+        stream->send_window += increment;
+        return 0;
+}
+
+/*
+ * Read the next frame from the server and act on it.
+ */
+static int read_frame (struct http2_session *session)
+{
+        struct http2_stream *stream;
+        const unsigned char *payload;
+        unsigned int type, flags;
+        unsigned long id;
+        size_t len;
+
+        if (session->dead)
+                return -1;
+
+        if (fill_input (session, FRAME_HEADER) < 0)
+                goto lost;
+
+        payload = session->in + session->inpos;
+        len = http2_get_uint (payload, 3);
+        type = payload[3];
+        flags = payload[4];
+        id = http2_get_uint (payload + 5, 4) & MAX_WINDOW;
+
+        if (len > MAX_FRAME) {
+                fail_session (session, ERROR_FRAME_SIZE);
+                return -1;
+        }
+
+        if (fill_input (session, FRAME_HEADER + len) < 0)
+                goto lost;
+
+        payload = session->in + session->inpos + FRAME_HEADER;
+        session->inpos += FRAME_HEADER + len;
+
+        /* Nothing may come between the frames of a header block */
+        if (session->block_id != 0 && type != FRAME_CONTINUATION) {
+                fail_session (session, ERROR_PROTOCOL);
+                return -1;
+        }
+
+        switch (type) {
+        case FRAME_DATA:
+                return handle_data (session, flags, id, payload, len);
+
+        case FRAME_HEADERS:
+                if (id == 0
+                    || http2_unpad (FRAME_HEADERS, flags, &payload,
+                                    &len) < 0) {
+                        fail_session (session, ERROR_PROTOCOL);
+                        return -1;
+                }
+
+                session->block_id = id;
+                session->block_end = flags & FLAG_END_STREAM;
+                if (add_block (session, payload, len) < 0)
+                        return -1;
+                return flags & FLAG_END_HEADERS ? end_headers (session) : 0;
+
+        case FRAME_CONTINUATION:
+                if (id == 0 || id != session->block_id) {
+                        fail_session (session, ERROR_PROTOCOL);
+                        return -1;
+                }
+
+                if (add_block (session, payload, len) < 0)
+                        return -1;
+                return flags & FLAG_END_HEADERS ? end_headers (session) : 0;
+
+        case FRAME_RST_STREAM:
+                if (len != 4) {
+                        fail_session (session, ERROR_FRAME_SIZE);
+                        return -1;
+                }
+
+                stream = find_stream (session, id);
+                if (stream) {
+                        log_message (LOG_INFO, "HTTP/2 stream %lu to %s "
+                                     "reset (error %lu)", id, session->key,
+                                     http2_get_uint (payload, 4));
+                        stream->reset = TRUE;
+                }
+                return 0;
+
+        case FRAME_SETTINGS:
+                return handle_settings (session, flags, id, payload, len);
+
+        case FRAME_PUSH_PROMISE:
+                /* Turned off by our settings */
+                fail_session (session, ERROR_PROTOCOL);
+                return -1;
+
+        case FRAME_PING:
+                if (len != 8 || id != 0) {
+                        fail_session (session, ERROR_PROTOCOL);
+                        return -1;
+                }
+                if (flags & FLAG_ACK)
+                        return 0;
+                return write_frame (session, FRAME_PING, FLAG_ACK, 0,
+                                    payload, 8);
+
+        case FRAME_GOAWAY:
+                return handle_goaway (session, payload, len);
+
+        case FRAME_WINDOW_UPDATE:
+                return handle_window_update (session, id, payload, len);
+
+        default:
+                /* PRIORITY, and the types unknown to us */
+                return 0;
+        }
+
+lost:
+        log_message (LOG_WARNING, "Lost the HTTP/2 connection to %s",
+                     session->key);
+        fail_session (session, ERROR_NONE);
+        return -1;
+}
+
+/*
+ * Handle what the server sent to an idle connection (settings, pings,
+ * or its going away) before it is used again.
+ */
+static void poll_session (struct http2_session *session)
+{
+        char c;
+        ssize_t ret;
+
+        while (!session->dead) {
+                if (session->inlen == session->inpos) {
+                        ret = recv (session->fd, &c, 1,
+                                    MSG_PEEK | MSG_DONTWAIT);
+                        if (ret < 0 && errno == EAGAIN)
+                                break;
+                        if (ret <= 0) {
+                                fail_session (session, ERROR_NONE);
+                                break;
+                        }
+                }
+
+                read_frame (session);
+        }
+}
+
+/*
+ * Close the connections which are of no use any more, or which stayed
+ * idle for too long.
+ */
+static void expire_sessions (time_t now)
+{
+        struct http2_session *session, *next;
+
+        for (session = sessions; session; session = next) {
+                next = session->next;
+
+                if (session->nstreams == 0
+                    && (session->dead || session->goaway
+                        || difftime (now, session->idle_since)
+                        >= config.pool_idle_timeout))
+                        free_session (session);
+        }
+}
+
+static struct http2_session *open_session (const char *key, const char *host,
+                                           int port, const char *bind_to)
+{
+        struct http2_session *session;
+        unsigned char settings[12];
+        int fd;
+
+        fd = opensock (host, port, bind_to);
+        if (fd < 0)
+                return NULL;
+
+        session = (struct http2_session *) safecalloc (1, sizeof (*session));
+        if (!session) {
+                close (fd);
+                return NULL;
+        }
+
+        session->fd = fd;
+        session->key = safestrdup (key);
+        session->in = (unsigned char *) safemalloc (INPUT_SIZE);
+        session->next_id = 1;
+        session->max_streams = ~0UL;
+        session->initial_window = DEFAULT_WINDOW;
+        session->send_window = DEFAULT_WINDOW;
+        session->max_frame = MAX_FRAME;
+        session->idle_since = time (NULL);
+        hpack_init (&session->decoder, HPACK_TABLE_SIZE);
+
+        session->next = sessions;
+        sessions = session;
+
+        if (!session->key || !session->in) {
+                session->dead = TRUE;
+                return NULL;
+        }
+
+        /*
+         * The preface, and our settings: no pushed responses, and larger
+         * windows than the default for the streams and the connection.
+         */
+        http2_put_uint (settings, SETTINGS_ENABLE_PUSH, 2);
+        http2_put_uint (settings + 2, 0, 4);
+        http2_put_uint (settings + 6, SETTINGS_INITIAL_WINDOW_SIZE, 2);
+        http2_put_uint (settings + 8, STREAM_WINDOW, 4);
+
+        if (safe_write (fd, PREFACE, strlen (PREFACE)) < 0
+            || write_frame (session, FRAME_SETTINGS, 0, 0, settings,
+                            sizeof (settings)) < 0
+            || send_window_update (session, 0,
+                                   SESSION_WINDOW - DEFAULT_WINDOW) < 0) {
+                session->dead = TRUE;
+                return NULL;
+        }
+
+        log_message (LOG_CONN, "Opened HTTP/2 connection to %s "
+                     "(file descriptor %d)", key, fd);
+        return session;
+}
+
+struct http2_stream *http2_open (const char *host, int port,
+                                 const char *bind_to)
+{
+        struct http2_session *session;
+        struct http2_stream *stream;
+        char *key;
+
+        key = connpool_key (host, port, bind_to);
+        if (!key)
+                return NULL;
+
+        expire_sessions (time (NULL));
+
+        for (session = sessions; session; session = session->next) {
+                if (strcmp (session->key, key) != 0
+                    || session->nstreams >= session->max_streams)
+                        continue;
+
+                if (session->nstreams == 0)
+                        poll_session (session);
+                if (!session->dead && !session->goaway)
+                        break;
+        }
+
+        if (session) {
+                update_stats (STAT_POOL_HIT);
+        } else {
+                update_stats (STAT_POOL_MISS);
+                session = open_session (key, host, port, bind_to);
+        }
+        safefree (key);
+
+        if (!session)
+                return NULL;
+
+        stream = (struct http2_stream *) safecalloc (1, sizeof (*stream));
+        if (!stream)
+                return NULL;
+
+        stream->session = session;
+        stream->send_window = session->initial_window;
+        stream->recv_window = STREAM_WINDOW;
+
+        stream->next = session->streams;
+        session->streams = stream;
+        session->nstreams++;
+
+        return stream;
+}
+
+int http2_fd (struct http2_stream *stream)
+{
+        return stream->session->fd;
+}
+
+int http2_add_header (struct http2_stream *stream, const char *name,
+                      const char *value)
+{
+        return hpack_encode (&stream->block, name, value);
+}
+
+int http2_send_headers (struct http2_stream *stream, int end_stream)
+{
+        struct http2_session *session = stream->session;
+        unsigned int type = FRAME_HEADERS, flags;
+        size_t offset = 0, len;
+
+        if (session->dead || session->goaway)
+                return -1;
+
+        stream->id = session->next_id;
+        session->next_id += 2;
+        if (session->next_id > (unsigned long) MAX_WINDOW)
+                session->goaway = TRUE;
+
+        /* A large block goes on in CONTINUATION frames */
+        do {
+                len = stream->block.len - offset;
+                if (len > session->max_frame)
+                        len = session->max_frame;
+
+                flags = 0;
+                if (type == FRAME_HEADERS && end_stream)
+                        flags |= FLAG_END_STREAM;
+                if (offset + len == stream->block.len)
+                        flags |= FLAG_END_HEADERS;
+
+                if (write_frame (session, type, flags, stream->id,
+                                 stream->block.data + offset, len) < 0)
+                        return -1;
+
+                offset += len;
+                type = FRAME_CONTINUATION;
+        } while (offset != stream->block.len);
+
+        stream->sent_end = end_stream;
+        hpack_block_free (&stream->block);
+        return 0;
+}
+
+int http2_write (struct http2_stream *stream, const char *data, size_t len,
+                 int end_stream)
+{
+        struct http2_session *session = stream->session;
+        long window;
+        size_t n;
+
+        while (len > 0 || (end_stream && !stream->sent_end)) {
+                if (stream->responded || stream->ended)
+                        return 1;
+                if (stream->reset)
+                        return -1;
+
+                window = stream->send_window < session->send_window ?
+                    stream->send_window : session->send_window;
+
+                /* Wait for the server to open the windows */
+                if (len > 0 && window <= 0) {
+                        if (read_frame (session) < 0)
+                                return -1;
+                        continue;
+                }
+
+                n = len;
+                if (n > session->max_frame)
+                        n = session->max_frame;
+                if (len > 0 && n > (size_t) window)
+                        n = window;
+
+                if (write_frame (session, FRAME_DATA,
+                                 end_stream && n == len ? FLAG_END_STREAM : 0,
+                                 stream->id, data, n) < 0)
+                        return -1;
+
+                stream->send_window -= n;
+                session->send_window -= n;
+                data += n;
+                len -= n;
+                if (end_stream && len == 0)
+                        stream->sent_end = TRUE;
+        }
+
+        return 0;
+}
+
+hashmap_t http2_read_headers (struct http2_stream *stream)
+{
+        hashmap_t headers;
+
+        while (!stream->headers) {
+                if (stream->reset || stream->ended
+                    || read_frame (stream->session) < 0)
+                        return NULL;
+        }
+
+        headers = stream->headers;
+        stream->headers = NULL;
+        return headers;
+}
+
+ssize_t http2_read (struct http2_stream *stream, char *buf, size_t len)
+{
+        struct http2_data *chunk;
+
+        while (!stream->data) {
+                if (stream->ended)
+                        return 0;
+                if (stream->reset || read_frame (stream->session) < 0)
+                        return -1;
+        }
+
+        chunk = stream->data;
+        if (len > chunk->len - chunk->offset)
+                len = chunk->len - chunk->offset;
+        memcpy (buf, chunk->data + chunk->offset, len);
+
+        chunk->offset += len;
+        if (chunk->offset == chunk->len) {
+                stream->data = chunk->next;
+                if (!stream->data)
+                        stream->last = NULL;
+                safefree (chunk->data);
+                safefree (chunk);
+        }
+
+        /* The server may send more once half the window was read */
+        stream->unacked += len;
+        if (!stream->ended && stream->unacked >= STREAM_WINDOW / 2) {
+                if (send_window_update (stream->session, stream->id,
+                                        stream->unacked) < 0)
+                        return -1;
+                stream->recv_window += stream->unacked;
+                stream->unacked = 0;
+        }
+
+        return len;
+}
+
+/*
+ * Forking happens between requests, so none of the streams are open:
+ * marked dead, the connections are closed without a GOAWAY frame.
+ */
+void http2_forget (void)
+{
+        while (sessions) {
+                sessions->dead = TRUE;
+                free_session (sessions);
+        }
+}
+
+void http2_close (struct http2_stream *stream)
+{
+        struct http2_session *session = stream->session;
+        struct http2_stream **ptr;
+        struct http2_data *chunk;
+
+        /* The rest of the response is not wanted */
+        if (stream->id != 0 && !stream->reset
+            && !(stream->ended && stream->sent_end))
+                send_rst_stream (stream, ERROR_CANCEL);
+
+        while ((chunk = stream->data) != NULL) {
+                stream->data = chunk->next;
+                safefree (chunk->data);
+                safefree (chunk);
+        }
+        if (stream->headers)
+                hashmap_delete (stream->headers);
+        hpack_block_free (&stream->block);
+
+        for (ptr = &session->streams; *ptr; ptr = &(*ptr)->next) {
+                if (*ptr == stream) {
+                        *ptr = stream->next;
+                        break;
+                }
+        }
+        safefree (stream);
+
+        session->nstreams--;
+        session->idle_since = time (NULL);
+        if (session->nstreams == 0 && (session->dead || session->goaway))
+                free_session (session);
+}
@@ -0,0 +1,78 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'http2.c' for detailed information. */
+
+#ifndef TINYPROXY_HTTP2_H
+#define TINYPROXY_HTTP2_H
+
+#include "common.h"
+#include "hashmap.h"
+
+/* Forward declaration */
+struct http2_stream;
+
+/*
+ * Open a stream on a connection to a server, reusing one of the child
+ * if it has room for more streams.  Returns NULL if no connection could
+ * be made.
+ */
+extern struct http2_stream *http2_open (const char *host, int port,
+                                        const char *bind_to);
+extern int http2_fd (struct http2_stream *stream);
+
+/*
+ * Build the header block of a request, field by field, and send it.
+ * With "end_stream" set the request has no body, otherwise it is sent
+ * with http2_write(), which returns 0 once all of "data" was sent, 1 if
+ * the server answered (or turned the body down) first, or -1 if the
+ * stream failed.
+ */
+extern int http2_add_header (struct http2_stream *stream, const char *name,
+                             const char *value);
+extern int http2_send_headers (struct http2_stream *stream, int end_stream);
+extern int http2_write (struct http2_stream *stream, const char *data,
+                        size_t len, int end_stream);
+
+/*
+ * Wait for the final response of the server.  Returns its header fields,
+ * ":status" included, in a hashmap to be deleted by the caller, or NULL
+ * if the stream failed.
+ */
+extern hashmap_t http2_read_headers (struct http2_stream *stream);
+
+/*
+ * Read some of the response body.  Returns the number of bytes read, 0
+ * at its end, or -1 if the stream failed.
+ */
+extern ssize_t http2_read (struct http2_stream *stream, char *buf,
+                           size_t len);
+
+/*
+ * Done with a stream, which is cancelled if the response is not
+ * complete.
+ */
+extern void http2_close (struct http2_stream *stream);
+
+/*
+ * Drop the connections inherited by a process forked off a child,
+ * without a word to the servers.
+ */
+extern void http2_forget (void);
+
+#endif
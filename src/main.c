@@ -33,14 +33,18 @@
 
 #include "anonymous.h"
 #include "authors.h"
+#include "balancer.h"
 #include "buffer.h"
+#include "cache.h"
 #include "conf.h"
 #include "daemon.h"
+#include "dns.h"
 #include "heap.h"
 #include "filter.h"
 #include "child.h"
 #include "log.h"
 #include "reqs.h"
+#include "shared-lock.h"
 #include "sock.h"
 #include "stats.h"
 #include "utils.h"
@@ -345,6 +349,20 @@ static void initialize_config_defaults (struct config_s *conf)
         conf->errorpages = NULL;
         conf->stathost = safestrdup (TINYPROXY_STATHOST);
         conf->idletimeout = MAX_IDLE_TIME;
+        conf->connect_timeout = 10;
+        conf->health_check_timeout = 2;
+        conf->max_fails = 1;
+        conf->fail_timeout = 10;
+        conf->keepalive_timeout = 15;
+        conf->max_keepalive_requests = 100;
+        conf->pipeline_depth = 1;
+        conf->upgrade_idle_timeout = 3600;
+        conf->http2_max_streams = 100;
+        conf->pool_idle_timeout = 10;
+        conf->cache_max_object = 1024;
+        conf->cache_disk_size = 1048576;
+        conf->cache_collapse_timeout = 5;
+        conf->spool_size = 102400;
         conf->logf_name = safestrdup (LOCALSTATEDIR "/log/tinyproxy/tinyproxy.log");
         conf->pidpath = safestrdup (LOCALSTATEDIR "/run/tinyproxy/tinyproxy.pid");
 }
@@ -366,6 +384,7 @@ int reload_config (void)
         }
 
         ret = setup_logging ();
+        dns_configure ();
 
 done:
         return ret;
@@ -395,6 +414,9 @@ main (int argc, char **argv)
         }
 
         init_stats ();
+        shared_lock_init ();
+        balancer_init ();
+        dns_init ();
 
         /* If ANONYMOUS is turned on, make sure that Content-Length is
          * in the list of allowed headers, since it is required in a
@@ -447,6 +469,13 @@ main (int argc, char **argv)
                 }
         }
 
+        /* After dropping privileges, so that the cache files are ours */
+        if (cache_init () < 0) {
+                fprintf (stderr, "%s: Could not set up the cache.\n",
+                         argv[0]);
+                exit (EX_SOFTWARE);
+        }
+
         if (child_pool_create () < 0) {
                 fprintf (stderr,
                          "%s: Could not create the pool of children.\n",
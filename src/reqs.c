@@ -30,11 +30,15 @@
 #include "acl.h"
 #include "anonymous.h"
 #include "buffer.h"
+#include "cache.h"
 #include "conns.h"
+#include "connpool.h"
 #include "filter.h"
 #include "hashmap.h"
 #include "heap.h"
 #include "html-error.h"
+#include "http2.h"
+#include "http2-server.h"
 #include "log.h"
 #include "network.h"
 #include "reqs.h"
@@ -54,6 +58,21 @@
  */
 #define HTTP_LINE_LENGTH (MAXBUFFSIZE / 6)
 
+/*
+ * Largest number of requests from one client in progress at once
+ */
+#define MAX_PIPELINE_DEPTH 16
+
+/*
+ * Data in flight each way through a tunnel (what a pipe holds by default)
+ */
+#define TUNNEL_SIZE (64 * 1024)
+
+/*
+ * Microseconds between looks at a status line which is still arriving
+ */
+#define STATUS_POLL 10000
+
 /*
  * Macro to help test if the Upstream proxy supported is compiled in and
  * enabled.
@@ -120,7 +139,7 @@ retry:
 /*
  * Free all the memory allocated in a request.
  */
-static void free_request_struct (struct request_s *request)
+void free_request_struct (struct request_s *request)
 {
         if (!request)
                 return;
@@ -269,9 +288,16 @@ establish_http_connection (struct conn_s *connptr, struct request_s *request)
 {
         char portbuff[7];
         char dst[sizeof(struct in6_addr)];
+        const char *connection = connptr->upgrade ? "upgrade"
+            : connptr->server_keepalive ? "keep-alive" : "close";
+
+        /* A server on a unix domain socket has no name of its own */
+        const char *host = *request->host == '/' ?
+            "localhost" : request->host;
 
         /* Build a port string if it's not a standard port */
-        if (request->port != HTTP_PORT && request->port != HTTP_PORT_SSL)
+        if (request->port != HTTP_PORT && request->port != HTTP_PORT_SSL
+            && *request->host != '/')
                 snprintf (portbuff, 7, ":%u", request->port);
         else
                 portbuff[0] = '\0';
@@ -280,18 +306,18 @@ establish_http_connection (struct conn_s *connptr, struct request_s *request)
                 /* host is an IPv6 address literal, so surround it with
                  * [] */
                 return write_message (connptr->server_fd,
-                                      "%s %s HTTP/1.0\r\n"
+                                      "%s %s HTTP/1.1\r\n"
                                       "Host: [%s]%s\r\n"
-                                      "Connection: close\r\n",
+                                      "Connection: %s\r\n",
                                       request->method, request->path,
-                                      request->host, portbuff);
+                                      request->host, portbuff, connection);
         } else {
                 return write_message (connptr->server_fd,
-                                      "%s %s HTTP/1.0\r\n"
+                                      "%s %s HTTP/1.1\r\n"
                                       "Host: %s%s\r\n"
-                                      "Connection: close\r\n",
+                                      "Connection: %s\r\n",
                                       request->method, request->path,
-                                      request->host, portbuff);
+                                      host, portbuff, connection);
         }
 }
 
@@ -416,6 +442,16 @@ BAD_REQUEST_ERROR:
                                              "url", url, NULL);
                         goto fail;
                 }
+
+#ifdef REVERSE_SUPPORT
+                if (connptr->reverse_socket) {
+                        safefree (request->host);
+                        request->host = safestrdup (connptr->reverse_socket);
+                        request->port = 0;
+                        if (!request->host)
+                                goto fail;
+                }
+#endif
         } else if (strcmp (request->method, "CONNECT") == 0) {
                 if (extract_ssl_url (url, request) < 0) {
                         indicate_http_error (connptr, 400, "Bad Request",
@@ -766,25 +802,97 @@ static long get_content_length (hashmap_t hashofheaders)
 }
 
 /*
- * Search for Via header in a hash of headers and either write a new Via
- * header, or append our information to the end of an existing Via header.
+ * Check whether a message body is sent with the chunked transfer coding,
+ * which has to be the last one listed.
+ */
+static int is_chunked (hashmap_t hashofheaders)
+{
+        char *data, *last;
+        size_t len;
+
+        if (hashmap_entry_by_key (hashofheaders, "transfer-encoding",
+                                  (void **) &data) <= 0)
+                return FALSE;
+
+        last = strrchr (data, ',');
+        last = last ? last + 1 : data;
+        last += strspn (last, " \t");
+        len = strcspn (last, " \t;");
+
+        return len == 7 && strncasecmp (last, "chunked", 7) == 0;
+}
+
+/*
+ * Check whether the Connection (or Proxy-Connection) header lists a
+ * given token.
+ */
+static int connection_has_token (hashmap_t hashofheaders, const char *token)
+{
+        static const char *headers[] = {
+                "connection",
+                "proxy-connection"
+        };
+        size_t toklen = strlen (token);
+        char *data, *ptr;
+        size_t len;
+        int i;
+
+        for (i = 0; i != (sizeof (headers) / sizeof (char *)); ++i) {
+                if (hashmap_entry_by_key (hashofheaders, headers[i],
+                                          (void **) &data) <= 0)
+                        continue;
+
+                for (ptr = data; *ptr; ptr += len) {
+                        ptr += strspn (ptr, " \t,");
+                        len = strcspn (ptr, " \t,");
+                        if (len == toklen && strncasecmp (ptr, token, len) == 0)
+                                return TRUE;
+                }
+        }
+
+        return FALSE;
+}
+
+/*
+ * Decide whether the client connection can be kept open after this
+ * request: HTTP/1.1 clients expect it unless they ask for "close", while
+ * HTTP/1.0 clients have to ask for "keep-alive".  The request body must
+ * have a known length, so that the next request can be found.
+ */
+static int
+client_wants_keepalive (struct conn_s *connptr, hashmap_t hashofheaders)
+{
+        if (connptr->protocol.major != 1 || connptr->connect_method)
+                return FALSE;
+
+        if (get_content_length (hashofheaders) < 0
+            && hashmap_search (hashofheaders, "transfer-encoding") > 0
+            && !is_chunked (hashofheaders))
+                return FALSE;
+
+        if (connection_has_token (hashofheaders, "close"))
+                return FALSE;
+
+        return connptr->protocol.minor >= 1
+            || connection_has_token (hashofheaders, "keep-alive");
+}
+
+/*
+ * Search for Via header in a hash of headers and either make a new Via
+ * header, or append our information to the end of an existing Via header
+ * (which is removed from the hash).  Returns the value, to be freed, or
+ * NULL if memory ran out.
  *
  * FIXME: Need to add code to "hide" our internal information for security
  * purposes.
  */
-static int
-write_via_header (int fd, hashmap_t hashofheaders,
+static char *
+via_header_value (hashmap_t hashofheaders,
                   unsigned int major, unsigned int minor)
 {
-        ssize_t len;
         char hostname[512];
-        char *data;
-        int ret;
-
-        if (config.disable_viaheader) {
-                ret = 0;
-                goto done;
-        }
+        char *data, *via;
+        size_t len;
 
         if (config.via_proxy_name) {
                 strlcpy (hostname, config.via_proxy_name, sizeof (hostname));
@@ -792,25 +900,47 @@ write_via_header (int fd, hashmap_t hashofheaders,
                 strlcpy (hostname, "unknown", 512);
         }
 
-        /*
-         * See if there is a "Via" header.  If so, again we need to do a bit
-         * of processing.
-         */
-        len = hashmap_entry_by_key (hashofheaders, "via", (void **) &data);
-        if (len > 0) {
-                ret = write_message (fd,
-                                     "Via: %s, %hu.%hu %s (%s/%s)\r\n",
-                                     data, major, minor, hostname, PACKAGE,
-                                     VERSION);
+        len = strlen (hostname) + strlen (PACKAGE) + strlen (VERSION) + 32;
+        if (hashmap_entry_by_key (hashofheaders, "via", (void **) &data) > 0)
+                len += strlen (data) + 2;
+        else
+                data = NULL;
+
+        via = (char *) safemalloc (len);
+        if (!via)
+                return NULL;
 
+        if (data) {
+                snprintf (via, len, "%s, %u.%u %s (%s/%s)", data, major,
+                          minor, hostname, PACKAGE, VERSION);
                 hashmap_remove (hashofheaders, "via");
         } else {
-                ret = write_message (fd,
-                                     "Via: %hu.%hu %s (%s/%s)\r\n",
-                                     major, minor, hostname, PACKAGE, VERSION);
+                snprintf (via, len, "%u.%u %s (%s/%s)", major, minor,
+                          hostname, PACKAGE, VERSION);
         }
 
-done:
+        return via;
+}
+
+/*
+ * Send the Via header, unless it is disabled.
+ */
+static int
+write_via_header (int fd, hashmap_t hashofheaders,
+                  unsigned int major, unsigned int minor)
+{
+        char *via;
+        int ret;
+
+        if (config.disable_viaheader)
+                return 0;
+
+        via = via_header_value (hashofheaders, major, minor);
+        if (!via)
+                return -1;
+
+        ret = write_message (fd, "Via: %s\r\n", via);
+        safefree (via);
         return ret;
 }
 
@@ -819,6 +949,220 @@ done:
  */
 #define HEADER_BUCKETS 32
 
+/*
+ * Pass an interim (1xx) response from the server on to the client, or
+ * drop it if the client predates HTTP/1.1 and so does not expect any.
+ */
+static int
+relay_interim_response (struct conn_s *connptr, const char *response_line,
+                        hashmap_t hashofheaders)
+{
+        hashmap_iter iter;
+        char *data, *header;
+
+        if (connptr->protocol.major != 1 || connptr->protocol.minor == 0)
+                return 0;
+
+        remove_connection_headers (hashofheaders);
+        hashmap_remove (hashofheaders, "keep-alive");
+
+        if (write_message (connptr->client_fd, "%s\r\n", response_line) < 0)
+                return -1;
+
+        iter = hashmap_first (hashofheaders);
+        if (iter >= 0) {
+                for (; !hashmap_is_end (hashofheaders, iter); ++iter) {
+                        hashmap_return_entry (hashofheaders,
+                                              iter, &data, (void **) &header);
+
+                        if (write_message (connptr->client_fd, "%s: %s\r\n",
+                                           data, header) < 0)
+                                return -1;
+                }
+        }
+
+        return safe_write (connptr->client_fd, "\r\n", 2) < 0 ? -1 : 0;
+}
+
+/*
+ * Read an interim response from the server, and relay it.
+ */
+static int pass_interim_response (struct conn_s *connptr)
+{
+        char *response_line;
+        hashmap_t hashofheaders;
+        ssize_t len;
+        int ret = -1;
+
+        len = readline (connptr->server_fd, &response_line);
+        if (len <= 0)
+                return -1;
+        chomp (response_line, len);
+
+        hashofheaders = hashmap_create (HEADER_BUCKETS);
+        if (!hashofheaders)
+                goto done;
+
+        if (get_all_headers (connptr->server_fd, hashofheaders) >= 0)
+                ret = relay_interim_response (connptr, response_line,
+                                              hashofheaders);
+
+        hashmap_delete (hashofheaders);
+done:
+        safefree (response_line);
+        return ret;
+}
+
+/*
+ * Is part of the request body still to be read from the client?
+ */
+static int request_body_pending (struct conn_s *connptr)
+{
+        if (connptr->request_chunked)
+                return !chunked_done (&connptr->request_chunks);
+
+        return connptr->content_length.client > 0;
+}
+
+/*
+ * Has the server sent an interim (1xx) response?  Those do not stop
+ * the request body.  Returns 1 if it has, 0 if it is sending anything
+ * else, and -1 if the status code has not all arrived yet.
+ */
+static int server_sent_interim (int fd)
+{
+        char status[13];
+        ssize_t len;
+
+        len = recv (fd, status, sizeof (status) - 1, MSG_PEEK);
+        if (len <= 0)
+                return 0;       /* left for the response to deal with */
+        status[len] = '\0';
+
+        if (strncmp (status, "HTTP/1.", min (len, 7)) != 0
+            || memchr (status, '\n', len))
+                return 0;
+        if (len < (ssize_t) sizeof (status) - 1)
+                return -1;
+
+        return status[9] == '1' && strncmp (status + 9, "101", 3) != 0;
+}
+
+/*
+ * Pass the request body on to the server as it comes in, without
+ * blocking on either side, so that neither has to hold all of it.  This
+ * stops as soon as the server starts answering, since it may be refusing
+ * the body (with a "413 Request Entity Too Large", say).
+ *
+ * Returns 0 once all the body was sent, 1 if the server answered first,
+ * or -1 on errors.
+ */
+static int stream_request_body (struct conn_s *connptr)
+{
+        fd_set rset, wset;
+        struct timeval tv;
+        int maxfd = max (connptr->client_fd, connptr->server_fd) + 1;
+        time_t partial = 0;     /* since when a status line is arriving */
+        ssize_t len;
+        int ret = 0, n;
+
+        socket_nonblocking (connptr->client_fd);
+        socket_nonblocking (connptr->server_fd);
+
+        while (request_body_pending (connptr)
+               || buffer_size (connptr->cbuffer) > 0) {
+                FD_ZERO (&rset);
+                FD_ZERO (&wset);
+
+                /*
+                 * The start of a status line is readable until the rest
+                 * comes in, so it is looked at again after a while.
+                 */
+                if (!partial)
+                        FD_SET (connptr->server_fd, &rset);
+                if (buffer_size (connptr->cbuffer) > 0)
+                        FD_SET (connptr->server_fd, &wset);
+                if (request_body_pending (connptr)
+                    && buffer_size (connptr->cbuffer) < MAXBUFFSIZE)
+                        FD_SET (connptr->client_fd, &rset);
+
+                tv.tv_sec = partial ? 0 : config.idletimeout;
+                tv.tv_usec = partial ? STATUS_POLL : 0;
+
+                n = select (maxfd, &rset, &wset, NULL, &tv);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0 || (n == 0 && (!partial || time (NULL) - partial
+                                         >= (time_t) config.idletimeout))) {
+                        log_message (LOG_ERR,
+                                     "stream_request_body: %s while sending "
+                                     "the request body (client_fd:%d, "
+                                     "server_fd:%d)",
+                                     n == 0 ? "Idle timeout" : strerror (errno),
+                                     connptr->client_fd, connptr->server_fd);
+                        ret = -1;
+                        break;
+                }
+
+                if (partial || FD_ISSET (connptr->server_fd, &rset)) {
+                        n = server_sent_interim (connptr->server_fd);
+                        if (n == 0) {
+                                ret = 1;
+                                break;
+                        }
+                        if (n > 0) {
+                                /*
+                                 * Such as "100 Continue", which the client
+                                 * may be waiting for before sending the
+                                 * body.
+                                 */
+                                partial = 0;
+                                socket_blocking (connptr->server_fd);
+                                n = pass_interim_response (connptr);
+                                socket_nonblocking (connptr->server_fd);
+                                if (n < 0) {
+                                        ret = -1;
+                                        break;
+                                }
+                                continue;
+                        }
+                        if (!partial)
+                                partial = time (NULL);
+                }
+
+                if (FD_ISSET (connptr->client_fd, &rset)) {
+                        if (connptr->request_chunked) {
+                                len = read_chunked_buffer
+                                    (connptr->client_fd, connptr->cbuffer,
+                                     &connptr->request_chunks, FALSE);
+                        } else {
+                                len = read_buffer_limit
+                                    (connptr->client_fd, connptr->cbuffer,
+                                     connptr->content_length.client);
+                                if (len > 0)
+                                        connptr->content_length.client -= len;
+                        }
+
+                        if (len < 0) {
+                                ret = -1;
+                                break;
+                        }
+                }
+
+                if (FD_ISSET (connptr->server_fd, &wset)
+                    && write_buffer (connptr->server_fd,
+                                     connptr->cbuffer) < 0) {
+                        ret = -1;
+                        break;
+                }
+        }
+
+        socket_blocking (connptr->client_fd);
+        socket_blocking (connptr->server_fd);
+
+        return ret;
+}
+
 /*
  * Here we loop through all the headers the client is sending. If we
  * are running in anonymous mode, we will _only_ send the headers listed
@@ -839,6 +1183,7 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
         int i;
         hashmap_iter iter;
         int ret = 0;
+        int expect_continue;
 
         char *data, *header;
 
@@ -860,6 +1205,27 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
          */
         connptr->content_length.client = get_content_length (hashofheaders);
 
+        /* A chunked body is never delimited by Content-Length */
+        if (is_chunked (hashofheaders)) {
+                hashmap_remove (hashofheaders, "content-length");
+                connptr->content_length.client = -1;
+                connptr->request_chunked = TRUE;
+                chunked_init (&connptr->request_chunks);
+        }
+
+        /*
+         * A client asking for "100 Continue" holds the body back until
+         * the server's interim response is relayed.  Older clients
+         * would not see it, so the server should not wait for them.
+         */
+        expect_continue = hashmap_entry_by_key (hashofheaders, "expect",
+                                                (void **) &data) > 0
+            && strcasecmp (data, "100-continue") == 0;
+        if (connptr->protocol.major != 1 || connptr->protocol.minor == 0) {
+                hashmap_remove (hashofheaders, "expect");
+                expect_continue = FALSE;
+        }
+
         /*
          * See if there is a "Connection" header.  If so, we need to do a bit
          * of processing. :)
@@ -919,15 +1285,29 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
                 add_xtinyproxy_header (connptr);
 #endif
 
+        /* The Connection header went with the request line */
+        if (connptr->upgrade
+            && write_message (connptr->server_fd, "Upgrade: %s\r\n",
+                              connptr->upgrade) < 0)
+                return -1;
+
         /* Write the final "blank" line to signify the end of the headers */
         if (safe_write (connptr->server_fd, "\r\n", 2) < 0)
                 return -1;
 
+        /* The body follows with the relay, see stream_request_body() */
+        return 0;
+
         /*
-         * Spin here pulling the data from the client.
+         * Spin here pulling the data from the client, so that the error
+         * can be reported.
          */
 PULL_CLIENT_DATA:
-        if (connptr->content_length.client > 0) {
+        connptr->request_chunked = FALSE;
+        if (expect_continue) {
+                /* The body may never come, so do not wait for it */
+                connptr->keepalive = FALSE;
+        } else if (connptr->content_length.client > 0) {
                 ret = pull_client_data (connptr,
                                         connptr->content_length.client);
         }
@@ -936,59 +1316,379 @@ PULL_CLIENT_DATA:
 }
 
 /*
- * Loop through all the headers (including the response code) from the
- * server.
+ * Send a request to a server spoken to over HTTP/2: the headers
+ * process_client_headers() would send, less those which have no place in
+ * HTTP/2, with the request line and the Host header turned into
+ * pseudo-header fields.  The body follows with stream_http2_body().
  */
-static int process_server_headers (struct conn_s *connptr)
+static int
+send_http2_request (struct conn_s *connptr, struct request_s *request,
+                    hashmap_t hashofheaders)
 {
         static const char *skipheaders[] = {
+                "connection",
+                "host",
                 "keep-alive",
-                "proxy-authenticate",
-                "proxy-authorization",
                 "proxy-connection",
+                "te",
+                "trailers",
+                "transfer-encoding",
+                "upgrade"
         };
-
-        char *response_line;
-
-        hashmap_t hashofheaders;
-        hashmap_iter iter;
+        struct http2_stream *stream = connptr->http2;
+        char *authority, *via = NULL;
         char *data, *header;
-        ssize_t len;
-        int i;
-        int ret;
+        hashmap_iter iter;
+        size_t len;
+        int i, expect_continue;
+        int ret = -1;
 
-#ifdef REVERSE_SUPPORT
-        struct reversepath *reverse = config.reversepath_list;
-#endif
+        connptr->content_length.client = get_content_length (hashofheaders);
 
-        /* Get the response line from the remote server. */
-retry:
-        len = readline (connptr->server_fd, &response_line);
-        if (len <= 0)
-                return -1;
+        /* Answered here, as the body is sent along as soon as it comes */
+        expect_continue = hashmap_entry_by_key (hashofheaders, "expect",
+                                                (void **) &data) > 0
+            && strcasecmp (data, "100-continue") == 0
+            && connptr->protocol.major == 1 && connptr->protocol.minor >= 1;
+        hashmap_remove (hashofheaders, "expect");
 
-        /*
-         * Strip the new line and character return from the string.
-         */
-        if (chomp (response_line, len) == len) {
-                /*
-                 * If the number of characters removed is the same as the
-                 * length then it was a blank line. Free the buffer and
-                 * try again (since we're looking for a request line.)
-                 */
-                safefree (response_line);
-                goto retry;
+        remove_connection_headers (hashofheaders);
+        for (i = 0; i != (sizeof (skipheaders) / sizeof (char *)); i++) {
+                hashmap_remove (hashofheaders, skipheaders[i]);
         }
 
-        hashofheaders = hashmap_create (HEADER_BUCKETS);
-        if (!hashofheaders) {
-                safefree (response_line);
-                return -1;
+        /* A server on a unix domain socket has no name of its own */
+        len = strlen (request->host) + 10;
+        authority = (char *) safemalloc (len);
+        if (!authority)
+                goto done;
+
+        if (*request->host == '/')
+                strlcpy (authority, "localhost", len);
+        else if (strchr (request->host, ':'))
+                snprintf (authority, len, "[%s]", request->host);
+        else
+                strlcpy (authority, request->host, len);
+        if (*request->host != '/' && request->port != HTTP_PORT)
+                snprintf (authority + strlen (authority),
+                          len - strlen (authority), ":%d", request->port);
+
+        if (http2_add_header (stream, ":method", request->method) < 0
+            || http2_add_header (stream, ":scheme", "http") < 0
+            || http2_add_header (stream, ":authority", authority) < 0
+            || http2_add_header (stream, ":path", request->path) < 0)
+                goto done;
+
+        if (!config.disable_viaheader) {
+                via = via_header_value (hashofheaders,
+                                        connptr->protocol.major,
+                                        connptr->protocol.minor);
+                if (!via || http2_add_header (stream, "via", via) < 0)
+                        goto done;
         }
 
-        /*
-         * Get all the headers from the remote server in a big hash
-         */
+        iter = hashmap_first (hashofheaders);
+        if (iter >= 0) {
+                for (; !hashmap_is_end (hashofheaders, iter); ++iter) {
+                        hashmap_return_entry (hashofheaders,
+                                              iter, &data, (void **) &header);
+
+                        if ((!is_anonymous_enabled ()
+                             || anonymous_search (data) > 0)
+                            && http2_add_header (stream, data, header) < 0)
+                                goto done;
+                }
+        }
+#if defined(XTINYPROXY_ENABLE)
+        if (config.add_xtinyproxy
+            && http2_add_header (stream, "x-tinyproxy",
+                                 connptr->client_ip_addr) < 0)
+                goto done;
+#endif
+
+        ret = http2_send_headers (stream,
+                                  connptr->content_length.client <= 0);
+        if (ret == 0 && expect_continue && connptr->content_length.client > 0)
+                ret = write_message (connptr->client_fd,
+                                     "HTTP/1.1 100 Continue\r\n\r\n");
+
+done:
+        safefree (authority);
+        safefree (via);
+
+        if (ret < 0) {
+                indicate_http_error (connptr, 503,
+                                     "Could not send data to remote server",
+                                     "detail",
+                                     "A network error occurred while "
+                                     "trying to write data to the "
+                                     "remote web server.", NULL);
+                if (!expect_continue && connptr->content_length.client > 0)
+                        pull_client_data (connptr,
+                                          connptr->content_length.client);
+        }
+
+        return ret;
+}
+
+/*
+ * Pass the request body on to a server spoken to over HTTP/2, within the
+ * flow control windows the server gives.  Returns as
+ * stream_request_body() does.
+ */
+static int stream_http2_body (struct conn_s *connptr)
+{
+        char buffer[16384];
+        fd_set rset;
+        struct timeval tv;
+        ssize_t len;
+        size_t size;
+        int ret;
+
+        while (connptr->content_length.client > 0) {
+                FD_ZERO (&rset);
+                FD_SET (connptr->client_fd, &rset);
+                tv.tv_sec = config.idletimeout;
+                tv.tv_usec = 0;
+
+                ret = select (connptr->client_fd + 1, &rset, NULL, NULL, &tv);
+                if (ret < 0 && errno == EINTR)
+                        continue;
+                if (ret <= 0) {
+                        log_message (LOG_ERR,
+                                     "stream_http2_body: %s while reading "
+                                     "the request body (client_fd:%d)",
+                                     ret == 0 ? "Idle timeout" :
+                                     strerror (errno), connptr->client_fd);
+                        return -1;
+                }
+
+                size = sizeof (buffer);
+                if ((long) size > connptr->content_length.client)
+                        size = connptr->content_length.client;
+
+                len = safe_read (connptr->client_fd, buffer, size);
+                if (len <= 0)
+                        return -1;
+                connptr->content_length.client -= len;
+
+                ret = http2_write (connptr->http2, buffer, len,
+                                   connptr->content_length.client == 0);
+                if (ret != 0)
+                        return ret;
+        }
+
+        return 0;
+}
+
+/*
+ * Wait for the response of a server spoken to over HTTP/2, and make the
+ * line of an HTTP/1.1 response for it (without a reason phrase, as
+ * HTTP/2 has none).  Returns -1 if the stream failed.
+ */
+static int
+read_http2_response (struct conn_s *connptr, char **response_line,
+                     hashmap_t *hashofheaders)
+{
+        char *status;
+
+        *hashofheaders = http2_read_headers (connptr->http2);
+        if (!*hashofheaders)
+                return -1;
+
+        if (hashmap_entry_by_key (*hashofheaders, ":status",
+                                  (void **) &status) <= 0
+            || strlen (status) != 3
+            || (*response_line = (char *) safemalloc (14)) == NULL) {
+                hashmap_delete (*hashofheaders);
+                return -1;
+        }
+
+        snprintf (*response_line, 14, "HTTP/1.1 %s ", status);
+        hashmap_remove (*hashofheaders, ":status");
+        return 0;
+}
+
+/*
+ * Remove the hop-by-hop headers of a response: those listed by the
+ * Connection header, and the ones in skipheaders.
+ */
+static void remove_server_hop_headers (hashmap_t hashofheaders)
+{
+        static const char *skipheaders[] = {
+                "keep-alive",
+                "proxy-authenticate",
+                "proxy-authorization",
+                "proxy-connection",
+        };
+        int i;
+
+        remove_connection_headers (hashofheaders);
+
+        for (i = 0; i != (sizeof (skipheaders) / sizeof (char *)); i++) {
+                hashmap_remove (hashofheaders, skipheaders[i]);
+        }
+}
+
+/*
+ * Copy the headers of a request which may have to be sent again, before
+ * process_client_headers() trims them.
+ */
+static hashmap_t copy_headers (hashmap_t hashofheaders)
+{
+        hashmap_t copy;
+        hashmap_iter iter;
+        char *name, *value;
+
+        copy = hashmap_create (HEADER_BUCKETS);
+        if (!copy)
+                return NULL;
+
+        iter = hashmap_first (hashofheaders);
+        for (; iter >= 0 && !hashmap_is_end (hashofheaders, iter); ++iter) {
+                hashmap_return_entry (hashofheaders, iter, &name,
+                                      (void **) &value);
+                if (hashmap_insert (copy, name, value,
+                                    strlen (value) + 1) < 0) {
+                        hashmap_delete (copy);
+                        return NULL;
+                }
+        }
+
+        return copy;
+}
+
+/*
+ * The methods whose requests can be sent twice without harm.
+ */
+static int idempotent_method (const char *method)
+{
+        static const char *methods[] = {
+                "GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE"
+        };
+        unsigned int i;
+
+        for (i = 0; i != sizeof (methods) / sizeof (char *); i++)
+                if (strcmp (method, methods[i]) == 0)
+                        return TRUE;
+        return FALSE;
+}
+
+/*
+ * The server of a connection from the pool may have closed it just as
+ * the request went out, which the check in connpool_get() cannot rule
+ * out.  If not a byte of the response has come, the request is sent
+ * once more on a new connection.  Returns -1 if that failed as well.
+ */
+static int retry_request (struct conn_s *connptr)
+{
+        char c;
+        ssize_t len;
+        int fd, ret;
+
+        do {
+                len = recv (connptr->server_fd, &c, 1, MSG_PEEK);
+        } while (len < 0 && errno == EINTR);
+
+        if (len > 0) {
+                forget_retry (connptr);
+                return 0;
+        }
+
+        log_message (LOG_INFO,
+                     "Reused connection to %s:%d was closed, sending the "
+                     "request again", connptr->retry_host,
+                     connptr->retry_port);
+
+        fd = opensock (connptr->retry_host, connptr->retry_port,
+                       connptr->server_ip_addr);
+        if (fd < 0) {
+                forget_retry (connptr);
+                return -1;
+        }
+
+        close (connptr->server_fd);
+        connptr->server_fd = fd;
+
+        ret = establish_http_connection (connptr, connptr->retry_request);
+        if (ret >= 0)
+                ret = process_client_headers (connptr,
+                                              connptr->retry_headers);
+        forget_retry (connptr);
+        return ret;
+}
+
+/*
+ * Read the response line and headers from the server, and send them on
+ * to the client.  Returns 1 if the client is to be answered from the
+ * cache instead, after a revalidation.
+ */
+static int process_server_headers (struct conn_s *connptr)
+{
+        char *response_line;
+
+        hashmap_t hashofheaders;
+        hashmap_iter iter;
+        char *data, *header, *upgrade;
+        ssize_t len;
+        int ret;
+        unsigned int major = 0, minor = 0;
+        unsigned int bodyless;
+        int status = 0;
+
+#ifdef REVERSE_SUPPORT
+        struct reversepath *reverse;
+        size_t urllen;
+#endif
+
+        /* Get the response line from the remote server. */
+retry:
+        if (connptr->http2) {
+                if (read_http2_response (connptr, &response_line,
+                                         &hashofheaders) < 0) {
+                        log_message (LOG_WARNING,
+                                     "Could not read the response from the "
+                                     "HTTP/2 server.");
+                        indicate_http_error (connptr, 503,
+                                             "Could not retrieve all the headers",
+                                             "detail",
+                                             PACKAGE_NAME " "
+                                             "was unable to retrieve and process headers from "
+                                             "the remote web server.", NULL);
+                        return -1;
+                }
+                goto got_headers;
+        }
+
+        if (connptr->retry_request && retry_request (connptr) < 0)
+                return -1;
+
+        len = readline (connptr->server_fd, &response_line);
+        if (len <= 0)
+                return -1;
+
+        /*
+         * Strip the new line and character return from the string.
+         */
+        if (chomp (response_line, len) == len) {
+                /*
+                 * If the number of characters removed is the same as the
+                 * length then it was a blank line. Free the buffer and
+                 * try again (since we're looking for a request line.)
+                 */
+                safefree (response_line);
+                goto retry;
+        }
+
+        hashofheaders = hashmap_create (HEADER_BUCKETS);
+        if (!hashofheaders) {
+                safefree (response_line);
+                return -1;
+        }
+
+        /*
+         * Get all the headers from the remote server in a big hash
+         */
         if (get_all_headers (connptr->server_fd, hashofheaders) < 0) {
                 log_message (LOG_WARNING,
                              "Could not retrieve all the headers from the remote server.");
@@ -1004,6 +1704,46 @@ retry:
                 return -1;
         }
 
+got_headers:
+        sscanf (response_line, "HTTP/%u.%u %d", &major, &minor, &status);
+
+        /* Interim responses come ahead of the final one */
+        if (status >= 100 && status < 200 && status != 101) {
+                ret = relay_interim_response (connptr, response_line,
+                                              hashofheaders);
+                hashmap_delete (hashofheaders);
+                safefree (response_line);
+                if (ret < 0)
+                        return -1;
+                goto retry;
+        }
+
+        /* The server switches protocols: what follows is a tunnel */
+        if (status == 101 && connptr->upgrade) {
+                connptr->upgraded = TRUE;
+                connptr->keepalive = connptr->server_keepalive = FALSE;
+        }
+
+        bodyless = connptr->head_method || status == 204 || status == 304;
+
+        /*
+         * Chunked responses are framed while they are relayed, and
+         * decoded for clients which predate HTTP/1.1.
+         */
+        if (!bodyless && is_chunked (hashofheaders)) {
+                connptr->response_chunked = TRUE;
+                chunked_init (&connptr->chunked);
+                hashmap_remove (hashofheaders, "content-length");
+
+                if (connptr->protocol.major < 1
+                    || (connptr->protocol.major == 1
+                        && connptr->protocol.minor == 0)) {
+                        connptr->dechunk = TRUE;
+                        connptr->keepalive = FALSE;
+                        hashmap_remove (hashofheaders, "transfer-encoding");
+                }
+        }
+
         /*
          * At this point we've received the response line and all the
          * headers.  However, if this is a simple HTTP/0.9 request we
@@ -1016,9 +1756,44 @@ retry:
                 return 0;
         }
 
+        /*
+         * The server connection can be reused if the server agrees to
+         * keep it open.
+         */
+        if (connptr->server_keepalive
+            && (major != 1 || connection_has_token (hashofheaders, "close")
+                || (minor == 0
+                    && !connection_has_token (hashofheaders, "keep-alive"))))
+                connptr->server_keepalive = FALSE;
+
+        /*
+         * A stale response from the cache is sent again if the server
+         * says it has not changed, or in place of a server error within
+         * its stale-if-error time.
+         */
+        if (connptr->cache_entry >= 0) {
+                if (status == 304) {
+                        cache_refresh (connptr, hashofheaders);
+                        ret = 1;
+                } else if (status >= 500 && cache_use_stale (connptr)) {
+                        log_message (LOG_INFO, "Server answered %d, "
+                                     "sending the stale response", status);
+                        connptr->server_keepalive = FALSE;
+                        ret = 1;
+                } else {
+                        cache_unpin (connptr);
+                        ret = 0;
+                }
+
+                if (ret > 0) {
+                        hashmap_delete (hashofheaders);
+                        safefree (response_line);
+                        return 1;
+                }
+        }
+
         /* Send the saved response line first */
         ret = write_message (connptr->client_fd, "%s\r\n", response_line);
-        safefree (response_line);
         if (ret < 0)
                 goto ERROR_EXIT;
 
@@ -1029,18 +1804,54 @@ retry:
         connptr->content_length.server = get_content_length (hashofheaders);
 
         /*
-         * See if there is a connection header.  If so, we need to to a bit of
-         * processing.
+         * The end of an HTTP/2 response is that of its stream, so one
+         * without a length is chunked for HTTP/1.1 clients (while it is
+         * relayed, see relay_http2_response()).
          */
-        remove_connection_headers (hashofheaders);
+        if (connptr->http2 && !bodyless
+            && connptr->content_length.server < 0
+            && connptr->protocol.major == 1 && connptr->protocol.minor >= 1) {
+                connptr->response_chunked = TRUE;
+                hashmap_insert (hashofheaders, "transfer-encoding",
+                                "chunked", 8);
+        }
 
         /*
-         * Delete the headers listed in the skipheaders list
+         * The client and server connections can only be kept open if the
+         * end of the response can be found without the server closing
+         * its side.
          */
-        for (i = 0; i != (sizeof (skipheaders) / sizeof (char *)); i++) {
-                hashmap_remove (hashofheaders, skipheaders[i]);
+        if (connptr->keepalive || connptr->server_keepalive) {
+                if (bodyless)
+                        connptr->content_length.server = 0;
+                else if (connptr->response_chunked)
+                        connptr->content_length.server = -1;
+                else if (connptr->content_length.server < 0
+                         || hashmap_search (hashofheaders,
+                                            "transfer-encoding") > 0)
+                        connptr->keepalive = connptr->server_keepalive =
+                            FALSE;
         }
 
+        /* The Upgrade header of a switch is hop-by-hop, yet passed on */
+        upgrade = NULL;
+        if (connptr->upgraded
+            && hashmap_entry_by_key (hashofheaders, "upgrade",
+                                     (void **) &header) > 0)
+                upgrade = safestrdup (header);
+
+        remove_server_hop_headers (hashofheaders);
+
+        if (upgrade) {
+                hashmap_insert (hashofheaders, "Upgrade", upgrade,
+                                strlen (upgrade) + 1);
+                safefree (upgrade);
+        }
+
+        /* Keep a copy of the response if it may be cached */
+        cache_begin (connptr, response_line, status, hashofheaders);
+        safefree (response_line);
+
         /* Send, or add the Via header */
         ret = write_via_header (connptr->client_fd, hashofheaders,
                                 connptr->protocol.major,
@@ -1048,6 +1859,20 @@ retry:
         if (ret < 0)
                 goto ERROR_EXIT;
 
+        if (connptr->upgraded)
+                ret = write_message (connptr->client_fd,
+                                     "Connection: upgrade\r\n");
+        else if (connptr->keepalive)
+                ret = write_message (connptr->client_fd,
+                                     "Connection: keep-alive\r\n"
+                                     "Keep-Alive: timeout=%u\r\n",
+                                     config.keepalive_timeout);
+        else if (config.keepalive)
+                ret = write_message (connptr->client_fd,
+                                     "Connection: close\r\n");
+        if (ret < 0)
+                goto ERROR_EXIT;
+
 #ifdef REVERSE_SUPPORT
         /* Write tracking cookie for the magical reverse proxy path hack */
         if (config.reversemagic && connptr->reversepath) {
@@ -1058,65 +1883,300 @@ retry:
                         goto ERROR_EXIT;
         }
 
-        /* Rewrite the HTTP redirect if needed */
-        if (config.reversebaseurl &&
-            hashmap_entry_by_key (hashofheaders, "location",
-                                  (void **) &header) > 0) {
+        /* Rewrite the HTTP redirect if needed */
+        if (config.reversebaseurl &&
+            hashmap_entry_by_key (hashofheaders, "location",
+                                  (void **) &header) > 0) {
+
+                /* Look for the longest matching entry by backend URL */
+                reverse = reversepath_get_url (header, &urllen);
+                if (reverse) {
+                        ret =
+                            write_message (connptr->client_fd,
+                                           "Location: %s%s%s\r\n",
+                                           config.reversebaseurl,
+                                           (reverse->path + 1), (header + urllen));
+                        if (ret < 0)
+                                goto ERROR_EXIT;
+
+                        log_message (LOG_INFO,
+                                     "Rewriting HTTP redirect: %s -> %s%s%s",
+                                     header, config.reversebaseurl,
+                                     (reverse->path + 1), (header + urllen));
+                        hashmap_remove (hashofheaders, "location");
+                }
+        }
+#endif
+
+        /*
+         * All right, output all the remaining headers to the client.
+         */
+        iter = hashmap_first (hashofheaders);
+        if (iter >= 0) {
+                for (; !hashmap_is_end (hashofheaders, iter); ++iter) {
+                        hashmap_return_entry (hashofheaders,
+                                              iter, &data, (void **) &header);
+
+                        ret = write_message (connptr->client_fd,
+                                             "%s: %s\r\n", data, header);
+                        if (ret < 0)
+                                goto ERROR_EXIT;
+                }
+        }
+        hashmap_delete (hashofheaders);
+
+        /* Write the final blank line to signify the end of the headers */
+        if (safe_write (connptr->client_fd, "\r\n", 2) < 0)
+                return -1;
+
+        return 0;
+
+ERROR_EXIT:
+        safefree (response_line);
+        hashmap_delete (hashofheaders);
+        return -1;
+}
+
+/*
+ * Read the answer of the server to the revalidation of a stale response
+ * which was already sent to the client, and refresh the cache with it.
+ */
+static void refresh_cached_response (struct conn_s *connptr)
+{
+        hashmap_t hashofheaders;
+        char *response_line = NULL;
+        char buffer[4096];
+        unsigned int major = 0, minor = 0;
+        int status = 0;
+        long length;
+        ssize_t len;
+
+        if (connptr->http2) {
+                if (read_http2_response (connptr, &response_line,
+                                         &hashofheaders) < 0) {
+                        hashofheaders = NULL;
+                        goto close;
+                }
+        } else {
+                hashofheaders = hashmap_create (HEADER_BUCKETS);
+                if (!hashofheaders)
+                        goto close;
+
+                len = readline (connptr->server_fd, &response_line);
+                if (len <= 0)
+                        goto close;
+                chomp (response_line, len);
+
+                if (get_all_headers (connptr->server_fd, hashofheaders) < 0)
+                        goto close;
+        }
+
+        sscanf (response_line, "HTTP/%u.%u %d", &major, &minor, &status);
+        if (status < 200)
+                goto close;
+
+        if (major != 1 || connection_has_token (hashofheaders, "close")
+            || (minor == 0
+                && !connection_has_token (hashofheaders, "keep-alive")))
+                connptr->server_keepalive = FALSE;
+
+        if (status == 304) {
+                cache_refresh (connptr, hashofheaders);
+                goto done;
+        }
+
+        /* A new response is only read if its end can be found */
+        length = get_content_length (hashofheaders);
+        if (connptr->head_method || status == 204)
+                length = 0;
+        else if (length < 0 || is_chunked (hashofheaders))
+                goto close;
+
+        remove_server_hop_headers (hashofheaders);
+        connptr->content_length.server = length;
+        cache_begin (connptr, response_line, status, hashofheaders);
+
+        while (length > 0) {
+                if (connptr->http2)
+                        len = http2_read (connptr->http2, buffer,
+                                          length < (long) sizeof (buffer)
+                                          ? (size_t) length : sizeof (buffer));
+                else
+                        len = read (connptr->server_fd, buffer,
+                                    length < (long) sizeof (buffer)
+                                    ? (size_t) length : sizeof (buffer));
+                if (len <= 0)
+                        goto close;
+
+                cache_append (connptr, (unsigned char *) buffer, len);
+                length -= len;
+        }
+        connptr->content_length.server = 0;
+        cache_commit (connptr);
+
+done:
+        hashmap_delete (hashofheaders);
+        safefree (response_line);
+        return;
+
+close:
+        connptr->server_keepalive = FALSE;
+        if (hashofheaders)
+                hashmap_delete (hashofheaders);
+        safefree (response_line);
+}
+
+/*
+ * Done with the server of a response: it goes back to the pool if it may
+ * be reused, and is closed otherwise.
+ */
+static void release_server (struct conn_s *connptr)
+{
+        if (connptr->server_fd < 0)
+                return;
+
+        if (connptr->server_keepalive && buffer_size (connptr->cbuffer) == 0)
+                connpool_put (connptr->pool_key, connptr->server_fd);
+        else
+                close (connptr->server_fd);
+        connptr->server_fd = -1;
+}
+
+/*
+ * The part of a response which a slow client is not ready for, once more
+ * than MAXBUFFSIZE of it has piled up.  It is kept in an unnamed file,
+ * from where it is sent on, so that the server can be let go of as soon
+ * as it is done rather than when the client is.
+ */
+struct spool {
+        int fd;                 /* -1 until needed */
+        off_t start;            /* sent to the client up to here */
+        off_t end;              /* written up to here */
+        unsigned int off;       /* disabled, or the file failed us */
+};
+
+static void spool_init (struct spool *spool)
+{
+        spool->fd = -1;
+        spool->start = spool->end = 0;
+        spool->off = (config.spool_dir == NULL);
+}
+
+static int spool_open (struct spool *spool)
+{
+        char *path;
+
+#ifdef O_TMPFILE
+        spool->fd = open (config.spool_dir, O_RDWR | O_TMPFILE, 0600);
+        if (spool->fd >= 0)
+                return 0;
+#endif
+
+        /* Not every system, nor every file system, has unnamed files */
+        path = (char *) safemalloc (strlen (config.spool_dir) + 16);
+        if (!path)
+                return -1;
+        sprintf (path, "%s/spool.XXXXXX", config.spool_dir);
+        spool->fd = mkstemp (path);
+        if (spool->fd >= 0)
+                unlink (path);
+        safefree (path);
+
+        return spool->fd >= 0 ? 0 : -1;
+}
+
+/*
+ * Move the buffered response behind what is in the spool already, if
+ * the buffer is full and the spool is not.
+ */
+static void spool_fill (struct spool *spool, struct conn_s *connptr)
+{
+        if (spool->off || buffer_size (connptr->sbuffer) < MAXBUFFSIZE
+            || spool->end - spool->start >= (off_t) config.spool_size * 1024)
+                return;
+
+        if (spool->fd < 0) {
+                if (spool_open (spool) < 0) {
+                        log_message (LOG_WARNING,
+                                     "Could not open a spool file in %s: %s",
+                                     config.spool_dir, strerror (errno));
+                        spool->off = TRUE;
+                        return;
+                }
+                log_message (LOG_INFO,
+                             "Spooling the response for client (fd:%d)",
+                             connptr->client_fd);
+        }
+
+        /* What is in the spool stays valid, the rest waits in memory */
+        if (flush_buffer (spool->fd, connptr->sbuffer) < 0)
+                spool->off = TRUE;
+        spool->end = lseek (spool->fd, 0, SEEK_CUR);
+}
+
+/*
+ * Send the client some of the spool, which starts over once it has been
+ * sent in full.  Returns -1 if the client went away.
+ */
+static ssize_t spool_send (struct spool *spool, int fd)
+{
+        ssize_t len;
+#ifdef HAVE_SYS_SENDFILE_H
+        len = sendfile (fd, spool->fd, &spool->start,
+                        spool->end - spool->start);
+#else
+        char buffer[16 * 1024];
+
+        len = pread (spool->fd, buffer,
+                     (size_t) min ((off_t) sizeof (buffer),
+                                   spool->end - spool->start),
+                     spool->start);
+        if (len > 0) {
+                len = send (fd, buffer, len, MSG_NOSIGNAL);
+                if (len > 0)
+                        spool->start += len;
+        }
+#endif
+        if (len < 0)
+                return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+        if (spool->start == spool->end && ftruncate (spool->fd, 0) == 0) {
+                lseek (spool->fd, 0, SEEK_SET);
+                spool->start = spool->end = 0;
+        }
+        return len;
+}
 
-                /* Look for a matching entry in the reversepath list */
-                while (reverse) {
-                        if (strncasecmp (header,
-                                         reverse->url, (len =
-                                                        strlen (reverse->
-                                                                url))) == 0)
-                                break;
-                        reverse = reverse->next;
-                }
+/*
+ * Send the client the rest of the spool, once its server is gone.
+ */
+static int spool_drain (struct spool *spool, int fd)
+{
+        fd_set wset;
+        struct timeval tv;
+        int ret;
 
-                if (reverse) {
-                        ret =
-                            write_message (connptr->client_fd,
-                                           "Location: %s%s%s\r\n",
-                                           config.reversebaseurl,
-                                           (reverse->path + 1), (header + len));
-                        if (ret < 0)
-                                goto ERROR_EXIT;
+        while (spool->end > spool->start) {
+                FD_ZERO (&wset);
+                FD_SET (fd, &wset);
+                tv.tv_sec = config.idletimeout;
+                tv.tv_usec = 0;
 
+                ret = select (fd + 1, NULL, &wset, NULL, &tv);
+                if (ret == 0) {
                         log_message (LOG_INFO,
-                                     "Rewriting HTTP redirect: %s -> %s%s%s",
-                                     header, config.reversebaseurl,
-                                     (reverse->path + 1), (header + len));
-                        hashmap_remove (hashofheaders, "location");
+                                     "Idle Timeout (spool) as %u seconds "
+                                     "passed.", config.idletimeout);
+                        return -1;
+                } else if (ret < 0 && errno != EINTR) {
+                        return -1;
                 }
-        }
-#endif
-
-        /*
-         * All right, output all the remaining headers to the client.
-         */
-        iter = hashmap_first (hashofheaders);
-        if (iter >= 0) {
-                for (; !hashmap_is_end (hashofheaders, iter); ++iter) {
-                        hashmap_return_entry (hashofheaders,
-                                              iter, &data, (void **) &header);
 
-                        ret = write_message (connptr->client_fd,
-                                             "%s: %s\r\n", data, header);
-                        if (ret < 0)
-                                goto ERROR_EXIT;
-                }
+                if (ret > 0 && spool_send (spool, fd) < 0)
+                        return -1;
         }
-        hashmap_delete (hashofheaders);
-
-        /* Write the final blank line to signify the end of the headers */
-        if (safe_write (connptr->client_fd, "\r\n", 2) < 0)
-                return -1;
 
         return 0;
-
-ERROR_EXIT:
-        hashmap_delete (hashofheaders);
-        return -1;
 }
 
 /*
@@ -1126,6 +2186,9 @@ ERROR_EXIT:
  * connections (as this was the reason why I originally modified
  * tinyproxy oh so long ago...)
  *	- rjkaes
+ *
+ * When either connection is kept alive only the response is relayed:
+ * anything more from the client is its next request.
  */
 static void relay_connection (struct conn_s *connptr)
 {
@@ -1136,6 +2199,10 @@ static void relay_connection (struct conn_s *connptr)
         double tdiff;
         int maxfd = max (connptr->client_fd, connptr->server_fd) + 1;
         ssize_t bytes_received;
+        const unsigned char *data;
+        struct spool spool;
+
+        spool_init (&spool);
 
         socket_nonblocking (connptr->client_fd);
         socket_nonblocking (connptr->server_fd);
@@ -1150,13 +2217,17 @@ static void relay_connection (struct conn_s *connptr)
                     config.idletimeout - difftime (time (NULL), last_access);
                 tv.tv_usec = 0;
 
-                if (buffer_size (connptr->sbuffer) > 0)
+                spool_fill (&spool, connptr);
+
+                if (buffer_size (connptr->sbuffer) > 0
+                    || spool.end > spool.start)
                         FD_SET (connptr->client_fd, &wset);
                 if (buffer_size (connptr->cbuffer) > 0)
                         FD_SET (connptr->server_fd, &wset);
                 if (buffer_size (connptr->sbuffer) < MAXBUFFSIZE)
                         FD_SET (connptr->server_fd, &rset);
-                if (buffer_size (connptr->cbuffer) < MAXBUFFSIZE)
+                if (buffer_size (connptr->cbuffer) < MAXBUFFSIZE
+                    && !connptr->keepalive && !connptr->server_keepalive)
                         FD_SET (connptr->client_fd, &rset);
 
                 ret = select (maxfd, &rset, &wset, NULL, &tv);
@@ -1167,6 +2238,8 @@ static void relay_connection (struct conn_s *connptr)
                                 log_message (LOG_INFO,
                                              "Idle Timeout (after select) as %g > %u.",
                                              tdiff, config.idletimeout);
+                                connptr->keepalive = FALSE;
+                                connptr->server_keepalive = FALSE;
                                 return;
                         } else {
                                 continue;
@@ -1177,6 +2250,8 @@ static void relay_connection (struct conn_s *connptr)
                                      "Closing connection (client_fd:%d, server_fd:%d)",
                                      strerror (errno), connptr->client_fd,
                                      connptr->server_fd);
+                        connptr->keepalive = FALSE;
+                        connptr->server_keepalive = FALSE;
                         return;
                 } else {
                         /*
@@ -1185,12 +2260,29 @@ static void relay_connection (struct conn_s *connptr)
                         last_access = time (NULL);
                 }
 
-                if (FD_ISSET (connptr->server_fd, &rset)) {
+                if (FD_ISSET (connptr->server_fd, &rset)
+                    && connptr->response_chunked) {
+                        if (read_chunked_buffer (connptr->server_fd,
+                                                 connptr->sbuffer,
+                                                 &connptr->chunked,
+                                                 connptr->dechunk) < 0)
+                                break;
+
+                        if (chunked_done (&connptr->chunked)) {
+                                connptr->content_length.server = 0;
+                                break;
+                        }
+                } else if (FD_ISSET (connptr->server_fd, &rset)) {
                         bytes_received =
                             read_buffer (connptr->server_fd, connptr->sbuffer);
                         if (bytes_received < 0)
                                 break;
 
+                        if (connptr->cache_object && bytes_received > 0) {
+                                buffer_last_line (connptr->sbuffer, &data);
+                                cache_append (connptr, data, bytes_received);
+                        }
+
                         connptr->content_length.server -= bytes_received;
                         if (connptr->content_length.server == 0)
                                 break;
@@ -1204,7 +2296,12 @@ static void relay_connection (struct conn_s *connptr)
                         break;
                 }
                 if (FD_ISSET (connptr->client_fd, &wset)
-                    && write_buffer (connptr->client_fd, connptr->sbuffer) < 0) {
+                    && spool.end > spool.start) {
+                        if (spool_send (&spool, connptr->client_fd) < 0)
+                                break;
+                } else if (FD_ISSET (connptr->client_fd, &wset)
+                           && write_buffer (connptr->client_fd,
+                                            connptr->sbuffer) < 0) {
                         break;
                 }
         }
@@ -1213,16 +2310,42 @@ static void relay_connection (struct conn_s *connptr)
          * Here the server has closed the connection... write the
          * remainder to the client and then exit.
          */
+        if (connptr->content_length.server != 0)
+                connptr->keepalive = connptr->server_keepalive = FALSE;
+
+        /*
+         * With the response spooled, the server is let go of first, and
+         * the client is left to catch up on its own time.
+         */
+        if (spool.fd >= 0) {
+                socket_blocking (connptr->server_fd);
+                while (buffer_size (connptr->cbuffer) > 0) {
+                        if (write_buffer (connptr->server_fd,
+                                          connptr->cbuffer) < 0)
+                                break;
+                }
+                release_server (connptr);
+
+                if (spool_drain (&spool, connptr->client_fd) < 0)
+                        connptr->keepalive = FALSE;
+                close (spool.fd);
+        }
+
         socket_blocking (connptr->client_fd);
         while (buffer_size (connptr->sbuffer) > 0) {
-                if (write_buffer (connptr->client_fd, connptr->sbuffer) < 0)
+                if (write_buffer (connptr->client_fd, connptr->sbuffer) < 0) {
+                        connptr->keepalive = FALSE;
                         break;
+                }
         }
-        shutdown (connptr->client_fd, SHUT_WR);
+        if (!connptr->keepalive)
+                shutdown (connptr->client_fd, SHUT_WR);
 
         /*
          * Try to send any remaining data to the server if we can.
          */
+        if (connptr->server_fd < 0)
+                return;
         socket_blocking (connptr->server_fd);
         while (buffer_size (connptr->cbuffer) > 0) {
                 if (write_buffer (connptr->server_fd, connptr->cbuffer) < 0)
@@ -1232,6 +2355,409 @@ static void relay_connection (struct conn_s *connptr)
         return;
 }
 
+/*
+ * One direction of a tunnel.  With splice() the data goes through a
+ * pipe, without being copied out of the kernel.
+ */
+struct tunnel_half {
+        int from, to;
+#ifdef HAVE_SPLICE
+        int pipe[2];
+#else
+        char data[TUNNEL_SIZE];
+        size_t start;
+#endif
+        size_t pending;         /* read, but not written yet */
+        unsigned int eof;       /* nothing more will be read */
+        unsigned int done;      /* and all of it was written */
+};
+
+static int tunnel_open (struct tunnel_half *half, int from, int to)
+{
+        half->from = from;
+        half->to = to;
+        half->pending = 0;
+        half->eof = half->done = FALSE;
+#ifdef HAVE_SPLICE
+        return pipe (half->pipe);
+#else
+        half->start = 0;
+        return 0;
+#endif
+}
+
+static void tunnel_close (struct tunnel_half *half)
+{
+#ifdef HAVE_SPLICE
+        close (half->pipe[0]);
+        close (half->pipe[1]);
+#endif
+}
+
+static ssize_t tunnel_read (struct tunnel_half *half)
+{
+#ifdef HAVE_SPLICE
+        return splice (half->from, NULL, half->pipe[1], NULL,
+                       TUNNEL_SIZE - half->pending,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+        if (half->pending == 0)
+                half->start = 0;
+        return read (half->from, half->data + half->start + half->pending,
+                     TUNNEL_SIZE - half->start - half->pending);
+#endif
+}
+
+static ssize_t tunnel_write (struct tunnel_half *half)
+{
+        ssize_t len;
+
+#ifdef HAVE_SPLICE
+        len = splice (half->pipe[0], NULL, half->to, NULL, half->pending,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+        len = send (half->to, half->data + half->start, half->pending,
+                    MSG_NOSIGNAL);
+        if (len > 0)
+                half->start += len;
+#endif
+        if (len > 0)
+                half->pending -= len;
+        return len;
+}
+
+/*
+ * Pass bytes both ways between the client and the server of a CONNECT
+ * tunnel, or of a connection which switched protocols, until both sides
+ * are done or it stays idle for "timeout" seconds.  When one side stops
+ * sending, the other is told with a shutdown once all has been passed
+ * on, so that the protocol inside can close on its own terms.
+ */
+static void tunnel_connection (struct conn_s *connptr, unsigned int timeout)
+{
+        struct tunnel_half halves[2], *half;
+        fd_set rset, wset;
+        struct timeval tv;
+        time_t last_access;
+        double tdiff;
+        ssize_t len;
+        int maxfd = max (connptr->client_fd, connptr->server_fd) + 1;
+        int ret, i;
+
+        connptr->keepalive = connptr->server_keepalive = FALSE;
+
+        /* Whatever was read ahead goes first */
+        while (buffer_size (connptr->sbuffer) > 0)
+                if (write_buffer (connptr->client_fd, connptr->sbuffer) < 0)
+                        return;
+        while (buffer_size (connptr->cbuffer) > 0)
+                if (write_buffer (connptr->server_fd, connptr->cbuffer) < 0)
+                        return;
+
+        if (tunnel_open (&halves[0], connptr->client_fd,
+                         connptr->server_fd) < 0) {
+                relay_connection (connptr);
+                return;
+        }
+        if (tunnel_open (&halves[1], connptr->server_fd,
+                         connptr->client_fd) < 0) {
+                tunnel_close (&halves[0]);
+                relay_connection (connptr);
+                return;
+        }
+
+        socket_nonblocking (connptr->client_fd);
+        socket_nonblocking (connptr->server_fd);
+
+        last_access = time (NULL);
+
+        while (!halves[0].done || !halves[1].done) {
+                FD_ZERO (&rset);
+                FD_ZERO (&wset);
+
+                for (i = 0; i != 2; i++) {
+                        half = &halves[i];
+                        if (!half->eof && half->pending < TUNNEL_SIZE)
+                                FD_SET (half->from, &rset);
+                        if (half->pending > 0)
+                                FD_SET (half->to, &wset);
+                }
+
+                tv.tv_sec = timeout - difftime (time (NULL), last_access);
+                tv.tv_usec = 0;
+
+                /* A timeout of 0 keeps the tunnel for as long as it lasts */
+                ret = select (maxfd, &rset, &wset, NULL, timeout ? &tv : NULL);
+                if (ret == 0) {
+                        tdiff = difftime (time (NULL), last_access);
+                        if (tdiff >= timeout) {
+                                log_message (LOG_INFO,
+                                             "Idle Timeout (tunnel) as "
+                                             "%g >= %u.", tdiff, timeout);
+                                break;
+                        }
+                        continue;
+                } else if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        log_message (LOG_ERR,
+                                     "tunnel_connection: select() error "
+                                     "\"%s\". Closing connection "
+                                     "(client_fd:%d, server_fd:%d)",
+                                     strerror (errno), connptr->client_fd,
+                                     connptr->server_fd);
+                        break;
+                }
+                last_access = time (NULL);
+
+                for (i = 0; i != 2; i++) {
+                        half = &halves[i];
+
+                        if (FD_ISSET (half->from, &rset)) {
+                                len = tunnel_read (half);
+                                if (len == 0)
+                                        half->eof = TRUE;
+                                else if (len < 0 && errno != EAGAIN
+                                         && errno != EINTR)
+                                        goto done;
+                                else if (len > 0)
+                                        half->pending += len;
+                        }
+
+                        if (FD_ISSET (half->to, &wset)) {
+                                len = tunnel_write (half);
+                                if (len < 0 && errno != EAGAIN
+                                    && errno != EINTR)
+                                        goto done;
+                        }
+
+                        if (half->eof && half->pending == 0 && !half->done) {
+                                shutdown (half->to, SHUT_WR);
+                                half->done = TRUE;
+                        }
+                }
+        }
+
+done:
+        tunnel_close (&halves[0]);
+        tunnel_close (&halves[1]);
+
+        socket_blocking (connptr->client_fd);
+        socket_blocking (connptr->server_fd);
+}
+
+/*
+ * Relay the body of a response from a server spoken to over HTTP/2, in
+ * chunks if process_server_headers() found it has no length.
+ */
+static void relay_http2_response (struct conn_s *connptr)
+{
+        char buffer[16 + 16384 + 2];
+        char *data = buffer + 16;
+        char size[16];
+        ssize_t len;
+        size_t n;
+
+        while ((len = http2_read (connptr->http2, data, 16384)) > 0) {
+                if (connptr->cache_object)
+                        cache_append (connptr, (unsigned char *) data, len);
+
+                if (connptr->response_chunked) {
+                        n = snprintf (size, sizeof (size), "%lx\r\n",
+                                      (unsigned long) len);
+                        memcpy (data - n, size, n);
+                        memcpy (data + len, "\r\n", 2);
+                        if (safe_write (connptr->client_fd, data - n,
+                                        n + len + 2) < 0)
+                                break;
+                } else {
+                        if (safe_write (connptr->client_fd, data, len) < 0)
+                                break;
+                        connptr->content_length.server -= len;
+                }
+        }
+
+        if (len == 0 && connptr->response_chunked
+            && safe_write (connptr->client_fd, "0\r\n\r\n", 5) == 5)
+                connptr->content_length.server = 0;
+
+        if (len != 0 || connptr->content_length.server != 0) {
+                connptr->keepalive = FALSE;
+                shutdown (connptr->client_fd, SHUT_WR);
+        }
+}
+
+/*
+ * Connect to a web server or upstream proxy, reusing an idle connection
+ * from the pool if there is one.  The backends of a ReverseHTTP2 path
+ * get a stream on a connection shared by the requests of the child.
+ */
+static int open_server (struct conn_s *connptr, const char *host, int port)
+{
+        int fd;
+
+#ifdef REVERSE_SUPPORT
+        if (connptr->reverse_http2 && !connptr->upstream_proxy) {
+                connptr->server_keepalive = FALSE;
+                connptr->http2 = http2_open (host, port,
+                                             connptr->server_ip_addr);
+                return connptr->http2 ? http2_fd (connptr->http2) : -1;
+        }
+#endif
+
+        if (connptr->server_keepalive) {
+                safefree (connptr->pool_key);
+                connptr->pool_key = connpool_key (host, port,
+                                                  connptr->server_ip_addr);
+                if (!connptr->pool_key)
+                        return -1;
+
+                fd = connpool_get (connptr->pool_key);
+                if (fd >= 0) {
+                        update_stats (STAT_POOL_HIT);
+                        log_message (LOG_INFO,
+                                     "Reusing connection to %s:%d "
+                                     "(file descriptor %d)", host, port, fd);
+                        safefree (connptr->retry_host);
+                        connptr->retry_host = safestrdup (host);
+                        connptr->retry_port = port;
+                        return fd;
+                }
+
+                update_stats (STAT_POOL_MISS);
+        }
+
+        return opensock (host, port, connptr->server_ip_addr);
+}
+
+#ifdef UPSTREAM_SUPPORT
+/*
+ * Connect to a member of an upstream pool (the members of a group, or
+ * the single proxy of a plain upstream rule), moving on to the next one
+ * chosen by the pool's policy whenever a connection attempt fails.  The
+ * member in use is kept in the connection so that it can be released
+ * when the connection is closed.  "attempts" is set to the number of
+ * members tried; it is 0 when the circuit breakers of all the members
+ * are open.
+ */
+static int
+connect_to_upstream_pool (struct conn_s *connptr,
+                          struct request_s *request,
+                          struct balancer_pool *pool,
+                          unsigned int *attempts)
+{
+        struct balancer_peer *peer;
+        unsigned char *tried;
+        char *url = NULL;
+        const char *key = request->host;
+        size_t len;
+        int fd = -1;
+
+        *attempts = 0;
+
+        /*
+         * The hashing policies send every request for a given host (or
+         * URL) to the same member, so that caching parents each keep
+         * their own share of the objects.
+         */
+        if (pool->policy == BALANCE_HASH_URL && !connptr->connect_method) {
+                len = strlen (request->host) + strlen (request->path) + 14;
+                url = (char *) safemalloc (len);
+                if (!url)
+                        return -1;
+
+                snprintf (url, len, "http://%s:%d%s", request->host,
+                          request->port, request->path);
+                key = url;
+        }
+
+        tried = (unsigned char *) safecalloc (pool->npeers, 1);
+        if (!tried) {
+                safefree (url);
+                return -1;
+        }
+
+        while ((peer = balancer_select (pool, tried, key)) != NULL) {
+                tried[peer->index] = 1;
+                (*attempts)++;
+
+                fd = open_server (connptr, peer->host, peer->port);
+                if (fd >= 0) {
+                        balancer_succeeded (peer);
+                        connptr->upstream_peer = peer;
+                        break;
+                }
+
+                log_message (LOG_WARNING,
+                             "Could not connect to upstream proxy %s:%d",
+                             peer->host, peer->port);
+                balancer_failed (peer);
+                balancer_release (peer);
+        }
+
+        safefree (tried);
+        safefree (url);
+        return fd;
+}
+#endif
+
+#ifdef REVERSE_SUPPORT
+/*
+ * Connect to one of the backends of a reverse path, as picked by its
+ * policy, moving on to the next one whenever a connection attempt fails.
+ * The request is pointed at the backend which accepted it.  "attempts"
+ * is set as for connect_to_upstream_pool().
+ */
+static int
+connect_to_reverse_pool (struct conn_s *connptr, struct request_s *request,
+                         hashmap_t hashofheaders, unsigned int *attempts)
+{
+        struct reversepath *reverse = connptr->reverse_pool;
+        struct balancer_peer *peer;
+        unsigned char *tried;
+        char *key;
+        int fd = -1;
+
+        *attempts = 0;
+
+        tried = (unsigned char *) safecalloc (reverse->pool.npeers, 1);
+        if (!tried)
+                return -1;
+        key = reversepath_balance_key (reverse, hashofheaders);
+
+        while ((peer = balancer_select (&reverse->pool, tried, key)) != NULL) {
+                tried[peer->index] = 1;
+                (*attempts)++;
+
+                fd = open_server (connptr, peer->host, peer->port);
+                if (fd >= 0) {
+                        balancer_succeeded (peer);
+                        connptr->reverse_peer = peer;
+                        if (reversepath_retarget (reverse, peer, request) < 0) {
+                                if (connptr->http2) {
+                                        http2_close (connptr->http2);
+                                        connptr->http2 = NULL;
+                                } else {
+                                        close (fd);
+                                }
+                                fd = -1;
+                        }
+                        break;
+                }
+
+                log_message (LOG_WARNING,
+                             "Could not connect to backend %s:%d of %s",
+                             peer->host, peer->port, reverse->path);
+                balancer_failed (peer);
+                balancer_release (peer);
+        }
+
+        safefree (tried);
+        safefree (key);
+        return fd;
+}
+#endif
+
 /*
  * Establish a connection to the upstream proxy server.
  */
@@ -1247,22 +2773,52 @@ connect_to_upstream (struct conn_s *connptr, struct request_s *request)
 #else
         char *combined_string;
         int len;
+        struct balancer_pool *pool;
+        unsigned int attempts;
+
+        struct upstream *cur_upstream = connptr->upstream_proxy;
+
+        if (!cur_upstream) {
+                log_message (LOG_WARNING,
+                             "No upstream proxy defined for %s.",
+                             request->host);
+                indicate_http_error (connptr, 503,
+                                     "Unable to connect to upstream proxy.",
+                                     NULL);
+                return -1;
+        }
+
+        if (cur_upstream->group) {
+                pool = &cur_upstream->group->pool;
+                if (pool->npeers == 0) {
+                        log_message (LOG_WARNING,
+                                     "Upstream group %s has no members",
+                                     cur_upstream->group->name);
+                        indicate_http_error (connptr, 503,
+                                             "Unable to connect to upstream proxy.",
+                                             NULL);
+                        return -1;
+                }
+        } else {
+                pool = &cur_upstream->pool;
+        }
 
-        struct upstream *cur_upstream = connptr->upstream_proxy;
+        connptr->server_fd =
+            connect_to_upstream_pool (connptr, request, pool, &attempts);
 
-        if (!cur_upstream) {
+        if (connptr->server_fd < 0 && attempts == 0) {
                 log_message (LOG_WARNING,
-                             "No upstream proxy defined for %s.",
+                             "Upstream proxy for %s is known to be down.",
                              request->host);
-                indicate_http_error (connptr, 404,
-                                     "Unable to connect to upstream proxy.");
+                indicate_http_error (connptr, 503,
+                                     "Upstream proxy unavailable",
+                                     "detail",
+                                     "The upstream web proxy is currently "
+                                     "unreachable. Please try again later.",
+                                     NULL);
                 return -1;
         }
 
-        connptr->server_fd =
-            opensock (cur_upstream->host, cur_upstream->port,
-                      connptr->server_ip_addr);
-
         if (connptr->server_fd < 0) {
                 log_message (LOG_WARNING,
                              "Could not connect to upstream proxy.");
@@ -1278,7 +2834,7 @@ connect_to_upstream (struct conn_s *connptr, struct request_s *request)
         log_message (LOG_CONN,
                      "Established connection to upstream proxy \"%s\" "
                      "using file descriptor %d.",
-                     cur_upstream->host, connptr->server_fd);
+                     connptr->upstream_peer->host, connptr->server_fd);
 
         /*
          * We need to re-write the "path" part of the request so that we
@@ -1359,51 +2915,79 @@ get_request_entity(struct conn_s *connptr)
 
 
 /*
- * This is the main drive for each connection. As you can tell, for the
- * first few steps we are using a blocking socket. If you remember the
- * older tinyproxy code, this use to be a very confusing state machine.
- * Well, no more! :) The sockets are only switched into nonblocking mode
- * when we start the relay portion. This makes most of the original
- * tinyproxy code, which was confusing, redundant. Hail progress.
- * 	- rjkaes
+ * Answer a request which failed or asked for the statistics page.
  */
-void handle_connection (int fd)
+static void send_error_response (struct conn_s *connptr)
 {
-        ssize_t i;
-        struct conn_s *connptr;
-        struct request_s *request = NULL;
-        hashmap_t hashofheaders = NULL;
+        connptr->keepalive = FALSE;
 
-        char sock_ipaddr[IP_LENGTH];
-        char peer_ipaddr[IP_LENGTH];
-        char peer_string[HOSTNAME_LENGTH];
+        /*
+         * First, get the body if there is one.
+         * If we don't read all there is from the socket first,
+         * it is still marked for reading and we won't be able
+         * to send our data properly.
+         */
+        if (get_request_entity (connptr) < 0) {
+                log_message (LOG_WARNING,
+                             "Could not retrieve request entity");
+                indicate_http_error (connptr, 400, "Bad Request",
+                                     "detail",
+                                     "Could not retrieve the request entity "
+                                     "the client.", NULL);
+                update_stats (STAT_BADCONN);
+        }
 
-        getpeer_information (fd, peer_ipaddr, peer_string);
+        if (connptr->error_variables) {
+                send_http_error_message (connptr);
+        } else if (connptr->show_stats) {
+                showstats (connptr);
+        }
+}
 
-        if (config.bindsame)
-                getsock_ip (fd, sock_ipaddr);
+/*
+ * Wait for the next request on a connection which is kept alive.
+ * Returns 1 once there is something to read, or 0 if the client closed
+ * the connection or stayed idle for longer than KeepAliveTimeout.
+ */
+static int wait_for_request (struct conn_s *connptr)
+{
+        fd_set rset;
+        struct timeval tv;
+        char c;
+        int ret;
 
-        log_message (LOG_CONN, config.bindsame ?
-                     "Connect (file descriptor %d): %s [%s] at [%s]" :
-                     "Connect (file descriptor %d): %s [%s]",
-                     fd, peer_string, peer_ipaddr, sock_ipaddr);
+        do {
+                FD_ZERO (&rset);
+                FD_SET (connptr->client_fd, &rset);
+                tv.tv_sec = config.keepalive_timeout;
+                tv.tv_usec = 0;
 
-        connptr = initialize_conn (fd, peer_ipaddr, peer_string,
-                                   config.bindsame ? sock_ipaddr : NULL);
-        if (!connptr) {
-                close (fd);
-                return;
-        }
+                ret = select (connptr->client_fd + 1, &rset, NULL, NULL, &tv);
+        } while (ret < 0 && errno == EINTR);
 
-        if (check_acl (peer_ipaddr, peer_string, config.access_list) <= 0) {
-                update_stats (STAT_DENIED);
-                indicate_http_error (connptr, 403, "Access denied",
-                                     "detail",
-                                     "The administrator of this proxy has not configured "
-                                     "it to service requests from your host.",
-                                     NULL);
-                goto fail;
-        }
+        if (ret <= 0)
+                return 0;
+
+        return recv (connptr->client_fd, &c, 1, MSG_PEEK) == 1;
+}
+
+/*
+ * Read one request from the client and pass it on to the server.
+ * "served" is the number of requests read before on this connection.
+ * connptr->keepalive is left set if the client connection can be used
+ * for another request.  Returns 0, or -1 if the request failed and an
+ * error has to be sent to the client instead of the server's response.
+ */
+static int dispatch_request (struct conn_s *connptr, unsigned int served)
+{
+        ssize_t i;
+        struct request_s *request = NULL;
+        hashmap_t hashofheaders = NULL, retry_headers;
+        char *upgrade;
+        int ret = -1;
+
+        if (served > 0)
+                update_stats (STAT_KEEPALIVE);
 
         if (read_request_line (connptr) < 0) {
                 update_stats (STAT_BADCONN);
@@ -1463,14 +3047,86 @@ void handle_connection (int fd)
                 goto fail;
         }
 
-        connptr->upstream_proxy = UPSTREAM_HOST (request->host);
+        connptr->head_method = (strcasecmp (request->method, "HEAD") == 0);
+        if (config.keepalive
+            && (config.max_keepalive_requests == 0
+                || served + 1 < config.max_keepalive_requests))
+                connptr->keepalive =
+                    client_wants_keepalive (connptr, hashofheaders);
+
+        /* Server connections are only pooled if requests are delimited */
+        connptr->server_keepalive = config.pool_max_idle > 0
+            && !connptr->connect_method
+            && (hashmap_search (hashofheaders, "transfer-encoding") <= 0
+                || get_content_length (hashofheaders) >= 0
+                || is_chunked (hashofheaders));
+
+#ifdef REVERSE_SUPPORT
+        /* A request body without a length only goes over HTTP/1.1 */
+        if (hashmap_search (hashofheaders, "transfer-encoding") > 0)
+                connptr->reverse_http2 = FALSE;
+#endif
+
+        /*
+         * An HTTP/1.1 client may ask to switch protocols (to WebSocket,
+         * say).  The request is passed on with its Upgrade header, over
+         * HTTP/1.1, and the connection becomes a tunnel if the server
+         * agrees.
+         */
+        if (!connptr->connect_method && connptr->protocol.major == 1
+            && connptr->protocol.minor >= 1
+            && connection_has_token (hashofheaders, "upgrade")
+            && hashmap_entry_by_key (hashofheaders, "upgrade",
+                                     (void **) &upgrade) > 0) {
+                connptr->upgrade = safestrdup (upgrade);
+                connptr->server_keepalive = FALSE;
+#ifdef REVERSE_SUPPORT
+                connptr->reverse_http2 = FALSE;
+#endif
+        }
+
+        /* Answer from the cache if the response is there */
+        if (!connptr->upgrade && cache_lookup (connptr, request,
+                                                hashofheaders)) {
+                ret = 0;
+                goto done;
+        }
+
+        /* Unix domain sockets are local, never behind an upstream proxy */
+        connptr->upstream_proxy = *request->host == '/' ?
+            NULL : UPSTREAM_HOST (request->host);
         if (connptr->upstream_proxy != NULL) {
                 if (connect_to_upstream (connptr, request) < 0) {
                         goto fail;
                 }
         } else {
-                connptr->server_fd = opensock (request->host, request->port,
-                                               connptr->server_ip_addr);
+#ifdef REVERSE_SUPPORT
+                if (connptr->reverse_pool) {
+                        unsigned int attempts;
+
+                        connptr->server_fd =
+                            connect_to_reverse_pool (connptr, request,
+                                                     hashofheaders,
+                                                     &attempts);
+                        if (connptr->server_fd < 0 && attempts == 0) {
+                                log_message (LOG_WARNING,
+                                             "The backends of %s are known "
+                                             "to be down.",
+                                             connptr->reverse_pool->path);
+                                indicate_http_error (connptr, 503,
+                                                     "Service unavailable",
+                                                     "detail",
+                                                     "All the servers for "
+                                                     "this page are known "
+                                                     "to be down. Please "
+                                                     "try again later.",
+                                                     NULL);
+                                goto fail;
+                        }
+                } else
+#endif
+                connptr->server_fd = open_server (connptr, request->host,
+                                                  request->port);
                 if (connptr->server_fd < 0) {
                         indicate_http_error (connptr, 500, "Unable to connect",
                                              "detail",
@@ -1485,17 +3141,113 @@ void handle_connection (int fd)
                              "file descriptor %d.", request->host,
                              connptr->server_fd);
 
-                if (!connptr->connect_method)
+                if (!connptr->connect_method && !connptr->http2)
                         establish_http_connection (connptr, request);
         }
 
-        if (process_client_headers (connptr, hashofheaders) < 0) {
+        /* A request on a connection from the pool may be sent again */
+        retry_headers = NULL;
+        if (connptr->retry_host && !connptr->http2 && !connptr->upgrade
+            && idempotent_method (request->method))
+                retry_headers = copy_headers (hashofheaders);
+
+        if (connptr->http2)
+                ret = send_http2_request (connptr, request, hashofheaders);
+        else
+                ret = process_client_headers (connptr, hashofheaders);
+        if (ret < 0) {
+                if (retry_headers)
+                        hashmap_delete (retry_headers);
                 update_stats (STAT_BADCONN);
                 goto fail;
         }
 
+        if (retry_headers && connptr->content_length.client <= 0
+            && !connptr->request_chunked) {
+                connptr->retry_request = request;
+                connptr->retry_headers = retry_headers;
+                request = NULL;
+        } else {
+                if (retry_headers)
+                        hashmap_delete (retry_headers);
+                safefree (connptr->retry_host);
+        }
+
+        ret = 0;
+        goto done;
+
+fail:
+        /* A stale response may stand in for a server out of reach */
+        if (connptr->server_fd < 0 && cache_use_stale (connptr)) {
+                log_message (LOG_INFO, "Sending the stale response");
+                ret = 0;
+                goto done;
+        }
+        connptr->keepalive = FALSE;
+
+done:
+        free_request_struct (request);
+
+        /* The headers are needed to cache a response which has a Vary */
+        if (ret == 0 && connptr->cache_key && connptr->server_fd >= 0)
+                connptr->cache_headers = hashofheaders;
+        else
+                hashmap_delete (hashofheaders);
+        return ret;
+}
+
+/*
+ * Send the client the answer to a request handed to dispatch_request(),
+ * which returned "dispatched".
+ */
+static void complete_request (struct conn_s *connptr, int dispatched)
+{
+        int ret;
+
+        if (dispatched < 0)
+                goto fail;
+
+        if (connptr->cache_entry >= 0
+            && (connptr->cache_refresh || connptr->server_fd < 0)) {
+                if (cache_send (connptr) < 0)
+                        connptr->keepalive = FALSE;
+                if (connptr->server_fd < 0)
+                        return;
+
+                /* The client has its answer, the cache is refreshed now */
+                refresh_cached_response (connptr);
+                goto done;
+        }
+
+        if (request_body_pending (connptr)) {
+                if (connptr->http2)
+                        ret = stream_http2_body (connptr);
+                else
+                        ret = stream_request_body (connptr);
+                if (ret < 0) {
+                        indicate_http_error (connptr, 503,
+                                             "Could not send data to remote server",
+                                             "detail",
+                                             "A network error occurred while "
+                                             "trying to write data to the "
+                                             "remote web server.", NULL);
+                        update_stats (STAT_BADCONN);
+                        goto fail;
+                }
+
+                /*
+                 * The rest of the body is still in the way of the next
+                 * request, and the server may not read it either.
+                 */
+                if (ret > 0)
+                        connptr->keepalive = connptr->server_keepalive =
+                            FALSE;
+        }
+
+        ret = 0;
         if (!(connptr->connect_method && (connptr->upstream_proxy == NULL))) {
-                if (process_server_headers (connptr) < 0) {
+                ret = process_server_headers (connptr);
+                if (ret < 0) {
                         update_stats (STAT_BADCONN);
                         goto fail;
                 }
@@ -1509,41 +3261,199 @@ void handle_connection (int fd)
                 }
         }
 
-        relay_connection (connptr);
+        if (ret > 0) {
+                /* The cached response was revalidated */
+                if (cache_send (connptr) < 0)
+                        connptr->keepalive = FALSE;
+                goto done;
+        }
+
+        /*
+         * A response without a body is already complete, except that the
+         * end of its HTTP/2 stream may still have to be read.
+         */
+        if (connptr->http2)
+                relay_http2_response (connptr);
+        else if (connptr->upgraded)
+                tunnel_connection (connptr, config.upgrade_idle_timeout);
+        else if (connptr->connect_method && !connptr->upstream_proxy)
+                tunnel_connection (connptr, config.idletimeout);
+        else if ((!connptr->keepalive && !connptr->server_keepalive)
+                 || connptr->content_length.server != 0)
+                relay_connection (connptr);
+
+        if (connptr->content_length.server == 0)
+                cache_commit (connptr);
 
         log_message (LOG_INFO,
                      "Closed connection between local client (fd:%d) "
                      "and remote client (fd:%d)",
                      connptr->client_fd, connptr->server_fd);
 
-        goto done;
+done:
+        if (connptr->server_keepalive)
+                release_server (connptr);
+
+        return;
 
 fail:
-        /*
-         * First, get the body if there is one.
-         * If we don't read all there is from the socket first,
-         * it is still marked for reading and we won't be able
-         * to send our data properly.
-         */
-        if (get_request_entity (connptr) < 0) {
-                log_message (LOG_WARNING,
-                             "Could not retrieve request entity");
-                indicate_http_error (connptr, 400, "Bad Request",
+        send_error_response (connptr);
+}
+
+/*
+ * Check whether the client has already sent the complete header of a
+ * further GET or HEAD request, which can then be passed on before the
+ * answers to the earlier ones have been sent back.  Requests with a body
+ * are always left until the connection is idle.
+ */
+static int request_buffered (int fd)
+{
+        char buffer[4096];
+        ssize_t len;
+
+        len = recv (fd, buffer, sizeof (buffer) - 1, MSG_PEEK | MSG_DONTWAIT);
+        if (len <= 0)
+                return FALSE;
+        buffer[len] = '\0';
+
+        if (strncmp (buffer, "GET ", 4) != 0
+            && strncmp (buffer, "HEAD ", 5) != 0)
+                return FALSE;
+
+        return strstr (buffer, "\r\n\r\n") != NULL
+            || strstr (buffer, "\n\n") != NULL;
+}
+
+/*
+ * This is the main drive for each connection. As you can tell, for the
+ * first few steps we are using a blocking socket. If you remember the
+ * older tinyproxy code, this use to be a very confusing state machine.
+ * Well, no more! :) The sockets are only switched into nonblocking mode
+ * when we start the relay portion. This makes most of the original
+ * tinyproxy code, which was confusing, redundant. Hail progress.
+ * 	- rjkaes
+ */
+void handle_connection (int fd)
+{
+        char sock_ipaddr[IP_LENGTH];
+        char peer_ipaddr[IP_LENGTH];
+        char peer_string[HOSTNAME_LENGTH];
+
+        getpeer_information (fd, peer_ipaddr, peer_string);
+
+        if (config.bindsame)
+                getsock_ip (fd, sock_ipaddr);
+
+        log_message (LOG_CONN, config.bindsame ?
+                     "Connect (file descriptor %d): %s [%s] at [%s]" :
+                     "Connect (file descriptor %d): %s [%s]",
+                     fd, peer_string, peer_ipaddr, sock_ipaddr);
+
+        serve_client (fd, peer_ipaddr, peer_string,
+                      config.bindsame ? sock_ipaddr : NULL);
+}
+
+/*
+ * Serve the requests on a client connection, which is either one the
+ * child accepted or, for a stream of an HTTP/2 client, a socket pair to
+ * the child serving that client.
+ */
+void serve_client (int fd, const char *peer_ipaddr, const char *peer_string,
+                   const char *sock_ipaddr)
+{
+        struct conn_s *connptr, *conn;
+        struct conn_s *queue[MAX_PIPELINE_DEPTH], *spare[MAX_PIPELINE_DEPTH];
+        int dispatched[MAX_PIPELINE_DEPTH];
+        unsigned int queued = 0, spares = 0, served = 0, depth, i;
+        unsigned int keep;
+
+        connptr = initialize_conn (fd, peer_ipaddr, peer_string, sock_ipaddr);
+        if (!connptr) {
+                close (fd);
+                return;
+        }
+
+        if (check_acl (peer_ipaddr, peer_string, config.access_list) <= 0) {
+                update_stats (STAT_DENIED);
+                indicate_http_error (connptr, 403, "Access denied",
                                      "detail",
-                                     "Could not retrieve the request entity "
-                                     "the client.", NULL);
-                update_stats (STAT_BADCONN);
+                                     "The administrator of this proxy has not configured "
+                                     "it to service requests from your host.",
+                                     NULL);
+                send_error_response (connptr);
+                destroy_conn (connptr);
+                return;
         }
 
-        if (connptr->error_variables) {
-                send_http_error_message (connptr);
-        } else if (connptr->show_stats) {
-                showstats (connptr);
+        /* A client speaking HTTP/2 starts with its connection preface */
+        if (config.http2_max_streams > 0 && http2_preface (fd)) {
+                http2_serve (fd, peer_ipaddr, peer_string, sock_ipaddr);
+                destroy_conn (connptr);
+                return;
         }
 
-done:
-        free_request_struct (request);
-        hashmap_delete (hashofheaders);
+        depth = config.pipeline_depth;
+        if (depth < 1)
+                depth = 1;
+        if (depth > MAX_PIPELINE_DEPTH)
+                depth = MAX_PIPELINE_DEPTH;
+
+        /*
+         * Each request in progress has its own connection structure, all
+         * sharing the client socket.  The answers are sent back in the
+         * order the requests came in.
+         */
+        spare[spares++] = connptr;
+
+        for (;;) {
+                /*
+                 * Pass on the next request, and those after it which the
+                 * client has already sent, up to PipelineDepth of them.
+                 */
+                while (queued == 0
+                       || (queued < depth && queue[queued - 1]->keepalive
+                           && !queue[queued - 1]->upgrade
+                           && !request_body_pending (queue[queued - 1])
+                           && request_buffered (connptr->client_fd))) {
+                        conn = spares > 0 ? spare[--spares]
+                            : pipeline_conn (connptr);
+                        if (!conn)
+                                break;
+
+                        dispatched[queued] = dispatch_request (conn, served++);
+                        queue[queued++] = conn;
+                }
+
+                if (queued == 0)
+                        break;
+
+                conn = queue[0];
+                complete_request (conn, dispatched[0]);
+
+                keep = conn->keepalive && buffer_size (conn->cbuffer) == 0
+                    && buffer_size (conn->sbuffer) == 0;
+
+                reset_conn (conn);
+                spare[spares++] = conn;
+
+                queued--;
+                for (i = 0; i != queued; i++) {
+                        queue[i] = queue[i + 1];
+                        dispatched[i] = dispatched[i + 1];
+                }
+
+                if (!keep)
+                        break;
+
+                /* Wait for the next request once all have been answered */
+                if (queued == 0 && !wait_for_request (connptr))
+                        break;
+        }
+
+        for (i = 0; i != queued; i++)
+                spare[spares++] = queue[i];
+        for (i = 0; i != spares; i++)
+                if (spare[i] != connptr)
+                        destroy_conn (spare[i]);
         destroy_conn (connptr);
-        return;
 }
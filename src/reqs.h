@@ -43,6 +43,9 @@ struct request_s {
         char *path;
 };
 
+extern void free_request_struct (struct request_s *request);
 extern void handle_connection (int fd);
+extern void serve_client (int fd, const char *peer_ipaddr,
+                          const char *peer_string, const char *sock_ipaddr);
 
 #endif
@@ -16,7 +16,23 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-/* Allow tinyproxy to be used as a reverse proxy. */
+/* Allow tinyproxy to be used as a reverse proxy.
+ *
+ * The ReversePath entries are kept in a list, and indexed in tries: by
+ * path, to find the mapping for a request, and by backend URL, to rewrite
+ * redirects.  Both find the longest matching prefix.  The entries for a
+ * given host name (or wildcard) get a trie of paths of their own, found
+ * through a hash table of the names.
+ *
+ * A path can have several backends (see ReverseBackend), which form a
+ * balancer pool: the request is rewritten with the first one, and only
+ * sent elsewhere when the connection is made.
+ *
+ * A backend can be a unix domain socket, given as "unix:/path/to/socket"
+ * (optionally followed by ":/path/" for the requests).  The request is
+ * rewritten for "localhost" and then given the path of the socket as
+ * its host name, which is what opensock() connects to.
+ */
 
 #include "main.h"
 #include "reverse-proxy.h"
@@ -26,14 +42,206 @@
 #include "html-error.h"
 #include "log.h"
 #include "conf.h"
+#include "dns.h"
+
+/* Buckets of the hash table of host names */
+#define REVERSE_HOSTS 256
+
+#define IS_UNIX_URL(url) (strncmp ((url), "unix:", 5) == 0)
+
+/*
+ * Split a backend URL into its host and port.  The host of a unix: URL
+ * is the path of the socket, and its port 0.  Returns -1 if it has no
+ * host.
+ */
+static int
+backend_address (const char *url, char *host, size_t size, int *port)
+{
+        const char *start, *end;
+        size_t len;
+
+        if (IS_UNIX_URL (url)) {
+                start = url + 5;
+                len = strcspn (start, ":");
+                if (*start != '/' || len >= size)
+                        return -1;
+
+                memcpy (host, start, len);
+                host[len] = '\0';
+                *port = 0;
+                return 0;
+        }
+
+        start = strstr (url, "://");
+        if (!start)
+                return -1;
+        start += 3;
+
+        if (*start == '[') {
+                start++;
+                len = strcspn (start, "]");
+                end = start + len + (start[len] == ']');
+        } else {
+                len = strcspn (start, ":/");
+                end = start + len;
+        }
+
+        if (len == 0 || len >= size)
+                return -1;
+
+        memcpy (host, start, len);
+        host[len] = '\0';
+        *port = (*end == ':') ? atoi (end + 1) : HTTP_PORT;
+
+        return *port > 0 ? 0 : -1;
+}
+
+/*
+ * The path part of a backend URL.
+ */
+static const char *backend_path (const char *url)
+{
+        const char *start;
+
+        if (IS_UNIX_URL (url)) {
+                start = strchr (url + 5, ':');
+                return start && start[1] == '/' ? start + 1 : "/";
+        }
+
+        start = strstr (url, "://");
+        start = strchr (start ? start + 3 : url, '/');
+        return start ? start : "/";
+}
+
+/*
+ * Add a backend to the pool of a reverse path.
+ */
+static int
+add_backend (struct reversepath *reverse, const char *url,
+             unsigned int weight)
+{
+        char host[256];
+        char **backends;
+        unsigned int n = reverse->pool.npeers;
+        int port;
+
+        if (backend_address (url, host, sizeof (host), &port) < 0) {
+                log_message (LOG_WARNING,
+                             "Skipping reverse proxy backend: '%s' is not "
+                             "a valid url", url);
+                return -1;
+        }
+
+        backends = (char **) saferealloc (reverse->backends,
+                                          (n + 1) * sizeof (char *));
+        if (!backends)
+                return -1;
+        reverse->backends = backends;
+
+        backends[n] = safestrdup (url);
+        if (!backends[n])
+                return -1;
+
+        if (balancer_add_peer (&reverse->pool, host, port, weight) < 0) {
+                safefree (backends[n]);
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * Split a path which may start with a host name ("www.example.com/app/")
+ * into the two.  Returns the path, or NULL if there is no valid host name
+ * before it; "host" is left empty if there is none.
+ */
+static const char *split_host (const char *spec, char *host, size_t size)
+{
+        const char *path = strchr (spec, '/');
+        size_t len;
+
+        host[0] = '\0';
+        if (!path)
+                return NULL;
+
+        len = path - spec;
+        if (len >= size)
+                return NULL;
+
+        memcpy (host, spec, len);
+        host[len] = '\0';
+
+        /* A wildcard can only stand for the first labels of the name */
+        if (strchr (strncmp (host, "*.", 2) == 0 ? host + 2 : host, '*'))
+                return NULL;
+
+        return path;
+}
+
+/*
+ * Find the reverse path configured for exactly "spec" (with its host
+ * name, if any), for the directives which add to a ReversePath.
+ */
+static struct reversepath *reversepath_find (const char *spec,
+                                             struct reversepath *reverse,
+                                             const char *directive)
+{
+        char host[256];
+        const char *path;
+
+        path = split_host (spec, host, sizeof (host));
+        if (path) {
+                for (; reverse; reverse = reverse->next) {
+                        if (strcmp (reverse->path, path) != 0)
+                                continue;
+                        if (reverse->host ? strcasecmp (reverse->host, host)
+                            == 0 : host[0] == '\0')
+                                return reverse;
+                }
+        }
+
+        log_message (LOG_WARNING, "%s: no ReversePath for \"%s\"",
+                     directive, spec);
+        return NULL;
+}
+
+/*
+ * Find the trie for the paths of a host name, creating it if needed.
+ */
+static trie_t host_paths (const char *host, struct config_s *conf)
+{
+        trie_t paths, *found;
+
+        if (!conf->reversehosts) {
+                conf->reversehosts = hashmap_create (REVERSE_HOSTS);
+                if (!conf->reversehosts)
+                        return NULL;
+        }
+
+        if (hashmap_entry_by_key (conf->reversehosts, host,
+                                  (void **) &found) > 0)
+                return *found;
+
+        paths = trie_create (FALSE);
+        if (paths && hashmap_insert (conf->reversehosts, host, &paths,
+                                     sizeof (paths)) < 0) {
+                trie_delete (paths);
+                return NULL;
+        }
+
+        return paths;
+}
 
 /*
  * Add entry to the reversepath list
  */
 void reversepath_add (const char *path, const char *url,
-                      struct reversepath **reversepath_list)
+                      struct config_s *conf)
 {
         struct reversepath *reverse;
+        char host[256];
+        trie_t paths;
+        size_t len;
 
         if (url == NULL) {
                 log_message (LOG_WARNING,
@@ -41,19 +249,23 @@ void reversepath_add (const char *path, const char *url,
                 return;
         }
 
-        if (!strstr (url, "://")) {
+        if (!strstr (url, "://") && !IS_UNIX_URL (url)) {
                 log_message (LOG_WARNING,
                              "Skipping reverse proxy rule: '%s' is not a valid url",
                              url);
                 return;
         }
 
-        if (path && *path != '/') {
+        host[0] = '\0';
+        if (path && *path != '/'
+            && !split_host (path, host, sizeof (host))) {
                 log_message (LOG_WARNING,
                              "Skipping reverse proxy rule: path '%s' "
-                             "doesn't start with a /", path);
+                             "doesn't start with a / or a host name", path);
                 return;
         }
+        if (host[0])
+                path = strchr (path, '/');
 
         reverse = (struct reversepath *) safemalloc (sizeof
                                                      (struct reversepath));
@@ -68,31 +280,275 @@ void reversepath_add (const char *path, const char *url,
         else
                 reverse->path = safestrdup (path);
 
-        reverse->url = safestrdup (url);
+        reverse->host = host[0] ? safestrdup (host) : NULL;
+
+        if (IS_UNIX_URL (url)) {
+                len = strlen (url) + 17;
+                reverse->url = (char *) safemalloc (len);
+                if (reverse->url)
+                        snprintf (reverse->url, len, "http://localhost%s",
+                                  backend_path (url));
+        } else {
+                reverse->url = safestrdup (url);
+        }
+        reverse->cache_time = 0;
+        reverse->cache_vary = NULL;
+
+        memset (&reverse->pool, 0, sizeof (reverse->pool));
+        reverse->pool.policy = BALANCE_ROUNDROBIN;
+        reverse->backends = NULL;
+        reverse->cookie = NULL;
+        reverse->http2 = FALSE;
+        add_backend (reverse, url, 1);
+
+        reverse->next = conf->reversepath_list;
+        conf->reversepath_list = reverse;
 
-        reverse->next = *reversepath_list;
-        *reversepath_list = reverse;
+        /* A later rule for the same path (or URL) takes precedence */
+        if (reverse->host) {
+                paths = host_paths (reverse->host, conf);
+        } else {
+                if (!conf->reversepath_trie)
+                        conf->reversepath_trie = trie_create (FALSE);
+                paths = conf->reversepath_trie;
+        }
+        if (!conf->reverseurl_trie)
+                conf->reverseurl_trie = trie_create (TRUE);
+        if (!paths || !conf->reverseurl_trie
+            || trie_insert (paths, reverse->path, reverse) < 0
+            || trie_insert (conf->reverseurl_trie, reverse->url,
+                            reverse) < 0)
+                log_message (LOG_ERR,
+                             "Unable to allocate memory in reversepath_add()");
 
         log_message (LOG_INFO,
-                     "Added reverse proxy rule: %s -> %s", reverse->path,
+                     "Added reverse proxy rule: %s%s -> %s",
+                     reverse->host ? reverse->host : "", reverse->path,
                      reverse->url);
 }
 
 /*
- * Check if a request url is in the reversepath list
+ * Find the paths to look a request up in: those of the host named in its
+ * Host header, matched exactly or else by the longest "*." wildcard, or
+ * the paths configured without a host name if there are none.
  */
-struct reversepath *reversepath_get (char *url, struct reversepath *reverse)
+trie_t reversepath_routes (hashmap_t hashofheaders)
 {
-        while (reverse) {
-                if (strstr (url, reverse->path) == url)
-                        return reverse;
+        char name[256], *host, *dot;
+        trie_t *paths;
+        size_t len;
 
-                reverse = reverse->next;
+        if (!config.reversehosts
+            || hashmap_entry_by_key (hashofheaders, "host",
+                                     (void **) &host) <= 0)
+                return config.reversepath_trie;
+
+        /* Without the port, or the dot of a fully qualified name */
+        len = (*host == '[') ? strcspn (host, "]") + 1 : strcspn (host, ":");
+        if (len > 0 && host[len - 1] == '.')
+                len--;
+        if (len == 0 || len >= sizeof (name))
+                return config.reversepath_trie;
+
+        memcpy (name, host, len);
+        name[len] = '\0';
+
+        if (hashmap_entry_by_key (config.reversehosts, name,
+                                  (void **) &paths) > 0)
+                return *paths;
+
+        /*
+         * Try "*.example.com", then "*.com", for "www.example.com", by
+         * overwriting the character in front of each dot in turn.
+         */
+        for (dot = strchr (name + 1, '.'); dot; dot = strchr (dot + 1, '.')) {
+                dot[-1] = '*';
+                if (hashmap_entry_by_key (config.reversehosts, dot - 1,
+                                          (void **) &paths) > 0)
+                        return *paths;
+        }
+
+        return config.reversepath_trie;
+}
+
+/*
+ * Find the reverse path which is the longest prefix of a request url
+ */
+struct reversepath *reversepath_get (const char *url, trie_t paths)
+{
+        return (struct reversepath *) trie_longest_prefix (paths, url, NULL);
+}
+
+/*
+ * Find the reverse path whose backend URL is the longest prefix of a URL
+ * (regardless of case), and the length of that URL in "len"
+ */
+struct reversepath *reversepath_get_url (const char *url, size_t *len)
+{
+        return (struct reversepath *)
+            trie_longest_prefix (config.reverseurl_trie, url, len);
+}
+
+/*
+ * Let the cache keep the responses for a reverse path for some seconds,
+ * even if they do not say how long they stay fresh.  Returns -1 if there
+ * is no ReversePath for "path".
+ */
+int reversepath_cache (const char *path, unsigned int seconds,
+                       const char *vary, struct reversepath *reverse)
+{
+        reverse = reversepath_find (path, reverse, "ReverseCache");
+        if (!reverse)
+                return -1;
+
+        reverse->cache_time = seconds;
+        safefree (reverse->cache_vary);
+        reverse->cache_vary = vary ? safestrdup (vary) : NULL;
+        return 0;
+}
+
+/*
+ * Add another backend to a reverse path, turning it into a pool.  The
+ * redirects to the backend are rewritten like those to the first one.
+ */
+int reversepath_backend (const char *path, const char *url,
+                         unsigned int weight, struct config_s *conf)
+{
+        struct reversepath *reverse;
+
+        reverse = reversepath_find (path, conf->reversepath_list,
+                                    "ReverseBackend");
+        if (!reverse || add_backend (reverse, url, weight) < 0
+            || trie_insert (conf->reverseurl_trie, url, reverse) < 0)
+                return -1;
+
+        log_message (LOG_INFO, "Added reverse proxy backend: %s -> %s",
+                     reverse->path, url);
+        return 0;
+}
+
+/*
+ * Set how the backends of a reverse path are picked.  The "cookiehash"
+ * policy needs the name of the cookie which identifies a client.
+ */
+int reversepath_policy (const char *path, const char *policy,
+                        const char *cookie, struct reversepath *reverse)
+{
+        reverse = reversepath_find (path, reverse, "ReversePolicy");
+        if (!reverse || balancer_set_policy (&reverse->pool, policy) < 0)
+                return -1;
+
+        if (reverse->pool.policy == BALANCE_HASH_COOKIE && !cookie) {
+                log_message (LOG_WARNING,
+                             "ReversePolicy: cookiehash needs the name of "
+                             "a cookie");
+                return -1;
+        }
+
+        safefree (reverse->cookie);
+        reverse->cookie = cookie ? safestrdup (cookie) : NULL;
+        return 0;
+}
+
+/*
+ * Speak HTTP/2 to the backends of a reverse path, so that the requests
+ * of a child share a connection to each of them.
+ */
+int reversepath_http2 (const char *path, struct reversepath *reverse)
+{
+        reverse = reversepath_find (path, reverse, "ReverseHTTP2");
+        if (!reverse)
+                return -1;
+
+        reverse->http2 = TRUE;
+        return 0;
+}
+
+/*
+ * The key to balance a request on: the value of the configured cookie
+ * for the "cookiehash" policy, so that a client keeps using the same
+ * backend.  Returns NULL if there is none, or a string to be freed.
+ */
+char *reversepath_balance_key (struct reversepath *reverse,
+                               hashmap_t hashofheaders)
+{
+        char *cookies, *p, *key;
+        size_t len, keylen;
+
+        if (reverse->pool.policy != BALANCE_HASH_COOKIE || !reverse->cookie
+            || hashmap_entry_by_key (hashofheaders, "cookie",
+                                     (void **) &cookies) <= 0)
+                return NULL;
+
+        len = strlen (reverse->cookie);
+        for (p = cookies; (p = strstr (p, reverse->cookie)) != NULL; p += len) {
+                if ((p != cookies && p[-1] != ' ' && p[-1] != ';')
+                    || p[len] != '=')
+                        continue;
+
+                p += len + 1;
+                keylen = strcspn (p, "; ");
+                if (keylen == 0)
+                        return NULL;
+
+                key = (char *) safemalloc (keylen + 1);
+                if (key) {
+                        memcpy (key, p, keylen);
+                        key[keylen] = '\0';
+                }
+                return key;
         }
 
         return NULL;
 }
 
+/*
+ * Point a request rewritten for the first backend of a reverse path at
+ * the backend "peer" instead.
+ */
+int reversepath_retarget (struct reversepath *reverse,
+                          struct balancer_peer *peer,
+                          struct request_s *request)
+{
+        const char *from = backend_path (reverse->url);
+        const char *to = backend_path (reverse->backends[peer->index]);
+        size_t len = strlen (from);
+        char *host, *path = NULL;
+
+        host = safestrdup (peer->host);
+        if (!host)
+                return -1;
+
+        if (strcmp (from, to) != 0 && strncmp (request->path, from, len) == 0) {
+                path = (char *) safemalloc (strlen (to) +
+                                            strlen (request->path + len) + 1);
+                if (!path) {
+                        safefree (host);
+                        return -1;
+                }
+
+                strcpy (path, to);
+                strcat (path, request->path + len);
+                safefree (request->path);
+                request->path = path;
+        }
+
+        safefree (request->host);
+        request->host = host;
+        request->port = peer->port;
+        return 0;
+}
+
+/*
+ * Run the active health checks of the reverse path pools which are due.
+ */
+void reversepath_check_health (struct reversepath *reverse)
+{
+        for (; reverse; reverse = reverse->next)
+                if (reverse->pool.npeers > 1)
+                        balancer_check_health (&reverse->pool);
+}
+
 /**
  * Free a reversepath list
  */
@@ -101,13 +557,44 @@ void free_reversepath_list (struct reversepath *reverse)
 {
         while (reverse) {
                 struct reversepath *tmp = reverse;
+                unsigned int i;
+
                 reverse = reverse->next;
+                for (i = 0; i != tmp->pool.npeers; i++)
+                        safefree (tmp->backends[i]);
+                safefree (tmp->backends);
+                balancer_free_pool (&tmp->pool);
+                safefree (tmp->cookie);
+                safefree (tmp->host);
                 safefree (tmp->url);
                 safefree (tmp->path);
+                safefree (tmp->cache_vary);
                 safefree (tmp);
         }
 }
 
+/*
+ * Free the tries of the host names (their entries are in the list).
+ */
+void free_reversepath_hosts (hashmap_t hosts)
+{
+        hashmap_iter iter;
+        char *key;
+        trie_t *paths;
+
+        if (!hosts)
+                return;
+
+        for (iter = hashmap_first (hosts); iter >= 0
+             && !hashmap_is_end (hosts, iter); ++iter) {
+                if (hashmap_return_entry (hosts, iter, &key,
+                                          (void **) &paths) > 0)
+                        trie_delete (*paths);
+        }
+
+        hashmap_delete (hosts);
+}
+
 /*
  * Rewrite the URL for reverse proxying.
  */
@@ -118,11 +605,12 @@ char *reverse_rewrite_url (struct conn_s *connptr, hashmap_t hashofheaders,
         char *cookie = NULL;
         char *cookieval;
         struct reversepath *reverse = NULL;
+        trie_t paths = reversepath_routes (hashofheaders);
 
         /* Reverse requests always start with a slash */
         if (*url == '/') {
                 /* First try locating the reverse mapping by request url */
-                reverse = reversepath_get (url, config.reversepath_list);
+                reverse = reversepath_get (url, paths);
                 if (reverse) {
                         rewrite_url = (char *)
                             safemalloc (strlen (url) + strlen (reverse->url) +
@@ -139,7 +627,7 @@ char *reverse_rewrite_url (struct conn_s *connptr, hashmap_t hashofheaders,
                             && (reverse =
                                 reversepath_get (cookieval +
                                                  strlen (REVERSE_COOKIE) + 1,
-                                                 config.reversepath_list)))
+                                                 paths)))
                         {
 
                                 rewrite_url = (char *) safemalloc
@@ -172,5 +660,35 @@ char *reverse_rewrite_url (struct conn_s *connptr, hashmap_t hashofheaders,
         if (config.reversemagic && reverse)
                 connptr->reversepath = safestrdup (reverse->path);
 
+        /* Balanced over the backends when the connection is made */
+        if (reverse && reverse->pool.npeers > 1)
+                connptr->reverse_pool = reverse;
+        connptr->reverse_http2 = reverse && reverse->http2;
+
+        /* The path of the socket of a unix: backend stands for its host */
+        if (reverse && reverse->pool.peers
+            && *reverse->pool.peers->host == '/')
+                connptr->reverse_socket =
+                    safestrdup (reverse->pool.peers->host);
+
+        /* Copied, as the configuration may be reloaded meanwhile */
+        if (reverse && reverse->cache_time > 0) {
+                connptr->cache_time = reverse->cache_time;
+                if (reverse->cache_vary)
+                        connptr->cache_vary = safestrdup (reverse->cache_vary);
+        }
+
         return rewrite_url;
 }
+
+/*
+ * Keep the addresses of the reverse proxy backends in the DNS cache.
+ */
+void reversepath_prefetch (struct reversepath *reverse)
+{
+        struct balancer_peer *peer;
+
+        for (; reverse; reverse = reverse->next)
+                for (peer = reverse->pool.peers; peer; peer = peer->next)
+                        dns_prefetch (peer->host);
+}
@@ -21,21 +21,54 @@
 #ifndef TINYPROXY_REVERSE_PROXY_H
 #define TINYPROXY_REVERSE_PROXY_H
 
+#include "balancer.h"
 #include "conns.h"
+#include "conf.h"
+#include "reqs.h"
 
 struct reversepath {
         struct reversepath *next;
+        char *host;             /* NULL for any host, may start with "*." */
         char *path;
         char *url;
+        unsigned int cache_time;        /* ReverseCache */
+        char *cache_vary;
+
+        /*
+         * The backends, "url" being the first.  The requests are only
+         * balanced when ReverseBackend added some more.
+         */
+        struct balancer_pool pool;
+        char **backends;                /* their URLs, by peer index */
+        char *cookie;                   /* hashed by ReversePolicy */
+        unsigned int http2;             /* ReverseHTTP2 */
 };
 
 #define REVERSE_COOKIE "yummy_magical_cookie"
 
 extern void reversepath_add (const char *path, const char *url,
-                             struct reversepath **reversepath_list);
-extern struct reversepath *reversepath_get (char *url,
-                                            struct reversepath *reverse);
+                             struct config_s *conf);
+extern trie_t reversepath_routes (hashmap_t hashofheaders);
+extern struct reversepath *reversepath_get (const char *url, trie_t paths);
+extern struct reversepath *reversepath_get_url (const char *url,
+                                                size_t *len);
+extern int reversepath_cache (const char *path, unsigned int seconds,
+                              const char *vary, struct reversepath *reverse);
+extern int reversepath_backend (const char *path, const char *url,
+                                unsigned int weight, struct config_s *conf);
+extern int reversepath_policy (const char *path, const char *policy,
+                               const char *cookie,
+                               struct reversepath *reverse);
+extern int reversepath_http2 (const char *path, struct reversepath *reverse);
+extern char *reversepath_balance_key (struct reversepath *reverse,
+                                      hashmap_t hashofheaders);
+extern int reversepath_retarget (struct reversepath *reverse,
+                                 struct balancer_peer *peer,
+                                 struct request_s *request);
+extern void reversepath_check_health (struct reversepath *reverse);
 void free_reversepath_list (struct reversepath *reverse);
+void free_reversepath_hosts (hashmap_t hosts);
+extern void reversepath_prefetch (struct reversepath *reverse);
 extern char *reverse_rewrite_url (struct conn_s *connptr,
                                   hashmap_t hashofheaders, char *url);
 
@@ -0,0 +1,87 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Inter-process locks for the structures kept in shared memory.  This is
+ * the same technique used for the "servers_waiting" counter in child.c:
+ * a temporary file is created (and immediately unlinked) before the
+ * children are forked, and fcntl() record locks are taken on it.  Each
+ * lock is a single byte of the file, so independent structures do not
+ * block one another.
+ */
+
+#include "main.h"
+
+#include "log.h"
+#include "shared-lock.h"
+
+static int lock_fd = -1;
+
+/*
+ * Create the lock file.  This MUST be called before any children are
+ * created so that they all inherit the descriptor.
+ */
+int shared_lock_init (void)
+{
+        char lock_file[] = "/tmp/tinyproxy.shared.lock.XXXXXX";
+
+        if (lock_fd >= 0)
+                return 0;
+
+        /* Only allow u+rw bits. This may be required for some versions
+         * of glibc so that mkstemp() doesn't make us vulnerable.
+         */
+        umask (0177);
+
+        lock_fd = mkstemp (lock_file);
+        if (lock_fd < 0) {
+                log_message (LOG_ERR, "Could not create shared lock file: %s",
+                             strerror (errno));
+                return -1;
+        }
+        unlink (lock_file);
+
+        return 0;
+}
+
+static void set_lock (shared_lock_t which, short type)
+{
+        struct flock fl;
+
+        if (lock_fd < 0)
+                return;
+
+        fl.l_type = type;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = (off_t) which;
+        fl.l_len = 1;
+
+        while (fcntl (lock_fd, F_SETLKW, &fl) < 0) {
+                if (errno != EINTR)
+                        return;
+        }
+}
+
+void shared_lock_wait (shared_lock_t which)
+{
+        set_lock (which, F_WRLCK);
+}
+
+void shared_lock_release (shared_lock_t which)
+{
+        set_lock (which, F_UNLCK);
+}
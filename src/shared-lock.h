@@ -0,0 +1,39 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'shared-lock.c' for detailed information. */
+
+#ifndef TINYPROXY_SHARED_LOCK_H
+#define TINYPROXY_SHARED_LOCK_H
+
+/*
+ * Each lock protects one structure living in shared memory.  Add a new
+ * entry here when another module needs to serialize access between the
+ * children.
+ */
+typedef enum {
+        LOCK_BALANCER,
+        LOCK_DNS,
+        LOCK_CACHE
+} shared_lock_t;
+
+extern int shared_lock_init (void);
+extern void shared_lock_wait (shared_lock_t which);
+extern void shared_lock_release (shared_lock_t which);
+
+#endif
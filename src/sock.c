@@ -27,6 +27,7 @@
 
 #include "main.h"
 
+#include "dns.h"
 #include "log.h"
 #include "heap.h"
 #include "network.h"
@@ -71,17 +72,154 @@ bind_socket (int sockfd, const char *addr, int family)
 }
 
 /*
- * Open a connection to a remote host.  It's been re-written to use
- * the getaddrinfo() library function, which allows for a protocol
- * independent implementation (mostly for IPv4 and IPv6 addresses.)
+ * Up to this many addresses of a host are tried, with a new attempt
+ * started every CONNECT_ATTEMPT_DELAY milliseconds while the earlier
+ * ones are still pending (the "Happy Eyeballs" algorithm of RFC 8305).
  */
-int opensock (const char *host, int port, const char *bind_to)
+#define MAX_CONNECT_ATTEMPTS 16
+#define CONNECT_ATTEMPT_DELAY 250
+
+/*
+ * Order the addresses returned by getaddrinfo() so that the address
+ * families alternate, starting with the preferred one.  This way a host
+ * with broken IPv6 connectivity does not hold up the IPv4 attempts.
+ */
+static unsigned int
+interleave_addresses (struct addrinfo *res, struct addrinfo **addrs,
+                      unsigned int max)
 {
-        int sockfd, n;
-        struct addrinfo hints, *res, *ressave;
+        struct addrinfo *first = res, *second;
+        int family = res->ai_family;
+        unsigned int n = 0;
+
+        for (second = res; second && second->ai_family == family;
+             second = second->ai_next) ;
+
+        while ((first || second) && n < max) {
+                if (first) {
+                        addrs[n++] = first;
+                        do {
+                                first = first->ai_next;
+                        } while (first && first->ai_family != family);
+                }
+
+                if (second && n < max) {
+                        addrs[n++] = second;
+                        do {
+                                second = second->ai_next;
+                        } while (second && second->ai_family == family);
+                }
+        }
+
+        return n;
+}
+
+static long elapsed_ms (const struct timeval *since)
+{
+        struct timeval now;
+
+        gettimeofday (&now, NULL);
+        return (now.tv_sec - since->tv_sec) * 1000L
+            + (now.tv_usec - since->tv_usec) / 1000L;
+}
+
+/*
+ * Start a non-blocking connection to one address.  Returns the socket,
+ * or -1 if the attempt failed straight away; "done" is set if the
+ * connection was established immediately.
+ */
+static int
+start_connect (struct addrinfo *ai, const char *bind_to, int *done)
+{
+        int sockfd;
+
+        sockfd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sockfd < 0)
+                return -1;
+
+        /* Bind to the specified address */
+        if (!bind_to)
+                bind_to = config.bind_address;
+        if (bind_to && bind_socket (sockfd, bind_to, ai->ai_family) < 0) {
+                close (sockfd);
+                return -1;
+        }
+
+        socket_nonblocking (sockfd);
+
+        if (connect (sockfd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                *done = TRUE;
+                return sockfd;
+        }
+
+        if (errno == EINPROGRESS) {
+                *done = FALSE;
+                return sockfd;
+        }
+
+        close (sockfd);
+        return -1;
+}
+
+/*
+ * Connect to a unix domain socket.  A local server accepts or refuses
+ * the connection at once, so there is no need for a timeout.
+ */
+static int opensock_unix (const char *path)
+{
+        struct sockaddr_un addr;
+        int sockfd;
+
+        if (strlen (path) >= sizeof (addr.sun_path))
+                return -1;
+
+        memset (&addr, 0, sizeof (addr));
+        addr.sun_family = AF_UNIX;
+        strlcpy (addr.sun_path, path, sizeof (addr.sun_path));
+
+        sockfd = socket (AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd < 0)
+                return -2;
+
+        if (connect (sockfd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+                close (sockfd);
+                return -2;
+        }
+
+        return sockfd;
+}
+
+/*
+ * Open a connection to a remote host, giving up after "timeout" seconds
+ * (0 means no limit other than the kernel's).  The addresses of the
+ * host are tried in parallel, staggered, and the first connection to
+ * succeed wins.  The socket returned is in blocking mode.  A "host" which
+ * starts with a slash is the path of a unix domain socket, and "port"
+ * is then ignored.
+ *
+ * Returns -1 if the host could not be resolved, and -2 if no connection
+ * could be established.  Nothing is logged.
+ */
+int opensock_timeout (const char *host, int port, const char *bind_to,
+                      unsigned int timeout)
+{
+        struct addrinfo hints, *res;
+        struct addrinfo *addrs[MAX_CONNECT_ATTEMPTS];
+        int pending[MAX_CONNECT_ATTEMPTS];
+        unsigned int naddrs, next = 0, npending = 0, i;
+        unsigned int start_now = TRUE;
+        int sockfd = -1, fd, done, maxfd, err;
+        socklen_t len;
+        struct timeval start, last, tv;
+        fd_set wset;
+        long wait, left;
         char portstr[6];
 
         assert (host != NULL);
+
+        if (*host == '/')
+                return opensock_unix (host);
+
         assert (port > 0);
 
         memset (&hints, 0, sizeof (struct addrinfo));
@@ -90,43 +228,143 @@ int opensock (const char *host, int port, const char *bind_to)
 
         snprintf (portstr, sizeof (portstr), "%d", port);
 
-        n = getaddrinfo (host, portstr, &hints, &res);
-        if (n != 0) {
-                log_message (LOG_ERR,
-                             "opensock: Could not retrieve info for %s", host);
+        if (dns_getaddrinfo (host, portstr, &hints, &res) != 0)
                 return -1;
-        }
 
-        ressave = res;
-        do {
-                sockfd =
-                    socket (res->ai_family, res->ai_socktype, res->ai_protocol);
-                if (sockfd < 0)
-                        continue;       /* ignore this one */
-
-                /* Bind to the specified address */
-                if (bind_to) {
-                        if (bind_socket (sockfd, bind_to,
-                                         res->ai_family) < 0) {
-                                close (sockfd);
-                                continue;       /* can't bind, so try again */
+        naddrs = interleave_addresses (res, addrs, MAX_CONNECT_ATTEMPTS);
+        gettimeofday (&start, NULL);
+
+        for (;;) {
+                /*
+                 * Start the next attempt if nothing is pending, if the
+                 * previous attempt failed, or if it has been pending for
+                 * longer than the attempt delay.
+                 */
+                if (next < naddrs
+                    && (start_now || npending == 0
+                        || elapsed_ms (&last) >= CONNECT_ATTEMPT_DELAY)) {
+                        start_now = FALSE;
+                        gettimeofday (&last, NULL);
+
+                        fd = start_connect (addrs[next++], bind_to, &done);
+                        if (fd < 0) {
+                                start_now = TRUE;
+                                continue;
                         }
-                } else if (config.bind_address) {
-                        if (bind_socket (sockfd, config.bind_address,
-                                         res->ai_family) < 0) {
-                                close (sockfd);
-                                continue;       /* can't bind, so try again */
+
+                        if (done) {
+                                sockfd = fd;
+                                break;
                         }
+
+                        pending[npending++] = fd;
                 }
 
-                if (connect (sockfd, res->ai_addr, res->ai_addrlen) == 0)
-                        break;  /* success */
+                if (npending == 0)
+                        break;  /* every address failed */
 
-                close (sockfd);
-        } while ((res = res->ai_next) != NULL);
+                wait = -1;
+                if (next < naddrs) {
+                        wait = CONNECT_ATTEMPT_DELAY - elapsed_ms (&last);
+                        if (wait < 0)
+                                wait = 0;
+                }
 
-        freeaddrinfo (ressave);
-        if (res == NULL) {
+                if (timeout > 0) {
+                        left = timeout * 1000L - elapsed_ms (&start);
+                        if (left <= 0)
+                                break;  /* deadline passed */
+                        if (wait < 0 || left < wait)
+                                wait = left;
+                }
+
+                FD_ZERO (&wset);
+                maxfd = -1;
+                for (i = 0; i != npending; i++) {
+                        FD_SET (pending[i], &wset);
+                        if (pending[i] > maxfd)
+                                maxfd = pending[i];
+                }
+
+                tv.tv_sec = wait / 1000;
+                tv.tv_usec = (wait % 1000) * 1000;
+
+                if (select (maxfd + 1, NULL, &wset, NULL,
+                            wait >= 0 ? &tv : NULL) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+
+                for (i = 0; i < npending;) {
+                        if (!FD_ISSET (pending[i], &wset)) {
+                                i++;
+                                continue;
+                        }
+
+                        len = sizeof (err);
+                        if (getsockopt (pending[i], SOL_SOCKET, SO_ERROR,
+                                        &err, &len) == 0 && err == 0) {
+                                sockfd = pending[i];
+                                pending[i] = pending[--npending];
+                                break;
+                        }
+
+                        /* This one failed; start the next one right away */
+                        close (pending[i]);
+                        pending[i] = pending[--npending];
+                        start_now = TRUE;
+                }
+
+                if (sockfd >= 0)
+                        break;
+        }
+
+        for (i = 0; i != npending; i++)
+                close (pending[i]);
+
+        dns_freeaddrinfo (res);
+
+        if (sockfd < 0)
+                return -2;
+
+#ifdef TCP_NODELAY
+        /*
+         * The headers of a request are written in several pieces, and on
+         * a connection which is kept for more requests, Nagle's algorithm
+         * would hold the later pieces back until the server's delayed
+         * acknowledgement of the first one.
+         */
+        {
+                int on = 1;
+
+                setsockopt (sockfd, IPPROTO_TCP, TCP_NODELAY, &on,
+                            sizeof (on));
+        }
+#endif
+
+        socket_blocking (sockfd);
+        return sockfd;
+}
+
+/*
+ * Open a connection to a remote host.  It's been re-written to use
+ * the getaddrinfo() library function, which allows for a protocol
+ * independent implementation (mostly for IPv4 and IPv6 addresses.)
+ */
+int opensock (const char *host, int port, const char *bind_to)
+{
+        int sockfd;
+
+        sockfd = opensock_timeout (host, port, bind_to,
+                                   config.connect_timeout);
+        if (sockfd == -1) {
+                log_message (LOG_ERR,
+                             "opensock: Could not retrieve info for %s", host);
+                return -1;
+        }
+
+        if (sockfd < 0) {
                 log_message (LOG_ERR,
                              "opensock: Could not establish a connection to %s",
                              host);
@@ -29,6 +29,8 @@
 #define MAXLINE (1024 * 4)
 
 extern int opensock (const char *host, int port, const char *bind_to);
+extern int opensock_timeout (const char *host, int port, const char *bind_to,
+                             unsigned int timeout);
 extern int listen_sock (uint16_t port, socklen_t * addrlen);
 
 extern int socket_nonblocking (int sock);
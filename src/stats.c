@@ -27,6 +27,8 @@
 
 #include "main.h"
 
+#include "balancer.h"
+#include "cache.h"
 #include "log.h"
 #include "heap.h"
 #include "html-error.h"
@@ -40,6 +42,9 @@ struct stat_s {
         unsigned long int num_open;
         unsigned long int num_refused;
         unsigned long int num_denied;
+        unsigned long int num_keepalive;
+        unsigned long int num_pool_hits;
+        unsigned long int num_pool_misses;
 };
 
 static struct stat_s *stats;
@@ -63,7 +68,13 @@ int
 showstats (struct conn_s *connptr)
 {
         char *message_buffer;
+        char *peers, *peers_table;
         char opens[16], reqs[16], badconns[16], denied[16], refused[16];
+        char keepalives[16], poolhits[16], poolmisses[16];
+        char cachehits[16], cachemisses[16], cacheratio[24], cachesaved[24];
+        char cachediskhits[16];
+        unsigned long hits, misses, disk_hits, saved;
+        unsigned int npeers;
         FILE *statfile;
 
         snprintf (opens, sizeof (opens), "%lu", stats->num_open);
@@ -71,11 +82,44 @@ showstats (struct conn_s *connptr)
         snprintf (badconns, sizeof (badconns), "%lu", stats->num_badcons);
         snprintf (denied, sizeof (denied), "%lu", stats->num_denied);
         snprintf (refused, sizeof (refused), "%lu", stats->num_refused);
+        snprintf (keepalives, sizeof (keepalives), "%lu",
+                  stats->num_keepalive);
+        snprintf (poolhits, sizeof (poolhits), "%lu", stats->num_pool_hits);
+        snprintf (poolmisses, sizeof (poolmisses), "%lu",
+                  stats->num_pool_misses);
+
+        cache_stats (&hits, &misses, &disk_hits, &saved);
+        snprintf (cachehits, sizeof (cachehits), "%lu", hits);
+        snprintf (cachediskhits, sizeof (cachediskhits), "%lu", disk_hits);
+        snprintf (cachemisses, sizeof (cachemisses), "%lu", misses);
+        snprintf (cacheratio, sizeof (cacheratio), "%lu%%",
+                  hits + misses > 0 ? hits * 100 / (hits + misses) : 0);
+        snprintf (cachesaved, sizeof (cachesaved), "%lu", saved / 1024);
+
+        /* State of the upstream proxies and their circuit breakers */
+        peers = (char *) safemalloc (MAXBUFFSIZE / 2);
+        if (!peers)
+                return -1;
+        npeers = balancer_status_html (peers, MAXBUFFSIZE / 2);
 
         if (!config.statpage || (!(statfile = fopen (config.statpage, "r")))) {
                 message_buffer = (char *) safemalloc (MAXBUFFSIZE);
-                if (!message_buffer)
+                peers_table = (char *) safemalloc (MAXBUFFSIZE / 2 + 256);
+                if (!message_buffer || !peers_table) {
+                        safefree (message_buffer);
+                        safefree (peers_table);
+                        safefree (peers);
                         return -1;
+                }
+
+                peers_table[0] = '\0';
+                if (npeers > 0)
+                        snprintf (peers_table, MAXBUFFSIZE / 2 + 256,
+                                  "<table>\n"
+                                  "<tr><th>Upstream</th><th>Breaker</th>"
+                                  "<th>Health</th><th>Active</th>"
+                                  "<th>Failures</th><th>Retry in</th></tr>\n"
+                                  "%s</table>\n", peers);
 
                 snprintf
                   (message_buffer, MAXBUFFSIZE,
@@ -89,18 +133,30 @@ showstats (struct conn_s *connptr)
                    "<p>\n"
                    "Number of open connections: %lu<br />\n"
                    "Number of requests: %lu<br />\n"
+                   "Number of requests on persistent connections: %lu<br />\n"
+                   "Server connections reused from the pool: %lu<br />\n"
+                   "Server connections not found in the pool: %lu<br />\n"
+                   "Cache hits: %s (%s of %lu lookups), %s from disk<br />\n"
+                   "Kilobytes served from the cache: %s<br />\n"
                    "Number of bad connections: %lu<br />\n"
                    "Number of denied connections: %lu<br />\n"
                    "Number of refused connections due to high load: %lu\n"
                    "</p>\n"
+                   "%s"
                    "<hr />\n"
                    "<p><em>Generated by %s version %s.</em></p>\n" "</body>\n"
                    "</html>\n",
                    PACKAGE, VERSION, PACKAGE, VERSION,
                    stats->num_open,
-                   stats->num_reqs,
+                   stats->num_reqs, stats->num_keepalive,
+                   stats->num_pool_hits, stats->num_pool_misses,
+                   cachehits, cacheratio, hits + misses, cachediskhits,
+                   cachesaved,
                    stats->num_badcons, stats->num_denied,
-                   stats->num_refused, PACKAGE, VERSION);
+                   stats->num_refused, peers_table, PACKAGE, VERSION);
+
+                safefree (peers_table);
+                safefree (peers);
 
                 if (send_http_message (connptr, 200, "OK",
                                        message_buffer) < 0) {
@@ -117,10 +173,20 @@ showstats (struct conn_s *connptr)
         add_error_variable (connptr, "badconns", badconns);
         add_error_variable (connptr, "deniedconns", denied);
         add_error_variable (connptr, "refusedconns", refused);
+        add_error_variable (connptr, "keepalives", keepalives);
+        add_error_variable (connptr, "poolhits", poolhits);
+        add_error_variable (connptr, "poolmisses", poolmisses);
+        add_error_variable (connptr, "cachehits", cachehits);
+        add_error_variable (connptr, "cachemisses", cachemisses);
+        add_error_variable (connptr, "cachediskhits", cachediskhits);
+        add_error_variable (connptr, "cacheratio", cacheratio);
+        add_error_variable (connptr, "cachesaved", cachesaved);
+        add_error_variable (connptr, "upstreams", peers);
         add_standard_vars (connptr);
         send_http_headers (connptr, 200, "Statistic requested");
         send_html_file (statfile, connptr);
         fclose (statfile);
+        safefree (peers);
 
         return 0;
 }
@@ -148,6 +214,16 @@ int update_stats (status_t update_level)
         case STAT_DENIED:
                 ++stats->num_denied;
                 break;
+        case STAT_KEEPALIVE:
+                ++stats->num_reqs;
+                ++stats->num_keepalive;
+                break;
+        case STAT_POOL_HIT:
+                ++stats->num_pool_hits;
+                break;
+        case STAT_POOL_MISS:
+                ++stats->num_pool_misses;
+                break;
         default:
                 return -1;
         }
@@ -31,7 +31,10 @@ typedef enum {
         STAT_OPEN,              /* connection opened */
         STAT_CLOSE,             /* connection closed */
         STAT_REFUSE,            /* connection refused (to outside world) */
-        STAT_DENIED             /* connection denied to tinyproxy itself */
+        STAT_DENIED,            /* connection denied to tinyproxy itself */
+        STAT_KEEPALIVE,         /* request on an already open connection */
+        STAT_POOL_HIT,          /* server connection reused from the pool */
+        STAT_POOL_MISS          /* no idle server connection in the pool */
 } status_t;
 
 /*
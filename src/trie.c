@@ -0,0 +1,193 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A byte-level prefix tree, for finding the longest key which is a
+ * prefix of a string in time proportional to the length of that key.
+ *
+ * Each node keeps the bytes leading to its children in a sorted array,
+ * searched with a binary search, so that the wide nodes near the root
+ * of a tree of many paths stay quick to go through.
+ */
+
+#include "main.h"
+
+#include "heap.h"
+#include "trie.h"
+
+struct trie_node {
+        void *data;             /* if a key ends here */
+        unsigned int nchildren;
+        unsigned char *bytes;   /* sorted */
+        struct trie_node **children;
+};
+
+struct trie_s {
+        struct trie_node root;
+        int nocase;
+};
+
+trie_t trie_create (int nocase)
+{
+        trie_t trie;
+
+        trie = (trie_t) safecalloc (1, sizeof (struct trie_s));
+        if (!trie)
+                return NULL;
+
+        trie->nocase = nocase;
+        return trie;
+}
+
+static void free_children (struct trie_node *node)
+{
+        unsigned int i;
+
+        for (i = 0; i != node->nchildren; i++) {
+                free_children (node->children[i]);
+                safefree (node->children[i]);
+        }
+
+        safefree (node->bytes);
+        safefree (node->children);
+}
+
+void trie_delete (trie_t trie)
+{
+        if (!trie)
+                return;
+
+        free_children (&trie->root);
+        safefree (trie);
+}
+
+/*
+ * Find the position of a byte among the children of a node, or where it
+ * would go.
+ */
+static unsigned int
+child_index (struct trie_node *node, unsigned char byte)
+{
+        unsigned int low = 0, high = node->nchildren, mid;
+
+        while (low < high) {
+                mid = (low + high) / 2;
+                if (node->bytes[mid] < byte)
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+
+        return low;
+}
+
+static unsigned char key_byte (trie_t trie, const char *key)
+{
+        unsigned char byte = (unsigned char) *key;
+
+        return trie->nocase ? (unsigned char) tolower (byte) : byte;
+}
+
+int trie_insert (trie_t trie, const char *key, void *data)
+{
+        struct trie_node *node = &trie->root;
+        struct trie_node *child, **children;
+        unsigned char byte, *bytes;
+        unsigned int i, n;
+
+        assert (trie != NULL);
+        assert (key != NULL);
+        assert (data != NULL);
+
+        for (; *key; key++) {
+                byte = key_byte (trie, key);
+                i = child_index (node, byte);
+                if (i < node->nchildren && node->bytes[i] == byte) {
+                        node = node->children[i];
+                        continue;
+                }
+
+                child = (struct trie_node *)
+                    safecalloc (1, sizeof (struct trie_node));
+                if (!child)
+                        return -1;
+
+                n = node->nchildren + 1;
+                bytes = (unsigned char *) saferealloc (node->bytes, n);
+                if (!bytes) {
+                        safefree (child);
+                        return -1;
+                }
+                node->bytes = bytes;
+
+                children = (struct trie_node **)
+                    saferealloc (node->children,
+                                 n * sizeof (struct trie_node *));
+                if (!children) {
+                        safefree (child);
+                        return -1;
+                }
+                node->children = children;
+
+                memmove (node->bytes + i + 1, node->bytes + i,
+                         node->nchildren - i);
+                memmove (node->children + i + 1, node->children + i,
+                         (node->nchildren - i) * sizeof (struct trie_node *));
+                node->bytes[i] = byte;
+                node->children[i] = child;
+                node->nchildren = n;
+
+                node = child;
+        }
+
+        node->data = data;
+        return 0;
+}
+
+void *trie_longest_prefix (trie_t trie, const char *str, size_t *len)
+{
+        struct trie_node *node;
+        void *found = NULL;
+        size_t depth = 0;
+        unsigned char byte;
+        unsigned int i;
+
+        if (!trie)
+                return NULL;
+
+        node = &trie->root;
+        for (;;) {
+                if (node->data) {
+                        found = node->data;
+                        if (len)
+                                *len = depth;
+                }
+
+                if (!str[depth])
+                        break;
+
+                byte = key_byte (trie, str + depth);
+                i = child_index (node, byte);
+                if (i == node->nchildren || node->bytes[i] != byte)
+                        break;
+
+                node = node->children[i];
+                depth++;
+        }
+
+        return found;
+}
@@ -0,0 +1,56 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * Copyright (C) 2026 Tinyproxy developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'trie.c' for detailed information. */
+
+#ifndef TINYPROXY_TRIE_H
+#define TINYPROXY_TRIE_H
+
+#include "common.h"
+
+/*
+ * Like the hashmap_t, the trie_t hides the structure in the C file.
+ */
+typedef struct trie_s *trie_t;
+
+/*
+ * trie_create() makes an empty trie.  With "nocase" set, the keys are
+ * matched regardless of case.  trie_delete() frees it, but not the data
+ * stored in it.
+ */
+extern trie_t trie_create (int nocase);
+extern void trie_delete (trie_t trie);
+
+/*
+ * Store "data" (which must not be NULL) under a key, replacing what was
+ * stored under the same key before.  The key is copied.
+ *
+ * Returns: negative on error
+ *          0 upon successful insert
+ */
+extern int trie_insert (trie_t trie, const char *key, void *data);
+
+/*
+ * Find the data stored under the longest key which is a prefix of "str",
+ * and that length in "len" (if it is not NULL).
+ *
+ * Returns: NULL if no key is a prefix of "str"
+ */
+extern void *trie_longest_prefix (trie_t trie, const char *str, size_t *len);
+
+#endif
@@ -27,12 +27,15 @@
 #include "upstream.h"
 #include "heap.h"
 #include "log.h"
+#include "dns.h"
 
 #ifdef UPSTREAM_SUPPORT
 /**
  * Construct an upstream struct from input data.
  */
-static struct upstream *upstream_build (const char *host, int port, const char *domain)
+static struct upstream *upstream_build (const char *host, int port,
+                                        const char *domain,
+                                        struct upstream_group *group)
 {
         char *ptr;
         struct upstream *up;
@@ -45,10 +48,25 @@ static struct upstream *upstream_build (const char *host, int port, const char *
         }
 
         up->host = up->domain = NULL;
+        up->group = group;
         up->ip = up->mask = 0;
+        memset (&up->pool, 0, sizeof (up->pool));
 
-        if (domain == NULL) {
-                if (!host || host[0] == '\0' || port < 1) {
+        if (group != NULL) {
+                if (domain && domain[0] == '\0') {
+                        log_message (LOG_WARNING,
+                                     "Nonsense upstream rule: empty domain");
+                        goto fail;
+                }
+
+                if (domain)
+                        up->domain = safestrdup (domain);
+
+                log_message (LOG_INFO, "Added upstream group %s for %s",
+                             group->name, domain ? domain : "[default]");
+        } else if (domain == NULL) {
+                if (!host || host[0] == '\0'
+                    || (port < 1 && host[0] != '/')) {
                         log_message (LOG_WARNING,
                                      "Nonsense upstream rule: invalid host or port");
                         goto fail;
@@ -56,6 +74,8 @@ static struct upstream *upstream_build (const char *host, int port, const char *
 
                 up->host = safestrdup (host);
                 up->port = port;
+                if (balancer_add_peer (&up->pool, host, port, 1) < 0)
+                        goto fail;
 
                 log_message (LOG_INFO, "Added upstream %s:%d for [default]",
                              host, port);
@@ -90,8 +110,9 @@ static struct upstream *upstream_build (const char *host, int port, const char *
 
                 log_message (LOG_INFO, "Added no-upstream for %s", domain);
         } else {
-                if (!host || host[0] == '\0' || port < 1 || !domain
-                    || domain == '\0') {
+                if (!host || host[0] == '\0'
+                    || (port < 1 && host[0] != '/') || !domain
+                    || domain[0] == '\0') {
                         log_message (LOG_WARNING,
                                      "Nonsense upstream rule: invalid parameters");
                         goto fail;
@@ -100,6 +121,8 @@ static struct upstream *upstream_build (const char *host, int port, const char *
                 up->host = safestrdup (host);
                 up->port = port;
                 up->domain = safestrdup (domain);
+                if (balancer_add_peer (&up->pool, host, port, 1) < 0)
+                        goto fail;
 
                 log_message (LOG_INFO, "Added upstream %s:%d for %s",
                              host, port, domain);
@@ -108,6 +131,7 @@ static struct upstream *upstream_build (const char *host, int port, const char *
         return up;
 
 fail:
+        balancer_free_pool (&up->pool);
         safefree (up->host);
         safefree (up->domain);
         safefree (up);
@@ -116,18 +140,11 @@ fail:
 }
 
 /*
- * Add an entry to the upstream list
+ * Insert a newly built entry into the upstream list
  */
-void upstream_add (const char *host, int port, const char *domain,
-                   struct upstream **upstream_list)
+static void upstream_insert (struct upstream *up,
+                             struct upstream **upstream_list)
 {
-        struct upstream *up;
-
-        up = upstream_build (host, port, domain);
-        if (up == NULL) {
-                return;
-        }
-
         if (!up->domain && !up->ip) {   /* always add default to end */
                 struct upstream *tmp = *upstream_list;
 
@@ -154,6 +171,7 @@ void upstream_add (const char *host, int port, const char *domain,
         return;
 
 upstream_cleanup:
+        balancer_free_pool (&up->pool);
         safefree (up->host);
         safefree (up->domain);
         safefree (up);
@@ -161,6 +179,46 @@ upstream_cleanup:
         return;
 }
 
+/*
+ * Add an entry to the upstream list
+ */
+void upstream_add (const char *host, int port, const char *domain,
+                   struct upstream **upstream_list)
+{
+        struct upstream *up;
+
+        up = upstream_build (host, port, domain, NULL);
+        if (up == NULL) {
+                return;
+        }
+
+        upstream_insert (up, upstream_list);
+}
+
+/*
+ * Add an entry to the upstream list which sends the matching requests
+ * to a group of upstream proxies.  The group is created if it has not
+ * been defined yet, so the rule may precede the group's members in the
+ * config file.
+ */
+void upstream_add_group (const char *name, const char *domain,
+                         struct upstream **upstream_list,
+                         struct upstream_group **groups)
+{
+        struct upstream_group *group;
+        struct upstream *up;
+
+        group = upstream_group_get (name, groups);
+        if (group == NULL)
+                return;
+
+        up = upstream_build (NULL, 0, domain, group);
+        if (up == NULL)
+                return;
+
+        upstream_insert (up, upstream_list);
+}
+
 /*
  * Check if a host is in the upstream list
  */
@@ -198,10 +256,13 @@ struct upstream *upstream_get (char *host, struct upstream *up)
                 up = up->next;
         }
 
-        if (up && (!up->host || !up->port))
+        if (up && !up->group && (!up->host || !up->port))
                 up = NULL;
 
-        if (up)
+        if (up && up->group)
+                log_message (LOG_INFO, "Found upstream group %s for %s",
+                             up->group->name, host);
+        else if (up)
                 log_message (LOG_INFO, "Found upstream proxy %s:%d for %s",
                              up->host, up->port, host);
         else
@@ -215,10 +276,81 @@ void free_upstream_list (struct upstream *up)
         while (up) {
                 struct upstream *tmp = up;
                 up = up->next;
+                balancer_free_pool (&tmp->pool);
                 safefree (tmp->domain);
                 safefree (tmp->host);
                 safefree (tmp);
         }
 }
 
+/*
+ * Find the upstream group with the given name, creating an empty one if
+ * it does not exist.
+ */
+struct upstream_group *upstream_group_get (const char *name,
+                                           struct upstream_group **groups)
+{
+        struct upstream_group *group, **tail;
+
+        for (tail = groups; *tail; tail = &(*tail)->next) {
+                if (strcasecmp ((*tail)->name, name) == 0)
+                        return *tail;
+        }
+
+        group = (struct upstream_group *)
+            safecalloc (1, sizeof (struct upstream_group));
+        if (!group) {
+                log_message (LOG_ERR,
+                             "Unable to allocate memory in upstream_group_get()");
+                return NULL;
+        }
+
+        group->name = safestrdup (name);
+        if (!group->name) {
+                safefree (group);
+                return NULL;
+        }
+
+        group->pool.policy = BALANCE_ROUNDROBIN;
+        *tail = group;
+
+        return group;
+}
+
+void free_upstream_groups (struct upstream_group *groups)
+{
+        while (groups) {
+                struct upstream_group *tmp = groups;
+                groups = groups->next;
+                balancer_free_pool (&tmp->pool);
+                safefree (tmp->name);
+                safefree (tmp);
+        }
+}
+
+/*
+ * Run the active health checks of every group which is due.
+ */
+void upstream_check_health (struct upstream_group *groups)
+{
+        for (; groups; groups = groups->next)
+                balancer_check_health (&groups->pool);
+}
+
+/*
+ * Keep the addresses of all the upstream proxies in the DNS cache.
+ */
+void upstream_prefetch (struct upstream *up, struct upstream_group *groups)
+{
+        struct balancer_peer *peer;
+
+        for (; up; up = up->next)
+                if (up->host)
+                        dns_prefetch (up->host);
+
+        for (; groups; groups = groups->next)
+                for (peer = groups->pool.peers; peer; peer = peer->next)
+                        dns_prefetch (peer->host);
+}
+
 #endif
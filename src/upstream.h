@@ -26,6 +26,17 @@
 #define _TINYPROXY_UPSTREAM_H_
 
 #include "common.h"
+#include "balancer.h"
+
+/*
+ * A named group of upstream proxies, used in turn according to the
+ * group's balancing policy.
+ */
+struct upstream_group {
+        struct upstream_group *next;
+        char *name;
+        struct balancer_pool pool;
+};
 
 /*
  * Even if upstream support is not compiled into tinyproxy, this
@@ -36,14 +47,27 @@ struct upstream {
         char *domain;           /* optional */
         char *host;
         int port;
+        struct upstream_group *group;   /* instead of host:port */
+        struct balancer_pool pool;      /* just host:port, when no group */
         in_addr_t ip, mask;
 };
 
 #ifdef UPSTREAM_SUPPORT
 extern void upstream_add (const char *host, int port, const char *domain,
                           struct upstream **upstream_list);
+extern void upstream_add_group (const char *name, const char *domain,
+                                struct upstream **upstream_list,
+                                struct upstream_group **groups);
 extern struct upstream *upstream_get (char *host, struct upstream *up);
 extern void free_upstream_list (struct upstream *up);
+
+extern struct upstream_group *upstream_group_get (const char *name,
+                                                  struct upstream_group
+                                                  **groups);
+extern void free_upstream_groups (struct upstream_group *groups);
+extern void upstream_check_health (struct upstream_group *groups);
+extern void upstream_prefetch (struct upstream *up,
+                               struct upstream_group *groups);
 #endif /* UPSTREAM_SUPPORT */
 
 #endif /* _TINYPROXY_UPSTREAM_H_ */
@@ -0,0 +1,262 @@
+#!/usr/bin/perl -w
+
+# Check the active health checks of an upstream group.
+#
+# Two stand-in upstream proxies answer every request with a body which
+# names them.  tinyproxy sends all requests to a group of the two, with
+# HealthCheckInterval set and the circuit breakers off, so that only the
+# health checks mark a member as down.  The script then checks that:
+#
+#  - requests are shared between both members;
+#  - once one of them is killed, the next check marks it as down on the
+#    statistics page, and every request goes to the other one;
+#  - once it is started again, a later check marks it as up, and
+#    requests reach it again.
+#
+# Copyright (C) 2026 Tinyproxy developers
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 2 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, see <http://www.gnu.org/licenses/>.
+
+use strict;
+
+use IO::Socket;
+use POSIX qw(:sys_wait_h);
+use File::Basename;
+use File::Temp qw(tempdir);
+use Time::HiRes qw(sleep);
+use Getopt::Long;
+use Pod::Usage;
+
+my $EOL = "\015\012";
+
+# The helper process runs the checks at most every 5 seconds
+my $CHECK_WAIT = 15;
+
+my $proxy_port = 12326;
+my @upstream_ports = (32128, 32129);
+my $tinyproxy = dirname($0) . "/../../src/tinyproxy";
+my $help = 0;
+
+GetOptions(
+	'proxy-port=i' => \$proxy_port,
+	'upstream-ports=i{2}' => \@upstream_ports,
+	'tinyproxy=s' => \$tinyproxy,
+	'help|?' => \$help,
+) or pod2usage(2);
+pod2usage(1) if $help;
+
+-x $tinyproxy or die "$tinyproxy is not executable\n";
+@upstream_ports = @upstream_ports[-2, -1];
+
+my $dir = tempdir("tinyproxy-balancer-XXXXXX", TMPDIR => 1, CLEANUP => 1);
+my %upstreams;
+my @children;
+my $failures = 0;
+
+# Start a stand-in upstream proxy which answers with its port.
+sub start_upstream($) {
+	my $port = shift;
+	my $listener = IO::Socket::INET->new(LocalAddr => "127.0.0.1",
+					     LocalPort => $port,
+					     Proto => "tcp",
+					     Listen => SOMAXCONN,
+					     Reuse => 1)
+		or die "Could not listen on port $port: $!\n";
+
+	my $pid = fork();
+	die "fork: $!\n" unless defined $pid;
+	if ($pid) {
+		close($listener);
+		$upstreams{$port} = $pid;
+		return $pid;
+	}
+
+	for (;;) {
+		my $client = $listener->accept() or next;
+		while (defined(my $line = <$client>)) {
+			last if $line eq $EOL;
+		}
+		print $client "HTTP/1.1 200 OK$EOL",
+			"Content-Length: ", length("$port\n"), "$EOL",
+			"Connection: close$EOL$EOL", "$port\n";
+		close($client);
+	}
+}
+
+sub stop_upstream($) {
+	my $port = shift;
+
+	kill("KILL", $upstreams{$port});
+	waitpid($upstreams{$port}, 0);
+	delete $upstreams{$port};
+}
+
+sub start_tinyproxy() {
+	my $conf = "$dir/tinyproxy.conf";
+	my $user = getpwuid($<);
+
+	open(my $fh, ">", $conf) or die "$conf: $!\n";
+	print $fh <<EOF;
+User $user
+Port $proxy_port
+Listen 127.0.0.1
+Timeout 10
+PidFile "$dir/tinyproxy.pid"
+Logfile "$dir/tinyproxy.log"
+LogLevel Warning
+MaxClients 10
+MinSpareServers 2
+MaxSpareServers 4
+StartServers 2
+MaxFails 0
+HealthCheckInterval 1
+HealthCheckTimeout 1
+UpstreamGroup "pool" 127.0.0.1:$upstream_ports[0]
+UpstreamGroup "pool" 127.0.0.1:$upstream_ports[1]
+Upstream group "pool"
+EOF
+	close($fh);
+
+	system($tinyproxy, "-c", $conf) == 0
+		or die "Could not start $tinyproxy\n";
+
+	for (1 .. 50) {
+		last if -s "$dir/tinyproxy.pid";
+		sleep(0.1);
+	}
+	open($fh, "<", "$dir/tinyproxy.pid") or die "tinyproxy did not start\n";
+	my $pid = <$fh>;
+	close($fh);
+	chomp($pid);
+
+	return $pid;
+}
+
+# Ask tinyproxy for a URL, and return the status code and the body.
+sub fetch($) {
+	my $url = shift;
+	my $proxy = IO::Socket::INET->new(PeerAddr => "127.0.0.1",
+					  PeerPort => $proxy_port,
+					  Proto => "tcp")
+		or die "Could not connect to tinyproxy: $!\n";
+	$proxy->autoflush(1);
+
+	print $proxy "GET $url HTTP/1.0$EOL$EOL";
+	my $response = join("", <$proxy>);
+	close($proxy);
+
+	return (0, "") unless $response =~ m{^HTTP/1\.\d (\d+)};
+	my $status = $1;
+	$response =~ s/^.*?\r\n\r\n//s;
+
+	return ($status, $response);
+}
+
+# Send some requests through the group, and count the answers of each
+# member; a request which failed counts for port 0.
+sub spread() {
+	my %count = map { $_ => 0 } (0, @upstream_ports);
+
+	for (1 .. 8) {
+		my ($status, $body) = fetch("http://example.test/");
+		chomp($body);
+		$count{$status == 200 && exists $count{$body} ? $body : 0}++;
+	}
+
+	return %count;
+}
+
+# The health of a member on the statistics page.
+sub health($) {
+	my $port = shift;
+	my (undef, $page) = fetch("http://tinyproxy.stats/");
+
+	return $page =~ m{<tr><td>127\.0\.0\.1:$port</td><td>[^<]*</td>
+			  <td>(\w+)</td>}x ? $1 : "unknown";
+}
+
+# Wait for the checks to find a member in a state.
+sub wait_health($$) {
+	my ($port, $state) = @_;
+
+	for (1 .. $CHECK_WAIT * 2) {
+		return 1 if health($port) eq $state;
+		sleep(0.5);
+	}
+	return 0;
+}
+
+sub check($$) {
+	my ($name, $ok) = @_;
+
+	print(($ok ? "ok" : "FAILED"), " - $name\n");
+	$failures++ unless $ok;
+}
+
+start_upstream($_) foreach @upstream_ports;
+push(@children, start_tinyproxy());
+
+eval {
+	my ($first, $second) = @upstream_ports;
+	my %count;
+
+	check("both members marked up", wait_health($first, "up")
+	      && wait_health($second, "up"));
+	%count = spread();
+	check("requests shared between both members",
+	      $count{$first} > 0 && $count{$second} > 0 && $count{0} == 0);
+
+	stop_upstream($first);
+	check("killed member marked down", wait_health($first, "down"));
+	%count = spread();
+	check("requests moved to the other member",
+	      $count{$second} == 8);
+
+	start_upstream($first);
+	check("restarted member marked up", wait_health($first, "up"));
+	%count = spread();
+	check("requests back on the restarted member",
+	      $count{$first} > 0 && $count{$second} > 0 && $count{0} == 0);
+};
+my $error = $@;
+
+kill("TERM", @children, values %upstreams);
+waitpid($children[0], 0);
+
+die $error if $error;
+die "$failures checks failed\n" if $failures;
+
+__END__
+
+=head1 NAME
+
+balancer_test.pl - check the health checks of an upstream group
+
+=head1 SYNOPSIS
+
+balancer_test.pl [options]
+
+ Options:
+  --proxy-port       port for tinyproxy to listen on (default 12326)
+  --upstream-ports   TCP ports of the two stand-in upstream proxies
+                     (default 32128 32129)
+  --tinyproxy        the tinyproxy binary (default ../../src/tinyproxy)
+  --help             this help
+
+=head1 DESCRIPTION
+
+The checks run in a helper process at most every 5 seconds, so the
+script takes half a minute or so.
+
+=cut
@@ -0,0 +1,248 @@
+#!/usr/bin/perl -w
+
+# Compare the latency of reverse proxying to a backend over loopback TCP
+# and over a unix domain socket.
+#
+# A stand-in backend answering every request with a short response is
+# started on both a TCP port and a unix socket, and a tinyproxy instance
+# reverse proxies "/tcp/" to the one and "/unix/" to the other.  The same
+# number of requests is then sent through tinyproxy for each, one at a
+# time, and the latencies are printed.
+#
+# Copyright (C) 2026 Tinyproxy developers
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 2 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, see <http://www.gnu.org/licenses/>.
+
+use strict;
+
+use IO::Socket;
+use IO::Socket::UNIX;
+use IO::Select;
+use POSIX qw(:sys_wait_h);
+use File::Basename;
+use File::Temp qw(tempdir);
+use Time::HiRes qw(time sleep);
+use Getopt::Long;
+use Pod::Usage;
+
+my $EOL = "\015\012";
+
+my $requests = 2000;
+my $proxy_port = 12322;
+my $backend_port = 32124;
+my $pool = 0;
+my $tinyproxy = dirname($0) . "/../../src/tinyproxy";
+my $help = 0;
+
+GetOptions(
+	'requests=i' => \$requests,
+	'proxy-port=i' => \$proxy_port,
+	'backend-port=i' => \$backend_port,
+	'pool' => \$pool,
+	'tinyproxy=s' => \$tinyproxy,
+	'help|?' => \$help,
+) or pod2usage(2);
+pod2usage(1) if $help;
+
+-x $tinyproxy or die "$tinyproxy is not executable\n";
+
+my $dir = tempdir("tinyproxy-bench-XXXXXX", TMPDIR => 1, CLEANUP => 1);
+my $socket_path = "$dir/backend.sock";
+my @children;
+
+# Answer the requests on a connection until the client closes it, or
+# asks for it to be closed.
+sub serve($) {
+	my $client = shift;
+	my ($length, $close) = (0, 0);
+
+	while (defined(my $line = <$client>)) {
+		$length = $1 if $line =~ /^Content-Length:\s*(\d+)/i;
+		$close = 1 if $line =~ /^Connection:\s*close/i;
+		next unless $line eq $EOL;
+
+		read($client, my $body, $length) if $length > 0;
+		print $client "HTTP/1.1 200 OK$EOL",
+			"Content-Type: text/plain$EOL",
+			"Content-Length: 3$EOL$EOL",
+			"ok\n";
+		last if $close;
+		$length = 0;
+	}
+
+	close($client);
+}
+
+sub start_backend() {
+	my $tcp = IO::Socket::INET->new(LocalAddr => "127.0.0.1",
+					LocalPort => $backend_port,
+					Proto => "tcp",
+					Listen => SOMAXCONN,
+					Reuse => 1)
+		or die "Could not listen on port $backend_port: $!\n";
+	my $unix = IO::Socket::UNIX->new(Local => $socket_path,
+					 Type => SOCK_STREAM,
+					 Listen => SOMAXCONN)
+		or die "Could not listen on $socket_path: $!\n";
+
+	my $pid = fork();
+	die "fork: $!\n" unless defined $pid;
+	if ($pid) {
+		close($tcp);
+		close($unix);
+		return $pid;
+	}
+
+	$SIG{CHLD} = sub { while (waitpid(-1, WNOHANG) > 0) {} };
+	my $select = IO::Select->new($tcp, $unix);
+	for (;;) {
+		foreach my $listener ($select->can_read()) {
+			my $client = $listener->accept() or next;
+			$client->autoflush(1);
+			if (fork() == 0) {
+				serve($client);
+				exit(0);
+			}
+			close($client);
+		}
+	}
+}
+
+sub start_tinyproxy() {
+	my $conf = "$dir/tinyproxy.conf";
+	my $user = getpwuid($<);
+
+	open(my $fh, ">", $conf) or die "$conf: $!\n";
+	print $fh <<EOF;
+User $user
+Port $proxy_port
+Listen 127.0.0.1
+Timeout 60
+PidFile "$dir/tinyproxy.pid"
+Logfile "$dir/tinyproxy.log"
+LogLevel Warning
+MaxClients 10
+MinSpareServers 2
+MaxSpareServers 4
+StartServers 2
+PoolMaxIdlePerHost $pool
+ReverseOnly Yes
+ReversePath "/tcp/" "http://127.0.0.1:$backend_port/"
+ReversePath "/unix/" "unix:$socket_path"
+EOF
+	close($fh);
+
+	system($tinyproxy, "-c", $conf) == 0
+		or die "Could not start $tinyproxy\n";
+
+	for (1 .. 50) {
+		last if -s "$dir/tinyproxy.pid";
+		sleep(0.1);
+	}
+	open($fh, "<", "$dir/tinyproxy.pid") or die "tinyproxy did not start\n";
+	my $pid = <$fh>;
+	close($fh);
+	chomp($pid);
+
+	return $pid;
+}
+
+# Send "count" requests for "path" one after the other, and return the
+# time each of them took, in milliseconds.  Every request has a client
+# connection of its own, the same for both backends, so that the delayed
+# acknowledgements of a persistent connection do not drown the results.
+sub run($$) {
+	my ($path, $count) = @_;
+	my @times;
+
+	for my $i (1 .. $count) {
+		my $start = time();
+		my $proxy = IO::Socket::INET->new(PeerAddr => "127.0.0.1",
+						  PeerPort => $proxy_port,
+						  Proto => "tcp")
+			or die "Could not connect to tinyproxy: $!\n";
+		$proxy->autoflush(1);
+
+		print $proxy "GET $path$i HTTP/1.1$EOL",
+			"Host: localhost$EOL",
+			"Connection: close$EOL$EOL";
+
+		my $status = <$proxy>;
+		die "No response for $path$i\n" unless defined $status;
+		die "Unexpected response for $path$i: $status" unless
+			$status =~ m{^HTTP/1\.\d 200};
+		while (<$proxy>) {}
+		close($proxy);
+
+		push(@times, (time() - $start) * 1000);
+	}
+
+	return @times;
+}
+
+sub report($@) {
+	my $name = shift;
+	my @times = sort { $a <=> $b } @_;
+	my $total = 0;
+
+	$total += $_ foreach @times;
+	printf("%-6s %6d requests  mean %.3f ms  p50 %.3f ms  p99 %.3f ms\n",
+	       $name, scalar(@times), $total / @times,
+	       $times[int(@times * 0.50)], $times[int(@times * 0.99)]);
+}
+
+push(@children, start_backend());
+push(@children, start_tinyproxy());
+
+eval {
+	# Warm up both paths first
+	run("/tcp/warmup", 100);
+	run("/unix/warmup", 100);
+
+	report("tcp", run("/tcp/", $requests));
+	report("unix", run("/unix/", $requests));
+};
+my $error = $@;
+
+kill("TERM", @children);
+waitpid($children[0], 0);
+
+die $error if $error;
+
+__END__
+
+=head1 NAME
+
+bench_unix_socket.pl - compare reverse proxying over TCP and unix sockets
+
+=head1 SYNOPSIS
+
+bench_unix_socket.pl [options]
+
+ Options:
+  --requests       number of requests for each backend (default 2000)
+  --proxy-port     port for tinyproxy to listen on (default 12322)
+  --backend-port   TCP port of the stand-in backend (default 32124)
+  --pool           keep idle backend connections (PoolMaxIdlePerHost 1)
+  --tinyproxy      the tinyproxy binary (default ../../src/tinyproxy)
+  --help           this help
+
+=head1 DESCRIPTION
+
+Without B<--pool>, tinyproxy opens a new connection to the backend for
+every request, so the difference includes the cost of setting up a
+loopback TCP connection.  With it, only the cost of moving the data
+through the TCP/IP stack remains.
+
+=cut
@@ -0,0 +1,322 @@
+#!/usr/bin/perl -w
+
+# Check the caching DNS resolver (DNSCache) against a stand-in server.
+#
+# The stand-in answers A queries on a local UDP port with 127.0.0.1,
+# and AAAA queries without any address, and writes down every query it
+# gets.  tinyproxy is started as a forward proxy with DNSCache and that
+# server, and requests for names under "test." are sent through it to
+# a stand-in web server.  The script then checks that:
+#
+#  - a name is only looked up once while its answer is fresh;
+#  - a name which does not exist is cached as well;
+#  - children asking for a name at once send one set of queries, when
+#    the server is slow to answer;
+#  - a name the server fails on (SERVFAIL) is handed to the system
+#    resolver.  This needs a name with a dot in /etc/hosts which maps to
+#    a loopback address, and is skipped without one.
+#
+# Copyright (C) 2026 Tinyproxy developers
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 2 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, see <http://www.gnu.org/licenses/>.
+
+use strict;
+
+use IO::Socket;
+use POSIX qw(:sys_wait_h);
+use File::Basename;
+use File::Temp qw(tempdir);
+use Time::HiRes qw(sleep);
+use Getopt::Long;
+use Pod::Usage;
+
+my $EOL = "\015\012";
+
+my $TYPE_A = 1;
+my $TYPE_AAAA = 28;
+my $RCODE_SERVFAIL = 2;
+my $RCODE_NXDOMAIN = 3;
+
+my $proxy_port = 12325;
+my $backend_port = 32127;
+my $dns_port = 32153;
+my $tinyproxy = dirname($0) . "/../../src/tinyproxy";
+my $help = 0;
+
+GetOptions(
+	'proxy-port=i' => \$proxy_port,
+	'backend-port=i' => \$backend_port,
+	'dns-port=i' => \$dns_port,
+	'tinyproxy=s' => \$tinyproxy,
+	'help|?' => \$help,
+) or pod2usage(2);
+pod2usage(1) if $help;
+
+-x $tinyproxy or die "$tinyproxy is not executable\n";
+
+my $dir = tempdir("tinyproxy-dns-XXXXXX", TMPDIR => 1, CLEANUP => 1);
+my $queries = "$dir/queries";
+my @children;
+my $failures = 0;
+
+# Build the answer to a query: the name, with the question copied.
+sub answer($) {
+	my $query = shift;
+	my ($id, $flags, $qdcount) = unpack("nnn", $query);
+	my ($pos, @labels) = (12);
+
+	return unless $qdcount == 1;
+	while ((my $len = ord(substr($query, $pos, 1))) != 0) {
+		push(@labels, substr($query, $pos + 1, $len));
+		$pos += $len + 1;
+	}
+	my ($type) = unpack("n", substr($query, $pos + 1, 2));
+	my $question = substr($query, 12, $pos + 5 - 12);
+	my $name = lc(join(".", @labels));
+
+	my ($rcode, $answers) = (0, "");
+	if ($name =~ /^missing\./) {
+		$rcode = $RCODE_NXDOMAIN;
+	} elsif ($name =~ /^fail\./ || $name !~ /\.test$/) {
+		$rcode = $RCODE_SERVFAIL;
+	} elsif ($type == $TYPE_A) {
+		$answers = pack("nnnNn", 0xc00c, $TYPE_A, 1, 60, 4)
+			. inet_aton("127.0.0.1");
+	}
+
+	return ($name, $type, pack("nnnnnn", $id, 0x8180 | $rcode, 1,
+				   $answers ? 1 : 0, 0, 0)
+		. $question . $answers);
+}
+
+sub start_dns() {
+	my $sock = IO::Socket::INET->new(LocalAddr => "127.0.0.1",
+					 LocalPort => $dns_port,
+					 Proto => "udp")
+		or die "Could not listen on UDP port $dns_port: $!\n";
+
+	my $pid = fork();
+	die "fork: $!\n" unless defined $pid;
+	if ($pid) {
+		close($sock);
+		return $pid;
+	}
+
+	$SIG{CHLD} = sub { while (waitpid(-1, WNOHANG) > 0) {} };
+	for (;;) {
+		my $peer = $sock->recv(my $query, 512) or next;
+		my ($name, $type, $reply) = answer($query) or next;
+
+		if (open(my $fh, ">>", $queries)) {
+			print $fh "$name $type\n";
+			close($fh);
+		}
+
+		# Names under "slow." are answered after half a second
+		if ($name =~ /^slow\./) {
+			next if fork() != 0;
+			sleep(0.5);
+			$sock->send($reply, 0, $peer);
+			exit(0);
+		}
+		$sock->send($reply, 0, $peer);
+	}
+}
+
+sub start_backend() {
+	my $listener = IO::Socket::INET->new(LocalAddr => "127.0.0.1",
+					     LocalPort => $backend_port,
+					     Proto => "tcp",
+					     Listen => SOMAXCONN,
+					     Reuse => 1)
+		or die "Could not listen on port $backend_port: $!\n";
+
+	my $pid = fork();
+	die "fork: $!\n" unless defined $pid;
+	if ($pid) {
+		close($listener);
+		return $pid;
+	}
+
+	for (;;) {
+		my $client = $listener->accept() or next;
+		while (defined(my $line = <$client>)) {
+			last if $line eq $EOL;
+		}
+		print $client "HTTP/1.1 200 OK$EOL",
+			"Content-Length: 3$EOL",
+			"Connection: close$EOL$EOL", "ok\n";
+		close($client);
+	}
+}
+
+sub start_tinyproxy() {
+	my $conf = "$dir/tinyproxy.conf";
+	my $user = getpwuid($<);
+
+	open(my $fh, ">", $conf) or die "$conf: $!\n";
+	print $fh <<EOF;
+User $user
+Port $proxy_port
+Listen 127.0.0.1
+Timeout 10
+PidFile "$dir/tinyproxy.pid"
+Logfile "$dir/tinyproxy.log"
+LogLevel Warning
+MaxClients 10
+MinSpareServers 5
+MaxSpareServers 10
+StartServers 5
+DNSCache Yes
+DNSServer "127.0.0.1:$dns_port"
+EOF
+	close($fh);
+
+	system($tinyproxy, "-c", $conf) == 0
+		or die "Could not start $tinyproxy\n";
+
+	for (1 .. 50) {
+		last if -s "$dir/tinyproxy.pid";
+		sleep(0.1);
+	}
+	open($fh, "<", "$dir/tinyproxy.pid") or die "tinyproxy did not start\n";
+	my $pid = <$fh>;
+	close($fh);
+	chomp($pid);
+
+	# Leave time for the children to start
+	sleep(1);
+
+	return $pid;
+}
+
+# Ask tinyproxy for a URL on a host, and return the status code.
+sub fetch($) {
+	my $host = shift;
+	my $proxy = IO::Socket::INET->new(PeerAddr => "127.0.0.1",
+					  PeerPort => $proxy_port,
+					  Proto => "tcp")
+		or die "Could not connect to tinyproxy: $!\n";
+	$proxy->autoflush(1);
+
+	print $proxy "GET http://$host:$backend_port/ HTTP/1.1$EOL",
+		"Host: $host:$backend_port$EOL",
+		"Connection: close$EOL$EOL";
+	my $status = <$proxy>;
+	while (<$proxy>) {}
+	close($proxy);
+
+	return defined($status) && $status =~ m{^HTTP/1\.\d (\d+)} ? $1 : 0;
+}
+
+# How many A queries for a name the server got.
+sub count($) {
+	my $name = shift;
+	my $n = 0;
+
+	open(my $fh, "<", $queries) or return 0;
+	while (<$fh>) {
+		$n++ if $_ eq "$name $TYPE_A\n";
+	}
+	close($fh);
+
+	return $n;
+}
+
+sub check($$) {
+	my ($name, $ok) = @_;
+
+	print(($ok ? "ok" : "FAILED"), " - $name\n");
+	$failures++ unless $ok;
+}
+
+# A name with a dot which the system resolver finds in /etc/hosts.
+sub hosts_name() {
+	open(my $fh, "<", "/etc/hosts") or return;
+	while (<$fh>) {
+		s/#.*//;
+		my ($ip, @names) = split;
+		next unless defined($ip) && $ip =~ /^127\./;
+		foreach my $name (@names) {
+			return $name if $name =~ /\./;
+		}
+	}
+	close($fh);
+
+	return;
+}
+
+push(@children, start_dns());
+push(@children, start_backend());
+push(@children, start_tinyproxy());
+
+eval {
+	check("first lookup", fetch("cached.test") == 200
+	      && count("cached.test") == 1);
+	check("answer cached", fetch("cached.test") == 200
+	      && count("cached.test") == 1);
+
+	fetch("missing.test");
+	fetch("missing.test");
+	check("missing name cached", count("missing.test") == 1);
+
+	my @clients;
+	for (1 .. 4) {
+		my $pid = fork();
+		die "fork: $!\n" unless defined $pid;
+		exit(fetch("slow.test") == 200 ? 0 : 1) if $pid == 0;
+		push(@clients, $pid);
+	}
+	my $ok = 1;
+	foreach my $pid (@clients) {
+		waitpid($pid, 0);
+		$ok = 0 if $? != 0;
+	}
+	check("concurrent lookups coalesced",
+	      $ok && count("slow.test") == 1);
+
+	my $name = hosts_name();
+	if (defined $name) {
+		check("system resolver after SERVFAIL for $name",
+		      fetch($name) == 200 && count(lc($name)) >= 1);
+	} else {
+		print "skipped - no name with a dot in /etc/hosts\n";
+	}
+};
+my $error = $@;
+
+kill("TERM", @children);
+waitpid($children[0], 0);
+
+die $error if $error;
+die "$failures checks failed\n" if $failures;
+
+__END__
+
+=head1 NAME
+
+dns_test.pl - check the caching DNS resolver with a stand-in server
+
+=head1 SYNOPSIS
+
+dns_test.pl [options]
+
+ Options:
+  --proxy-port     port for tinyproxy to listen on (default 12325)
+  --backend-port   TCP port of the stand-in web server (default 32127)
+  --dns-port       UDP port of the stand-in DNS server (default 32153)
+  --tinyproxy      the tinyproxy binary (default ../../src/tinyproxy)
+  --help           this help
+
+=cut
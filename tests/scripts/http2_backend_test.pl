@@ -0,0 +1,266 @@
+#!/usr/bin/perl -w
+
+# Check the HTTP/2 client of ReverseHTTP2 against a stand-in backend.
+#
+# The backend speaks h2c and answers every request with a header block
+# which first adds a large field to the HPACK dynamic table, and then a
+# field with incremental indexing whose name refers to that entry.  The
+# second field does not fit next to the first, so adding it evicts the
+# entry its name comes from (RFC 7541, section 4.4).  The body is sent
+# in a DATA frame which has the undefined flag 0x20 set, which is to be
+# ignored.  The response must reach the HTTP/1.1 client intact.
+#
+# Copyright (C) 2026 Tinyproxy developers
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 2 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, see <http://www.gnu.org/licenses/>.
+
+use strict;
+
+use IO::Socket;
+use POSIX qw(:sys_wait_h);
+use File::Basename;
+use File::Temp qw(tempdir);
+use Time::HiRes qw(sleep);
+use Getopt::Long;
+use Pod::Usage;
+
+my $EOL = "\015\012";
+my $PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+my $proxy_port = 12323;
+my $backend_port = 32125;
+my $tinyproxy = dirname($0) . "/../../src/tinyproxy";
+my $help = 0;
+
+GetOptions(
+	'proxy-port=i' => \$proxy_port,
+	'backend-port=i' => \$backend_port,
+	'tinyproxy=s' => \$tinyproxy,
+	'help|?' => \$help,
+) or pod2usage(2);
+pod2usage(1) if $help;
+
+-x $tinyproxy or die "$tinyproxy is not executable\n";
+
+my $dir = tempdir("tinyproxy-h2-XXXXXX", TMPDIR => 1, CLEANUP => 1);
+my @children;
+
+my $big = "a" x 4000;
+my $small = "b" x 100;
+my $body = "hello world\n";
+
+sub frame($$$$) {
+	my ($type, $flags, $stream, $payload) = @_;
+
+	return substr(pack("N", length($payload)), 1)
+		. pack("CCN", $type, $flags, $stream) . $payload;
+}
+
+# An HPACK integer with an "n" bit prefix, after the bits in "first".
+sub hpack_int($$$) {
+	my ($first, $n, $value) = @_;
+	my $max = (1 << $n) - 1;
+
+	return pack("C", $first | $value) if $value < $max;
+
+	my $out = pack("C", $first | $max);
+	$value -= $max;
+	while ($value >= 128) {
+		$out .= pack("C", ($value & 0x7f) | 0x80);
+		$value >>= 7;
+	}
+	return $out . pack("C", $value);
+}
+
+sub hpack_string($) {
+	my $s = shift;
+
+	return hpack_int(0, 7, length($s)) . $s;
+}
+
+sub read_frame($) {
+	my $sock = shift;
+	my ($head, $payload) = ("", "");
+
+	while (length($head) < 9) {
+		sysread($sock, $head, 9 - length($head), length($head))
+			or return;
+	}
+	my ($len, $type, $flags, $stream) = unpack("NCCN", "\0" . $head);
+	$stream &= 0x7fffffff;
+	while (length($payload) < $len) {
+		sysread($sock, $payload, $len - length($payload),
+			length($payload)) or return;
+	}
+
+	return ($type, $flags, $stream, $payload);
+}
+
+# Answer the streams of a connection until the client closes it.
+sub serve($) {
+	my $client = shift;
+	my $preface = "";
+
+	while (length($preface) < length($PREFACE)) {
+		sysread($client, $preface, length($PREFACE) - length($preface),
+			length($preface)) or return;
+	}
+	return unless $preface eq $PREFACE;
+	syswrite($client, frame(4, 0, 0, ""));
+
+	while (my ($type, $flags, $stream, $payload) = read_frame($client)) {
+		if ($type == 4 && !($flags & 1)) {
+			syswrite($client, frame(4, 1, 0, ""));
+		} elsif ($type == 6 && !($flags & 1)) {
+			syswrite($client, frame(6, 1, 0, $payload));
+		} elsif (($type == 0 || $type == 1) && ($flags & 1)) {
+			# ":status: 200", "x-a" added to the table, and then
+			# "x-a" again, named by the entry it evicts (62)
+			my $block = pack("C", 0x88)
+				. pack("C", 0x40) . hpack_string("x-a")
+				. hpack_string($big)
+				. hpack_int(0x40, 6, 62) . hpack_string($small)
+				. pack("C", 0x0f) . pack("C", 0x0d)
+				. hpack_string(length($body));
+			syswrite($client, frame(1, 4, $stream, $block)
+				 . frame(0, 0x21, $stream, $body));
+		}
+	}
+}
+
+sub start_backend() {
+	my $listener = IO::Socket::INET->new(LocalAddr => "127.0.0.1",
+					     LocalPort => $backend_port,
+					     Proto => "tcp",
+					     Listen => SOMAXCONN,
+					     Reuse => 1)
+		or die "Could not listen on port $backend_port: $!\n";
+
+	my $pid = fork();
+	die "fork: $!\n" unless defined $pid;
+	if ($pid) {
+		close($listener);
+		return $pid;
+	}
+
+	$SIG{CHLD} = sub { while (waitpid(-1, WNOHANG) > 0) {} };
+	for (;;) {
+		my $client = $listener->accept() or next;
+		if (fork() == 0) {
+			close($listener);
+			serve($client);
+			exit(0);
+		}
+		close($client);
+	}
+}
+
+sub start_tinyproxy() {
+	my $conf = "$dir/tinyproxy.conf";
+	my $user = getpwuid($<);
+
+	open(my $fh, ">", $conf) or die "$conf: $!\n";
+	print $fh <<EOF;
+User $user
+Port $proxy_port
+Listen 127.0.0.1
+Timeout 10
+PidFile "$dir/tinyproxy.pid"
+Logfile "$dir/tinyproxy.log"
+LogLevel Warning
+MaxClients 10
+MinSpareServers 2
+MaxSpareServers 4
+StartServers 2
+ReverseOnly Yes
+ReversePath "/h2/" "http://127.0.0.1:$backend_port/"
+ReverseHTTP2 "/h2/"
+EOF
+	close($fh);
+
+	system($tinyproxy, "-c", $conf) == 0
+		or die "Could not start $tinyproxy\n";
+
+	for (1 .. 50) {
+		last if -s "$dir/tinyproxy.pid";
+		sleep(0.1);
+	}
+	open($fh, "<", "$dir/tinyproxy.pid") or die "tinyproxy did not start\n";
+	my $pid = <$fh>;
+	close($fh);
+	chomp($pid);
+
+	return $pid;
+}
+
+sub check($) {
+	my $path = shift;
+	my $proxy = IO::Socket::INET->new(PeerAddr => "127.0.0.1",
+					  PeerPort => $proxy_port,
+					  Proto => "tcp")
+		or die "Could not connect to tinyproxy: $!\n";
+	$proxy->autoflush(1);
+
+	print $proxy "GET $path HTTP/1.1$EOL",
+		"Host: localhost$EOL",
+		"Connection: close$EOL$EOL";
+	my $response = join("", <$proxy>);
+	close($proxy);
+
+	die "Unexpected response for $path:\n$response\n" unless
+		$response =~ m{^HTTP/1\.1 200 } &&
+		$response =~ m{^x-a: $big\r$}mi &&
+		$response =~ m{^x-a: $small\r$}mi &&
+		$response =~ m{\r\n\r\n\Q$body\E$};
+}
+
+push(@children, start_backend());
+push(@children, start_tinyproxy());
+
+eval {
+	# The second request goes over the same backend connection
+	check("/h2/one");
+	check("/h2/two");
+};
+my $error = $@;
+
+kill("TERM", @children);
+waitpid($children[0], 0);
+
+die $error if $error;
+print "ok\n";
+
+__END__
+
+=head1 NAME
+
+http2_backend_test.pl - check the HTTP/2 client against a stand-in backend
+
+=head1 SYNOPSIS
+
+http2_backend_test.pl [options]
+
+ Options:
+  --proxy-port     port for tinyproxy to listen on (default 12323)
+  --backend-port   TCP port of the stand-in backend (default 32125)
+  --tinyproxy      the tinyproxy binary (default ../../src/tinyproxy)
+  --help           this help
+
+=head1 DESCRIPTION
+
+Run it with a tinyproxy built with AddressSanitizer, or under valgrind,
+to catch a use of the evicted entry even when the freed memory still
+holds the name.
+
+=cut
@@ -0,0 +1,344 @@
+#!/usr/bin/perl -w
+
+# Check how tinyproxy serves h2c clients on its listener.
+#
+# A stand-in HTTP/1.1 backend sends back the head of every request it
+# gets as the body of its response, so that the request which tinyproxy
+# built from a stream can be looked at.  The script then speaks HTTP/2
+# with prior knowledge to tinyproxy and checks that:
+#
+#  - the cookie fields of a stream are joined on one line;
+#  - a header block whose name refers to a dynamic table entry that
+#    adding the field evicts is decoded (RFC 7541, section 4.4);
+#  - streams with fields which could not be written out as HTTP/1.1
+#    safely are reset with PROTOCOL_ERROR, and nothing reaches the
+#    backend for them.
+#
+# Copyright (C) 2026 Tinyproxy developers
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 2 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, see <http://www.gnu.org/licenses/>.
+
+use strict;
+
+use IO::Socket;
+use POSIX qw(:sys_wait_h);
+use File::Basename;
+use File::Temp qw(tempdir);
+use Time::HiRes qw(sleep);
+use Getopt::Long;
+use Pod::Usage;
+
+my $EOL = "\015\012";
+my $PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+my $FRAME_DATA = 0;
+my $FRAME_HEADERS = 1;
+my $FRAME_RST_STREAM = 3;
+my $FRAME_SETTINGS = 4;
+my $FRAME_GOAWAY = 7;
+
+my $proxy_port = 12324;
+my $backend_port = 32126;
+my $tinyproxy = dirname($0) . "/../../src/tinyproxy";
+my $help = 0;
+
+GetOptions(
+	'proxy-port=i' => \$proxy_port,
+	'backend-port=i' => \$backend_port,
+	'tinyproxy=s' => \$tinyproxy,
+	'help|?' => \$help,
+) or pod2usage(2);
+pod2usage(1) if $help;
+
+-x $tinyproxy or die "$tinyproxy is not executable\n";
+
+my $dir = tempdir("tinyproxy-h2c-XXXXXX", TMPDIR => 1, CLEANUP => 1);
+my $seen = "$dir/seen";
+my @children;
+my $failures = 0;
+
+# Answer a request with its own head, and note its request line.
+sub serve($) {
+	my $client = shift;
+	my $head = "";
+
+	while (defined(my $line = <$client>)) {
+		$head .= $line;
+		last if $line eq $EOL;
+	}
+	return unless $head;
+
+	if (open(my $fh, ">>", $seen)) {
+		print $fh (split(/\r?\n/, $head))[0], "\n";
+		close($fh);
+	}
+	print $client "HTTP/1.1 200 OK$EOL",
+		"Content-Type: text/plain$EOL",
+		"Content-Length: ", length($head), "$EOL",
+		"Connection: close$EOL$EOL", $head;
+	close($client);
+}
+
+sub start_backend() {
+	my $listener = IO::Socket::INET->new(LocalAddr => "127.0.0.1",
+					     LocalPort => $backend_port,
+					     Proto => "tcp",
+					     Listen => SOMAXCONN,
+					     Reuse => 1)
+		or die "Could not listen on port $backend_port: $!\n";
+
+	my $pid = fork();
+	die "fork: $!\n" unless defined $pid;
+	if ($pid) {
+		close($listener);
+		return $pid;
+	}
+
+	$SIG{CHLD} = sub { while (waitpid(-1, WNOHANG) > 0) {} };
+	for (;;) {
+		my $client = $listener->accept() or next;
+		if (fork() == 0) {
+			close($listener);
+			serve($client);
+			exit(0);
+		}
+		close($client);
+	}
+}
+
+sub start_tinyproxy() {
+	my $conf = "$dir/tinyproxy.conf";
+	my $user = getpwuid($<);
+
+	open(my $fh, ">", $conf) or die "$conf: $!\n";
+	print $fh <<EOF;
+User $user
+Port $proxy_port
+Listen 127.0.0.1
+Timeout 10
+PidFile "$dir/tinyproxy.pid"
+Logfile "$dir/tinyproxy.log"
+LogLevel Warning
+MaxClients 10
+MinSpareServers 2
+MaxSpareServers 4
+StartServers 2
+ReverseOnly Yes
+ReversePath "/echo/" "http://127.0.0.1:$backend_port/"
+EOF
+	close($fh);
+
+	system($tinyproxy, "-c", $conf) == 0
+		or die "Could not start $tinyproxy\n";
+
+	for (1 .. 50) {
+		last if -s "$dir/tinyproxy.pid";
+		sleep(0.1);
+	}
+	open($fh, "<", "$dir/tinyproxy.pid") or die "tinyproxy did not start\n";
+	my $pid = <$fh>;
+	close($fh);
+	chomp($pid);
+
+	return $pid;
+}
+
+sub frame($$$$) {
+	my ($type, $flags, $stream, $payload) = @_;
+
+	return substr(pack("N", length($payload)), 1)
+		. pack("CCN", $type, $flags, $stream) . $payload;
+}
+
+# An HPACK integer with an "n" bit prefix, after the bits in "first".
+sub hpack_int($$$) {
+	my ($first, $n, $value) = @_;
+	my $max = (1 << $n) - 1;
+
+	return pack("C", $first | $value) if $value < $max;
+
+	my $out = pack("C", $first | $max);
+	$value -= $max;
+	while ($value >= 128) {
+		$out .= pack("C", ($value & 0x7f) | 0x80);
+		$value >>= 7;
+	}
+	return $out . pack("C", $value);
+}
+
+sub hpack_string($) {
+	my $s = shift;
+
+	return hpack_int(0, 7, length($s)) . $s;
+}
+
+# A field with a literal name, not added to the dynamic table.
+sub literal($$) {
+	my ($name, $value) = @_;
+
+	return pack("C", 0) . hpack_string($name) . hpack_string($value);
+}
+
+sub request_fields($) {
+	my $path = shift;
+
+	return literal(":method", "GET") . literal(":scheme", "http")
+		. literal(":authority", "localhost") . literal(":path", $path);
+}
+
+sub read_frame($) {
+	my $sock = shift;
+	my ($head, $payload) = ("", "");
+
+	while (length($head) < 9) {
+		sysread($sock, $head, 9 - length($head), length($head))
+			or return;
+	}
+	my ($len, $type, $flags, $stream) = unpack("NCCN", "\0" . $head);
+	$stream &= 0x7fffffff;
+	while (length($payload) < $len) {
+		sysread($sock, $payload, $len - length($payload),
+			length($payload)) or return;
+	}
+
+	return ($type, $flags, $stream, $payload);
+}
+
+# Send a header block on stream 1 of a new connection, and return the
+# body of the response, or "RST n" if the stream was reset.
+sub exchange($) {
+	my $block = shift;
+	my $body = "";
+	my $result;
+
+	my $proxy = IO::Socket::INET->new(PeerAddr => "127.0.0.1",
+					  PeerPort => $proxy_port,
+					  Proto => "tcp")
+		or die "Could not connect to tinyproxy: $!\n";
+	syswrite($proxy, $PREFACE . frame($FRAME_SETTINGS, 0, 0, "")
+		 . frame($FRAME_HEADERS, 0x05, 1, $block));
+
+	local $SIG{ALRM} = sub { die "timeout\n" };
+	alarm(10);
+	while (my ($type, $flags, $stream, $payload) = read_frame($proxy)) {
+		if ($type == $FRAME_SETTINGS && !($flags & 1)) {
+			syswrite($proxy, frame($FRAME_SETTINGS, 1, 0, ""));
+		} elsif ($type == $FRAME_RST_STREAM && $stream == 1) {
+			$result = "RST " . unpack("N", $payload);
+			last;
+		} elsif ($type == $FRAME_GOAWAY) {
+			$result = "GOAWAY " . unpack("N", substr($payload, 4));
+			last;
+		} elsif ($type == $FRAME_DATA && $stream == 1) {
+			$body .= $payload;
+			if ($flags & 1) {
+				$result = $body;
+				last;
+			}
+		}
+	}
+	alarm(0);
+	close($proxy);
+
+	return defined($result) ? $result : "closed";
+}
+
+sub check($$) {
+	my ($name, $ok) = @_;
+
+	print(($ok ? "ok" : "FAILED"), " - $name\n");
+	$failures++ unless $ok;
+}
+
+push(@children, start_backend());
+push(@children, start_tinyproxy());
+
+eval {
+	my $body;
+
+	$body = exchange(request_fields("/echo/cookies")
+			 . literal("cookie", "a=1") . literal("cookie", "b=2"));
+	check("cookies joined on one line",
+	      $body =~ /^cookie: a=1; b=2\r$/mi
+	      && scalar(() = $body =~ /^cookie:/mgi) == 1);
+
+	# "x-a" goes into the dynamic table, and the next field names it
+	# by index 62 while evicting it
+	$body = exchange(request_fields("/echo/evict")
+			 . pack("C", 0x40) . hpack_string("x-a")
+			 . hpack_string("a" x 4000)
+			 . hpack_int(0x40, 6, 62) . hpack_string("b" x 100));
+	check("name of an evicted entry",
+	      $body =~ /^x-a: a{4000}\r$/mi && $body =~ /^x-a: b{100}\r$/mi);
+
+	my %malformed = (
+		"CR LF in a value" => literal("x-a", "1\r\nx-b: 2"),
+		"CR LF in a name" => literal("x-a\r\nx-b", "1"),
+		"NUL in a value" => literal("x-a", "1\0"),
+		"upper case name" => literal("X-A", "1"),
+		"space in a name" => literal("x a", "1"),
+		"unknown pseudo field" => literal(":foo", "1"),
+	);
+	foreach my $name (sort keys %malformed) {
+		check("reset for $name",
+		      exchange(request_fields("/echo/bad")
+			       . $malformed{$name}) eq "RST 1");
+	}
+
+	check("reset for a space in :method",
+	      exchange(literal(":method", "GET /echo/bad HTTP/1.1")
+		       . literal(":scheme", "http")
+		       . literal(":authority", "localhost")
+		       . literal(":path", "/echo/ok")) eq "RST 1");
+	check("reset for a space in :path",
+	      exchange(request_fields("/echo/bad HTTP/1.1")) eq "RST 1");
+
+	my $lines = "";
+	if (open(my $fh, "<", $seen)) {
+		$lines = join("", <$fh>);
+		close($fh);
+	}
+	check("nothing sent on for reset streams", $lines !~ /bad/);
+};
+my $error = $@;
+
+kill("TERM", @children);
+waitpid($children[0], 0);
+
+die $error if $error;
+die "$failures checks failed\n" if $failures;
+
+__END__
+
+=head1 NAME
+
+http2_client_test.pl - check the h2c listener with a stand-in backend
+
+=head1 SYNOPSIS
+
+http2_client_test.pl [options]
+
+ Options:
+  --proxy-port     port for tinyproxy to listen on (default 12324)
+  --backend-port   TCP port of the stand-in backend (default 32126)
+  --tinyproxy      the tinyproxy binary (default ../../src/tinyproxy)
+  --help           this help
+
+=head1 DESCRIPTION
+
+Run it with a tinyproxy built with AddressSanitizer, or under valgrind,
+to catch a use of the evicted dynamic table entry even when the freed
+memory still holds the name.
+
+=cut